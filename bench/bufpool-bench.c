@@ -0,0 +1,254 @@
+/*
+ * bufpool-bench.c - Allocation churn of the I/O buffers, heap versus pool
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	Each thread keeps a set of live buffers, and repeatedly replaces
+ *	a random one with a buffer of a random size, as readahead, write
+ *	back, decompression and hashing would do, and writes into it.
+ *	The sizes are the cluster, a few clusters, the compression unit
+ *	and a large transfer of 1MB.
+ *
+ *	The buffers are got from the heap (posix_memalign and free) then
+ *	from the buffer pool of the plugin, each in a child process, and
+ *	for each the time per replacement, the minor page faults, the
+ *	system time and the peak resident size are printed, as measures
+ *	of the churn, followed by the statistics of the pool.
+ *
+ *	Usage : bufpool-bench [options]
+ *		-c bytes	cluster size (default 4096)
+ *		-t n		count of threads (default 4)
+ *		-n n		replacements per thread (default 1000000)
+ *		-w n		live buffers per thread (default 32)
+ *		-s n		seed of the random sizes (default 1)
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "../src/onedrive.h"
+
+#define SIZE_KINDS 5
+
+struct BENCH_THREAD {
+	pthread_t thread;
+	unsigned int seed;
+	BOOL pooled;
+} ;
+
+static u32 cluster_size = 4096;
+static int thread_count = 4;
+static long replacements = 1000000;
+static int live_count = 32;
+
+/*
+ *	Weights out of 100 of the sizes, in clusters except the last one
+ */
+
+static const struct {
+	int weight;
+	size_t clusters;
+} kinds[SIZE_KINDS] = {
+	{ 40, 1 },		/* a cluster */
+	{ 15, 4 },		/* a few clusters */
+	{ 30, 16 },		/* a compression unit */
+	{ 10, 32 },		/* two compression units */
+	{ 5, 0 },		/* 1MB */
+} ;
+
+static size_t random_size(unsigned int *seed)
+{
+	int r;
+	int k;
+
+	r = rand_r(seed) % 100;
+	for (k=0; (k < (SIZE_KINDS - 1)) && (r >= kinds[k].weight); k++)
+		r -= kinds[k].weight;
+	return (kinds[k].clusters ? kinds[k].clusters*cluster_size
+				: (size_t)1048576);
+}
+
+static void *bench_thread(void *arg)
+{
+	struct BENCH_THREAD *bt;
+	void **bufs;
+	size_t *sizes;
+	void *buf;
+	long n;
+	int i;
+
+	bt = (struct BENCH_THREAD*)arg;
+	bufs = (void**)calloc(live_count, sizeof(void*));
+	sizes = (size_t*)calloc(live_count, sizeof(size_t));
+	if (!bufs || !sizes)
+		return ((void*)NULL);
+	for (n=0; n<replacements; n++) {
+		i = rand_r(&bt->seed) % live_count;
+		if (bufs[i]) {
+			if (bt->pooled)
+				onedrive_buffer_put(bufs[i], sizes[i]);
+			else
+				free(bufs[i]);
+		}
+		sizes[i] = random_size(&bt->seed);
+		if (bt->pooled)
+			buf = onedrive_buffer_get(sizes[i]);
+		else
+			if (posix_memalign(&buf, cluster_size, sizes[i]))
+				buf = (void*)NULL;
+		if (buf) {
+				/* touch the head and the tail */
+			memset(buf, n, 64);
+			memset((char*)buf + sizes[i] - 64, n, 64);
+		}
+		bufs[i] = buf;
+	}
+	for (i=0; i<live_count; i++)
+		if (bufs[i]) {
+			if (bt->pooled)
+				onedrive_buffer_put(bufs[i], sizes[i]);
+			else
+				free(bufs[i]);
+		}
+	free(bufs);
+	free(sizes);
+	return ((void*)NULL);
+}
+
+/*
+ *		Run the threads, in a child process
+ */
+
+static int run(BOOL pooled, unsigned int seed)
+{
+	struct BENCH_THREAD *threads;
+	struct timespec start;
+	struct timespec end;
+	struct rusage usage;
+	ntfs_volume vol;
+	double ns;
+	pid_t pid;
+	int status;
+	int i;
+
+	pid = fork();
+	if (pid < 0)
+		return (-1);
+	if (!pid) {
+		threads = (struct BENCH_THREAD*)calloc(thread_count,
+				sizeof(struct BENCH_THREAD));
+		if (!threads)
+			exit(1);
+		if (pooled) {
+			onedrive_bufpool_init();
+			memset(&vol, 0, sizeof(vol));
+			vol.cluster_size = cluster_size;
+			onedrive_bufpool_start(&vol);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i=0; i<thread_count; i++) {
+			threads[i].seed = seed + i;
+			threads[i].pooled = pooled;
+			if (pthread_create(&threads[i].thread,
+					(pthread_attr_t*)NULL,
+					bench_thread, &threads[i]))
+				exit(1);
+		}
+		for (i=0; i<thread_count; i++)
+			pthread_join(threads[i].thread, (void**)NULL);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		getrusage(RUSAGE_SELF, &usage);
+		ns = (end.tv_sec - start.tv_sec)*1000000000.0
+				+ end.tv_nsec - start.tv_nsec;
+		printf("%-6s %10.1f %10ld %10.3f %10ld\n",
+			(pooled ? "pool" : "heap"),
+			ns/replacements/thread_count,
+			usage.ru_minflt,
+			usage.ru_stime.tv_sec
+				+ usage.ru_stime.tv_usec/1000000.0,
+			usage.ru_maxrss);
+		if (pooled) {
+			printf("\n");
+			onedrive_bufpool_report(stdout);
+		}
+		exit(0);
+	}
+	if ((waitpid(pid, &status, 0) != pid)
+	    || !WIFEXITED(status) || WEXITSTATUS(status))
+		return (-1);
+	return (0);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage : bufpool-bench [-c cluster] [-t threads]"
+			" [-n replacements] [-w live] [-s seed]\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int seed;
+	int opt;
+
+	seed = 1;
+	while ((opt = getopt(argc, argv, "c:n:s:t:w:")) != -1) {
+		switch (opt) {
+		case 'c' :
+			cluster_size = strtoul(optarg, (char**)NULL, 0);
+			break;
+		case 'n' :
+			replacements = atol(optarg);
+			break;
+		case 's' :
+			seed = strtoul(optarg, (char**)NULL, 0);
+			break;
+		case 't' :
+			thread_count = atoi(optarg);
+			break;
+		case 'w' :
+			live_count = atoi(optarg);
+			break;
+		default :
+			usage();
+		}
+	}
+	if ((cluster_size < 512) || (cluster_size & (cluster_size - 1))
+	    || (thread_count <= 0) || (replacements <= 0)
+	    || (live_count <= 0))
+		usage();
+	printf("%-6s %10s %10s %10s %10s\n", "alloc", "ns/op",
+		"minflt", "sys s", "maxrss KB");
+	fflush(stdout);
+	if (run(FALSE, seed) || run(TRUE, seed)) {
+		fprintf(stderr, "bufpool-bench : a run failed\n");
+		return (1);
+	}
+	return (0);
+}
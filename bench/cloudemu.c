@@ -0,0 +1,330 @@
+/*
+ * cloudemu.c - Local stand-in for the OneDrive cloud, for benchmarking
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	Serves the contents of cloud-only files to the plugin over the
+ *	hydration protocol (see src/hydrate.h). The contents of the file
+ *	whose reparse point holds a GUID are taken from a file of the
+ *	served directory named by the GUID, such as
+ *		8f3a0b12-44c1-4e0a-9d2b-0123456789ab
+ *
+ *	Each request is delayed to emulate the network : a fixed latency
+ *	plus a random jitter, then the transfer time at the configured
+ *	bandwidth. Errors may be injected at a given rate, and the count
+ *	of requests served concurrently may be limited.
+ *
+ *	The random values are derived from the seed, the GUID and the
+ *	offset of each request, so that a run can be reproduced whatever
+ *	the scheduling of the requests.
+ *
+ *	Usage : cloudemu [options] directory socket
+ *		-l ms	latency of each request (default 0)
+ *		-j ms	max random jitter added (default 0)
+ *		-b KB/s	bandwidth, shared by all requests (default unlimited)
+ *		-e n	inject an error in n requests out of 1000 (default 0)
+ *		-c n	max count of concurrent requests (default unlimited)
+ *		-s n	seed of the random values (default 1)
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../src/hydrate.h"
+
+static const char *dirname;
+static unsigned int latency_ms = 0;
+static unsigned int jitter_ms = 0;
+static unsigned long bandwidth = 0;	/* bytes per second */
+static unsigned int error_rate = 0;	/* per thousand */
+static unsigned int max_concurrent = 0;
+static uint64_t seed = 1;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slot_freed = PTHREAD_COND_INITIALIZER;
+static unsigned int running = 0;
+static struct timespec link_free;	/* when the emulated link is idle */
+
+static unsigned long long count_requests = 0;
+static unsigned long long count_errors = 0;
+static unsigned long long count_bytes = 0;
+static unsigned int max_running = 0;
+
+static volatile sig_atomic_t stopping = 0;
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage : cloudemu [-l latency_ms] [-j jitter_ms]"
+			" [-b KB/s] [-e errors_per_1000]\n"
+			"\t\t[-c max_concurrent] [-s seed]"
+			" directory socket\n");
+	exit(1);
+}
+
+/*
+ *		Derive a reproducible random value for a request
+ */
+
+static uint64_t request_random(const struct ONEDRIVE_HYDRATE_REQUEST *req,
+			int which)
+{
+	uint64_t x;
+	int i;
+
+	x = seed ^ (req->offset * 0x9e3779b97f4a7c15ULL) ^ which;
+	for (i=0; i<16; i++)
+		x = (x ^ req->guid[i]) * 0x100000001b3ULL;
+		/* splitmix64 finalizer */
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return (x ^ (x >> 31));
+}
+
+static void add_ns(struct timespec *ts, uint64_t ns)
+{
+	ns += ts->tv_nsec;
+	ts->tv_sec += ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+}
+
+static int before(const struct timespec *a, const struct timespec *b)
+{
+	return ((a->tv_sec < b->tv_sec)
+		|| ((a->tv_sec == b->tv_sec) && (a->tv_nsec < b->tv_nsec)));
+}
+
+/*
+ *		Wait for the emulated network
+ *
+ *	The latency and jitter apply to each request independently,
+ *	whereas the transfers are serialized on the link.
+ */
+
+static void shape(const struct ONEDRIVE_HYDRATE_REQUEST *req, size_t size)
+{
+	struct timespec now;
+	struct timespec done;
+	uint64_t delay;
+
+	delay = (uint64_t)latency_ms*1000000;
+	if (jitter_ms)
+		delay += request_random(req, 1)
+				% ((uint64_t)jitter_ms*1000000);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	done = now;
+	add_ns(&done, delay);
+	if (bandwidth && size) {
+		pthread_mutex_lock(&lock);
+		if (before(&link_free, &done))
+			link_free = done;
+		add_ns(&link_free, (uint64_t)size*1000000000/bandwidth);
+		done = link_free;
+		pthread_mutex_unlock(&lock);
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &done, NULL)
+			== EINTR) { }
+}
+
+static int xfer(int fd, char *buf, size_t size, int out)
+{
+	ssize_t n;
+
+	while (size > 0) {
+		if (out)
+			n = send(fd, buf, size, MSG_NOSIGNAL);
+		else
+			n = recv(fd, buf, size, 0);
+		if (n <= 0) {
+			if ((n < 0) && (errno == EINTR))
+				continue;
+			return (-1);
+		}
+		buf += n;
+		size -= n;
+	}
+	return (0);
+}
+
+/*
+ *		Get the data for a request
+ *
+ *	Returns the count of bytes read, or a negative errno value
+ */
+
+static ssize_t fetch(const struct ONEDRIVE_HYDRATE_REQUEST *req, char *buf)
+{
+	char path[4096];
+	char name[40];
+	ssize_t n;
+	int fd;
+
+	if ((req->magic != ONEDRIVE_HYDRATE_MAGIC)
+	    || (req->size > ONEDRIVE_HYDRATE_MAX))
+		return (-EINVAL);
+	if (error_rate && ((request_random(req, 2) % 1000) < error_rate))
+		return (-EIO);
+	onedrive_guid_string(req->guid, name);
+	snprintf(path, sizeof(path), "%s/%s", dirname, name);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return (-errno);
+	n = pread(fd, buf, req->size, req->offset);
+	if (n < 0)
+		n = -errno;
+	close(fd);
+	return (n);
+}
+
+static void *serve(void *arg)
+{
+	struct ONEDRIVE_HYDRATE_REQUEST req;
+	struct ONEDRIVE_HYDRATE_REPLY reply;
+	char *buf;
+	ssize_t n;
+	int fd;
+
+	fd = (int)(long)arg;
+	buf = (char*)malloc(ONEDRIVE_HYDRATE_MAX);
+	while (buf && !xfer(fd, (char*)&req, sizeof(req), 0)) {
+		pthread_mutex_lock(&lock);
+		while (max_concurrent && (running >= max_concurrent))
+			pthread_cond_wait(&slot_freed, &lock);
+		if (++running > max_running)
+			max_running = running;
+		pthread_mutex_unlock(&lock);
+
+		n = fetch(&req, buf);
+		shape(&req, (n > 0 ? n : 0));
+
+		pthread_mutex_lock(&lock);
+		running--;
+		count_requests++;
+		if (n < 0)
+			count_errors++;
+		else
+			count_bytes += n;
+		pthread_cond_signal(&slot_freed);
+		pthread_mutex_unlock(&lock);
+
+		reply.magic = ONEDRIVE_HYDRATE_MAGIC;
+		reply.status = (n < 0 ? -n : 0);
+		reply.size = (n < 0 ? 0 : n);
+		reply.reserved = 0;
+		if (xfer(fd, (char*)&reply, sizeof(reply), 1)
+		    || xfer(fd, buf, reply.size, 1))
+			break;
+	}
+	free(buf);
+	close(fd);
+	return ((void*)NULL);
+}
+
+static void stop(int sig __attribute__((unused)))
+{
+	stopping = 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int lfd;
+	int fd;
+	int c;
+
+	while ((c = getopt(argc, argv, "l:j:b:e:c:s:")) != -1) {
+		switch (c) {
+		case 'l' :
+			latency_ms = strtoul(optarg, (char**)NULL, 0);
+			break;
+		case 'j' :
+			jitter_ms = strtoul(optarg, (char**)NULL, 0);
+			break;
+		case 'b' :
+			bandwidth = strtoul(optarg, (char**)NULL, 0)*1024;
+			break;
+		case 'e' :
+			error_rate = strtoul(optarg, (char**)NULL, 0);
+			break;
+		case 'c' :
+			max_concurrent = strtoul(optarg, (char**)NULL, 0);
+			break;
+		case 's' :
+			seed = strtoull(optarg, (char**)NULL, 0);
+			break;
+		default :
+			usage();
+		}
+	}
+	if ((argc - optind) != 2)
+		usage();
+	dirname = argv[optind];
+	if (strlen(argv[optind + 1]) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket name too long\n");
+		return (1);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, argv[optind + 1]);
+	unlink(addr.sun_path);
+	lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ((lfd < 0)
+	    || bind(lfd, (struct sockaddr*)&addr, sizeof(addr))
+	    || listen(lfd, 16)) {
+		perror(addr.sun_path);
+		return (1);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop;
+	sigaction(SIGINT, &sa, (struct sigaction*)NULL);
+	sigaction(SIGTERM, &sa, (struct sigaction*)NULL);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	clock_gettime(CLOCK_MONOTONIC, &link_free);
+
+	while (!stopping) {
+		fd = accept(lfd, (struct sockaddr*)NULL, (socklen_t*)NULL);
+		if (fd < 0)
+			continue;
+		if (pthread_create(&thread, &attr, serve, (void*)(long)fd))
+			close(fd);
+	}
+
+	close(lfd);
+	unlink(addr.sun_path);
+	pthread_mutex_lock(&lock);
+	printf("requests %llu errors %llu bytes %llu max concurrent %u\n",
+		count_requests, count_errors, count_bytes, max_running);
+	pthread_mutex_unlock(&lock);
+	return (0);
+}
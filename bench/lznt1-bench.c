@@ -0,0 +1,367 @@
+/*
+ * lznt1-bench.c - Throughput and ratio of the LZNT1 compression engine
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	The data is split into compression units of 16 clusters, which
+ *	are compressed one at a time by a single thread, then in batches
+ *	by the workers of the plugin, and decompressed to check the
+ *	round trip. For each kind of data, the space used in clusters
+ *	relative to the uncompressed units, and the throughputs in MB/s
+ *	of uncompressed data are printed.
+ *
+ *	The data is either synthetic : text, fixed-size records, random
+ *	bytes and zeroes, or read from the files given.
+ *
+ *	Usage : lznt1-bench [options] [file...]
+ *		-c bytes	cluster size (default 4096)
+ *		-m MB		size of each synthetic kind (default 64)
+ *		-r n		rounds, the best one is kept (default 3)
+ *		-w n		count of workers (default processors - 1)
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/onedrive.h"
+
+#define BATCH_UNITS 32			/* as in compress.c */
+
+struct UNIT_JOB {
+	const char *in;
+	char *out;
+	size_t out_size;
+} ;
+
+struct BENCH_BATCH {
+	struct UNIT_JOB jobs[BATCH_UNITS];
+	size_t unit_size;
+	size_t max;
+} ;
+
+static u32 cluster_size = 4096;
+static size_t unit_size;
+static int rounds = 3;
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec/1000000000.0);
+}
+
+static void fill_text(char *buf, size_t size, unsigned int seed)
+{
+	static const char *words[] = {
+		"the", "sync", "root", "of", "OneDrive", "file", "cloud",
+		"directory", "is", "a", "volume", "and", "compression",
+		"unit", "data", "cluster", "NTFS", "placeholder", "to",
+		"reparse", "point", "which", "with", "local", "copy",
+	} ;
+	size_t pos;
+	size_t len;
+	const char *w;
+
+	pos = 0;
+	while (pos < size) {
+		w = words[rand_r(&seed) % (sizeof(words)/sizeof(words[0]))];
+		len = strlen(w);
+		if ((pos + len + 1) > size)
+			len = size - pos - 1;
+		memcpy(buf + pos, w, len);
+		pos += len;
+		buf[pos++] = ((rand_r(&seed) % 12) ? ' ' : '\n');
+	}
+}
+
+static void fill_records(char *buf, size_t size, unsigned int seed)
+{
+	size_t pos;
+	int n;
+
+	for (pos=0; pos<size; pos+=n) {
+		n = snprintf(buf + pos, size - pos,
+			"%08u;customer-%05u;%10.2f;EUR;2020-%02u-%02u;OK\n",
+			(unsigned int)(pos/64), rand_r(&seed) % 50000,
+			(rand_r(&seed) % 10000000)/100.0,
+			rand_r(&seed) % 12 + 1, rand_r(&seed) % 28 + 1);
+		if ((n <= 0) || ((size_t)n >= (size - pos))) {
+			memset(buf + pos, ' ', size - pos);
+			break;
+		}
+	}
+}
+
+static void fill_random(char *buf, size_t size, unsigned int seed)
+{
+	size_t pos;
+
+	for (pos=0; pos<size; pos++)
+		buf[pos] = rand_r(&seed);
+}
+
+static char *read_file(const char *path, size_t *size)
+{
+	FILE *f;
+	char *buf;
+	char *p;
+	size_t alloc;
+	size_t got;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return ((char*)NULL);
+	buf = (char*)NULL;
+	alloc = 0;
+	*size = 0;
+	do {
+		if (*size == alloc) {
+			p = (char*)realloc(buf, alloc + 16777216);
+			if (!p) {
+				free(buf);
+				fclose(f);
+				return ((char*)NULL);
+			}
+			buf = p;
+			alloc += 16777216;
+		}
+		got = fread(buf + *size, 1, alloc - *size, f);
+		*size += got;
+	} while (got);
+	fclose(f);
+	return (buf);
+}
+
+static size_t clusters_of(size_t compressed)
+{
+	if (!compressed)
+		return (unit_size/cluster_size);
+	return ((compressed + cluster_size - 1)/cluster_size);
+}
+
+static void compress_job(void *arg, int job)
+{
+	struct BENCH_BATCH *b;
+
+	b = (struct BENCH_BATCH*)arg;
+	b->jobs[job].out_size = onedrive_lznt1_compress(b->jobs[job].in,
+			b->unit_size, b->jobs[job].out, b->max);
+}
+
+/*
+ *		Compress, decompress and check some data
+ *
+ *	The data is padded with zeroes to full units.
+ */
+
+static int bench(const char *kind, const char *data, size_t size)
+{
+	struct BENCH_BATCH batch;
+	char *out;
+	char *back;
+	size_t *sizes;
+	size_t units;
+	size_t used;
+	size_t stored;
+	size_t i;
+	double start;
+	double single;
+	double pooled;
+	double decomp;
+	double t;
+	ssize_t got;
+	int count;
+	int r;
+	int j;
+
+	units = (size + unit_size - 1)/unit_size;
+	out = (char*)malloc(units*unit_size);
+	back = (char*)malloc(unit_size);
+	sizes = (size_t*)calloc(units, sizeof(size_t));
+	if (!out || !back || !sizes) {
+		free(out);
+		free(back);
+		free(sizes);
+		return (-1);
+	}
+	single = pooled = decomp = 0.0;
+	for (r=0; r<rounds; r++) {
+		start = now_s();
+		for (i=0; i<units; i++)
+			sizes[i] = onedrive_lznt1_compress(data + i*unit_size,
+					unit_size, out + i*unit_size,
+					unit_size - cluster_size);
+		t = now_s() - start;
+		if (!r || (t < single))
+			single = t;
+		batch.unit_size = unit_size;
+		batch.max = unit_size - cluster_size;
+		start = now_s();
+		for (i=0; i<units; i+=count) {
+			count = (units - i > BATCH_UNITS ? BATCH_UNITS
+					: units - i);
+			for (j=0; j<count; j++) {
+				batch.jobs[j].in = data + (i + j)*unit_size;
+				batch.jobs[j].out = out + (i + j)*unit_size;
+			}
+			onedrive_workers_run(compress_job, &batch, count);
+			for (j=0; j<count; j++)
+				if (batch.jobs[j].out_size != sizes[i + j]) {
+					fprintf(stderr, "%s : unit %lu differs"
+						" with the workers\n", kind,
+						(unsigned long)(i + j));
+					return (-1);
+				}
+		}
+		t = now_s() - start;
+		if (!r || (t < pooled))
+			pooled = t;
+		start = now_s();
+		for (i=0; i<units; i++)
+			if (sizes[i]) {
+				got = onedrive_lznt1_decompress(
+					out + i*unit_size, sizes[i],
+					back, unit_size);
+				if ((got != (ssize_t)unit_size)
+				    || memcmp(back, data + i*unit_size,
+						unit_size)) {
+					fprintf(stderr, "%s : unit %lu does"
+						" not round trip\n", kind,
+						(unsigned long)i);
+					return (-1);
+				}
+			}
+		t = now_s() - start;
+		if (!r || (t < decomp))
+			decomp = t;
+	}
+	used = 0;
+	stored = 0;
+	for (i=0; i<units; i++) {
+		used += clusters_of(sizes[i]);
+		if (!sizes[i])
+			stored++;
+	}
+	printf("%-16s %8.1f %7.1f%% %10.1f %10.1f", kind,
+		units*(double)unit_size/1048576,
+		100.0*used/(units*(unit_size/cluster_size)),
+		units*(double)unit_size/1048576/single,
+		units*(double)unit_size/1048576/pooled);
+		/* the units which do not compress are stored */
+	if (stored < units)
+		printf(" %10.1f\n", (units - stored)*(double)unit_size
+					/1048576/decomp);
+	else
+		printf(" %10s\n", "-");
+	free(out);
+	free(back);
+	free(sizes);
+	return (0);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage : lznt1-bench [-c cluster] [-m MB] [-r rounds]"
+			" [-w workers] [file...]\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	char *data;
+	size_t size;
+	size_t mb;
+	int rc;
+	int opt;
+	int i;
+
+	mb = 64;
+	onedrive_workers_set(-1);
+	while ((opt = getopt(argc, argv, "c:m:r:w:")) != -1) {
+		switch (opt) {
+		case 'c' :
+			cluster_size = strtoul(optarg, (char**)NULL, 0);
+			break;
+		case 'm' :
+			mb = atol(optarg);
+			break;
+		case 'r' :
+			rounds = atoi(optarg);
+			break;
+		case 'w' :
+			onedrive_workers_set(atoi(optarg));
+			break;
+		default :
+			usage();
+		}
+	}
+	if ((cluster_size < 512) || (cluster_size > 4096)
+	    || (cluster_size & (cluster_size - 1))
+	    || !mb || (rounds <= 0))
+		usage();
+	unit_size = (size_t)cluster_size << 4;
+	printf("%d workers, %u-byte clusters\n", onedrive_workers_count(),
+		cluster_size);
+	printf("%-16s %8s %8s %10s %10s %10s\n", "data", "MB", "space",
+		"1 thread", "workers", "decompress");
+	rc = 0;
+	if (optind < argc) {
+		for (i=optind; i<argc; i++) {
+			data = read_file(argv[i], &size);
+			if (!data) {
+				fprintf(stderr, "Could not read %s : %s\n",
+					argv[i], strerror(errno));
+				rc = 1;
+				continue;
+			}
+				/* pad to full units */
+			data = (char*)realloc(data, (size + unit_size - 1)
+					/unit_size*unit_size + 1);
+			if (!data)
+				return (1);
+			memset(data + size, 0, (size + unit_size - 1)
+					/unit_size*unit_size - size);
+			if (size && bench(argv[i], data, size))
+				rc = 1;
+			free(data);
+		}
+	} else {
+		size = mb << 20;
+		data = (char*)malloc(size);
+		if (!data)
+			return (1);
+		fill_text(data, size, 1);
+		rc |= (bench("text", data, size) != 0);
+		fill_records(data, size, 1);
+		rc |= (bench("records", data, size) != 0);
+		fill_random(data, size, 1);
+		rc |= (bench("random", data, size) != 0);
+		memset(data, 0, size);
+		rc |= (bench("zeroes", data, size) != 0);
+		free(data);
+	}
+	onedrive_workers_report(stdout);
+	return (rc);
+}
@@ -0,0 +1,330 @@
+#!/bin/sh
+#
+# mount-bench.sh - End-to-end benchmark of the OneDrive plugin through FUSE
+#
+# Copyright (C) 2026 agent
+#
+# This program is free software: you can redistribute it and/or modify it under
+# the terms of the GNU General Public License as published by the Free Software
+# Foundation, either version 2 of the License, or (at your option) any later
+# version.
+#
+#	A loop image is formatted with mkntfs and mounted with ntfs-3g,
+#	the plugin from the build tree being bind-mounted over the
+#	installed one. The same data set is copied to a OneDrive
+#	directory (tagged with cloud reparse points) and to a plain
+#	directory, and a set of real-tool workloads is run on both,
+#	each one after a remount and a page cache flush.
+#
+#	For each workload, the wall time, the CPU time of the tool and
+#	of the ntfs-3g process, and the reads and writes on the loop
+#	device are recorded into a tab-separated result file, followed
+#	by the cloud to plain overhead ratios. The statistics of the
+#	plugin for each workload are kept as stats-<workload>-<root>.
+#
+#	The ddoverwrite workload rewrites the large files in place with
+#	dd, so that the writes reach the plugin in the OneDrive tree,
+#	the clusters being already allocated (see ONEDRIVE_DIRECT_WRITES).
+#
+#	The ddcompress workloads rewrite in place the compressible files
+#	of a directory marked compressed, so that the writes reach the
+#	plugin in the OneDrive tree : ddcompress lets ntfs-3g compress
+#	them, as without the plugin, and ddcompress-workers sets
+#	ONEDRIVE_COMPRESS_WRITES for the plugin to compress them on its
+#	workers. The throughputs of the rewrites in MB/s are printed
+#	after the ratios.
+#
+#	Must be run as root. Environment :
+#		BENCH_DIR	work directory (default /tmp/onedrive-bench)
+#		BENCH_SIZE	image size (default 2G)
+#		BENCH_FILES	count of small files (default 5000)
+#		BENCH_LARGE	count of 64MB files of each kind (default 4)
+#		PLUGIN		plugin to test (default ./.libs/ntfs-plugin-9000001a.so)
+#		PLUGIN_DIR	ntfs-3g plugin directory (default from ntfs-3g)
+#		WORKLOADS	workloads to run (default all)
+#
+
+set -e
+
+BENCH_DIR=${BENCH_DIR:-/tmp/onedrive-bench}
+BENCH_SIZE=${BENCH_SIZE:-2G}
+BENCH_FILES=${BENCH_FILES:-5000}
+BENCH_LARGE=${BENCH_LARGE:-4}
+PLUGIN=${PLUGIN:-./.libs/ntfs-plugin-9000001a.so}
+WORKLOADS=${WORKLOADS:-"find du lsr tar rsync cplarge ddoverwrite ddcompress ddcompress-workers git unzip"}
+PLUGIN_NAME=ntfs-plugin-9000001a.so
+
+IMAGE=$BENCH_DIR/ntfs.img
+MNT=$BENCH_DIR/mnt
+SRC=$BENCH_DIR/src
+RESULTS=$BENCH_DIR/results.tsv
+
+LOOP=
+BOUND=
+CREATED=
+
+die() {
+	echo "mount-bench: $*" >&2
+	exit 1
+}
+
+cleanup() {
+	if mountpoint -q "$MNT" 2>/dev/null; then
+		umount "$MNT" || true
+	fi
+	[ -n "$LOOP" ] && losetup -d "$LOOP" 2>/dev/null || true
+	[ -n "$BOUND" ] && umount "$BOUND" 2>/dev/null || true
+	[ -n "$CREATED" ] && rm -f "$CREATED" || true
+}
+
+trap cleanup EXIT INT TERM
+
+[ "$(id -u)" -eq 0 ] || die "must be run as root"
+for tool in mkntfs ntfs-3g losetup setfattr awk; do
+	command -v $tool >/dev/null 2>&1 || die "$tool is needed"
+done
+[ -f "$PLUGIN" ] || die "no plugin $PLUGIN, run make first"
+PLUGIN=$(readlink -f "$PLUGIN")
+
+#
+#		Locate the plugin directory compiled into ntfs-3g
+#
+
+if [ -z "$PLUGIN_DIR" ]; then
+	pattern=$(strings "$(command -v ntfs-3g)" | grep 'ntfs-plugin-%' | head -n 1)
+	[ -n "$pattern" ] || die "cannot find the plugin directory, set PLUGIN_DIR"
+	PLUGIN_DIR=$(dirname "$pattern")
+fi
+
+#
+#		Make ntfs-3g load the plugin from the build tree
+#
+
+mkdir -p "$PLUGIN_DIR"
+if [ ! -e "$PLUGIN_DIR/$PLUGIN_NAME" ]; then
+	touch "$PLUGIN_DIR/$PLUGIN_NAME"
+	CREATED="$PLUGIN_DIR/$PLUGIN_NAME"
+fi
+mount --bind "$PLUGIN" "$PLUGIN_DIR/$PLUGIN_NAME"
+BOUND="$PLUGIN_DIR/$PLUGIN_NAME"
+
+#
+#		Build the data set
+#
+
+mkdir -p "$BENCH_DIR" "$MNT"
+rm -rf "$SRC"
+mkdir -p "$SRC/tree" "$SRC/large" "$SRC/text"
+i=0
+while [ $i -lt "$BENCH_FILES" ]; do
+	d="$SRC/tree/d$((i / 100))"
+	[ -d "$d" ] || mkdir "$d"
+	seq $i $((i + (i % 37) * 40)) > "$d/f$i.txt"
+	i=$((i + 1))
+done
+i=0
+while [ $i -lt "$BENCH_LARGE" ]; do
+	dd if=/dev/urandom of="$SRC/large/big$i" bs=1M count=64 2>/dev/null
+	seq $((i * 10000000)) $((i * 10000000 + 9999999)) | head -c 64M \
+		> "$SRC/text/text$i"
+	i=$((i + 1))
+done
+if command -v git >/dev/null 2>&1; then
+	git init -q "$SRC/repo"
+	cp -r "$SRC/tree/d0" "$SRC/tree/d1" "$SRC/repo/"
+	git -C "$SRC/repo" add -A
+	git -C "$SRC/repo" -c user.name=bench -c user.email=bench@localhost \
+		commit -q -m bench
+fi
+if command -v zip >/dev/null 2>&1; then
+	(cd "$SRC" && zip -q -r archive.zip tree/d2 tree/d3 tree/d4)
+fi
+
+#
+#		Format and populate the image
+#
+
+rm -f "$IMAGE"
+truncate -s "$BENCH_SIZE" "$IMAGE"
+LOOP=$(losetup -f --show "$IMAGE")
+mkntfs -Q -F -L onedrive-bench "$LOOP" >/dev/null
+DEV=$(basename "$LOOP")
+
+ntfs-3g "$LOOP" "$MNT"
+mkdir "$MNT/OneDrive" "$MNT/Plain"
+for root in OneDrive Plain; do
+	cp -r "$SRC/tree" "$SRC/large" "$MNT/$root/"
+	mkdir "$MNT/$root/compressed"
+	# FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_COMPRESSED
+	setfattr -n system.ntfs_attrib_be -v 0x00000810 \
+		"$MNT/$root/compressed"
+	cp "$SRC"/text/* "$MNT/$root/compressed/"
+done
+
+#
+#	Tag the OneDrive tree with cloud reparse points, each
+#	one with its own GUID
+#
+
+reparse() {
+	printf '0x1a0000901a0000000000000000000000%08x0000000000000000000000000000\n' "$1"
+}
+
+n=1
+setfattr -h -n system.ntfs_reparse_data -v "$(reparse $n)" "$MNT/OneDrive"
+find "$MNT/OneDrive" -mindepth 1 | while read -r path; do
+	n=$((n + 1))
+	setfattr -h -n system.ntfs_reparse_data -v "$(reparse $n)" "$path"
+done
+umount "$MNT"
+
+#
+#		Measurement helpers
+#
+
+# the workers only compress for the workload meant to measure them
+mount_fresh() {
+	mountpoint -q "$MNT" && umount "$MNT"
+	sync
+	echo 3 > /proc/sys/vm/drop_caches
+	case $1 in
+	ddcompress-workers-*) compress_writes=1 ;;
+	*) compress_writes= ;;
+	esac
+	ONEDRIVE_STATS_FILE=$BENCH_DIR/stats-$1 \
+	ONEDRIVE_COMPRESS_WRITES=$compress_writes \
+		ntfs-3g "$LOOP" "$MNT"
+	NTFS_PID=$(pgrep -n -f "ntfs-3g $LOOP") || die "ntfs-3g is not running"
+}
+
+# cpu time of ntfs-3g in clock ticks
+ntfs_cpu() {
+	awk '{ print $14 + $15 }' "/proc/$NTFS_PID/stat"
+}
+
+# sectors read and written on the loop device
+dev_io() {
+	awk '{ print $3, $7 }' "/sys/block/$DEV/stat"
+}
+
+now() {
+	date +%s.%N
+}
+
+workload() {
+	root=$MNT/$1
+	case $2 in
+	find)	find "$root" > /dev/null ;;
+	du)	du -s "$root" > /dev/null ;;
+	lsr)	ls -lR "$root" > /dev/null ;;
+	tar)	tar cf - -C "$root" tree | cat > /dev/null ;;
+	rsync)	command -v rsync >/dev/null 2>&1 || return 2
+		rsync -a "$SRC/tree/" "$root/rsync/" ;;
+	cplarge) mkdir "$root/copy"
+		cp "$SRC"/large/* "$root/copy/" ;;
+	ddcompress|ddcompress-workers) for f in "$SRC"/text/*; do
+			dd if="$f" of="$root/compressed/${f##*/}" bs=1M \
+				conv=notrunc,fsync status=none || return 1
+		done ;;
+	ddoverwrite) for f in "$SRC"/large/*; do
+			dd if="$f" of="$root/large/${f##*/}" bs=1M \
+				conv=notrunc,fsync status=none || return 1
+		done ;;
+	git)	[ -d "$SRC/repo/.git" ] || return 2
+		mkdir "$root/checkout"
+		git --git-dir="$SRC/repo/.git" --work-tree="$root/checkout" \
+			checkout -q -f HEAD -- . ;;
+	unzip)	[ -f "$SRC/archive.zip" ] && command -v unzip >/dev/null 2>&1 \
+			|| return 2
+		unzip -q "$SRC/archive.zip" -d "$root/unzip" ;;
+	*)	die "unknown workload $2" ;;
+	esac
+}
+
+measure() {
+	mount_fresh "$2-$1"
+	cpu0=$(ntfs_cpu)
+	io0=$(dev_io)
+	t0=$(now)
+	set +e
+	( workload "$1" "$2"; echo $? > "$BENCH_DIR/status" ; times ) \
+		> "$BENCH_DIR/times" 2>/dev/null
+	set -e
+	sync
+	t1=$(now)
+	cpu1=$(ntfs_cpu)
+	io1=$(dev_io)
+	status=$(cat "$BENCH_DIR/status")
+	if [ "$status" = 2 ]; then
+		echo "skipping $2 : tool or data missing" >&2
+		return
+	fi
+	[ "$status" = 0 ] || die "workload $2 failed on $1"
+	hz=$(getconf CLK_TCK)
+	echo "$2 $1 $t0 $t1 $cpu0 $cpu1 $io0 $io1 $hz" | awk '
+		function secs(s,  a) {
+			split(s, a, "m"); return a[1] * 60 + a[2] + 0
+		}
+		{
+			getline line < "'"$BENCH_DIR/times"'"
+			getline line < "'"$BENCH_DIR/times"'"
+			split(line, t, " ")
+			printf "%s\t%s\t%.3f\t%.3f\t%.3f\t%d\t%d\n",
+				$1, $2, $4 - $3,
+				secs(t[1]) + secs(t[2]),
+				($6 - $5) / $11,
+				($9 - $7) / 2, ($10 - $8) / 2
+		}' >> "$RESULTS"
+}
+
+#
+#		Run the workloads on both trees
+#
+
+printf 'workload\troot\twall_s\ttool_cpu_s\tntfs3g_cpu_s\tread_kb\twrite_kb\n' \
+	> "$RESULTS"
+for w in $WORKLOADS; do
+	for root in Plain OneDrive; do
+		measure $root $w
+	done
+done
+umount "$MNT"
+
+#
+#		Report the overhead of the plugin
+#
+
+awk -F '\t' '
+	NR == 1 { print; next }
+	{
+		print
+		key = $1
+		if ($2 == "Plain") {
+			wall[key] = $3; cpu[key] = $5; io[key] = $6 + $7
+		} else {
+			cwall[key] = $3; ccpu[key] = $5; cio[key] = $6 + $7
+			order[++n] = key
+		}
+	}
+	END {
+		print ""
+		print "workload\twall_ratio\tntfs3g_cpu_ratio\tio_ratio"
+		for (i = 1; i <= n; i++) {
+			k = order[i]
+			printf "%s\t%.2f\t%.2f\t%.2f\n", k,
+				wall[k] ? cwall[k] / wall[k] : 0,
+				cpu[k] ? ccpu[k] / cpu[k] : 0,
+				io[k] ? cio[k] / io[k] : 0
+		}
+	}' "$RESULTS"
+
+#
+#		Report the write throughput of the rewrites in place
+#
+
+awk -F '\t' -v mb=$((BENCH_LARGE * 64)) '
+	$1 ~ /^dd/ && $3 > 0 {
+		if (!done++)
+			print "\nworkload\troot\tMB_s"
+		printf "%s\t%s\t%.1f\n", $1, $2, mb / $3
+	}' "$RESULTS"
@@ -0,0 +1,426 @@
+/*
+ * onedrive-status.c - Client of the sync status service of the OneDrive plugin
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	Each query is a single round trip on the socket. The paths are
+ *	translated to paths from the root of the volume without any
+ *	access to the mounted file system, so "." and ".." are resolved
+ *	by the plugin, and symbolic links are not followed. When the
+ *	plugin has been restarted, or has closed the connection left
+ *	idle, the connection is established again.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "onedrive-status.h"
+
+struct ONEDRIVE_STATUS_CLIENT {
+	int fd;
+	char *socket_path;
+	char *mountpoint;		/* with no trailing '/' */
+	size_t mountpoint_length;
+} ;
+
+static int open_socket(struct ONEDRIVE_STATUS_CLIENT *client)
+{
+	struct sockaddr_un addr;
+
+	if (strlen(client->socket_path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, client->socket_path);
+	client->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (client->fd < 0)
+		return (-1);
+	if (connect(client->fd, (struct sockaddr*)&addr, sizeof(addr))) {
+		close(client->fd);
+		client->fd = -1;
+		return (-1);
+	}
+	return (0);
+}
+
+struct ONEDRIVE_STATUS_CLIENT *onedrive_status_connect(const char *socket_path,
+			const char *mountpoint)
+{
+	struct ONEDRIVE_STATUS_CLIENT *client;
+	size_t len;
+
+	client = (struct ONEDRIVE_STATUS_CLIENT*)malloc(
+			sizeof(struct ONEDRIVE_STATUS_CLIENT));
+	if (!client)
+		return ((struct ONEDRIVE_STATUS_CLIENT*)NULL);
+	client->fd = -1;
+	client->socket_path = strdup(socket_path);
+	client->mountpoint = strdup(mountpoint);
+	if (!client->socket_path || !client->mountpoint
+	    || open_socket(client)) {
+		onedrive_status_close(client);
+		return ((struct ONEDRIVE_STATUS_CLIENT*)NULL);
+	}
+	len = strlen(client->mountpoint);
+	while (len && (client->mountpoint[len - 1] == '/'))
+		len--;
+	client->mountpoint[len] = '\0';
+	client->mountpoint_length = len;
+	return (client);
+}
+
+void onedrive_status_close(struct ONEDRIVE_STATUS_CLIENT *client)
+{
+	int olderrno;
+
+	if (client) {
+		olderrno = errno;
+		if (client->fd >= 0)
+			close(client->fd);
+		free(client->socket_path);
+		free(client->mountpoint);
+		free(client);
+		errno = olderrno;
+	}
+}
+
+/*
+ *		Translate a path to a path from the root of the volume
+ *
+ *	Returns an allocated path, or NULL if the path is not within
+ *	the mount point (errno is then EXDEV) or there is no memory
+ */
+
+static char *volume_path(const struct ONEDRIVE_STATUS_CLIENT *client,
+			const char *path)
+{
+	char cwd[4096];
+	char *full;
+	char *res;
+	size_t len;
+
+	if (path[0] == '/')
+		full = strdup(path);
+	else {
+		if (!getcwd(cwd, sizeof(cwd)))
+			return ((char*)NULL);
+		full = (char*)malloc(strlen(cwd) + strlen(path) + 2);
+		if (full)
+			sprintf(full, "%s/%s", cwd, path);
+	}
+	if (!full)
+		return ((char*)NULL);
+	len = client->mountpoint_length;
+	if (strncmp(full, client->mountpoint, len)
+	    || (full[len] && (full[len] != '/'))) {
+		free(full);
+		errno = EXDEV;
+		return ((char*)NULL);
+	}
+	res = strdup(&full[len]);
+	free(full);
+	return (res);
+}
+
+static int read_all(int fd, void *buf, size_t size)
+{
+	ssize_t got;
+	size_t total;
+
+	for (total=0; total<size; total+=got) {
+		got = recv(fd, (char*)buf + total, size - total, 0);
+		if (got <= 0) {
+			if (!got)
+				errno = ECONNRESET;
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+static int send_request(int fd, const struct ONEDRIVE_STATUS_REQUEST *request,
+			const void *data)
+{
+	ssize_t sent;
+	size_t total;
+
+	sent = send(fd, request, sizeof(*request), MSG_NOSIGNAL);
+	if (sent != (ssize_t)sizeof(*request))
+		return (-1);
+	for (total=0; total<request->size; total+=sent) {
+		sent = send(fd, (const char*)data + total,
+				request->size - total, MSG_NOSIGNAL);
+		if (sent <= 0)
+			return (-1);
+	}
+	return (0);
+}
+
+/*
+ *		Send a request and get the reply
+ *
+ *	The request is sent again on a new connection if the plugin
+ *	has closed the previous one.
+ *	Returns the entries followed by the names, allocated, or NULL
+ */
+
+static char *transact(struct ONEDRIVE_STATUS_CLIENT *client,
+			enum ONEDRIVE_STATUS_KINDS kind, uint32_t count,
+			const void *data, size_t size,
+			struct ONEDRIVE_STATUS_REPLY *reply)
+{
+	struct ONEDRIVE_STATUS_REQUEST request;
+	char *buf;
+	int retry;
+
+	if (size > ONEDRIVE_STATUS_MAX_REQUEST) {
+		errno = E2BIG;
+		return ((char*)NULL);
+	}
+	request.magic = ONEDRIVE_STATUS_MAGIC;
+	request.version = ONEDRIVE_STATUS_VERSION;
+	request.kind = kind;
+	request.count = count;
+	request.size = size;
+	for (retry=0; retry<2; retry++) {
+		if ((client->fd < 0) && open_socket(client))
+			return ((char*)NULL);
+		if (!send_request(client->fd, &request, data)
+		    && !read_all(client->fd, reply, sizeof(*reply)))
+			break;
+		close(client->fd);
+		client->fd = -1;
+		if ((errno != EPIPE) && (errno != ECONNRESET))
+			return ((char*)NULL);
+	}
+	if (retry >= 2)
+		return ((char*)NULL);
+	if ((reply->magic != ONEDRIVE_STATUS_MAGIC)
+	    || (reply->size < (uint64_t)reply->count
+			*sizeof(struct ONEDRIVE_STATUS_ENTRY))) {
+		close(client->fd);
+		client->fd = -1;
+		errno = EPROTO;
+		return ((char*)NULL);
+	}
+	buf = (char*)malloc(reply->size + 1);
+	if (!buf || read_all(client->fd, buf, reply->size)) {
+		free(buf);
+		close(client->fd);
+		client->fd = -1;
+		return ((char*)NULL);
+	}
+	if (reply->error) {
+		free(buf);
+		errno = reply->error;
+		return ((char*)NULL);
+	}
+	return (buf);
+}
+
+/*
+ *		Get the status of files designated by their paths
+ *
+ *	The files outside the mount point are reported as not found.
+ */
+
+int onedrive_status_paths(struct ONEDRIVE_STATUS_CLIENT *client,
+			const char *const paths[], int count,
+			struct ONEDRIVE_STATUS_FILE files[])
+{
+	struct ONEDRIVE_STATUS_REPLY reply;
+	const struct ONEDRIVE_STATUS_ENTRY *entries;
+	char **translated;
+	char *data;
+	char *buf;
+	size_t size;
+	uint32_t sent;
+	int res;
+	int i;
+
+	translated = (char**)calloc(count + 1, sizeof(char*));
+	if (!translated)
+		return (-1);
+	res = -1;
+	data = (char*)NULL;
+	size = 0;
+	for (i=0; i<count; i++) {
+		translated[i] = volume_path(client, paths[i]);
+		if (translated[i])
+			size += strlen(translated[i]) + 1;
+		else
+			if (errno != EXDEV)
+				goto out;
+	}
+	data = (char*)calloc(size + 1, 1);
+	if (!data)
+		goto out;
+	size = 0;
+	sent = 0;
+	for (i=0; i<count; i++)
+		if (translated[i]) {
+			strcpy(&data[size], translated[i]);
+			size += strlen(translated[i]) + 1;
+			sent++;
+		}
+	buf = transact(client, ONEDRIVE_STATUS_BY_PATH, sent, data, size,
+			&reply);
+	if (!buf)
+		goto out;
+	if (reply.count != sent) {
+		free(buf);
+		errno = EPROTO;
+		goto out;
+	}
+	entries = (const struct ONEDRIVE_STATUS_ENTRY*)buf;
+	for (i=0; i<count; i++) {
+		files[i].name = (const char*)NULL;
+		if (translated[i]) {
+			files[i].mref = entries->mref;
+			files[i].status = entries->status;
+			entries++;
+		} else {
+			files[i].mref = 0;
+			files[i].status = 0;
+		}
+	}
+	free(buf);
+	res = count;
+out :
+	for (i=0; i<count; i++)
+		free(translated[i]);
+	free(translated);
+	free(data);
+	return (res);
+}
+
+/*
+ *		Get the status of files designated by their inode references
+ *
+ *	A reference with a zero sequence number designates whichever
+ *	file has the inode number, such as the st_ino of a file.
+ */
+
+int onedrive_status_refs(struct ONEDRIVE_STATUS_CLIENT *client,
+			const uint64_t mrefs[], int count,
+			struct ONEDRIVE_STATUS_FILE files[])
+{
+	struct ONEDRIVE_STATUS_REPLY reply;
+	const struct ONEDRIVE_STATUS_ENTRY *entries;
+	char *buf;
+	int i;
+
+	if (((size_t)count*sizeof(uint64_t)) > ONEDRIVE_STATUS_MAX_REQUEST) {
+		errno = E2BIG;
+		return (-1);
+	}
+	buf = transact(client, ONEDRIVE_STATUS_BY_REF, count, mrefs,
+			count*sizeof(uint64_t), &reply);
+	if (!buf)
+		return (-1);
+	if (reply.count != (uint32_t)count) {
+		free(buf);
+		errno = EPROTO;
+		return (-1);
+	}
+	entries = (const struct ONEDRIVE_STATUS_ENTRY*)buf;
+	for (i=0; i<count; i++) {
+		files[i].name = (const char*)NULL;
+		files[i].mref = entries[i].mref;
+		files[i].status = entries[i].status;
+	}
+	free(buf);
+	return (count);
+}
+
+/*
+ *		Get the status of all the files in a directory
+ *
+ *	Returns the count of files, the list being allocated
+ */
+
+int onedrive_status_list(struct ONEDRIVE_STATUS_CLIENT *client,
+			const char *dir, struct ONEDRIVE_STATUS_FILE **files)
+{
+	struct ONEDRIVE_STATUS_REPLY reply;
+	const struct ONEDRIVE_STATUS_ENTRY *entries;
+	struct ONEDRIVE_STATUS_FILE *list;
+	const char *names;
+	uint32_t names_size;
+	size_t used;
+	char *path;
+	char *name;
+	char *buf;
+	uint32_t i;
+
+	path = volume_path(client, dir);
+	if (!path) {
+		if (errno == EXDEV)
+			errno = ENOENT;
+		return (-1);
+	}
+	buf = transact(client, ONEDRIVE_STATUS_DIRECTORY, 1, path,
+			strlen(path) + 1, &reply);
+	free(path);
+	if (!buf)
+		return (-1);
+	entries = (const struct ONEDRIVE_STATUS_ENTRY*)buf;
+	names = (const char*)&entries[reply.count];
+	names_size = reply.size
+			- reply.count*sizeof(struct ONEDRIVE_STATUS_ENTRY);
+	list = (struct ONEDRIVE_STATUS_FILE*)malloc(reply.count
+			*sizeof(struct ONEDRIVE_STATUS_FILE)
+			+ names_size + reply.count);
+	if (!list) {
+		free(buf);
+		return (-1);
+	}
+	name = (char*)&list[reply.count];
+	used = 0;
+	for (i=0; i<reply.count; i++) {
+		used += entries[i].name_length + 1;
+		if ((((uint64_t)entries[i].name_offset
+				+ entries[i].name_length) > names_size)
+		    || (used > (size_t)names_size + reply.count)) {
+			free(list);
+			free(buf);
+			errno = EPROTO;
+			return (-1);
+		}
+		memcpy(name, &names[entries[i].name_offset],
+				entries[i].name_length);
+		name[entries[i].name_length] = '\0';
+		list[i].name = name;
+		list[i].mref = entries[i].mref;
+		list[i].status = entries[i].status;
+		name += entries[i].name_length + 1;
+	}
+	free(buf);
+	*files = list;
+	return (reply.count);
+}
@@ -0,0 +1,125 @@
+/*
+ * onedrive-status.h - Queries of the sync status of OneDrive files
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ONEDRIVE_STATUS_H
+#define _ONEDRIVE_STATUS_H
+
+/*
+ *	The OneDrive plugin answers queries about the status of files on
+ *	the Unix socket designated by ONEDRIVE_STATUS_SOCKET, from its
+ *	name index, without going through FUSE. Many paths or inode
+ *	references may be queried in a single request, and a directory
+ *	may be listed with the status of each of its files.
+ *
+ *	A request is a struct ONEDRIVE_STATUS_REQUEST followed by "size"
+ *	bytes : "count" paths, each terminated by a null, or "count"
+ *	inode references, or a single path for a directory. The paths
+ *	are relative to the root of the volume.
+ *
+ *	A reply is a struct ONEDRIVE_STATUS_REPLY followed by "size"
+ *	bytes : "count" entries, then the names of the files listed,
+ *	not terminated. The entries are in the order of the request.
+ *
+ *	Integers are in the byte order of the host.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ONEDRIVE_STATUS_MAGIC 0x5453444f		/* "ODST" */
+#define ONEDRIVE_STATUS_VERSION 1
+#define ONEDRIVE_STATUS_MAX_REQUEST 1048576	/* bytes after the header */
+
+enum ONEDRIVE_STATUS_KINDS {
+	ONEDRIVE_STATUS_BY_PATH = 1,
+	ONEDRIVE_STATUS_BY_REF = 2,
+	ONEDRIVE_STATUS_DIRECTORY = 3
+} ;
+
+#define ONEDRIVE_STATUS_FOUND 1		/* known to the plugin */
+#define ONEDRIVE_STATUS_DIR 2		/* a directory */
+#define ONEDRIVE_STATUS_LOCAL 4		/* the data is on the device */
+#define ONEDRIVE_STATUS_OFFLINE 8	/* the data is only in the cloud */
+#define ONEDRIVE_STATUS_PINNED 16	/* always kept on the device */
+#define ONEDRIVE_STATUS_UNPINNED 32	/* only kept in the cloud */
+#define ONEDRIVE_STATUS_MODIFIED 64	/* written, not synced by Windows */
+#define ONEDRIVE_STATUS_OUTSIDE 128	/* leading to the OneDrive tree */
+
+struct ONEDRIVE_STATUS_REQUEST {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t kind;			/* ONEDRIVE_STATUS_BY_PATH, ... */
+	uint32_t count;			/* of paths or references */
+	uint32_t size;			/* of what follows */
+} ;
+
+struct ONEDRIVE_STATUS_REPLY {
+	uint32_t magic;
+	int32_t error;			/* zero or an errno value */
+	uint32_t count;			/* of entries */
+	uint32_t size;			/* of what follows */
+} ;
+
+struct ONEDRIVE_STATUS_ENTRY {
+	uint64_t mref;			/* zero if not found */
+	uint32_t status;		/* ONEDRIVE_STATUS_* */
+	uint32_t name_offset;		/* in the names, when listing */
+	uint32_t name_length;		/* zero when not listing */
+	uint32_t reserved;
+} ;
+
+/*
+ *	The client library
+ *
+ *	The paths given to the client are absolute, or relative to the
+ *	current directory, and they must be within the mount point. The
+ *	functions return zero or a count of files, or -1 with errno set,
+ *	EAGAIN meaning the plugin has not indexed the volume yet.
+ *	The listing of a directory is allocated with its names as a
+ *	single block, to be freed by free(3).
+ */
+
+struct ONEDRIVE_STATUS_CLIENT;
+
+struct ONEDRIVE_STATUS_FILE {
+	const char *name;		/* when listing a directory */
+	uint64_t mref;			/* zero if not found */
+	uint32_t status;
+} ;
+
+struct ONEDRIVE_STATUS_CLIENT *onedrive_status_connect(const char *socket_path,
+			const char *mountpoint);
+void onedrive_status_close(struct ONEDRIVE_STATUS_CLIENT *client);
+int onedrive_status_paths(struct ONEDRIVE_STATUS_CLIENT *client,
+			const char *const paths[], int count,
+			struct ONEDRIVE_STATUS_FILE files[]);
+int onedrive_status_refs(struct ONEDRIVE_STATUS_CLIENT *client,
+			const uint64_t mrefs[], int count,
+			struct ONEDRIVE_STATUS_FILE files[]);
+int onedrive_status_list(struct ONEDRIVE_STATUS_CLIENT *client,
+			const char *dir, struct ONEDRIVE_STATUS_FILE **files);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _ONEDRIVE_STATUS_H */
@@ -0,0 +1,586 @@
+/*
+ * bufpool.c - Pool of aligned I/O buffers, and memory budget
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	The buffers used for I/O, compression, hashing and fetching
+ *	from the cloud are taken from a pool instead of the heap, so
+ *	that a long-running ntfs-3g does not fragment its heap, and
+ *	the buffers are aligned for O_DIRECT.
+ *
+ *	The sizes of buffers are powers of two from the cluster size
+ *	(at least 4096) up to 1MB and the compression unit, and the
+ *	buffers are carved from slabs of 2MB aligned to their size, each
+ *	slab being dedicated to a size. The buffers freed are kept for
+ *	reuse, first in a small cache local to the thread, then in the
+ *	pool. When ONEDRIVE_HUGEPAGES is set, the slabs are huge pages,
+ *	or transparent huge pages if none are reserved.
+ *
+ *	The slabs are charged to the memory budget of the plugin, set
+ *	by ONEDRIVE_MEM_BUDGET in MB (no limit by default), together with
+ *	the arrays of the name index, which grow with the volume. The
+ *	other tables (heat, sampler, hashing) have a fixed or small size
+ *	and are not charged. When the budget is reached, a slab whose
+ *	buffers are all free is given to another size, and if there is
+ *	none, the buffer is refused.
+ *
+ *	Buffers larger than the largest size are mapped individually.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <ntfs-3g/types.h>
+#include <ntfs-3g/layout.h>
+#include <ntfs-3g/volume.h>
+
+#include "onedrive.h"
+
+#define SLAB_SIZE 2097152		/* a huge page */
+#define MIN_BUFFER_SIZE 4096
+#define MAX_POOLED_SIZE 1048576		/* unless the compression unit */
+#define MAX_CLASSES 10
+#define THREAD_CACHE_BYTES 1048576	/* per size, in a thread */
+#define THREAD_CACHE_SLOTS 4
+
+struct FREE_BUFFER {
+	struct FREE_BUFFER *next;
+} ;
+
+struct BUFFER_CLASS {
+	size_t size;
+	int thread_slots;		/* buffers kept by a thread */
+	struct FREE_BUFFER *free;
+	u32 free_count;
+	u32 slabs;
+	u64 gets;
+	u64 thread_hits;		/* from the thread cache */
+	u64 pool_hits;			/* from the pool */
+	u64 carved;			/* from a new slab */
+	u64 refused;
+} ;
+
+struct SLAB {
+	char *base;
+	int class;
+	u32 used;			/* buffers out of the pool */
+	BOOL huge;			/* from reserved huge pages */
+} ;
+
+struct THREAD_CACHE {
+	int count[MAX_CLASSES];
+	void *buffers[MAX_CLASSES][THREAD_CACHE_SLOTS];
+} ;
+
+static pthread_mutex_t bufpool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t cache_key;
+static BOOL key_made = FALSE;
+static BOOL use_hugepages = FALSE;
+static int class_count = 0;
+static struct BUFFER_CLASS classes[MAX_CLASSES];
+static struct SLAB *slabs = (struct SLAB*)NULL;	/* ordered by base */
+static u32 slab_count = 0;
+static u32 slab_alloc = 0;
+static u64 reassigned = 0;
+static u64 oversize = 0;
+
+static s64 mem_budget = 0;		/* bytes, no limit if zero */
+static s64 mem_charged = 0;
+static s64 mem_peak = 0;
+static u64 over_budget = 0;
+
+static __thread struct THREAD_CACHE *thread_cache =
+			(struct THREAD_CACHE*)NULL;
+
+static struct SLAB *find_slab(const void *buf)
+{
+	char *base;
+	u32 low, high, mid;
+
+	base = (char*)((uintptr_t)buf & ~(uintptr_t)(SLAB_SIZE - 1));
+	low = 0;
+	high = slab_count;
+	while (low < high) {
+		mid = (low + high)/2;
+		if (slabs[mid].base < base)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return ((low < slab_count) && (slabs[low].base == base)
+			? &slabs[low] : (struct SLAB*)NULL);
+}
+
+/*
+ *		Give back a buffer to the pool
+ */
+
+static void pool_put(void *buf, int c)
+{
+	struct BUFFER_CLASS *pc;
+	struct FREE_BUFFER *fb;
+	struct SLAB *slab;
+
+	pc = &classes[c];
+	fb = (struct FREE_BUFFER*)buf;
+	pthread_mutex_lock(&bufpool_lock);
+	fb->next = pc->free;
+	pc->free = fb;
+	pc->free_count++;
+	slab = find_slab(buf);
+	if (slab)
+		slab->used--;
+	pthread_mutex_unlock(&bufpool_lock);
+}
+
+/*
+ *		Give back the buffers kept by a thread which exits
+ */
+
+static void drop_thread_cache(void *arg)
+{
+	struct THREAD_CACHE *tc;
+	int c;
+
+	tc = (struct THREAD_CACHE*)arg;
+	thread_cache = (struct THREAD_CACHE*)NULL;
+	for (c=0; c<class_count; c++)
+		while (tc->count[c] > 0)
+			pool_put(tc->buffers[c][--tc->count[c]], c);
+	free(tc);
+}
+
+void onedrive_bufpool_init(void)
+{
+	const char *value;
+
+	value = getenv("ONEDRIVE_MEM_BUDGET");
+	if (value && value[0])
+		mem_budget = (s64)atol(value) << 20;
+	if (mem_budget < 0)
+		mem_budget = 0;
+	value = getenv("ONEDRIVE_HUGEPAGES");
+	use_hugepages = (value && value[0] && (value[0] != '0'));
+	if (!pthread_key_create(&cache_key, drop_thread_cache))
+		key_made = TRUE;
+}
+
+/*
+ *		Define the sizes of buffers from the cluster size
+ *
+ *	This is done once, before the first buffer is got.
+ *	Must be called with the lock held.
+ */
+
+static void configure(u32 cluster_size)
+{
+	size_t size;
+	size_t max;
+	int c;
+
+	if (class_count)
+		return;
+	size = (cluster_size > MIN_BUFFER_SIZE ? cluster_size
+						: MIN_BUFFER_SIZE);
+	max = (size_t)cluster_size << 4;	/* compression unit */
+	if (max < MAX_POOLED_SIZE)
+		max = MAX_POOLED_SIZE;
+	if (max > SLAB_SIZE)
+		max = SLAB_SIZE;
+	for (c=0; (c<MAX_CLASSES) && (size<=max); c++) {
+		classes[c].size = size;
+		classes[c].thread_slots = THREAD_CACHE_BYTES/size;
+		if (classes[c].thread_slots > THREAD_CACHE_SLOTS)
+			classes[c].thread_slots = THREAD_CACHE_SLOTS;
+		size <<= 1;
+	}
+	class_count = c;
+}
+
+void onedrive_bufpool_start(ntfs_volume *vol)
+{
+	if (!class_count) {
+		pthread_mutex_lock(&bufpool_lock);
+		configure(vol->cluster_size);
+		pthread_mutex_unlock(&bufpool_lock);
+	}
+}
+
+/*
+ *		Charge some memory to the budget
+ *
+ *	Returns FALSE if the budget would be exceeded
+ */
+
+BOOL onedrive_mem_charge(s64 bytes)
+{
+	BOOL ok;
+
+	pthread_mutex_lock(&bufpool_lock);
+	ok = !mem_budget || ((mem_charged + bytes) <= mem_budget);
+	if (ok) {
+		mem_charged += bytes;
+		if (mem_charged > mem_peak)
+			mem_peak = mem_charged;
+	} else
+		over_budget++;
+	pthread_mutex_unlock(&bufpool_lock);
+	return (ok);
+}
+
+void onedrive_mem_uncharge(s64 bytes)
+{
+	pthread_mutex_lock(&bufpool_lock);
+	mem_charged -= bytes;
+	pthread_mutex_unlock(&bufpool_lock);
+}
+
+static int class_of(size_t size)
+{
+	int c;
+
+	c = 0;
+	while ((c < class_count) && (classes[c].size < size))
+		c++;
+	return (c < class_count ? c : -1);
+}
+
+/*
+ *		Map a slab aligned to its size
+ *
+ *	Returns NULL if there is no memory
+ */
+
+static char *map_slab(BOOL *huge)
+{
+	char *p;
+	char *aligned;
+
+	*huge = FALSE;
+#ifdef MAP_HUGETLB
+	if (use_hugepages) {
+		p = (char*)mmap((void*)NULL, SLAB_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != (char*)MAP_FAILED) {
+			*huge = TRUE;
+			return (p);
+		}
+	}
+#endif
+	p = (char*)mmap((void*)NULL, 2*SLAB_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == (char*)MAP_FAILED)
+		return ((char*)NULL);
+	aligned = (char*)(((uintptr_t)p + SLAB_SIZE - 1)
+				& ~(uintptr_t)(SLAB_SIZE - 1));
+	if (aligned > p)
+		munmap(p, aligned - p);
+	munmap(aligned + SLAB_SIZE, p + SLAB_SIZE - aligned);
+#ifdef MADV_HUGEPAGE
+	if (use_hugepages)
+		madvise(aligned, SLAB_SIZE, MADV_HUGEPAGE);
+#endif
+	return (aligned);
+}
+
+/*
+ *		Split a slab into free buffers
+ *
+ *	Must be called with the lock held.
+ */
+
+static void carve(struct SLAB *slab, int c)
+{
+	struct BUFFER_CLASS *pc;
+	struct FREE_BUFFER *fb;
+	size_t off;
+
+	pc = &classes[c];
+	slab->class = c;
+	slab->used = 0;
+	for (off=SLAB_SIZE; off>=pc->size; off-=pc->size) {
+		fb = (struct FREE_BUFFER*)(slab->base + off - pc->size);
+		fb->next = pc->free;
+		pc->free = fb;
+		pc->free_count++;
+	}
+	pc->slabs++;
+}
+
+/*
+ *		Take back an unused slab from another size
+ *
+ *	Returns the slab, or NULL if all slabs have buffers in use.
+ *	Must be called with the lock held.
+ */
+
+static struct SLAB *reclaim_slab(int c)
+{
+	struct BUFFER_CLASS *pc;
+	struct FREE_BUFFER **prev;
+	struct SLAB *slab;
+	u32 i;
+
+	slab = (struct SLAB*)NULL;
+	for (i=0; (i<slab_count) && !slab; i++)
+		if (!slabs[i].used && (slabs[i].class != c))
+			slab = &slabs[i];
+	if (slab) {
+		pc = &classes[slab->class];
+		prev = &pc->free;
+		while (*prev) {
+			if (((char*)*prev >= slab->base)
+			    && ((char*)*prev < (slab->base + SLAB_SIZE))) {
+				*prev = (*prev)->next;
+				pc->free_count--;
+			} else
+				prev = &(*prev)->next;
+		}
+		pc->slabs--;
+		reassigned++;
+	}
+	return (slab);
+}
+
+/*
+ *		Get a new slab for a size
+ *
+ *	Returns zero, or -1 if there is no memory or no budget left
+ *	Must be called with the lock held.
+ */
+
+static int grow(int c)
+{
+	struct SLAB *newslabs;
+	struct SLAB *slab;
+	char *base;
+	BOOL huge;
+	u32 i;
+
+	slab = (struct SLAB*)NULL;
+	base = (char*)NULL;
+	if (slab_count >= slab_alloc) {
+		newslabs = (struct SLAB*)realloc(slabs,
+				(slab_alloc + 64)*sizeof(struct SLAB));
+		if (newslabs) {
+			slabs = newslabs;
+			slab_alloc += 64;
+		}
+	}
+	if ((slab_count < slab_alloc)
+	    && (!mem_budget || ((mem_charged + SLAB_SIZE) <= mem_budget)))
+		base = map_slab(&huge);
+	if (base) {
+		mem_charged += SLAB_SIZE;
+		if (mem_charged > mem_peak)
+			mem_peak = mem_charged;
+		for (i=slab_count; (i>0) && (slabs[i - 1].base>base); i--)
+			slabs[i] = slabs[i - 1];
+		slab = &slabs[i];
+		slab->base = base;
+		slab->huge = huge;
+		slab_count++;
+	} else {
+		over_budget++;
+		slab = reclaim_slab(c);
+	}
+	if (!slab)
+		return (-1);
+	carve(slab, c);
+	classes[c].carved++;
+	return (0);
+}
+
+static struct THREAD_CACHE *get_thread_cache(void)
+{
+	if (!thread_cache && key_made) {
+		thread_cache = (struct THREAD_CACHE*)calloc(1,
+				sizeof(struct THREAD_CACHE));
+		if (thread_cache
+		    && pthread_setspecific(cache_key, thread_cache)) {
+			free(thread_cache);
+			thread_cache = (struct THREAD_CACHE*)NULL;
+		}
+	}
+	return (thread_cache);
+}
+
+static void *map_oversize(size_t size)
+{
+	void *buf;
+
+	if (!onedrive_mem_charge(size))
+		return ((void*)NULL);
+	buf = mmap((void*)NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED) {
+		onedrive_mem_uncharge(size);
+		return ((void*)NULL);
+	}
+	__atomic_add_fetch(&oversize, 1, __ATOMIC_RELAXED);
+	return (buf);
+}
+
+/*
+ *		Get a buffer, aligned to its size up to 2MB
+ *
+ *	Returns NULL with errno set to ENOMEM if there is no memory or
+ *	the budget is exhausted
+ */
+
+void *onedrive_buffer_get(size_t size)
+{
+	struct THREAD_CACHE *tc;
+	struct BUFFER_CLASS *pc;
+	struct FREE_BUFFER *fb;
+	struct SLAB *slab;
+	int c;
+
+	if (!class_count) {
+		pthread_mutex_lock(&bufpool_lock);
+		configure(MIN_BUFFER_SIZE);
+		pthread_mutex_unlock(&bufpool_lock);
+	}
+	size = (size + 4095) & ~(size_t)4095;
+	c = class_of(size);
+	if (c < 0) {
+		fb = (struct FREE_BUFFER*)map_oversize(size);
+		if (!fb)
+			errno = ENOMEM;
+		return ((void*)fb);
+	}
+	pc = &classes[c];
+	__atomic_add_fetch(&pc->gets, 1, __ATOMIC_RELAXED);
+	tc = get_thread_cache();
+	if (tc && (tc->count[c] > 0)) {
+		__atomic_add_fetch(&pc->thread_hits, 1, __ATOMIC_RELAXED);
+		return (tc->buffers[c][--tc->count[c]]);
+	}
+	pthread_mutex_lock(&bufpool_lock);
+	if (pc->free)
+		pc->pool_hits++;
+	else
+		if (grow(c))
+			pc->refused++;
+	fb = pc->free;
+	if (fb) {
+		pc->free = fb->next;
+		pc->free_count--;
+		slab = find_slab(fb);
+		if (slab)
+			slab->used++;
+	}
+	pthread_mutex_unlock(&bufpool_lock);
+	if (!fb)
+		errno = ENOMEM;
+	return ((void*)fb);
+}
+
+/*
+ *		Give back a buffer, with the size it was got with
+ */
+
+void onedrive_buffer_put(void *buf, size_t size)
+{
+	struct THREAD_CACHE *tc;
+	int c;
+
+	if (!buf)
+		return;
+	size = (size + 4095) & ~(size_t)4095;
+	c = class_of(size);
+	if (c < 0) {
+		munmap(buf, size);
+		onedrive_mem_uncharge(size);
+		return;
+	}
+	tc = get_thread_cache();
+	if (tc && (tc->count[c] < classes[c].thread_slots))
+		tc->buffers[c][tc->count[c]++] = buf;
+	else
+		pool_put(buf, c);
+}
+
+void onedrive_bufpool_report(FILE *f)
+{
+	const struct BUFFER_CLASS *pc;
+	u64 gets;
+	u64 hits;
+	u32 huge;
+	u32 i;
+	int c;
+
+	pthread_mutex_lock(&bufpool_lock);
+	gets = hits = 0;
+	for (c=0; c<class_count; c++) {
+		gets += classes[c].gets;
+		hits += classes[c].thread_hits + classes[c].pool_hits;
+	}
+	if (gets || oversize || mem_charged) {
+		huge = 0;
+		for (i=0; i<slab_count; i++)
+			if (slabs[i].huge)
+				huge++;
+		fprintf(f, "memory : %lld KB charged, peak %lld KB,"
+				" budget %lld KB, %llu over budget\n",
+			(long long)(mem_charged >> 10),
+			(long long)(mem_peak >> 10),
+			(long long)(mem_budget >> 10),
+			(unsigned long long)over_budget);
+		fprintf(f, "buffers : %llu got, %.1f%% reused, %u slabs"
+				" (%u huge), %llu reassigned, %llu oversize\n",
+			(unsigned long long)gets,
+			(gets ? 100.0*hits/gets : 0.0),
+			slab_count, huge,
+			(unsigned long long)reassigned,
+			(unsigned long long)oversize);
+		fprintf(f, "%8s %10s %10s %10s %8s %8s %8s %6s\n",
+			"size KB", "got", "thread", "pool", "carved",
+			"refused", "free", "slabs");
+		for (c=0; c<class_count; c++) {
+			pc = &classes[c];
+			if (pc->gets || pc->slabs)
+				fprintf(f, "%8lu %10llu %10llu %10llu %8llu"
+						" %8llu %8u %6u\n",
+					(unsigned long)(pc->size >> 10),
+					(unsigned long long)pc->gets,
+					(unsigned long long)pc->thread_hits,
+					(unsigned long long)pc->pool_hits,
+					(unsigned long long)pc->carved,
+					(unsigned long long)pc->refused,
+					pc->free_count, pc->slabs);
+		}
+	}
+	pthread_mutex_unlock(&bufpool_lock);
+}
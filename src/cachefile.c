@@ -0,0 +1,183 @@
+/*
+ * cachefile.c - Persistent tables of the OneDrive plugin
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	The tables learned by the plugin are kept across mounts in the
+ *	directory designated by the environment variable
+ *	ONEDRIVE_CACHE_DIR. There is no persistence when it is not set.
+ *
+ *	Inode numbers are only meaningful within a volume, so the file
+ *	names are made of the serial number of the volume, as found in
+ *	its boot sector, and of the kind of table.
+ *
+ *	A file begins with a header identifying the kind of table and
+ *	its layout version, a table found with another version is
+ *	ignored. Files are replaced atomically.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <ntfs-3g/types.h>
+#include <ntfs-3g/layout.h>
+#include <ntfs-3g/device.h>
+#include <ntfs-3g/volume.h>
+#include <ntfs-3g/logging.h>
+
+#include "onedrive.h"
+
+#define SERIAL_OFFSET 0x48	/* of the serial number in boot sector */
+
+static pthread_mutex_t cachefile_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char *cache_dir = (const char*)NULL;
+static u64 volume_serial = 0;
+static BOOL serial_known = FALSE;
+
+void onedrive_cachefile_init(void)
+{
+	cache_dir = getenv("ONEDRIVE_CACHE_DIR");
+	if (cache_dir && !cache_dir[0])
+		cache_dir = (const char*)NULL;
+}
+
+BOOL onedrive_cachefile_enabled(void)
+{
+	return (cache_dir != (const char*)NULL);
+}
+
+/*
+ *		Get the serial number of the volume, from its boot sector
+ */
+
+static BOOL get_serial(ntfs_volume *vol)
+{
+	char boot[512];
+	le64 serial;
+
+	pthread_mutex_lock(&cachefile_lock);
+	if (!serial_known
+	    && (ntfs_pread(vol->dev, 0, sizeof(boot), boot) == sizeof(boot))) {
+		memcpy(&serial, &boot[SERIAL_OFFSET], sizeof(serial));
+		volume_serial = le64_to_cpu(serial);
+		serial_known = TRUE;
+	}
+	pthread_mutex_unlock(&cachefile_lock);
+	return (serial_known);
+}
+
+/*
+ *		Build the name of the file holding a table for a volume
+ *
+ *	Returns zero, or -1 if there is no persistence
+ */
+
+int onedrive_cachefile_path(ntfs_volume *vol, const char *kind,
+			char *path, size_t size)
+{
+	int res;
+
+	res = -1;
+	if (cache_dir && vol && get_serial(vol)
+	    && ((size_t)snprintf(path, size, "%s/%016llx.%s", cache_dir,
+			(unsigned long long)volume_serial, kind) < size))
+		res = 0;
+	return (res);
+}
+
+/*
+ *		Load a table
+ *
+ *	Returns the allocated contents, the header excluded, or NULL if
+ *	there is no table of the expected version.
+ */
+
+void *onedrive_cachefile_load(const char *path, u32 magic, u32 version,
+			size_t *size)
+{
+	struct ONEDRIVE_CACHEFILE_HEADER header;
+	char *buf;
+	FILE *f;
+
+	buf = (char*)NULL;
+	f = fopen(path, "r");
+	if (f) {
+		if ((fread(&header, sizeof(header), 1, f) == 1)
+		    && (header.magic == magic)
+		    && (header.version == version)) {
+			buf = (char*)malloc(header.size ? header.size : 1);
+			if (buf && header.size
+			    && (fread(buf, header.size, 1, f) != 1)) {
+				free(buf);
+				buf = (char*)NULL;
+			}
+			*size = header.size;
+		}
+		fclose(f);
+	}
+	return (buf);
+}
+
+/*
+ *		Save a table
+ *
+ *	Returns zero or -1 if the table could not be written
+ */
+
+int onedrive_cachefile_save(const char *path, u32 magic, u32 version,
+			const void *buf, size_t size)
+{
+	struct ONEDRIVE_CACHEFILE_HEADER header;
+	char tmpname[4096];
+	FILE *f;
+	int res;
+
+	res = -1;
+	header.magic = magic;
+	header.version = version;
+	header.size = size;
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", path);
+	f = fopen(tmpname, "w");
+	if (f) {
+		if ((fwrite(&header, sizeof(header), 1, f) == 1)
+		    && (!size || (fwrite(buf, size, 1, f) == 1)))
+			res = 0;
+		if (fclose(f) || (!res && rename(tmpname, path)))
+			res = -1;
+		if (res)
+			unlink(tmpname);
+	}
+	if (res)
+		ntfs_log_error("OneDrive could not save %s\n", path);
+	return (res);
+}
@@ -0,0 +1,40 @@
+/*
+ * cachefile.h - Layout of the tables saved by the OneDrive plugin
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ONEDRIVE_CACHEFILE_H
+#define _ONEDRIVE_CACHEFILE_H
+
+/*
+ *	The tables are saved in the directory designated by
+ *	ONEDRIVE_CACHE_DIR, as files named <serial>.<kind>, where serial
+ *	is the serial number of the volume in 16 hex digits.
+ *
+ *	The tables are only used on the host which wrote them, so the
+ *	fields are in host order.
+ */
+
+#include <stdint.h>
+
+struct ONEDRIVE_CACHEFILE_HEADER {
+	uint32_t magic;		/* identifies the kind of table */
+	uint32_t version;	/* of the layout of the table */
+	uint64_t size;		/* of contents, header excluded */
+} ;
+
+#endif /* _ONEDRIVE_CACHEFILE_H */
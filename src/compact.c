@@ -0,0 +1,778 @@
+/*
+ * compact.c - Compaction of the directory indexes of the OneDrive tree
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	After many files were deleted from a directory, its $I30 index
+ *	is left with half-empty blocks, which have to be read by every
+ *	readdir and lookup. The compaction rebuilds the index densely :
+ *	the entries are collected in collation order by walking the
+ *	current tree, then the blocks of the new tree are filled bottom
+ *	up, each entry which does not fit into a block being moved to the
+ *	upper level. The index root is only left with a pointer to the
+ *	top block.
+ *
+ *	To be safe against a crash, the current tree is not modified :
+ *	- the new blocks are written to free places of the allocation,
+ *	which is extended if needed, and the device is synced,
+ *	- the new blocks are marked in use in the bitmap, and synced,
+ *	- the index root is switched to the new tree by a single write
+ *	of the MFT record, and synced,
+ *	- the old blocks are marked free, and the allocation is
+ *	truncated after the last block in use.
+ *	A crash at any step leaves either the old or the new tree, with
+ *	at worst some blocks marked in use and not referenced, which
+ *	chkdsk reclaims.
+ *
+ *	ntfs-3g serializes the operations on the volume, so nothing else
+ *	uses the directory while its index is being rebuilt.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include <stdio.h>
+#include <stddef.h>
+#include <time.h>
+
+#include <ntfs-3g/types.h>
+#include <ntfs-3g/layout.h>
+#include <ntfs-3g/volume.h>
+#include <ntfs-3g/inode.h>
+#include <ntfs-3g/attrib.h>
+#include <ntfs-3g/dir.h>
+#include <ntfs-3g/logging.h>
+
+#include "compact.h"
+
+#define INDEX_MAX_DEPTH 32
+#define ENTRY_HEADER_SIZE 0x10		/* entry with no key */
+#define ENTRY_VCN_SIZE 8		/* pointer to a subnode */
+#define ROOT_SIZE (sizeof(INDEX_ROOT) + ENTRY_HEADER_SIZE + ENTRY_VCN_SIZE)
+
+struct PLAN_ITEM {
+	u32 entry;			/* offset of entry */
+	s32 child;			/* node on the left, or -1 */
+} ;
+
+struct PLAN_NODE {
+	u32 first;			/* first item */
+	u32 count;
+	s32 end_child;			/* node on the right, or -1 */
+	s64 slot;			/* index of block in allocation */
+} ;
+
+struct INDEX_CONTEXT {
+	ntfs_inode *ni;
+	ntfs_attr *root_na;
+	ntfs_attr *alloc_na;
+	ntfs_attr *bitmap_na;
+	INDEX_ROOT *root;
+	u8 *bitmap;
+	s64 bitmap_size;
+	u8 *old;			/* blocks of the current tree */
+	s64 old_size;
+	u32 old_blocks;
+	u32 block_size;
+	u32 entries_offset;		/* in a block, from index header */
+	u32 capacity;			/* room for entries in a block */
+	u8 vcn_size_bits;
+	s64 block_count;
+	char *entries;
+	u32 entries_size;
+	u32 entries_alloc;
+	u32 *offsets;
+	u32 entry_count;
+	u32 offsets_alloc;
+	u64 live_bytes;
+	struct PLAN_NODE *nodes;
+	u32 node_count;
+	u32 nodes_alloc;
+	struct PLAN_ITEM *items;
+	u32 item_count;
+	u32 items_alloc;
+	s32 root_child;
+	INDEX_BLOCK *block;
+} ;
+
+static ntfschar I30[] = {
+	const_cpu_to_le16('$'), const_cpu_to_le16('I'),
+	const_cpu_to_le16('3'), const_cpu_to_le16('0')
+} ;
+
+static BOOL test_bit(const u8 *map, s64 size, s64 bit)
+{
+	return (((bit >> 3) < size) && (map[bit >> 3] & (1 << (bit & 7))));
+}
+
+/*
+ *		Make room for more elements in an array
+ *
+ *	Returns zero, or -1 if there is no memory, the array being left
+ *	unchanged.
+ */
+
+static int grow(void **array, u32 *alloc, u32 needed, size_t unit)
+{
+	void *p;
+	u32 count;
+
+	if (needed <= *alloc)
+		return (0);
+	count = (*alloc ? *alloc : 256);
+	while (count < needed)
+		count <<= 1;
+	p = realloc(*array, (size_t)count*unit);
+	if (!p)
+		return (-1);
+	*array = p;
+	*alloc = count;
+	return (0);
+}
+
+static int count_filldir(void *count, const ntfschar *name
+				__attribute__((unused)),
+			const int name_len __attribute__((unused)),
+			const int name_type __attribute__((unused)),
+			const s64 pos __attribute__((unused)),
+			const MFT_REF mref __attribute__((unused)),
+			const unsigned dt_type __attribute__((unused)))
+{
+	(*(u32*)count)++;
+	return (0);
+}
+
+/*
+ *		Time a full reading of a directory
+ */
+
+static u64 time_readdir(ntfs_inode *ni)
+{
+	struct timespec start;
+	struct timespec end;
+	s64 pos;
+	u32 count;
+
+	pos = 0;
+	count = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ntfs_readdir(ni, &pos, &count, count_filldir);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return ((u64)(end.tv_sec - start.tv_sec)*1000000000
+			+ end.tv_nsec - start.tv_nsec);
+}
+
+/*
+ *		Append a copy of an entry, with no subnode
+ */
+
+static int add_entry(struct INDEX_CONTEXT *ctx, const INDEX_ENTRY *ie,
+			u32 length)
+{
+	INDEX_ENTRY *copy;
+
+	if (grow((void**)&ctx->entries, &ctx->entries_alloc,
+				ctx->entries_size + length, 1)
+	    || grow((void**)&ctx->offsets, &ctx->offsets_alloc,
+				ctx->entry_count + 1, sizeof(u32))) {
+		errno = ENOMEM;
+		return (-1);
+	}
+	copy = (INDEX_ENTRY*)&ctx->entries[ctx->entries_size];
+	memcpy(copy, ie, length);
+	copy->length = cpu_to_le16(length);
+	copy->ie_flags &= ~INDEX_ENTRY_NODE;
+	ctx->offsets[ctx->entry_count++] = ctx->entries_size;
+	ctx->entries_size += length;
+	ctx->live_bytes += length;
+	return (0);
+}
+
+static int collect_block(struct INDEX_CONTEXT *ctx, s64 vcn, int depth);
+
+/*
+ *		Collect the entries of a node and of its subnodes, in order
+ */
+
+static int collect(struct INDEX_CONTEXT *ctx, const INDEX_HEADER *ih,
+			u32 room, int depth)
+{
+	const INDEX_ENTRY *ie;
+	u32 pos;
+	u32 end;
+	u32 length;
+	s64 vcn;
+	int res;
+
+	res = 0;
+	pos = le32_to_cpu(ih->entries_offset);
+	end = le32_to_cpu(ih->index_length);
+	if ((end > room) || (depth > INDEX_MAX_DEPTH)) {
+		errno = EIO;
+		return (-1);
+	}
+	do {
+		ie = (const INDEX_ENTRY*)((const char*)ih + pos);
+		if ((pos + ENTRY_HEADER_SIZE) > end)
+			length = 0;
+		else
+			length = le16_to_cpu(ie->length);
+		if ((length < ENTRY_HEADER_SIZE) || ((pos + length) > end)
+		    || (length & 7)
+		    || ((ie->ie_flags & INDEX_ENTRY_NODE)
+			&& (length < (ENTRY_HEADER_SIZE + ENTRY_VCN_SIZE)))) {
+			errno = EIO;
+			return (-1);
+		}
+		if (ie->ie_flags & INDEX_ENTRY_NODE) {
+			vcn = sle64_to_cpu(*(const sle64*)((const char*)ie
+					+ length - ENTRY_VCN_SIZE));
+			res = collect_block(ctx, vcn, depth + 1);
+			length -= ENTRY_VCN_SIZE;
+		}
+		if (!res && !(ie->ie_flags & INDEX_ENTRY_END))
+			res = add_entry(ctx, ie, length);
+		pos += le16_to_cpu(ie->length);
+	} while (!res && !(ie->ie_flags & INDEX_ENTRY_END));
+	return (res);
+}
+
+/*
+ *		Collect the entries of an index block
+ *
+ *	A block found twice, or not marked in use, means the index is
+ *	not consistent, and is not compacted.
+ */
+
+static int collect_block(struct INDEX_CONTEXT *ctx, s64 vcn, int depth)
+{
+	INDEX_BLOCK *ib;
+	s64 pos;
+	s64 slot;
+	int res;
+
+	pos = vcn << ctx->vcn_size_bits;
+	slot = pos/ctx->block_size;
+	if ((vcn < 0) || (pos % ctx->block_size)
+	    || (slot >= ctx->block_count)
+	    || test_bit(ctx->old, ctx->old_size, slot)
+	    || !test_bit(ctx->bitmap, ctx->bitmap_size, slot)) {
+		errno = EIO;
+		return (-1);
+	}
+	ib = (INDEX_BLOCK*)malloc(ctx->block_size);
+	if (!ib)
+		return (-1);
+	res = -1;
+	if ((ntfs_attr_mst_pread(ctx->alloc_na, pos, 1,
+				ctx->block_size, ib) == 1)
+	    && (ib->magic == magic_INDX)
+	    && (sle64_to_cpu(ib->index_block_vcn) == vcn)) {
+		ctx->old[slot >> 3] |= 1 << (slot & 7);
+		ctx->old_blocks++;
+		res = collect(ctx, &ib->index,
+			ctx->block_size - offsetof(INDEX_BLOCK, index),
+			depth);
+	} else
+		errno = EIO;
+	free(ib);
+	return (res);
+}
+
+/*
+ *		Record a node of the new tree
+ */
+
+static s32 add_node(struct INDEX_CONTEXT *ctx, const struct PLAN_ITEM *items,
+			u32 count, s32 end_child)
+{
+	struct PLAN_NODE *node;
+
+	if (grow((void**)&ctx->nodes, &ctx->nodes_alloc,
+				ctx->node_count + 1, sizeof(struct PLAN_NODE))
+	    || grow((void**)&ctx->items, &ctx->items_alloc,
+				ctx->item_count + count,
+				sizeof(struct PLAN_ITEM))) {
+		errno = ENOMEM;
+		return (-1);
+	}
+	node = &ctx->nodes[ctx->node_count];
+	node->first = ctx->item_count;
+	node->count = count;
+	node->end_child = end_child;
+	node->slot = -1;
+	memcpy(&ctx->items[ctx->item_count], items,
+			count*sizeof(struct PLAN_ITEM));
+	ctx->item_count += count;
+	return (ctx->node_count++);
+}
+
+/*
+ *		Fill the nodes of a level of the new tree
+ *
+ *	The entries which do not fit are returned to make the upper
+ *	level, each of them pointing to the node on its left. The last
+ *	node gets the "tail" of the level, and is never left empty.
+ *
+ *	Returns the count of entries for the upper level, or -1
+ */
+
+static int plan_level(struct INDEX_CONTEXT *ctx, const struct PLAN_ITEM *items,
+			u32 count, s32 tail, struct PLAN_ITEM *upper)
+{
+	const INDEX_ENTRY *ie;
+	BOOL leaf;
+	u32 start;
+	u32 used;
+	u32 size;
+	u32 i;
+	s32 node;
+	int promoted;
+
+	leaf = (tail < 0);
+	promoted = 0;
+	start = 0;
+	do {
+		used = ENTRY_HEADER_SIZE + (leaf ? 0 : ENTRY_VCN_SIZE);
+		for (i=start; i<count; i++) {
+			ie = (const INDEX_ENTRY*)&ctx->entries[items[i].entry];
+			size = le16_to_cpu(ie->length)
+					+ (leaf ? 0 : ENTRY_VCN_SIZE);
+			if ((used + size) > ctx->capacity)
+				break;
+			used += size;
+		}
+		if ((i < count) && ((i + 1) == count))
+			i--;
+		if (i <= start) {
+			errno = EINVAL;
+			return (-1);
+		}
+		if (i < count) {
+			node = add_node(ctx, &items[start], i - start,
+					items[i].child);
+			upper[promoted].entry = items[i].entry;
+			upper[promoted].child = node;
+			promoted++;
+		} else
+			node = add_node(ctx, &items[start], i - start, tail);
+		if (node < 0)
+			return (-1);
+		start = i + 1;
+	} while (start < count);
+	return (promoted);
+}
+
+/*
+ *		Plan the new tree, from the leaves to the top block
+ */
+
+static int plan(struct INDEX_CONTEXT *ctx)
+{
+	struct PLAN_ITEM *items;
+	struct PLAN_ITEM *upper;
+	s32 tail;
+	int count;
+	u32 i;
+
+	items = (struct PLAN_ITEM*)malloc(ctx->entry_count
+				*sizeof(struct PLAN_ITEM));
+	if (!items)
+		return (-1);
+	for (i=0; i<ctx->entry_count; i++) {
+		items[i].entry = ctx->offsets[i];
+		items[i].child = -1;
+	}
+	count = ctx->entry_count;
+	tail = -1;
+	do {
+		upper = (struct PLAN_ITEM*)malloc(count
+					*sizeof(struct PLAN_ITEM));
+		if (upper)
+			count = plan_level(ctx, items, count, tail, upper);
+		else
+			count = -1;
+		free(items);
+		items = upper;
+		tail = ctx->node_count - 1;
+	} while (count > 0);
+	free(items);
+	ctx->root_child = tail;
+	return (count);
+}
+
+static s64 slot_vcn(const struct INDEX_CONTEXT *ctx, s64 slot)
+{
+	return ((slot*ctx->block_size) >> ctx->vcn_size_bits);
+}
+
+/*
+ *		Set the pointer to a subnode at the end of an entry
+ */
+
+static void set_subnode(const struct INDEX_CONTEXT *ctx, INDEX_ENTRY *ie,
+			u32 length, s32 child)
+{
+	ie->length = cpu_to_le16(length + ENTRY_VCN_SIZE);
+	ie->ie_flags |= INDEX_ENTRY_NODE;
+	*(sle64*)((char*)ie + length) = cpu_to_sle64(slot_vcn(ctx,
+					ctx->nodes[child].slot));
+}
+
+/*
+ *		Build and write a block of the new tree
+ */
+
+static int write_node(struct INDEX_CONTEXT *ctx, const struct PLAN_NODE *node)
+{
+	const struct PLAN_ITEM *item;
+	INDEX_BLOCK *ib;
+	INDEX_ENTRY *ie;
+	u32 length;
+	u32 pos;
+	u32 i;
+
+	ib = ctx->block;
+	memset(ib, 0, ctx->block_size);
+	ib->magic = magic_INDX;
+	ib->usa_ofs = const_cpu_to_le16(sizeof(INDEX_BLOCK));
+	ib->usa_count = cpu_to_le16(ctx->block_size/NTFS_BLOCK_SIZE + 1);
+	*(le16*)((char*)ib + sizeof(INDEX_BLOCK)) = const_cpu_to_le16(1);
+	ib->index_block_vcn = cpu_to_sle64(slot_vcn(ctx, node->slot));
+	ib->index.entries_offset = cpu_to_le32(ctx->entries_offset);
+	ib->index.allocated_size = cpu_to_le32(ctx->block_size
+				- offsetof(INDEX_BLOCK, index));
+	ib->index.ih_flags = (node->end_child >= 0 ? INDEX_NODE : LEAF_NODE);
+	pos = ctx->entries_offset;
+	for (i=0; i<node->count; i++) {
+		item = &ctx->items[node->first + i];
+		ie = (INDEX_ENTRY*)((char*)&ib->index + pos);
+		length = le16_to_cpu(((const INDEX_ENTRY*)
+				&ctx->entries[item->entry])->length);
+		memcpy(ie, &ctx->entries[item->entry], length);
+		if (item->child >= 0)
+			set_subnode(ctx, ie, length, item->child);
+		pos += le16_to_cpu(ie->length);
+	}
+	ie = (INDEX_ENTRY*)((char*)&ib->index + pos);
+	ie->length = const_cpu_to_le16(ENTRY_HEADER_SIZE);
+	ie->ie_flags = INDEX_ENTRY_END;
+	if (node->end_child >= 0)
+		set_subnode(ctx, ie, ENTRY_HEADER_SIZE, node->end_child);
+	pos += le16_to_cpu(ie->length);
+	ib->index.index_length = cpu_to_le32(pos);
+	if (ntfs_attr_mst_pwrite(ctx->alloc_na,
+			node->slot*ctx->block_size, 1,
+			ctx->block_size, ib) != 1)
+		return (-1);
+	return (0);
+}
+
+/*
+ *		Flush the MFT record and the device
+ */
+
+static int sync_all(struct INDEX_CONTEXT *ctx)
+{
+	struct ntfs_device *dev;
+
+	dev = ctx->ni->vol->dev;
+	if (ntfs_inode_sync(ctx->ni)
+	    || (dev->d_ops->sync && dev->d_ops->sync(dev)))
+		return (-1);
+	return (0);
+}
+
+/*
+ *		Resize the bitmap to cover a count of blocks
+ */
+
+static int resize_bitmap(struct INDEX_CONTEXT *ctx, s64 blocks)
+{
+	s64 size;
+	u8 *p;
+
+	size = ((blocks + 63) >> 6) << 3;
+	if (size == ctx->bitmap_size)
+		return (0);
+	if (ntfs_attr_truncate(ctx->bitmap_na, size))
+		return (-1);
+	p = (u8*)realloc(ctx->bitmap, size);
+	if (!p)
+		return (-1);
+	if (size > ctx->bitmap_size)
+		memset(&p[ctx->bitmap_size], 0, size - ctx->bitmap_size);
+	ctx->bitmap = p;
+	ctx->bitmap_size = size;
+	return (0);
+}
+
+static int write_bitmap(struct INDEX_CONTEXT *ctx)
+{
+	if ((ntfs_attr_pwrite(ctx->bitmap_na, 0, ctx->bitmap_size,
+			ctx->bitmap) != ctx->bitmap_size)
+	    || sync_all(ctx))
+		return (-1);
+	return (0);
+}
+
+/*
+ *		Switch the index root to the new tree
+ */
+
+static int switch_root(struct INDEX_CONTEXT *ctx)
+{
+	char buf[sizeof(INDEX_ROOT) + sizeof(INDEX_ENTRY)];
+	INDEX_ROOT *ir;
+	INDEX_ENTRY *ie;
+
+	ir = (INDEX_ROOT*)buf;
+	memset(buf, 0, sizeof(buf));
+	memcpy(ir, ctx->root, offsetof(INDEX_ROOT, index));
+	ir->index.entries_offset = const_cpu_to_le32(sizeof(INDEX_HEADER));
+	ir->index.index_length = cpu_to_le32(ROOT_SIZE
+				- offsetof(INDEX_ROOT, index));
+	ir->index.allocated_size = ir->index.index_length;
+	ir->index.ih_flags = LARGE_INDEX;
+	ie = (INDEX_ENTRY*)&buf[sizeof(INDEX_ROOT)];
+	ie->ie_flags = INDEX_ENTRY_END;
+	set_subnode(ctx, ie, ENTRY_HEADER_SIZE, ctx->root_child);
+	if (ntfs_attr_truncate(ctx->root_na, ROOT_SIZE)
+	    || (ntfs_attr_pwrite(ctx->root_na, 0, ROOT_SIZE, buf)
+			!= ROOT_SIZE)
+	    || sync_all(ctx))
+		return (-1);
+	return (0);
+}
+
+/*
+ *		Write the new tree and switch to it
+ */
+
+static int apply(struct INDEX_CONTEXT *ctx)
+{
+	s64 slot;
+	s64 last;
+	u32 i;
+
+		/* place the new blocks where the old tree is not */
+	slot = 0;
+	for (i=0; i<ctx->node_count; i++) {
+		while (test_bit(ctx->bitmap, ctx->bitmap_size, slot))
+			slot++;
+		ctx->nodes[i].slot = slot++;
+	}
+	if (slot > ctx->block_count) {
+		if (ntfs_attr_truncate(ctx->alloc_na, slot*ctx->block_size))
+			return (-1);
+		ctx->block_count = slot;
+	}
+	if ((((slot + 7) >> 3) > ctx->bitmap_size)
+	    && resize_bitmap(ctx, slot))
+		return (-1);
+	for (i=0; i<ctx->node_count; i++)
+		if (write_node(ctx, &ctx->nodes[i]))
+			return (-1);
+	if (sync_all(ctx))
+		return (-1);
+	for (i=0; i<ctx->node_count; i++) {
+		slot = ctx->nodes[i].slot;
+		ctx->bitmap[slot >> 3] |= 1 << (slot & 7);
+	}
+	if (write_bitmap(ctx) || switch_root(ctx))
+		return (-1);
+		/* release the old blocks and the tail of the allocation */
+	last = -1;
+	for (slot=0; slot<ctx->block_count; slot++) {
+		if (test_bit(ctx->old, ctx->old_size, slot))
+			ctx->bitmap[slot >> 3] &= ~(1 << (slot & 7));
+		if (test_bit(ctx->bitmap, ctx->bitmap_size, slot))
+			last = slot;
+	}
+	if ((last + 1) < ctx->block_count) {
+		if (ntfs_attr_truncate(ctx->alloc_na,
+				(last + 1)*ctx->block_size)
+		    || resize_bitmap(ctx, last + 1))
+			return (-1);
+		ctx->block_count = last + 1;
+	}
+	return (write_bitmap(ctx));
+}
+
+/*
+ *		Open the attributes of the index and read the root and bitmap
+ *
+ *	Returns 1 if there is an index allocation, 0 if not, -1 if error
+ */
+
+static int open_index(struct INDEX_CONTEXT *ctx)
+{
+	ntfs_inode *ni;
+	u32 usa_count;
+	s64 size;
+
+	ni = ctx->ni;
+	ctx->root_na = ntfs_attr_open(ni, AT_INDEX_ROOT, I30, 4);
+	if (!ctx->root_na)
+		return (-1);
+	size = ctx->root_na->data_size;
+	ctx->root = (INDEX_ROOT*)malloc(size);
+	if (!ctx->root
+	    || (size < (s64)sizeof(INDEX_ROOT))
+	    || (ntfs_attr_pread(ctx->root_na, 0, size, ctx->root) != size)) {
+		errno = EIO;
+		return (-1);
+	}
+	if ((ctx->root->type != AT_FILE_NAME)
+	    || (ctx->root->collation_rule != COLLATION_FILE_NAME)) {
+		errno = EOPNOTSUPP;
+		return (-1);
+	}
+	if (!(ctx->root->index.ih_flags & LARGE_INDEX))
+		return (0);
+	ctx->alloc_na = ntfs_attr_open(ni, AT_INDEX_ALLOCATION, I30, 4);
+	ctx->bitmap_na = ntfs_attr_open(ni, AT_BITMAP, I30, 4);
+	if (!ctx->alloc_na || !ctx->bitmap_na)
+		return (-1);
+	ctx->block_size = le32_to_cpu(ctx->root->index_block_size);
+	if ((ctx->block_size < NTFS_BLOCK_SIZE)
+	    || (ctx->block_size & (ctx->block_size - 1))) {
+		errno = EIO;
+		return (-1);
+	}
+	if (ctx->block_size >= ni->vol->cluster_size)
+		ctx->vcn_size_bits = ni->vol->cluster_size_bits;
+	else
+		ctx->vcn_size_bits = NTFS_BLOCK_SIZE_BITS;
+	usa_count = ctx->block_size/NTFS_BLOCK_SIZE + 1;
+	ctx->entries_offset = ((sizeof(INDEX_BLOCK) + 2*usa_count + 7) & ~7)
+				- offsetof(INDEX_BLOCK, index);
+	ctx->capacity = ctx->block_size - offsetof(INDEX_BLOCK, index)
+				- ctx->entries_offset;
+	ctx->block_count = ctx->alloc_na->data_size/ctx->block_size;
+	ctx->bitmap_size = ctx->bitmap_na->data_size;
+	ctx->bitmap = (u8*)malloc(ctx->bitmap_size);
+	ctx->old_size = ctx->bitmap_size;
+	ctx->old = (u8*)calloc(1, ctx->old_size);
+	ctx->block = (INDEX_BLOCK*)malloc(ctx->block_size);
+	if (!ctx->bitmap || !ctx->old || !ctx->block)
+		return (-1);
+	if (ntfs_attr_pread(ctx->bitmap_na, 0, ctx->bitmap_size, ctx->bitmap)
+			!= ctx->bitmap_size) {
+		errno = EIO;
+		return (-1);
+	}
+	return (1);
+}
+
+static void close_index(struct INDEX_CONTEXT *ctx)
+{
+	if (ctx->bitmap_na)
+		ntfs_attr_close(ctx->bitmap_na);
+	if (ctx->alloc_na)
+		ntfs_attr_close(ctx->alloc_na);
+	if (ctx->root_na)
+		ntfs_attr_close(ctx->root_na);
+	free(ctx->root);
+	free(ctx->bitmap);
+	free(ctx->old);
+	free(ctx->block);
+	free(ctx->entries);
+	free(ctx->offsets);
+	free(ctx->nodes);
+	free(ctx->items);
+}
+
+/*
+ *		Compact the index of a directory
+ *
+ *	The index is rebuilt if it would use fewer blocks and its blocks
+ *	are filled less than "min_fill" percent. With "dry_run" the new
+ *	tree is only planned, to show what would be achieved.
+ *
+ *	Returns 0 if successful, whether the index was rebuilt or not,
+ *		-1 with errno set if there was an error
+ */
+
+int onedrive_compact_index(ntfs_inode *ni, int min_fill, BOOL dry_run,
+			struct ONEDRIVE_COMPACTION *result)
+{
+	struct INDEX_CONTEXT ctx;
+	int olderrno;
+	int res;
+
+	memset(result, 0, sizeof(struct ONEDRIVE_COMPACTION));
+	result->mft_no = ni->mft_no;
+	if (!(ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)) {
+		errno = ENOTDIR;
+		return (-1);
+	}
+	result->readdir_ns_before = time_readdir(ni);
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.ni = ni;
+	res = open_index(&ctx);
+	if (res > 0) {
+		result->allocated_before = ctx.alloc_na->data_size;
+		res = collect(&ctx, &ctx.root->index,
+			ctx.root_na->data_size - offsetof(INDEX_ROOT, index),
+			0);
+		if (!res && ctx.entry_count)
+			res = plan(&ctx);
+		if (!res && ctx.entry_count) {
+			result->entries = ctx.entry_count;
+			result->blocks_before = ctx.old_blocks;
+			result->blocks_after = ctx.node_count;
+			result->fill_before = ctx.live_bytes*100
+					/((u64)ctx.old_blocks*ctx.capacity);
+			result->fill_after = ctx.live_bytes*100
+					/((u64)ctx.node_count*ctx.capacity);
+			if (!dry_run
+			    && (ctx.node_count < ctx.old_blocks)
+			    && (result->fill_before < min_fill)) {
+				res = apply(&ctx);
+				if (!res)
+					result->compacted = TRUE;
+			}
+		}
+		result->allocated_after = ctx.alloc_na->data_size;
+		if (result->compacted && test_nino_flag(ni, KnownSize)) {
+			ni->data_size = ctx.alloc_na->data_size;
+			ni->allocated_size = ctx.alloc_na->allocated_size;
+		}
+	}
+	olderrno = errno;
+	close_index(&ctx);
+	errno = olderrno;
+	if (res < 0)
+		ntfs_log_perror("Could not compact the index of inode %lld",
+				(long long)ni->mft_no);
+	if (result->compacted)
+		result->readdir_ns_after = time_readdir(ni);
+	return (res < 0 ? -1 : 0);
+}
@@ -0,0 +1,45 @@
+/*
+ * compact.h - Compaction of the directory indexes of the OneDrive tree
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ONEDRIVE_COMPACT_H
+#define _ONEDRIVE_COMPACT_H
+
+/*
+ *	The compaction is shared by the plugin, which runs it on idle
+ *	directories, and by onedrive-maint, which runs it on request.
+ */
+
+struct ONEDRIVE_COMPACTION {
+	u64 mft_no;
+	u32 entries;
+	u32 blocks_before;		/* index blocks in use */
+	u32 blocks_after;
+	s64 allocated_before;		/* size of the index allocation */
+	s64 allocated_after;
+	int fill_before;		/* percent of the block space */
+	int fill_after;
+	u64 readdir_ns_before;
+	u64 readdir_ns_after;
+	BOOL compacted;
+} ;
+
+int onedrive_compact_index(ntfs_inode *ni, int min_fill, BOOL dry_run,
+			struct ONEDRIVE_COMPACTION *result);
+
+#endif /* _ONEDRIVE_COMPACT_H */
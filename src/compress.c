@@ -0,0 +1,948 @@
+/*
+ * compress.c - NTFS compression of the data of OneDrive files
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	The data of a compressed file is split into compression units of
+ *	16 clusters. A unit which compresses is stored into the clusters
+ *	needed, the following ones being a hole, a unit of zeroes is a
+ *	hole, and a unit which does not compress is stored as is.
+ *
+ *	ntfs-3g compresses the units one at a time while writing. For
+ *	large writes, the units fully covered are compressed here by the
+ *	workers (see lznt1.c and workers.c), then clusters are allocated
+ *	for all of them, the compressed data is written, and the runs of
+ *	the units are replaced before the clusters previously used are
+ *	freed. The partial units at both ends are left to ntfs-3g. This
+ *	is only done when ONEDRIVE_COMPRESS_WRITES is set.
+ *
+ *	A file which is not compressed can be compressed as a whole : the
+ *	units are compressed into newly allocated clusters and the device
+ *	is synced before the attribute is switched to the new runs, and
+ *	the old clusters are only freed once the MFT record is synced, so
+ *	that a crash leaves at worst clusters marked in use and not
+ *	referenced. A sample of the units is compressed first, so that
+ *	files which would not shrink enough are not read in full.
+ *
+ *	ntfs-3g serializes the operations on the volume, and the workers
+ *	only compress buffers, so libntfs-3g is only called from the
+ *	thread of the current operation.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include <stdio.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <ntfs-3g/types.h>
+#include <ntfs-3g/layout.h>
+#include <ntfs-3g/volume.h>
+#include <ntfs-3g/inode.h>
+#include <ntfs-3g/attrib.h>
+#include <ntfs-3g/lcnalloc.h>
+#include <ntfs-3g/logging.h>
+
+#include "onedrive.h"
+#include "compress.h"
+
+#define MAX_CLUSTER_SIZE 4096		/* beyond, no compression */
+#define BATCH_UNITS 32			/* units compressed at once */
+#define SAMPLE_UNITS 16			/* compressed for an estimate */
+#define MIN_WRITE_UNITS 1		/* full units in a write */
+#define RUNS_INCREMENT 64
+
+struct UNIT {
+	const char *in;			/* data, padded to the unit size */
+	char *out;			/* compressed data */
+	size_t size;			/* bytes to compress */
+	s64 clusters;			/* to allocate */
+	BOOL compressed;
+} ;
+
+struct UNIT_BATCH {
+	struct UNIT units[BATCH_UNITS];
+	int count;
+	u32 unit_size;
+	u32 cluster_size;
+	u8 cluster_size_bits;
+} ;
+
+struct RUNS {
+	runlist_element *rl;
+	int count;
+	int alloc;
+	int sealed;			/* runs which must not change */
+} ;
+
+static pthread_mutex_t compress_lock = PTHREAD_MUTEX_INITIALIZER;
+static BOOL compress_writes = FALSE;
+static u64 units_written = 0;
+static u64 units_compressed = 0;
+static u64 units_zero = 0;
+static u64 clusters_in = 0;
+static u64 clusters_out = 0;
+static u64 write_compress_ns = 0;
+
+void onedrive_compress_init(void)
+{
+	const char *value;
+
+	value = getenv("ONEDRIVE_COMPRESS_WRITES");
+	compress_writes = (value && value[0] && (value[0] != '0'));
+}
+
+static u64 elapsed_ns(const struct timespec *from)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((u64)(now.tv_sec - from->tv_sec)*1000000000
+			+ now.tv_nsec - from->tv_nsec);
+}
+
+static BOOL is_zero(const char *buf, size_t size)
+{
+	const u64 *p;
+	size_t i;
+
+	p = (const u64*)buf;
+	for (i=0; i<size/8; i++)
+		if (p[i])
+			return (FALSE);
+	return (TRUE);
+}
+
+/*
+ *		Compress a unit, run by the workers
+ */
+
+static void compress_job(void *arg, int job)
+{
+	struct UNIT_BATCH *batch;
+	struct UNIT *unit;
+	size_t size;
+	size_t padded;
+
+	batch = (struct UNIT_BATCH*)arg;
+	unit = &batch->units[job];
+	unit->compressed = FALSE;
+	if (is_zero(unit->in, batch->unit_size)) {
+		unit->clusters = 0;
+		return;
+	}
+	size = onedrive_lznt1_compress(unit->in, unit->size, unit->out,
+			batch->unit_size - batch->cluster_size);
+	if (size) {
+		padded = (size + batch->cluster_size - 1)
+				& ~(size_t)(batch->cluster_size - 1);
+		memset(unit->out + size, 0, padded - size);
+		unit->clusters = padded >> batch->cluster_size_bits;
+		unit->compressed = TRUE;
+	} else
+		unit->clusters = batch->unit_size >> batch->cluster_size_bits;
+}
+
+/*
+ *		Append a run, merging it with the previous one if possible
+ */
+
+static int add_run(struct RUNS *runs, VCN vcn, LCN lcn, s64 length)
+{
+	runlist_element *prev;
+	runlist_element *p;
+
+	if (length <= 0)
+		return (0);
+	if (runs->count > runs->sealed) {
+		prev = &runs->rl[runs->count - 1];
+		if (((prev->vcn + prev->length) == vcn)
+		    && (((prev->lcn < 0) && (lcn == prev->lcn))
+			|| ((prev->lcn >= 0)
+			    && ((prev->lcn + prev->length) == lcn)))) {
+			prev->length += length;
+			return (0);
+		}
+	}
+		/* keep room for the terminator */
+	if ((runs->count + 1) >= runs->alloc) {
+		p = (runlist_element*)realloc(runs->rl,
+			(runs->alloc + RUNS_INCREMENT)
+				*sizeof(runlist_element));
+		if (!p)
+			return (-1);
+		runs->rl = p;
+		runs->alloc += RUNS_INCREMENT;
+	}
+	p = &runs->rl[runs->count++];
+	p->vcn = vcn;
+	p->lcn = lcn;
+	p->length = length;
+	return (0);
+}
+
+/*
+ *		Terminate a runlist
+ *
+ *	There is always room for the terminator.
+ */
+
+static runlist_element *end_runs(struct RUNS *runs, VCN vcn)
+{
+	runlist_element *p;
+
+	if (!runs->rl) {
+		runs->rl = (runlist_element*)malloc(RUNS_INCREMENT
+					*sizeof(runlist_element));
+		if (!runs->rl)
+			return ((runlist_element*)NULL);
+		runs->alloc = RUNS_INCREMENT;
+	}
+	p = &runs->rl[runs->count];
+	p->vcn = vcn;
+	p->lcn = LCN_ENOENT;
+	p->length = 0;
+	return (runs->rl);
+}
+
+/*
+ *		Allocate the clusters of a batch of compressed units
+ *		and write them
+ *
+ *	The runs of the units, starting at "vcn", are appended to "runs".
+ *	If there is an error, the clusters are freed and nothing is
+ *	appended.
+ */
+
+static int place_units(ntfs_volume *vol, struct UNIT_BATCH *batch, VCN vcn,
+			LCN *hint, struct RUNS *runs)
+{
+	runlist_element *alloc;
+	runlist_element *r;
+	const struct UNIT *unit;
+	const char *data;
+	s64 unit_clusters;
+	s64 total;
+	s64 used;
+	s64 take;
+	s64 done;
+	int olderrno;
+	int i;
+
+	unit_clusters = batch->unit_size >> batch->cluster_size_bits;
+	total = 0;
+	for (i=0; i<batch->count; i++)
+		total += batch->units[i].clusters;
+	alloc = (runlist_element*)NULL;
+	if (total) {
+		alloc = ntfs_cluster_alloc(vol, 0, total, *hint, DATA_ZONE);
+		if (!alloc)
+			return (-1);
+	}
+	runs->sealed = runs->count;
+	r = alloc;
+	used = 0;
+	for (i=0; i<batch->count; i++) {
+		unit = &batch->units[i];
+		data = (unit->compressed ? unit->out : unit->in);
+		done = 0;
+		while (done < unit->clusters) {
+			while (r->lcn < 0 || used >= r->length) {
+				r++;
+				used = 0;
+			}
+			take = r->length - used;
+			if (take > (unit->clusters - done))
+				take = unit->clusters - done;
+			if (add_run(runs, vcn + done, r->lcn + used, take)
+			    || (ntfs_pwrite(vol->dev,
+					(r->lcn + used) << vol->cluster_size_bits,
+					take << vol->cluster_size_bits,
+					data + (done << vol->cluster_size_bits))
+				!= (take << vol->cluster_size_bits)))
+				goto error;
+			*hint = r->lcn + used + take;
+			used += take;
+			done += take;
+		}
+		if (add_run(runs, vcn + done, LCN_HOLE, unit_clusters - done))
+			goto error;
+		vcn += unit_clusters;
+	}
+	free(alloc);
+	return (0);
+error :
+	olderrno = errno;
+	runs->count = runs->sealed;
+	if (alloc) {
+		ntfs_cluster_free_from_rl(vol, alloc);
+		free(alloc);
+	}
+	errno = olderrno;
+	return (-1);
+}
+
+/*
+ *		Replace the runs of a range of clusters
+ *
+ *	Returns the new runlist, the runs replaced being appended to
+ *	"removed", or NULL if there is an error.
+ */
+
+static runlist_element *splice_runs(const runlist_element *rl, VCN vcn,
+			s64 count, const struct RUNS *insert,
+			struct RUNS *removed)
+{
+	struct RUNS out;
+	const runlist_element *r;
+	VCN start;
+	VCN end;
+	VCN from;
+	VCN to;
+	BOOL inserted;
+	int i;
+
+	memset(&out, 0, sizeof(out));
+	inserted = FALSE;
+	end = 0;
+	for (r=rl; r->length; r++) {
+		if (r->lcn == LCN_RL_NOT_MAPPED)
+			goto error;
+		start = r->vcn;
+		end = r->vcn + r->length;
+		if ((start < vcn)
+		    && add_run(&out, start, r->lcn,
+				(end < vcn ? end : vcn) - start))
+			goto error;
+		from = (start > vcn ? start : vcn);
+		to = (end < (vcn + count) ? end : vcn + count);
+		if ((from < to) && (r->lcn >= 0)
+		    && add_run(removed, from, r->lcn + from - start,
+				to - from))
+			goto error;
+		if (!inserted && (end >= (vcn + count))) {
+			for (i=0; i<insert->count; i++)
+				if (add_run(&out, insert->rl[i].vcn,
+						insert->rl[i].lcn,
+						insert->rl[i].length))
+					goto error;
+			inserted = TRUE;
+		}
+		from = (start > (vcn + count) ? start : vcn + count);
+		if ((from < end)
+		    && add_run(&out, from,
+				(r->lcn < 0 ? r->lcn : r->lcn + from - start),
+				end - from))
+			goto error;
+	}
+	if (!inserted) {
+		errno = EIO;
+		goto error;
+	}
+	return (end_runs(&out, end));
+error :
+	free(out.rl);
+	return ((runlist_element*)NULL);
+}
+
+/*
+ *		Get a place near the clusters before some vcn
+ */
+
+static LCN hint_before(const runlist_element *rl, VCN vcn)
+{
+	LCN hint;
+
+	hint = 0;
+	for ( ; rl->length && (rl->vcn < vcn); rl++)
+		if (rl->lcn >= 0)
+			hint = rl->lcn + (rl->vcn + rl->length <= vcn
+					? rl->length : vcn - rl->vcn);
+	return (hint);
+}
+
+/*
+ *		Update the initialized size of an attribute
+ */
+
+static int set_initialized(ntfs_attr *na, s64 size)
+{
+	ntfs_attr_search_ctx *ctx;
+	int res;
+
+	res = -1;
+	ctx = ntfs_attr_get_search_ctx(na->ni, (MFT_RECORD*)NULL);
+	if (ctx) {
+		if (!ntfs_attr_lookup(na->type, na->name, na->name_len,
+				CASE_SENSITIVE, 0, (u8*)NULL, 0, ctx)) {
+			ctx->attr->initialized_size = cpu_to_sle64(size);
+			na->initialized_size = size;
+			ntfs_inode_mark_dirty(ctx->ntfs_ino);
+			res = 0;
+		}
+		ntfs_attr_put_search_ctx(ctx);
+	}
+	return (res);
+}
+
+/*
+ *		Compress and write a batch of full units
+ */
+
+static int write_units(ntfs_attr *na, s64 pos, int count, const char *buf)
+{
+	struct UNIT_BATCH batch;
+	struct timespec start;
+	struct RUNS runs;
+	struct RUNS removed;
+	runlist_element *old_rl;
+	runlist_element *new_rl;
+	ntfs_volume *vol;
+	s64 unit_clusters;
+	VCN vcn;
+	LCN hint;
+	int olderrno;
+	int res;
+	int i;
+
+	vol = na->ni->vol;
+	memset(&runs, 0, sizeof(runs));
+	memset(&removed, 0, sizeof(removed));
+	batch.count = count;
+	batch.unit_size = na->compression_block_size;
+	batch.cluster_size = vol->cluster_size;
+	batch.cluster_size_bits = vol->cluster_size_bits;
+	unit_clusters = batch.unit_size >> vol->cluster_size_bits;
+	res = -1;
+	for (i=0; i<count; i++) {
+		batch.units[i].in = buf + (size_t)i*batch.unit_size;
+		batch.units[i].size = batch.unit_size;
+		batch.units[i].out = (char*)onedrive_buffer_get(
+						batch.unit_size);
+		if (!batch.units[i].out) {
+			while (--i >= 0)
+				onedrive_buffer_put(batch.units[i].out,
+						batch.unit_size);
+			return (-1);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	onedrive_workers_run(compress_job, &batch, count);
+	pthread_mutex_lock(&compress_lock);
+	write_compress_ns += elapsed_ns(&start);
+	pthread_mutex_unlock(&compress_lock);
+	vcn = pos >> vol->cluster_size_bits;
+	hint = hint_before(na->rl, vcn);
+	if (place_units(vol, &batch, vcn, &hint, &runs))
+		goto out;
+	new_rl = splice_runs(na->rl, vcn, count*unit_clusters, &runs,
+				&removed);
+	if (!new_rl) {
+		olderrno = errno;
+		ntfs_cluster_free_from_rl(vol, end_runs(&runs, 0));
+		errno = olderrno;
+		goto out;
+	}
+	old_rl = na->rl;
+	na->rl = new_rl;
+	if (ntfs_attr_update_mapping_pairs(na, vcn)) {
+		olderrno = errno;
+		na->rl = old_rl;
+		if (!ntfs_attr_update_mapping_pairs(na, vcn))
+			ntfs_cluster_free_from_rl(vol, end_runs(&runs, 0));
+		free(new_rl);
+		errno = olderrno;
+		goto out;
+	}
+	free(old_rl);
+	if (removed.count)
+		ntfs_cluster_free_from_rl(vol, end_runs(&removed, 0));
+	pthread_mutex_lock(&compress_lock);
+	for (i=0; i<count; i++) {
+		units_written++;
+		if (batch.units[i].compressed)
+			units_compressed++;
+		if (!batch.units[i].clusters)
+			units_zero++;
+		clusters_out += batch.units[i].clusters;
+	}
+	clusters_in += count*unit_clusters;
+	pthread_mutex_unlock(&compress_lock);
+	res = 0;
+out :
+	olderrno = errno;
+	for (i=0; i<count; i++)
+		onedrive_buffer_put(batch.units[i].out, batch.unit_size);
+	free(runs.rl);
+	free(removed.rl);
+	errno = olderrno;
+	return (res);
+}
+
+/*
+ *		Write to a compressed attribute
+ *
+ *	The full units are compressed by the workers, the partial units at
+ *	both ends are written by ntfs-3g. This is only done if the write
+ *	covers full units and does not leave a gap after the initialized
+ *	data.
+ *
+ *	Returns the count of bytes written,
+ *		0 if this does not apply, for ntfs-3g to do the write,
+ *		-1 with errno set if nothing could be written
+ */
+
+s64 onedrive_compress_write(ntfs_attr *na, s64 offset, s64 size,
+			const char *buf)
+{
+	ntfs_volume *vol;
+	s64 unit_size;
+	s64 first;
+	s64 last;
+	s64 done;
+	s64 ret;
+	int count;
+
+	vol = na->ni->vol;
+	if (!compress_writes
+	    || !NAttrNonResident(na)
+	    || ((na->data_flags & (ATTR_COMPRESSION_MASK | ATTR_IS_ENCRYPTED))
+			!= ATTR_IS_COMPRESSED)
+	    || (vol->cluster_size > MAX_CLUSTER_SIZE)
+	    || (na->compression_block_size
+			!= (vol->cluster_size << STANDARD_COMPRESSION_UNIT))
+	    || (offset > na->initialized_size))
+		return (0);
+	unit_size = na->compression_block_size;
+	first = (offset + unit_size - 1) & -unit_size;
+	last = (offset + size) & -unit_size;
+	if ((last - first) < (MIN_WRITE_UNITS*unit_size))
+		return (0);
+	done = 0;
+	while (done < (first - offset)) {
+		ret = ntfs_attr_pwrite(na, offset + done,
+				first - offset - done, buf + done);
+		if (ret <= 0)
+			return (done ? done : -1);
+		done += ret;
+	}
+		/* have ntfs-3g compress the unit it was appending to */
+	if ((NAttrComprClosing(na) && ntfs_attr_pclose(na))
+	    || ntfs_attr_map_whole_runlist(na)
+	    || ((last > na->data_size) && ntfs_attr_truncate(na, last)))
+		return (done ? done : -1);
+	while ((offset + done) < last) {
+		count = (last - offset - done)/unit_size;
+		if (count > BATCH_UNITS)
+			count = BATCH_UNITS;
+		if (write_units(na, offset + done, count, buf + done))
+			return (done ? done : -1);
+		done += count*unit_size;
+		if (((offset + done) > na->initialized_size)
+		    && set_initialized(na, offset + done))
+			return (done);
+	}
+	while (done < size) {
+		ret = ntfs_attr_pwrite(na, offset + done, size - done,
+				buf + done);
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+	return (done);
+}
+
+/*
+ *		Read a batch of units, padded with zeroes
+ */
+
+static int read_units(ntfs_attr *na, struct UNIT_BATCH *batch, s64 pos)
+{
+	struct UNIT *unit;
+	s64 size;
+	s64 got;
+	int i;
+
+	for (i=0; i<batch->count; i++) {
+		unit = &batch->units[i];
+		size = na->data_size - pos;
+		if (size > batch->unit_size)
+			size = batch->unit_size;
+		got = ntfs_attr_pread(na, pos, size, (char*)unit->in);
+		if (got != size) {
+			if (got >= 0)
+				errno = EIO;
+			return (-1);
+		}
+		memset((char*)unit->in + size, 0, batch->unit_size - size);
+			/* compress whole chunks */
+		unit->size = (size + 4095) & -4096;
+		pos += batch->unit_size;
+	}
+	return (0);
+}
+
+/*
+ *		Switch an attribute to compressed
+ *
+ *	The attribute record gets the compression unit and the compressed
+ *	size, and the name and the mapping pairs are moved accordingly.
+ *	The runs and the initialized size are not changed, the initialized
+ *	size is only raised when the compressed runs are in place.
+ */
+
+static int make_compressed(ntfs_inode *ni)
+{
+	ntfs_attr_search_ctx *ctx;
+	ATTR_RECORD *a;
+	u32 length;
+	u32 offset;
+	int res;
+
+	res = -1;
+	ctx = ntfs_attr_get_search_ctx(ni, (MFT_RECORD*)NULL);
+	if (!ctx)
+		return (-1);
+	if (!ntfs_attr_lookup(AT_DATA, AT_UNNAMED, 0, CASE_SENSITIVE,
+				0, (u8*)NULL, 0, ctx)) {
+		a = ctx->attr;
+		length = le32_to_cpu(a->length);
+			/* the compressed size follows the initialized size */
+		offset = offsetof(ATTR_RECORD, compressed_size);
+		if (!ntfs_attr_record_resize(ctx->mrec, a, length + 8)) {
+			memmove((char*)a + offset + 8, (char*)a + offset,
+					length - offset);
+			a->mapping_pairs_offset = cpu_to_le16(
+				le16_to_cpu(a->mapping_pairs_offset) + 8);
+			a->name_offset = cpu_to_le16(
+					le16_to_cpu(a->name_offset) + 8);
+			a->flags |= ATTR_IS_COMPRESSED;
+			a->compression_unit = STANDARD_COMPRESSION_UNIT;
+			a->compressed_size = a->allocated_size;
+			ntfs_inode_mark_dirty(ctx->ntfs_ino);
+			res = 0;
+		}
+	}
+	ntfs_attr_put_search_ctx(ctx);
+	return (res);
+}
+
+/*
+ *		Switch an attribute back to not compressed, after a failure
+ *
+ *	This undoes make_compressed() : the compressed size is removed
+ *	and the name and the mapping pairs are moved back.
+ */
+
+static void clear_compressed(ntfs_inode *ni)
+{
+	ntfs_attr_search_ctx *ctx;
+	ATTR_RECORD *a;
+	u32 length;
+	u32 offset;
+
+	ctx = ntfs_attr_get_search_ctx(ni, (MFT_RECORD*)NULL);
+	if (ctx) {
+		if (!ntfs_attr_lookup(AT_DATA, AT_UNNAMED, 0, CASE_SENSITIVE,
+				0, (u8*)NULL, 0, ctx)) {
+			a = ctx->attr;
+			length = le32_to_cpu(a->length);
+			offset = offsetof(ATTR_RECORD, compressed_size);
+			memmove((char*)a + offset, (char*)a + offset + 8,
+					length - offset - 8);
+			a->mapping_pairs_offset = cpu_to_le16(
+				le16_to_cpu(a->mapping_pairs_offset) - 8);
+			a->name_offset = cpu_to_le16(
+					le16_to_cpu(a->name_offset) - 8);
+			a->flags &= ~ATTR_COMPRESSION_MASK;
+			a->compression_unit = 0;
+				/* shrinking cannot fail */
+			ntfs_attr_record_resize(ctx->mrec, a, length - 8);
+			ntfs_inode_mark_dirty(ctx->ntfs_ino);
+		}
+		ntfs_attr_put_search_ctx(ctx);
+	}
+}
+
+static int sync_all(ntfs_inode *ni)
+{
+	struct ntfs_device *dev;
+
+	dev = ni->vol->dev;
+	if (ntfs_inode_sync(ni)
+	    || (dev->d_ops->sync && dev->d_ops->sync(dev)))
+		return (-1);
+	return (0);
+}
+
+/*
+ *		Compress a batch of units, and place them unless dry run
+ */
+
+static int compress_units(ntfs_attr *na, struct UNIT_BATCH *batch,
+			s64 pos, LCN *hint, struct RUNS *runs,
+			struct ONEDRIVE_COMPRESSION *result)
+{
+	struct timespec start;
+	int i;
+
+	if (read_units(na, batch, pos))
+		return (-1);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	onedrive_workers_run(compress_job, batch, batch->count);
+	result->compress_ns += elapsed_ns(&start);
+	for (i=0; i<batch->count; i++) {
+		result->clusters_after += batch->units[i].clusters;
+		if (batch->units[i].compressed)
+			result->units_compressed++;
+		if (!batch->units[i].clusters)
+			result->units_zero++;
+	}
+	if (runs && place_units(na->ni->vol, batch,
+			pos >> na->ni->vol->cluster_size_bits, hint, runs))
+		return (-1);
+	return (0);
+}
+
+/*
+ *		Estimate the clusters needed from a sample of the units
+ */
+
+static int sample_units(ntfs_attr *na, struct UNIT_BATCH *batch,
+			struct ONEDRIVE_COMPRESSION *result)
+{
+	struct UNIT_BATCH one;
+	int i;
+
+	one = *batch;
+	one.count = 1;
+	for (i=0; i<SAMPLE_UNITS; i++)
+		if (compress_units(na, &one,
+			(s64)(i*result->units/SAMPLE_UNITS)*batch->unit_size,
+			(LCN*)NULL, (struct RUNS*)NULL, result))
+			return (-1);
+	result->clusters_after = result->clusters_after*result->units
+				/SAMPLE_UNITS;
+	result->units_compressed = result->units_compressed*result->units
+				/SAMPLE_UNITS;
+	result->units_zero = result->units_zero*result->units/SAMPLE_UNITS;
+	result->sampled = TRUE;
+	return (0);
+}
+
+/*
+ *		Compress the data of a file
+ *
+ *	Nothing is done if the file is already compressed, sparse or
+ *	encrypted, if its data is resident or spread over several MFT
+ *	records, or if compressing would not save "min_saving" percent of
+ *	its clusters.
+ *
+ *	Returns 0 if successful, whether the data was compressed or not,
+ *		-1 with errno set if there was an error
+ */
+
+int onedrive_compress_file(ntfs_volume *vol, MFT_REF mref, int min_saving,
+			BOOL dry_run, struct ONEDRIVE_COMPRESSION *result)
+{
+	struct UNIT_BATCH batch;
+	struct timespec start;
+	struct RUNS runs;
+	runlist_element *old_rl;
+	runlist_element *new_rl;
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	s64 unit_clusters;
+	s64 old_allocated;
+	s64 pos;
+	LCN hint;
+	BOOL switched;
+	int olderrno;
+	int res;
+	int i;
+
+	memset(result, 0, sizeof(struct ONEDRIVE_COMPRESSION));
+	memset(&runs, 0, sizeof(runs));
+	memset(&batch, 0, sizeof(batch));
+	result->mft_no = MREF(mref);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ni = ntfs_inode_open(vol, mref);
+	if (!ni)
+		return (-1);
+	res = -1;
+	switched = FALSE;
+	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	if (!na)
+		goto out;
+	res = 0;
+	if ((na->data_flags & (ATTR_COMPRESSION_MASK
+				| ATTR_IS_ENCRYPTED | ATTR_IS_SPARSE))
+	    || !NAttrNonResident(na) || NInoAttrList(ni)
+	    || (vol->cluster_size > MAX_CLUSTER_SIZE))
+		goto out;
+	res = -1;
+	if (ntfs_attr_map_whole_runlist(na))
+		goto out;
+	batch.unit_size = vol->cluster_size << STANDARD_COMPRESSION_UNIT;
+	batch.cluster_size = vol->cluster_size;
+	batch.cluster_size_bits = vol->cluster_size_bits;
+	unit_clusters = 1 << STANDARD_COMPRESSION_UNIT;
+	result->data_size = na->data_size;
+	result->clusters_before = na->allocated_size >> vol->cluster_size_bits;
+	result->units = (na->data_size + batch.unit_size - 1)
+				/batch.unit_size;
+	for (i=0; i<BATCH_UNITS; i++) {
+		batch.units[i].in = (char*)onedrive_buffer_get(
+					batch.unit_size);
+		batch.units[i].out = (char*)onedrive_buffer_get(
+					batch.unit_size);
+		if (!batch.units[i].in || !batch.units[i].out)
+			goto out;
+	}
+	if ((result->units > (2*SAMPLE_UNITS))
+	    && sample_units(na, &batch, result))
+		goto out;
+	res = 0;
+	if (result->sampled
+	    && (result->clusters_after*100 > result->clusters_before
+				*(100 - min_saving)))
+		goto out;
+	res = -1;
+	result->clusters_after = 0;
+	result->compress_ns = 0;
+	result->units_compressed = 0;
+	result->units_zero = 0;
+	result->sampled = FALSE;
+	hint = hint_before(na->rl, result->clusters_before);
+	for (pos=0; pos<na->data_size; pos+=batch.count*batch.unit_size) {
+		batch.count = (na->data_size - pos + batch.unit_size - 1)
+					/batch.unit_size;
+		if (batch.count > BATCH_UNITS)
+			batch.count = BATCH_UNITS;
+		if (compress_units(na, &batch, pos, &hint,
+				(dry_run ? (struct RUNS*)NULL : &runs), result))
+			goto out;
+	}
+	res = 0;
+	if (dry_run
+	    || (result->clusters_after*100 > result->clusters_before
+				*(100 - min_saving)))
+		goto out;
+	res = -1;
+	new_rl = end_runs(&runs, result->units*unit_clusters);
+	if (!new_rl
+	    || (vol->dev->d_ops->sync && vol->dev->d_ops->sync(vol->dev)))
+		goto out;
+		/* reopen the attribute as compressed */
+	ntfs_attr_close(na);
+	na = (ntfs_attr*)NULL;
+	if (make_compressed(ni))
+		goto out;
+	switched = TRUE;
+	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	if (!na || ntfs_attr_map_whole_runlist(na))
+		goto out;
+	old_rl = na->rl;
+	old_allocated = na->allocated_size;
+	na->rl = new_rl;
+	na->allocated_size = result->units*batch.unit_size;
+		/* all the data is in the compressed units */
+	if (ntfs_attr_update_mapping_pairs(na, 0)
+	    || set_initialized(na, na->data_size)) {
+		olderrno = errno;
+		na->rl = old_rl;
+		na->allocated_size = old_allocated;
+		if (ntfs_attr_update_mapping_pairs(na, 0)) {
+				/* the new clusters may be referenced */
+			free(new_rl);
+			runs.rl = (runlist_element*)NULL;
+		}
+		errno = olderrno;
+		goto out;
+	}
+	runs.rl = (runlist_element*)NULL;
+	switched = FALSE;
+	ni->flags |= FILE_ATTR_COMPRESSED;
+	NInoFileNameSetDirty(ni);
+	ntfs_inode_mark_dirty(ni);
+	ntfs_attr_close(na);
+	na = (ntfs_attr*)NULL;
+	if (!sync_all(ni)) {
+		ntfs_cluster_free_from_rl(vol, old_rl);
+		result->compressed = TRUE;
+		res = 0;
+	}
+	free(old_rl);
+out :
+	olderrno = errno;
+	if (switched)
+		clear_compressed(ni);
+	if (runs.rl) {
+		ntfs_cluster_free_from_rl(vol, end_runs(&runs, 0));
+		free(runs.rl);
+	}
+	for (i=0; i<BATCH_UNITS; i++) {
+		if (batch.units[i].in)
+			onedrive_buffer_put((char*)batch.units[i].in,
+					batch.unit_size);
+		if (batch.units[i].out)
+			onedrive_buffer_put(batch.units[i].out,
+					batch.unit_size);
+	}
+	if (na)
+		ntfs_attr_close(na);
+	ntfs_inode_close(ni);
+	result->total_ns = elapsed_ns(&start);
+	errno = olderrno;
+	if (res)
+		ntfs_log_perror("Could not compress the data of inode %lld",
+				(long long)MREF(mref));
+	return (res);
+}
+
+void onedrive_compress_report(FILE *f)
+{
+	pthread_mutex_lock(&compress_lock);
+	if (units_written)
+		fprintf(f, "compressed writes : %llu units, %.1f%%"
+				" compressed, %.1f%% zero, %.1f%% of the"
+				" clusters, %.1f MB/s compressing\n",
+			(unsigned long long)units_written,
+			100.0*units_compressed/units_written,
+			100.0*units_zero/units_written,
+			100.0*clusters_out/clusters_in,
+			(write_compress_ns
+				? (double)units_written*1000.0
+					*(clusters_in/units_written)
+					/write_compress_ns
+				: 0.0));
+	pthread_mutex_unlock(&compress_lock);
+}
@@ -0,0 +1,47 @@
+/*
+ * compress.h - NTFS compression of the data of OneDrive files
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ONEDRIVE_COMPRESS_H
+#define _ONEDRIVE_COMPRESS_H
+
+/*
+ *	Compressing a file is shared by the plugin, which does it for the
+ *	cold files, and by onedrive-maint, which does it on request.
+ */
+
+struct ONEDRIVE_COMPRESSION {
+	u64 mft_no;
+	s64 data_size;
+	s64 clusters_before;
+	s64 clusters_after;		/* or which would be */
+	u32 units;
+	u32 units_compressed;		/* stored compressed */
+	u32 units_zero;			/* left as holes */
+	u64 compress_ns;
+	u64 total_ns;
+	BOOL sampled;			/* only a sample was compressed */
+	BOOL compressed;
+} ;
+
+int onedrive_compress_file(ntfs_volume *vol, MFT_REF mref, int min_saving,
+			BOOL dry_run, struct ONEDRIVE_COMPRESSION *result);
+s64 onedrive_compress_write(ntfs_attr *na, s64 offset, s64 size,
+			const char *buf);
+
+#endif /* _ONEDRIVE_COMPRESS_H */
@@ -0,0 +1,214 @@
+/*
+ * direct.c - Direct writes of large requests to the clusters of files
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	When a large write falls into clusters already allocated to a
+ *	plain file (neither compressed nor encrypted), and initialized,
+ *	the clusters are fixed and nothing has to be changed in the MFT
+ *	record, so the data is written to the device from the buffer
+ *	received from fuse, one extent at a time, instead of going
+ *	through ntfs_attr_pwrite() which splits the request and looks up
+ *	the runlist for each piece.
+ *
+ *	The unaligned clusters at both ends, the holes of sparse files
+ *	and the part beyond the initialized size are left to ntfs-3g.
+ *	This is done for writes of at least ONEDRIVE_DIRECT_MIN_KB
+ *	(default 64), unless ONEDRIVE_DIRECT_WRITES is set to 0.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <ntfs-3g/types.h>
+#include <ntfs-3g/layout.h>
+#include <ntfs-3g/volume.h>
+#include <ntfs-3g/inode.h>
+#include <ntfs-3g/attrib.h>
+#include <ntfs-3g/runlist.h>
+#include <ntfs-3g/device.h>
+
+#include "onedrive.h"
+
+#define DEFAULT_DIRECT_MIN 65536
+
+static pthread_mutex_t direct_lock = PTHREAD_MUTEX_INITIALIZER;
+static BOOL direct_writes = TRUE;
+static s64 direct_min = DEFAULT_DIRECT_MIN;
+static u64 direct_requests = 0;
+static u64 direct_extents = 0;
+static u64 direct_bytes = 0;
+static u64 edge_bytes = 0;		/* left to ntfs-3g */
+static u64 direct_ns = 0;
+
+void onedrive_direct_init(void)
+{
+	const char *value;
+
+	value = getenv("ONEDRIVE_DIRECT_WRITES");
+	if (value && value[0])
+		direct_writes = (value[0] != '0');
+	value = getenv("ONEDRIVE_DIRECT_MIN_KB");
+	if (value && value[0] && (atol(value) > 0))
+		direct_min = (s64)atol(value) << 10;
+}
+
+/*
+ *		Have ntfs-3g write a part of the request
+ */
+
+static s64 generic_write(ntfs_attr *na, s64 pos, s64 size, const char *buf)
+{
+	s64 done;
+	s64 ret;
+
+	done = 0;
+	while (done < size) {
+		ret = ntfs_attr_pwrite(na, pos + done, size - done, buf + done);
+		if (ret <= 0)
+			return (done ? done : -1);
+		done += ret;
+	}
+	return (done);
+}
+
+/*
+ *		Write a large request directly to the clusters of a file
+ *
+ *	The part beyond the aligned clusters is written by ntfs-3g.
+ *
+ *	Returns the count of bytes written,
+ *		0 if this does not apply, for ntfs-3g to do the write,
+ *		-1 with errno set if nothing could be written
+ */
+
+s64 onedrive_direct_write(ntfs_attr *na, s64 offset, s64 size,
+			const char *buf)
+{
+	ntfs_volume *vol;
+	runlist_element *rl;
+	struct timespec start;
+	struct timespec end;
+	s64 first;
+	s64 last;
+	s64 done;
+	s64 pos;
+	s64 span;
+	s64 ret;
+	s64 holes;
+	s64 edges;
+	s64 direct;
+	VCN vcn;
+	u64 extents;
+
+	vol = na->ni->vol;
+	if (!direct_writes
+	    || (size < direct_min)
+	    || !NAttrNonResident(na)
+	    || (na->data_flags & (ATTR_COMPRESSION_MASK | ATTR_IS_ENCRYPTED)))
+		return (0);
+	first = (offset + vol->cluster_size - 1) & -(s64)vol->cluster_size;
+	last = offset + size;
+	if (last > na->initialized_size)
+		last = na->initialized_size;
+	last &= -(s64)vol->cluster_size;
+	if ((last - first) < direct_min)
+		return (0);
+	done = generic_write(na, offset, first - offset, buf);
+	if (done < (first - offset))
+		return (done);
+	extents = 0;
+	holes = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while ((offset + done) < last) {
+		pos = offset + done;
+		vcn = pos >> vol->cluster_size_bits;
+		rl = ntfs_attr_find_vcn(na, vcn);
+		if (!rl)
+			break;
+		span = (rl->vcn + rl->length - vcn) << vol->cluster_size_bits;
+		if (span > (last - pos))
+			span = last - pos;
+		if (rl->lcn >= 0) {
+			ret = ntfs_pwrite(vol->dev,
+				((rl->lcn + vcn - rl->vcn)
+					<< vol->cluster_size_bits),
+				span, buf + done);
+			extents++;
+		} else {
+				/* a hole to be allocated by ntfs-3g */
+			ret = generic_write(na, pos, span, buf + done);
+			if (ret > 0)
+				holes += ret;
+		}
+		if (ret > 0)
+			done += ret;
+		if (ret != span) {
+			if (!ret)
+				errno = EIO;
+			break;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	edges = first - offset + holes;
+	direct = done - edges;
+	if ((offset + done) == last) {
+		ret = generic_write(na, last, offset + size - last, buf + done);
+		if (ret > 0) {
+			done += ret;
+			edges += ret;
+		}
+	}
+	pthread_mutex_lock(&direct_lock);
+	direct_requests++;
+	direct_extents += extents;
+	direct_bytes += direct;
+	edge_bytes += edges;
+	direct_ns += (u64)(end.tv_sec - start.tv_sec)*1000000000
+			+ end.tv_nsec - start.tv_nsec;
+	pthread_mutex_unlock(&direct_lock);
+	return (done ? done : -1);
+}
+
+void onedrive_direct_report(FILE *f)
+{
+	pthread_mutex_lock(&direct_lock);
+	if (direct_requests)
+		fprintf(f, "direct writes : %llu requests, %.1f MB in %llu"
+				" extents, %.1f MB left to ntfs-3g,"
+				" %.1f MB/s direct\n",
+			(unsigned long long)direct_requests,
+			direct_bytes/1048576.0,
+			(unsigned long long)direct_extents,
+			edge_bytes/1048576.0,
+			(direct_ns
+				? direct_bytes*1000.0/direct_ns
+				: 0.0));
+	pthread_mutex_unlock(&direct_lock);
+}
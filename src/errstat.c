@@ -0,0 +1,290 @@
+/*
+ * errstat.c - Aggregation of the I/O errors met by the OneDrive plugin
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	A failing disk makes every read of a region fail, and logging
+ *	each failure would flood the log and slow down the FUSE thread.
+ *	So the errors are aggregated by operation, inode, error code and
+ *	region of the device (ERROR_REGION_BITS clusters), with their
+ *	count and the times of the first and last occurrences. Short
+ *	reads which are recovered from are aggregated as errors with no
+ *	error code.
+ *
+ *	An error is logged when it comes in only if a token is available
+ *	in a bucket refilled at ONEDRIVE_ERROR_LOG_RATE per minute
+ *	(default 10), with a burst of ERROR_BURST. The errors which were
+ *	not logged are summarized every ERROR_FLUSH_INTERVAL, one line
+ *	per aggregate, and all the aggregates are shown in the report.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <ntfs-3g/types.h>
+#include <ntfs-3g/layout.h>
+#include <ntfs-3g/volume.h>
+#include <ntfs-3g/inode.h>
+#include <ntfs-3g/attrib.h>
+#include <ntfs-3g/runlist.h>
+#include <ntfs-3g/logging.h>
+
+#include "onedrive.h"
+
+#define ERROR_SLOTS 64
+#define ERROR_REGION_BITS 12		/* clusters in a region, as a shift */
+#define ERROR_BURST 10
+#define DEFAULT_LOG_RATE 10		/* per minute */
+#define ERROR_FLUSH_INTERVAL 60		/* seconds */
+
+struct ERROR_AGGREGATE {
+	enum ONEDRIVE_OPS type;
+	u64 mft_no;
+	int err;			/* zero for short reads */
+	s64 region;			/* -1 if not known */
+	u64 count;
+	u64 unlogged;			/* since last flush */
+	time_t first;
+	time_t last;
+} ;
+
+static pthread_mutex_t error_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ERROR_AGGREGATE errors[ERROR_SLOTS];
+static int error_count = 0;
+static u64 error_total = 0;
+static u64 error_evicted = 0;
+static u64 unlogged_total = 0;
+static double log_rate = DEFAULT_LOG_RATE/60.0;	/* per second */
+static double tokens = ERROR_BURST;
+static struct timespec refilled;
+static time_t flushed = 0;
+
+void onedrive_errstat_init(void)
+{
+	const char *value;
+
+	value = getenv("ONEDRIVE_ERROR_LOG_RATE");
+	if (value && value[0])
+		log_rate = atof(value)/60.0;
+	clock_gettime(CLOCK_MONOTONIC, &refilled);
+	flushed = time((time_t*)NULL);
+}
+
+/*
+ *		Take a token from the bucket, if there is one
+ *
+ *	Must be called with the lock held
+ */
+
+static BOOL take_token(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	tokens += ((now.tv_sec - refilled.tv_sec)
+			+ (now.tv_nsec - refilled.tv_nsec)/1000000000.0)
+			* log_rate;
+	if (tokens > ERROR_BURST)
+		tokens = ERROR_BURST;
+	refilled = now;
+	if (tokens < 1.0)
+		return (FALSE);
+	tokens -= 1.0;
+	return (TRUE);
+}
+
+/*
+ *		Find the aggregate of an error, evicting the least recent
+ *	one if there is no room
+ *
+ *	Must be called with the lock held
+ */
+
+static struct ERROR_AGGREGATE *find_aggregate(enum ONEDRIVE_OPS type,
+			u64 mft_no, int err, s64 region, time_t now)
+{
+	struct ERROR_AGGREGATE *ea;
+	int i;
+
+	for (i=0; i<error_count; i++) {
+		ea = &errors[i];
+		if ((ea->type == type) && (ea->mft_no == mft_no)
+		    && (ea->err == err) && (ea->region == region))
+			return (ea);
+	}
+	if (error_count < ERROR_SLOTS)
+		ea = &errors[error_count++];
+	else {
+		ea = &errors[0];
+		for (i=1; i<ERROR_SLOTS; i++)
+			if (errors[i].last < ea->last)
+				ea = &errors[i];
+		unlogged_total -= ea->unlogged;
+		error_evicted++;
+	}
+	memset(ea, 0, sizeof(struct ERROR_AGGREGATE));
+	ea->type = type;
+	ea->mft_no = mft_no;
+	ea->err = err;
+	ea->region = region;
+	ea->first = now;
+	return (ea);
+}
+
+static const char *error_text(int err)
+{
+	return (err ? strerror(err) : "short transfer");
+}
+
+/*
+ *		Log the errors which were not logged when they came in
+ *
+ *	Must be called with the lock held
+ */
+
+static void flush_errors(time_t now)
+{
+	struct ERROR_AGGREGATE *ea;
+	int i;
+
+	flushed = now;
+	if (!unlogged_total)
+		return;
+	for (i=0; i<error_count; i++) {
+		ea = &errors[i];
+		if (ea->unlogged) {
+			ntfs_log_error("OneDrive %s : %llu more errors"
+				" \"%s\" on inode %llu region %lld"
+				" (%llu since first)\n",
+				onedrive_op_name(ea->type),
+				(unsigned long long)ea->unlogged,
+				error_text(ea->err),
+				(unsigned long long)ea->mft_no,
+				(long long)ea->region,
+				(unsigned long long)ea->count);
+			ea->unlogged = 0;
+		}
+	}
+	unlogged_total = 0;
+}
+
+/*
+ *		Record an error met when reading or writing an attribute
+ *
+ *	"err" is the error code, zero for a short transfer.
+ */
+
+void onedrive_error_record(enum ONEDRIVE_OPS type, ntfs_attr *na,
+			s64 offset, int err)
+{
+	struct ERROR_AGGREGATE *ea;
+	LCN lcn;
+	s64 region;
+	time_t now;
+	BOOL logged;
+
+	region = -1;
+	if (NAttrNonResident(na) && na->rl) {
+		lcn = ntfs_rl_vcn_to_lcn(na->rl,
+				offset >> na->ni->vol->cluster_size_bits);
+		if (lcn >= 0)
+			region = lcn >> ERROR_REGION_BITS;
+	}
+	now = time((time_t*)NULL);
+	pthread_mutex_lock(&error_lock);
+	error_total++;
+	ea = find_aggregate(type, na->ni->mft_no, err, region, now);
+	ea->count++;
+	ea->last = now;
+	logged = take_token();
+	if (!logged) {
+		ea->unlogged++;
+		unlogged_total++;
+	}
+	if ((now - flushed) >= ERROR_FLUSH_INTERVAL)
+		flush_errors(now);
+	pthread_mutex_unlock(&error_lock);
+	if (logged)
+		ntfs_log_error("OneDrive %s error \"%s\" on inode %lld"
+				" at offset %lld, region %lld\n",
+			onedrive_op_name(type), error_text(err),
+			(long long)na->ni->mft_no, (long long)offset,
+			(long long)region);
+}
+
+/*
+ *		Log the summaries which are due
+ *
+ *	This is checked when operations end, as errors may stop coming.
+ */
+
+void onedrive_errstat_tick(void)
+{
+	time_t now;
+
+	if (unlogged_total) {
+		now = time((time_t*)NULL);
+		pthread_mutex_lock(&error_lock);
+		if ((now - flushed) >= ERROR_FLUSH_INTERVAL)
+			flush_errors(now);
+		pthread_mutex_unlock(&error_lock);
+	}
+}
+
+void onedrive_errstat_report(FILE *f)
+{
+	const struct ERROR_AGGREGATE *ea;
+	char first[32];
+	char last[32];
+	struct tm tm;
+	int i;
+
+	pthread_mutex_lock(&error_lock);
+	if (error_total) {
+		fprintf(f, "errors : %llu, %llu aggregates evicted\n",
+			(unsigned long long)error_total,
+			(unsigned long long)error_evicted);
+		fprintf(f, "%-9s %-12s %-24s %10s %10s %-19s %-19s\n",
+			"op", "inode", "error", "region", "count",
+			"first", "last");
+	}
+	for (i=0; i<error_count; i++) {
+		ea = &errors[i];
+		localtime_r(&ea->first, &tm);
+		strftime(first, sizeof(first), "%F %T", &tm);
+		localtime_r(&ea->last, &tm);
+		strftime(last, sizeof(last), "%F %T", &tm);
+		fprintf(f, "%-9s %-12llu %-24.24s %10lld %10llu %s %s\n",
+			onedrive_op_name(ea->type),
+			(unsigned long long)ea->mft_no, error_text(ea->err),
+			(long long)ea->region, (unsigned long long)ea->count,
+			first, last);
+	}
+	pthread_mutex_unlock(&error_lock);
+}
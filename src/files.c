@@ -0,0 +1,375 @@
+/*
+ * files.c - Contexts of the files opened through the OneDrive plugin
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	A context is allocated when a file is opened and it is designated
+ *	by fi->fh until the file is released. ntfs-3g uses the low bits
+ *	of fi->fh for its own flags, so the handle is the index of the
+ *	context in a table, shifted by FH_SHIFT bits.
+ *
+ *	When a file is opened for writing while empty, or with the hash
+ *	of its data known, the data written is folded into a QuickXorHash
+ *	(see quickxor.c), which is recorded when the file is released, so
+ *	that the hash of a file written from Linux is known without
+ *	reading it back. The ranges written are tracked, so that writes
+ *	out of order are hashed as well. Hashing is dropped for the file
+ *	if bytes already hashed are written again or truncated, if the
+ *	ranges are too scattered, or if the file is written through
+ *	another handle.
+ */
+
+#include "config.h"
+
+#define FUSE_USE_VERSION 26
+#include <fuse.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <ntfs-3g/types.h>
+#include <ntfs-3g/layout.h>
+#include <ntfs-3g/inode.h>
+
+#include "onedrive.h"
+
+#define FH_SHIFT 8
+#define FH_INCREMENT 64		/* table extension when full */
+#define HASH_RANGES 8		/* disjoint ranges written */
+
+struct ONEDRIVE_HASHING {
+	u8 fold[ONEDRIVE_QXH_FOLD];
+	u8 reg[ONEDRIVE_QXH_SIZE];	/* of the data present when opened */
+	s64 seed_size;			/* size of the data present */
+	struct ONEDRIVE_RANGE written[HASH_RANGES];	/* sorted */
+	int range_count;
+	BOOL dirty;			/* data was changed */
+} ;
+
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ONEDRIVE_FILE **handles = (struct ONEDRIVE_FILE**)NULL;
+static unsigned int handle_count = 0;
+static unsigned int handle_next = 0;	/* where to look for a free slot */
+
+/*
+ *		Start hashing the data written through a handle
+ *
+ *	This is only possible when the file is empty, or when the hash
+ *	of its current data is known.
+ */
+
+static void start_hashing(ntfs_inode *ni, struct ONEDRIVE_FILE *file,
+			int flags)
+{
+	struct ONEDRIVE_HASHING *h;
+
+	h = (struct ONEDRIVE_HASHING*)calloc(1,
+				sizeof(struct ONEDRIVE_HASHING));
+	if (!h)
+		return;
+	if (ni->data_size && !(flags & O_TRUNC)) {
+		if (!onedrive_hash_get(ni, h->reg)) {
+			free(h);
+			return;
+		}
+		h->seed_size = ni->data_size;
+		onedrive_hash_event(ONEDRIVE_HASH_SEEDED);
+	}
+	file->hashing = h;
+	onedrive_hash_event(ONEDRIVE_HASH_STARTED);
+}
+
+/*
+ *		Stop hashing through a handle
+ *
+ *	Must be called with the lock held.
+ */
+
+static void drop_hashing(struct ONEDRIVE_FILE *file,
+			enum ONEDRIVE_HASH_EVENTS event)
+{
+	free(file->hashing);
+	file->hashing = (struct ONEDRIVE_HASHING*)NULL;
+	onedrive_hash_event(event);
+}
+
+/*
+ *		Allocate the context of a file being opened
+ *
+ *	Returns the context, or NULL if there is no memory
+ */
+
+struct ONEDRIVE_FILE *onedrive_file_open(ntfs_inode *ni,
+			struct fuse_file_info *fi)
+{
+	struct ONEDRIVE_FILE *file;
+	struct ONEDRIVE_FILE **newhandles;
+	unsigned int i;
+
+	file = (struct ONEDRIVE_FILE*)calloc(1, sizeof(struct ONEDRIVE_FILE));
+	if (!file)
+		return (file);
+	file->mft_no = ni->mft_no;
+	file->mref = MK_MREF(ni->mft_no,
+			le16_to_cpu(ni->mrec->sequence_number));
+	file->data_size = ni->data_size;
+	pthread_mutex_lock(&files_lock);
+	for (i=0; (i<handle_count) && handles[handle_next]; i++)
+		handle_next = (handle_next + 1) % handle_count;
+	if (i >= handle_count) {
+		newhandles = (struct ONEDRIVE_FILE**)realloc(handles,
+				(handle_count + FH_INCREMENT)
+					*sizeof(struct ONEDRIVE_FILE*));
+		if (newhandles) {
+			handles = newhandles;
+			memset(&handles[handle_count], 0,
+				FH_INCREMENT*sizeof(struct ONEDRIVE_FILE*));
+			handle_next = handle_count;
+			handle_count += FH_INCREMENT;
+		} else {
+			free(file);
+			file = (struct ONEDRIVE_FILE*)NULL;
+		}
+	}
+	if (file) {
+		handles[handle_next] = file;
+		fi->fh = (u64)(handle_next + 1) << FH_SHIFT;
+	}
+	pthread_mutex_unlock(&files_lock);
+	if (file && ((fi->flags & O_ACCMODE) != O_RDONLY))
+		start_hashing(ni, file, fi->flags);
+	return (file);
+}
+
+/*
+ *		Get the context of an open file
+ *
+ *	Returns NULL if there is none
+ */
+
+struct ONEDRIVE_FILE *onedrive_file_get(struct fuse_file_info *fi)
+{
+	struct ONEDRIVE_FILE *file;
+	u64 slot;
+
+	file = (struct ONEDRIVE_FILE*)NULL;
+	if (fi) {
+		slot = fi->fh >> FH_SHIFT;
+		pthread_mutex_lock(&files_lock);
+		if (slot && (slot <= handle_count))
+			file = handles[slot - 1];
+		pthread_mutex_unlock(&files_lock);
+	}
+	return (file);
+}
+
+/*
+ *		Free the context of a file being released
+ */
+
+void onedrive_file_release(struct fuse_file_info *fi)
+{
+	struct ONEDRIVE_FILE *file;
+	u64 slot;
+
+	file = (struct ONEDRIVE_FILE*)NULL;
+	slot = fi->fh >> FH_SHIFT;
+	pthread_mutex_lock(&files_lock);
+	if (slot && (slot <= handle_count)) {
+		file = handles[slot - 1];
+		handles[slot - 1] = (struct ONEDRIVE_FILE*)NULL;
+	}
+	pthread_mutex_unlock(&files_lock);
+	fi->fh &= ((u64)1 << FH_SHIFT) - 1;
+	if (file)
+		free(file->hashing);
+	free(file);
+}
+
+/*
+ *		Check whether a file is open through the plugin
+ */
+
+BOOL onedrive_file_is_open(u64 mft_no)
+{
+	unsigned int i;
+	BOOL found;
+
+	found = FALSE;
+	pthread_mutex_lock(&files_lock);
+	for (i=0; (i<handle_count) && !found; i++)
+		found = handles[i] && (handles[i]->mft_no == mft_no);
+	pthread_mutex_unlock(&files_lock);
+	return (found);
+}
+
+/*
+ *		Record a range written into the hashed ranges
+ *
+ *	Returns the reason for dropping the hashing, or -1 if the range
+ *	can be hashed.
+ */
+
+static int add_range(struct ONEDRIVE_HASHING *h, s64 offset, s64 size)
+{
+	struct ONEDRIVE_RANGE *w;
+	s64 end;
+	int i, j;
+
+	if (offset < h->seed_size)
+		return (ONEDRIVE_HASH_REWRITTEN);
+	w = h->written;
+	end = offset + size;
+	i = 0;
+	while ((i < h->range_count) && ((w[i].offset + w[i].length) < offset))
+		i++;
+	j = i;
+	if ((j < h->range_count) && ((w[j].offset + w[j].length) == offset))
+		j++;
+	if ((j < h->range_count) && (w[j].offset < end))
+		return (ONEDRIVE_HASH_REWRITTEN);
+	if (i < j) {
+		w[i].length += size;
+		if ((j < h->range_count) && (w[j].offset == end)) {
+			w[i].length += w[j].length;
+			memmove(&w[j], &w[j + 1], (h->range_count - j - 1)
+					*sizeof(struct ONEDRIVE_RANGE));
+			h->range_count--;
+		}
+	} else
+		if ((j < h->range_count) && (w[j].offset == end)) {
+			w[j].offset = offset;
+			w[j].length += size;
+		} else {
+			if (h->range_count >= HASH_RANGES)
+				return (ONEDRIVE_HASH_SCATTERED);
+			memmove(&w[j + 1], &w[j], (h->range_count - j)
+					*sizeof(struct ONEDRIVE_RANGE));
+			w[j].offset = offset;
+			w[j].length = size;
+			h->range_count++;
+		}
+	return (-1);
+}
+
+/*
+ *		Hash the data written to a file
+ *
+ *	The hashing through the other handles of the file is dropped, as
+ *	it misses the data.
+ */
+
+void onedrive_file_written(ntfs_inode *ni, struct ONEDRIVE_FILE *file,
+			s64 offset, const char *buf, s64 size)
+{
+	struct ONEDRIVE_FILE *other;
+	struct ONEDRIVE_HASHING *h;
+	unsigned int i;
+	int event;
+
+	if (size <= 0)
+		return;
+	onedrive_hash_forget(ni);
+	pthread_mutex_lock(&files_lock);
+	for (i=0; i<handle_count; i++) {
+		other = handles[i];
+		if (other && (other != file) && other->hashing
+		    && (other->mft_no == ni->mft_no))
+			drop_hashing(other, ONEDRIVE_HASH_OTHER_WRITER);
+	}
+	h = (file ? file->hashing : (struct ONEDRIVE_HASHING*)NULL);
+	if (h) {
+		event = add_range(h, offset, size);
+		if (event < 0) {
+			onedrive_qxh_fold(h->fold, offset, buf, size);
+			h->dirty = TRUE;
+		} else
+			drop_hashing(file, (enum ONEDRIVE_HASH_EVENTS)event);
+	}
+	pthread_mutex_unlock(&files_lock);
+}
+
+/*
+ *		Adjust the hashing of a file being truncated
+ *
+ *	Truncating to zero restarts the hashing, extending does not
+ *	change the hash as the new bytes are zeroes.
+ */
+
+void onedrive_file_truncated(ntfs_inode *ni, s64 size)
+{
+	struct ONEDRIVE_FILE *file;
+	struct ONEDRIVE_HASHING *h;
+	unsigned int i;
+
+	onedrive_hash_forget(ni);
+	pthread_mutex_lock(&files_lock);
+	for (i=0; i<handle_count; i++) {
+		file = handles[i];
+		if (!file || !file->hashing || (file->mft_no != ni->mft_no))
+			continue;
+		h = file->hashing;
+		if (!size) {
+			memset(h, 0, sizeof(struct ONEDRIVE_HASHING));
+			h->dirty = TRUE;
+		} else
+			if ((size < h->seed_size)
+			    || (h->range_count
+				&& (size < (h->written[h->range_count - 1]
+						.offset
+					+ h->written[h->range_count - 1]
+						.length))))
+				drop_hashing(file, ONEDRIVE_HASH_TRUNCATED);
+			else
+				h->dirty = TRUE;
+	}
+	pthread_mutex_unlock(&files_lock);
+}
+
+/*
+ *		Record the hash of a file being released
+ */
+
+void onedrive_file_commit(ntfs_inode *ni, struct ONEDRIVE_FILE *file)
+{
+	struct ONEDRIVE_HASHING *h;
+	u8 reg[ONEDRIVE_QXH_SIZE];
+
+	pthread_mutex_lock(&files_lock);
+	h = file->hashing;
+	file->hashing = (struct ONEDRIVE_HASHING*)NULL;
+	pthread_mutex_unlock(&files_lock);
+	if (h && h->dirty && (h->seed_size <= ni->data_size)
+	    && (!h->range_count
+		|| ((h->written[h->range_count - 1].offset
+			+ h->written[h->range_count - 1].length)
+				<= ni->data_size))) {
+		memcpy(reg, h->reg, ONEDRIVE_QXH_SIZE);
+		onedrive_qxh_register(h->fold, reg);
+		onedrive_hash_commit(ni, reg);
+	}
+	free(h);
+}
@@ -0,0 +1,347 @@
+/*
+ * flatten.c - Relocation of the data of fragmented OneDrive files
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	When the data of a file is very fragmented, its mapping pairs do
+ *	not fit into the base MFT record, and extension records listed
+ *	in an attribute list have to be loaded whenever the data is
+ *	opened. The data is relocated into clusters allocated as a whole,
+ *	which are usually few large extents, so that the mapping pairs
+ *	fit into the base record again. The attributes left in extension
+ *	records are then moved back to the base record if there is room,
+ *	and the attribute list is deleted by ntfs-3g when no longer needed.
+ *	The other attributes (reparse point, object id, named streams)
+ *	are only moved, never changed.
+ *
+ *	The data is copied and synced before the mapping pairs are
+ *	switched to the new clusters, and the old clusters are freed
+ *	last, once the MFT records are synced. The records are however
+ *	written by ntfs-3g in no specified order, so a crash in between
+ *	may leave an inconsistency for chkdsk to repair.
+ *
+ *	The cost of opening the data, as done by each read, is measured
+ *	before and after.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include <stdio.h>
+#include <time.h>
+
+#include <ntfs-3g/types.h>
+#include <ntfs-3g/layout.h>
+#include <ntfs-3g/volume.h>
+#include <ntfs-3g/inode.h>
+#include <ntfs-3g/attrib.h>
+#include <ntfs-3g/lcnalloc.h>
+#include <ntfs-3g/logging.h>
+
+#include "flatten.h"
+
+#define OPEN_SAMPLES 16
+#define COPY_BUFFER_SIZE 1048576
+#define MAX_MOVES 64
+
+static u32 count_runs(const runlist_element *rl)
+{
+	u32 count;
+
+	count = 0;
+	for ( ; rl && rl->length; rl++)
+		if (rl->lcn >= 0)
+			count++;
+	return (count);
+}
+
+static const runlist_element *find_run(const runlist_element *rl, VCN vcn)
+{
+	while (rl->length && ((rl->vcn + rl->length) <= vcn))
+		rl++;
+	return (rl->length ? rl : (const runlist_element*)NULL);
+}
+
+/*
+ *		Time the opening of the data, loading all its extents
+ *
+ *	The inode is opened each time, as for a read from ntfs-3g.
+ */
+
+static u64 time_open(ntfs_volume *vol, MFT_REF mref, u32 *extents)
+{
+	struct timespec start;
+	struct timespec end;
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	u64 total;
+	int i;
+
+	total = 0;
+	*extents = 0;
+	for (i=0; i<OPEN_SAMPLES; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		ni = ntfs_inode_open(vol, mref);
+		if (!ni)
+			return (0);
+		na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+		if (na) {
+			ntfs_attr_map_whole_runlist(na);
+			ntfs_attr_close(na);
+		}
+		*extents = ni->nr_extents;
+		ntfs_inode_close(ni);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		total += (u64)(end.tv_sec - start.tv_sec)*1000000000
+				+ end.tv_nsec - start.tv_nsec;
+	}
+	return (total/OPEN_SAMPLES);
+}
+
+/*
+ *		Check whether some of the data attribute is out of the base record
+ */
+
+BOOL onedrive_flatten_needed(ntfs_inode *ni)
+{
+	ntfs_attr_search_ctx *ctx;
+	BOOL needed;
+
+	needed = FALSE;
+	if (NInoAttrList(ni)) {
+		ctx = ntfs_attr_get_search_ctx(ni, (MFT_RECORD*)NULL);
+		if (ctx) {
+			while (!needed
+			    && !ntfs_attr_lookup(AT_DATA, AT_UNNAMED, 0,
+					CASE_SENSITIVE, 0, (u8*)NULL, 0, ctx))
+				if (ctx->ntfs_ino != ni)
+					needed = TRUE;
+			ntfs_attr_put_search_ctx(ctx);
+		}
+	}
+	return (needed);
+}
+
+/*
+ *		Copy the data from the old clusters to the new ones
+ */
+
+static int copy_clusters(ntfs_volume *vol, const runlist_element *from,
+			const runlist_element *to, char *buf)
+{
+	const runlist_element *dst;
+	s64 count;
+	s64 bytes;
+	VCN vcn;
+	LCN lcn;
+	s64 left;
+
+	for ( ; from->length; from++) {
+		if (from->lcn < 0)
+			continue;
+		vcn = from->vcn;
+		lcn = from->lcn;
+		left = from->length;
+		while (left > 0) {
+			dst = find_run(to, vcn);
+			if (!dst || (dst->lcn < 0)) {
+				errno = EIO;
+				return (-1);
+			}
+			count = dst->vcn + dst->length - vcn;
+			if (count > left)
+				count = left;
+			if (count > (COPY_BUFFER_SIZE >> vol->cluster_size_bits))
+				count = COPY_BUFFER_SIZE
+						>> vol->cluster_size_bits;
+			bytes = count << vol->cluster_size_bits;
+			if ((ntfs_pread(vol->dev,
+				lcn << vol->cluster_size_bits,
+				bytes, buf) != bytes)
+			    || (ntfs_pwrite(vol->dev,
+				(dst->lcn + vcn - dst->vcn)
+					<< vol->cluster_size_bits,
+				bytes, buf) != bytes))
+				return (-1);
+			vcn += count;
+			lcn += count;
+			left -= count;
+		}
+	}
+	return (0);
+}
+
+/*
+ *		Move the attributes in extension records to the base record
+ *
+ *	This stops when the base record is full, or when the attribute
+ *	list has been deleted because all the attributes are in the
+ *	base record.
+ */
+
+static void move_to_base(ntfs_inode *ni)
+{
+	ntfs_attr_search_ctx *ctx;
+	int moves;
+
+	ctx = ntfs_attr_get_search_ctx(ni, (MFT_RECORD*)NULL);
+	if (ctx) {
+		moves = 0;
+		while (NInoAttrList(ni) && (moves < MAX_MOVES)
+		    && !ntfs_attr_lookup(AT_UNUSED, (ntfschar*)NULL, 0,
+				CASE_SENSITIVE, 0, (u8*)NULL, 0, ctx)) {
+			if ((ctx->ntfs_ino != ni)
+			    && !ntfs_attr_record_move_to(ctx, ni)) {
+				moves++;
+				ntfs_attr_reinit_search_ctx(ctx);
+			}
+		}
+		ntfs_attr_put_search_ctx(ctx);
+	}
+}
+
+static int sync_all(ntfs_inode *ni)
+{
+	struct ntfs_device *dev;
+
+	dev = ni->vol->dev;
+	if (ntfs_inode_sync(ni)
+	    || (dev->d_ops->sync && dev->d_ops->sync(dev)))
+		return (-1);
+	return (0);
+}
+
+/*
+ *		Relocate the data of a file and bring it back to the base record
+ *
+ *	Nothing is done if the data is not partly in extension records,
+ *	or if the free space is so fragmented that the data would not
+ *	get fewer extents. Compressed, encrypted and sparse data is not
+ *	relocated.
+ *
+ *	Returns 0 if successful, whether the data was relocated or not,
+ *		-1 with errno set if there was an error
+ */
+
+int onedrive_flatten_file(ntfs_volume *vol, MFT_REF mref, BOOL dry_run,
+			struct ONEDRIVE_FLATTENING *result)
+{
+	runlist_element *old_rl;
+	runlist_element *new_rl;
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	char *buf;
+	int olderrno;
+	int res;
+
+	memset(result, 0, sizeof(struct ONEDRIVE_FLATTENING));
+	result->mft_no = MREF(mref);
+	result->open_ns_before = time_open(vol, mref,
+				&result->extents_before);
+	ni = ntfs_inode_open(vol, mref);
+	if (!ni)
+		return (-1);
+	res = -1;
+	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	if (!na)
+		goto out;
+	if (na->data_flags & (ATTR_COMPRESSION_MASK
+				| ATTR_IS_ENCRYPTED | ATTR_IS_SPARSE)) {
+		errno = EOPNOTSUPP;
+		goto out;
+	}
+	if (NAttrNonResident(na) && ntfs_attr_map_whole_runlist(na))
+		goto out;
+	res = 0;
+	result->clusters = na->allocated_size >> vol->cluster_size_bits;
+	result->runs_before = count_runs(NAttrNonResident(na)
+				? na->rl : (runlist_element*)NULL);
+	result->runs_after = result->runs_before;
+	if (dry_run || !NAttrNonResident(na) || !result->clusters
+	    || !onedrive_flatten_needed(ni))
+		goto out;
+	res = -1;
+	new_rl = ntfs_cluster_alloc(vol, 0, result->clusters, -1, DATA_ZONE);
+	if (!new_rl)
+		goto out;
+	result->runs_after = count_runs(new_rl);
+	buf = (char*)malloc(COPY_BUFFER_SIZE);
+	if ((result->runs_after >= result->runs_before)
+	    || !buf
+	    || copy_clusters(vol, na->rl, new_rl, buf)
+	    || (vol->dev->d_ops->sync && vol->dev->d_ops->sync(vol->dev))) {
+		olderrno = errno;
+		if (result->runs_after >= result->runs_before) {
+				/* free space too fragmented */
+			result->runs_after = result->runs_before;
+			res = 0;
+		}
+		free(buf);
+		ntfs_cluster_free_from_rl(vol, new_rl);
+		free(new_rl);
+		errno = olderrno;
+		goto out;
+	}
+	free(buf);
+	old_rl = na->rl;
+	na->rl = new_rl;
+	if (ntfs_attr_update_mapping_pairs(na, 0)) {
+		olderrno = errno;
+		na->rl = old_rl;
+		if (!ntfs_attr_update_mapping_pairs(na, 0)) {
+			ntfs_cluster_free_from_rl(vol, new_rl);
+			free(new_rl);
+		}
+		errno = olderrno;
+		goto out;
+	}
+	ntfs_attr_close(na);
+	na = (ntfs_attr*)NULL;
+	move_to_base(ni);
+	if (!sync_all(ni)) {
+		ntfs_cluster_free_from_rl(vol, old_rl);
+		result->flattened = TRUE;
+		res = 0;
+	}
+	free(old_rl);
+out :
+	olderrno = errno;
+	result->attrlist_after = (NInoAttrList(ni) ? TRUE : FALSE);
+	if (na)
+		ntfs_attr_close(na);
+	ntfs_inode_close(ni);
+	if (result->flattened)
+		result->open_ns_after = time_open(vol, mref,
+					&result->extents_after);
+	errno = olderrno;
+	if (res)
+		ntfs_log_perror("Could not relocate the data of inode %lld",
+				(long long)MREF(mref));
+	return (res);
+}
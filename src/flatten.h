@@ -0,0 +1,40 @@
+/*
+ * flatten.h - Relocation of the data of fragmented OneDrive files
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ONEDRIVE_FLATTEN_H
+#define _ONEDRIVE_FLATTEN_H
+
+struct ONEDRIVE_FLATTENING {
+	u64 mft_no;
+	s64 clusters;
+	u32 runs_before;
+	u32 runs_after;
+	u32 extents_before;		/* extension records loaded */
+	u32 extents_after;
+	u64 open_ns_before;		/* mean time to open $DATA */
+	u64 open_ns_after;
+	BOOL attrlist_after;		/* the attribute list is kept */
+	BOOL flattened;
+} ;
+
+BOOL onedrive_flatten_needed(ntfs_inode *ni);
+int onedrive_flatten_file(ntfs_volume *vol, MFT_REF mref, BOOL dry_run,
+			struct ONEDRIVE_FLATTENING *result);
+
+#endif /* _ONEDRIVE_FLATTEN_H */
@@ -0,0 +1,506 @@
+/*
+ * heat.c - Tracking how often the OneDrive files are used
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	Each file opened gets a score, which is increased by one for each
+ *	opening and for each READ_UNIT bytes read, and which decays with
+ *	a half-life set by the environment variable ONEDRIVE_HEAT_HOURS
+ *	(default one week). The parent directory gets the same increases,
+ *	so that the hot parts of the tree show up.
+ *
+ *	The scores are kept in a set-associative table of fixed size, the
+ *	lowest score of a set being evicted, and they are saved in the
+ *	cache directory. The report lists the hottest files and
+ *	directories, the hot files which Windows may free and the
+ *	cold ones which it keeps.
+ *
+ *	When ONEDRIVE_AUTOPIN is set to a score, the files reaching it
+ *	are marked to be kept on the device (pinned), so that Windows
+ *	fetches them if they were freed. When such a file becomes cold
+ *	again, its previous marks are restored. The marks set by the
+ *	user are never changed otherwise.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <ntfs-3g/types.h>
+#include <ntfs-3g/layout.h>
+#include <ntfs-3g/volume.h>
+#include <ntfs-3g/inode.h>
+
+#include "onedrive.h"
+
+#define HEAT_WAYS 4
+#define HEAT_SETS 1024
+#define READ_UNIT 4194304.0	/* bytes read worth an opening */
+#define DEFAULT_HALF_LIFE 168	/* hours */
+#define COLD_RATIO 8		/* autopin score / score to unpin */
+#define FREE_SCORE 0.5		/* below which a file is cold */
+#define HEAT_REPORT 10
+#define HEAT_SAVE_INTERVAL 300	/* seconds */
+#define HEAT_MAINTAIN_INTERVAL 3600	/* seconds */
+#define HEAT_MAGIC 0x5448444f	/* "ODHT" */
+#define HEAT_VERSION 1
+
+enum {
+	HEAT_DIR = 1,			/* a directory */
+	HEAT_OFFLINE = 2,		/* no local data when last seen */
+	HEAT_PINNED = 4,		/* pinned when last seen */
+	HEAT_AUTOPINNED = 8,		/* pinned by us */
+	HEAT_WAS_UNPINNED = 16,		/* unpinned before we pinned */
+} ;
+
+struct HEAT {
+	MFT_REF mref;			/* zero when free */
+	MFT_REF parent;
+	float score;			/* at time "when" */
+	u32 when;
+	u32 flags;
+	char name[44];
+} ;
+
+static pthread_mutex_t heat_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct HEAT heats[HEAT_SETS][HEAT_WAYS];
+static double half_life = DEFAULT_HALF_LIFE*3600.0;
+static double autopin_score = 0.0;
+static BOOL heats_loaded = FALSE;
+static BOOL heats_dirty = FALSE;
+static time_t heats_saved = 0;
+static time_t heats_maintained = 0;
+static char heat_path[4096] = "";
+
+static u64 autopinned = 0;
+static u64 autounpinned = 0;
+
+void onedrive_heat_init(void)
+{
+	const char *value;
+
+	value = getenv("ONEDRIVE_HEAT_HOURS");
+	if (value && (atof(value) > 0))
+		half_life = atof(value)*3600.0;
+	value = getenv("ONEDRIVE_AUTOPIN");
+	if (value && value[0])
+		autopin_score = atof(value);
+}
+
+/*
+ *		Get the score of an entry at some time
+ */
+
+static double decayed(const struct HEAT *h, time_t now)
+{
+	return (h->score*exp2(-(double)(s32)((u32)now - h->when)/half_life));
+}
+
+static void load_heats(ntfs_volume *vol)
+{
+	struct HEAT *saved;
+	size_t size;
+
+	heats_loaded = TRUE;
+	heats_saved = heats_maintained = time((time_t*)NULL);
+	if (onedrive_cachefile_path(vol, "heat", heat_path,
+				sizeof(heat_path))) {
+		heat_path[0] = 0;
+		return;
+	}
+	saved = (struct HEAT*)onedrive_cachefile_load(heat_path,
+			HEAT_MAGIC, HEAT_VERSION, &size);
+	if (saved) {
+		if (size == sizeof(heats))
+			memcpy(heats, saved, size);
+		free(saved);
+	}
+}
+
+static void save_heats(void)
+{
+	if (heats_dirty && heat_path[0]
+	    && !onedrive_cachefile_save(heat_path, HEAT_MAGIC,
+			HEAT_VERSION, heats, sizeof(heats)))
+		heats_dirty = FALSE;
+	heats_saved = time((time_t*)NULL);
+}
+
+/*
+ *		Find the entry of a file or directory, creating it if needed
+ *
+ *	The coldest entry of the set is evicted if there is no room,
+ *	unless it was pinned by us.
+ *	Must be called with the lock held.
+ */
+
+static struct HEAT *find_heat(MFT_REF mref, time_t now, BOOL *created)
+{
+	struct HEAT *set;
+	struct HEAT *h;
+	double low;
+	double score;
+	int i;
+
+	*created = FALSE;
+	set = heats[(mref ^ (mref >> 48)) % HEAT_SETS];
+	for (i=0; i<HEAT_WAYS; i++)
+		if (set[i].mref == mref)
+			return (&set[i]);
+	h = (struct HEAT*)NULL;
+	low = 0.0;
+	for (i=0; (i<HEAT_WAYS) && (!h || h->mref); i++) {
+		if (!set[i].mref)
+			h = &set[i];
+		else
+			if (!(set[i].flags & HEAT_AUTOPINNED)) {
+				score = decayed(&set[i], now);
+				if (!h || (score < low)) {
+					h = &set[i];
+					low = score;
+				}
+			}
+	}
+	if (h) {
+		memset(h, 0, sizeof(struct HEAT));
+		h->mref = mref;
+		h->when = now;
+		*created = TRUE;
+	}
+	return (h);
+}
+
+static void add_heat(struct HEAT *h, double weight, time_t now)
+{
+	h->score = decayed(h, now) + weight;
+	h->when = now;
+	heats_dirty = TRUE;
+}
+
+/*
+ *		Charge the parent directory of a file
+ *
+ *	Must be called with the lock held
+ */
+
+static void heat_parent(ntfs_volume *vol, MFT_REF parent, double weight,
+			time_t now)
+{
+	struct HEAT *h;
+	ntfs_inode *dir_ni;
+	MFT_REF grandparent;
+	BOOL created;
+
+	h = find_heat(parent, now, &created);
+	if (h) {
+		if (created) {
+			h->flags = HEAT_DIR;
+			if (MREF(parent) == FILE_root)
+				strcpy(h->name, "/");
+			else {
+				dir_ni = ntfs_inode_open(vol, parent);
+				if (dir_ni) {
+					if (onedrive_inode_name(dir_ni, h->name,
+						sizeof(h->name),
+						&grandparent) < 0)
+						h->name[0] = 0;
+					ntfs_inode_close(dir_ni);
+				}
+			}
+		}
+		add_heat(h, weight, now);
+	}
+}
+
+/*
+ *		Pin or unpin a file, noting what was done
+ */
+
+static void set_pinned(ntfs_inode *ni, struct HEAT *h, BOOL pin)
+{
+	if (pin) {
+		h->flags |= HEAT_AUTOPINNED | HEAT_PINNED;
+		if (ni->flags & FILE_ATTR_UNPINNED)
+			h->flags |= HEAT_WAS_UNPINNED;
+		ni->flags = (ni->flags & ~FILE_ATTR_UNPINNED)
+				| FILE_ATTR_PINNED;
+		autopinned++;
+	} else {
+		ni->flags &= ~FILE_ATTR_PINNED;
+		if (h->flags & HEAT_WAS_UNPINNED)
+			ni->flags |= FILE_ATTR_UNPINNED;
+		h->flags &= ~(HEAT_AUTOPINNED | HEAT_PINNED
+				| HEAT_WAS_UNPINNED);
+		autounpinned++;
+	}
+	NInoFileNameSetDirty(ni);
+	ntfs_inode_mark_dirty(ni);
+	onedrive_names_state(ni, FALSE);
+	heats_dirty = TRUE;
+}
+
+/*
+ *		Restore the marks of the files pinned by us which became cold
+ *
+ *	The inode being used by the current operation is skipped, it
+ *	would be opened twice.
+ *	Must be called with the lock held.
+ */
+
+static void unpin_cold(ntfs_inode *cur_ni, time_t now)
+{
+	struct HEAT *h;
+	ntfs_inode *ni;
+	int i, j;
+
+	heats_maintained = now;
+	for (i=0; i<HEAT_SETS; i++)
+		for (j=0; j<HEAT_WAYS; j++) {
+			h = &heats[i][j];
+			if ((h->flags & HEAT_AUTOPINNED)
+			    && (MREF(h->mref) != cur_ni->mft_no)
+			    && (decayed(h, now)
+					< autopin_score/COLD_RATIO)) {
+				ni = ntfs_inode_open(cur_ni->vol, h->mref);
+				if (ni) {
+					if (ni->flags & FILE_ATTR_PINNED)
+						set_pinned(ni, h, FALSE);
+					ntfs_inode_close(ni);
+				} else
+					h->flags &= ~HEAT_AUTOPINNED;
+			}
+		}
+}
+
+/*
+ *		Charge the use of a file
+ *
+ *	The file is pinned if it became hot enough, in automatic mode,
+ *	unless the volume is mounted read-only.
+ */
+
+static void heat_file(ntfs_inode *ni, double weight)
+{
+	struct HEAT *h;
+	MFT_REF mref;
+	MFT_REF parent;
+	time_t now;
+	BOOL created;
+
+	now = time((time_t*)NULL);
+	mref = MK_MREF(ni->mft_no, le16_to_cpu(ni->mrec->sequence_number));
+	pthread_mutex_lock(&heat_lock);
+	if (!heats_loaded)
+		load_heats(ni->vol);
+	h = find_heat(mref, now, &created);
+	if (h) {
+		if (created
+		    && (onedrive_inode_name(ni, h->name, sizeof(h->name),
+				&parent) >= 0))
+			h->parent = parent;
+		add_heat(h, weight, now);
+		h->flags &= ~(HEAT_OFFLINE | HEAT_PINNED);
+		if (ni->flags & FILE_ATTR_OFFLINE)
+			h->flags |= HEAT_OFFLINE;
+		if (ni->flags & FILE_ATTR_PINNED)
+			h->flags |= HEAT_PINNED;
+		if ((autopin_score > 0) && (h->score >= autopin_score)
+		    && !(ni->flags & FILE_ATTR_PINNED)
+		    && !NVolReadOnly(ni->vol))
+			set_pinned(ni, h, TRUE);
+		if (h->parent)
+			heat_parent(ni->vol, h->parent, weight, now);
+	}
+	if ((autopin_score > 0) && !NVolReadOnly(ni->vol)
+	    && ((now - heats_maintained) >= HEAT_MAINTAIN_INTERVAL))
+		unpin_cold(ni, now);
+	if (heats_dirty && ((now - heats_saved) >= HEAT_SAVE_INTERVAL))
+		save_heats();
+	pthread_mutex_unlock(&heat_lock);
+}
+
+void onedrive_heat_open(ntfs_inode *ni)
+{
+	heat_file(ni, 1.0);
+}
+
+void onedrive_heat_read(ntfs_inode *ni, s64 bytes)
+{
+	if (bytes > 0)
+		heat_file(ni, bytes/READ_UNIT);
+}
+
+/*
+ *		Check whether a file is cold
+ *
+ *	A file which was not used since the heats were lost is cold.
+ */
+
+BOOL onedrive_heat_cold(ntfs_volume *vol, MFT_REF mref)
+{
+	struct HEAT *set;
+	time_t now;
+	BOOL cold;
+	int i;
+
+	now = time((time_t*)NULL);
+	cold = TRUE;
+	pthread_mutex_lock(&heat_lock);
+	if (!heats_loaded)
+		load_heats(vol);
+	set = heats[(mref ^ (mref >> 48)) % HEAT_SETS];
+	for (i=0; i<HEAT_WAYS; i++)
+		if ((set[i].mref == mref)
+		    && ((set[i].flags & HEAT_AUTOPINNED)
+			|| (decayed(&set[i], now) >= FREE_SCORE)))
+			cold = FALSE;
+	pthread_mutex_unlock(&heat_lock);
+	return (cold);
+}
+
+struct HEAT_RANK {
+	const struct HEAT *h;
+	double score;
+} ;
+
+static int compare_ranks(const void *p1, const void *p2)
+{
+	const struct HEAT_RANK *r1 = (const struct HEAT_RANK*)p1;
+	const struct HEAT_RANK *r2 = (const struct HEAT_RANK*)p2;
+
+	return ((r1->score < r2->score) - (r1->score > r2->score));
+}
+
+static void report_ranks(FILE *f, const char *title,
+			const struct HEAT_RANK *ranks, int count, BOOL coldest)
+{
+	const struct HEAT_RANK *r;
+	int i;
+
+	if (!count)
+		return;
+	fprintf(f, "%s\n", title);
+	if (count > HEAT_REPORT)
+		count = HEAT_REPORT;
+	for (i=0; i<count; i++) {
+		r = (coldest ? &ranks[-i] : &ranks[i]);
+		fprintf(f, "  %-12llu %-12llu %9.2f %s%s \"%s\"\n",
+			(unsigned long long)MREF(r->h->mref),
+			(unsigned long long)MREF(r->h->parent),
+			r->score,
+			(r->h->flags & HEAT_OFFLINE ? "O" : "-"),
+			(r->h->flags & HEAT_AUTOPINNED ? "A"
+				: (r->h->flags & HEAT_PINNED ? "P" : "-")),
+			r->h->name);
+	}
+}
+
+/*
+ *		Report the hottest files and directories, and suggest the
+ *	files to pin or to free
+ *
+ *	"Pin" suggests hot files which are not pinned, and "free" the
+ *	cold files with local data which are not pinned.
+ */
+
+void onedrive_heat_report(FILE *f)
+{
+	struct HEAT_RANK *files;
+	struct HEAT_RANK *dirs;
+	struct HEAT_RANK *pins;
+	struct HEAT_RANK *frees;
+	const struct HEAT *h;
+	int nfiles, ndirs, npins, nfrees;
+	double score;
+	double hot;
+	time_t now;
+	int i, j;
+
+	files = (struct HEAT_RANK*)malloc(4*HEAT_SETS*HEAT_WAYS
+				*sizeof(struct HEAT_RANK));
+	if (!files)
+		return;
+	dirs = &files[HEAT_SETS*HEAT_WAYS];
+	pins = &dirs[HEAT_SETS*HEAT_WAYS];
+	frees = &pins[HEAT_SETS*HEAT_WAYS];
+	nfiles = ndirs = npins = nfrees = 0;
+	now = time((time_t*)NULL);
+	hot = (autopin_score > 0 ? autopin_score : 8.0);
+	pthread_mutex_lock(&heat_lock);
+	for (i=0; i<HEAT_SETS; i++)
+		for (j=0; j<HEAT_WAYS; j++) {
+			h = &heats[i][j];
+			if (!h->mref)
+				continue;
+			score = decayed(h, now);
+			if (h->flags & HEAT_DIR) {
+				dirs[ndirs].h = h;
+				dirs[ndirs++].score = score;
+			} else {
+				files[nfiles].h = h;
+				files[nfiles++].score = score;
+				if ((score >= hot)
+				    && !(h->flags & HEAT_PINNED)) {
+					pins[npins].h = h;
+					pins[npins++].score = score;
+				}
+				if ((score < FREE_SCORE)
+				    && !(h->flags
+					& (HEAT_PINNED | HEAT_OFFLINE))) {
+					frees[nfrees].h = h;
+					frees[nfrees++].score = score;
+				}
+			}
+		}
+	if (nfiles)
+		fprintf(f, "heat : %d files %d directories tracked,"
+				" %llu pinned %llu unpinned automatically\n",
+			nfiles, ndirs,
+			(unsigned long long)autopinned,
+			(unsigned long long)autounpinned);
+	qsort(files, nfiles, sizeof(struct HEAT_RANK), compare_ranks);
+	qsort(dirs, ndirs, sizeof(struct HEAT_RANK), compare_ranks);
+	qsort(pins, npins, sizeof(struct HEAT_RANK), compare_ranks);
+	qsort(frees, nfrees, sizeof(struct HEAT_RANK), compare_ranks);
+	report_ranks(f, "hottest files (inode parent score flags name)",
+			files, nfiles, FALSE);
+	report_ranks(f, "hottest directories", dirs, ndirs, FALSE);
+	report_ranks(f, "suggested to pin", pins, npins, FALSE);
+	report_ranks(f, "suggested to free", &frees[nfrees - 1], nfrees,
+			TRUE);
+	pthread_mutex_unlock(&heat_lock);
+	free(files);
+}
+
+static void __attribute__((destructor)) heat_exit(void)
+{
+	pthread_mutex_lock(&heat_lock);
+	save_heats();
+	pthread_mutex_unlock(&heat_lock);
+}
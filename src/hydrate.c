@@ -0,0 +1,233 @@
+/*
+ * hydrate.c - Fetching the contents of OneDrive files stored in the cloud
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	When the environment variable ONEDRIVE_HYDRATE_SOCKET designates
+ *	a Unix socket, the files which have no local data can be opened
+ *	for reading, and their contents are requested from the service
+ *	listening on the socket (see hydrate.h for the protocol). The
+ *	service may be the local emulator from the bench directory.
+ *
+ *	A single connection is kept open, and reopened once when a
+ *	request fails because of the connection.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <ntfs-3g/types.h>
+#include <ntfs-3g/layout.h>
+#include <ntfs-3g/logging.h>
+
+#include "hydrate.h"
+#include "onedrive.h"
+
+#define HYDRATE_TIMEOUT 30	/* seconds */
+#define MAX_ERRNO 4095		/* highest status accepted */
+
+static struct sockaddr_un hydrate_addr;
+static BOOL hydrate_on = FALSE;
+static int hydrate_fd = -1;
+
+/*
+ *		Get the socket of the service from the environment
+ */
+
+void onedrive_hydrate_init(void)
+{
+	const char *path;
+
+	path = getenv("ONEDRIVE_HYDRATE_SOCKET");
+	if (path && path[0]) {
+		if (strlen(path) < sizeof(hydrate_addr.sun_path)) {
+			hydrate_addr.sun_family = AF_UNIX;
+			strcpy(hydrate_addr.sun_path, path);
+			hydrate_on = TRUE;
+			ntfs_log_info("OneDrive files fetched from %s\n",
+					path);
+		} else
+			ntfs_log_error("OneDrive hydration socket name"
+					" too long\n");
+	}
+}
+
+BOOL onedrive_hydrate_enabled(void)
+{
+	return (hydrate_on);
+}
+
+static void hydrate_disconnect(void)
+{
+	if (hydrate_fd >= 0) {
+		close(hydrate_fd);
+		hydrate_fd = -1;
+	}
+}
+
+static int hydrate_connect(void)
+{
+	struct timeval tv;
+	int fd;
+
+	if (hydrate_fd < 0) {
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd >= 0) {
+			tv.tv_sec = HYDRATE_TIMEOUT;
+			tv.tv_usec = 0;
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO,
+					&tv, sizeof(tv));
+			setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO,
+					&tv, sizeof(tv));
+			if (connect(fd, (struct sockaddr*)&hydrate_addr,
+					sizeof(hydrate_addr))) {
+				close(fd);
+				fd = -1;
+			}
+		}
+		hydrate_fd = fd;
+	}
+	return (hydrate_fd);
+}
+
+/*
+ *		Send or receive a full buffer
+ *
+ *	Returns zero or -1 (with errno set) if the connection failed
+ */
+
+static int hydrate_xfer(char *buf, size_t size, BOOL out)
+{
+	ssize_t n;
+
+	while (size > 0) {
+		if (out)
+			n = send(hydrate_fd, buf, size, MSG_NOSIGNAL);
+		else
+			n = recv(hydrate_fd, buf, size, 0);
+		if (n <= 0) {
+			if (!n)
+				errno = ECONNRESET;
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		buf += n;
+		size -= n;
+	}
+	return (0);
+}
+
+/*
+ *		Issue a single request and get its reply
+ *
+ *	Returns the count of bytes received, or a negative error code.
+ *	The connection is dropped when it is out of sync, or when the
+ *	status is not a valid error number.
+ */
+
+static int hydrate_request(const GUID *guid, char *buf, size_t size,
+			off_t offset)
+{
+	struct ONEDRIVE_HYDRATE_REQUEST req;
+	struct ONEDRIVE_HYDRATE_REPLY reply;
+
+	if (hydrate_connect() < 0)
+		return (-EREMOTE);
+	req.magic = ONEDRIVE_HYDRATE_MAGIC;
+	req.size = size;
+	req.offset = offset;
+	memcpy(req.guid, guid, sizeof(req.guid));
+	if (hydrate_xfer((char*)&req, sizeof(req), TRUE)
+	    || hydrate_xfer((char*)&reply, sizeof(reply), FALSE)) {
+		hydrate_disconnect();
+		return (-ECONNRESET);
+	}
+	if ((reply.magic != ONEDRIVE_HYDRATE_MAGIC)
+	    || (reply.status < 0) || (reply.status > MAX_ERRNO)
+	    || (!reply.status && (reply.size > size))) {
+		hydrate_disconnect();
+		return (-EIO);
+	}
+	if (reply.status)
+		return (-reply.status);
+	if (hydrate_xfer(buf, reply.size, FALSE)) {
+		hydrate_disconnect();
+		return (-ECONNRESET);
+	}
+	return (reply.size);
+}
+
+/*
+ *		Read a range of a file stored in the cloud
+ *
+ *	The caller has limited the range to the file size.
+ *	Returns the count of bytes read or a negative error code.
+ */
+
+int onedrive_hydrate_read(const GUID *guid, char *buf, size_t size,
+			off_t offset)
+{
+	size_t total;
+	size_t chunk;
+	int retried;
+	int res;
+
+	total = 0;
+	retried = 0;
+	res = 0;
+	while ((total < size) && (res >= 0)) {
+		chunk = size - total;
+		if (chunk > ONEDRIVE_HYDRATE_MAX)
+			chunk = ONEDRIVE_HYDRATE_MAX;
+		res = hydrate_request(guid, buf + total, chunk,
+				offset + total);
+		if ((res == -ECONNRESET) && !retried) {
+			retried = 1;
+			res = 0;
+		} else
+			if (res > 0)
+				total += res;
+			else
+				if (!res)
+					break;	/* end of file */
+	}
+	if (res < 0) {
+		ntfs_log_error("OneDrive could not fetch %lld bytes at"
+				" %lld : %s\n", (long long)size,
+				(long long)offset, strerror(-res));
+		return (res == -ECONNRESET ? -EREMOTE : res);
+	}
+	return (total);
+}
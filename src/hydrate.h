@@ -0,0 +1,72 @@
+/*
+ * hydrate.h - Protocol for fetching the contents of OneDrive placeholders
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ONEDRIVE_HYDRATE_H
+#define _ONEDRIVE_HYDRATE_H
+
+/*
+ *	The contents of files which are only stored in the cloud are
+ *	requested from a local service over a Unix stream socket. A
+ *	file is designated by the GUID from its reparse point, and a
+ *	request asks for a byte range. The reply header is followed by
+ *	"size" bytes of data, which may be fewer than requested at the
+ *	end of the file.
+ *
+ *	Both ends are on the same host, so the fields are in host order.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define ONEDRIVE_HYDRATE_MAGIC 0x5948444f	/* "ODHY" */
+#define ONEDRIVE_HYDRATE_MAX 0x100000		/* max size of a request */
+
+struct ONEDRIVE_HYDRATE_REQUEST {
+	uint32_t magic;
+	uint32_t size;		/* count of bytes requested */
+	uint64_t offset;
+	uint8_t guid[16];	/* as stored in the reparse point */
+} ;
+
+struct ONEDRIVE_HYDRATE_REPLY {
+	uint32_t magic;
+	int32_t status;		/* zero or an errno value */
+	uint32_t size;		/* count of bytes following */
+	uint32_t reserved;
+} ;
+
+/*
+ *		Format a GUID the usual way, which is how the service
+ *	names the files it holds.
+ *
+ *	The buffer must have room for 37 bytes.
+ */
+
+static inline void onedrive_guid_string(const uint8_t guid[16], char *buf)
+{
+	sprintf(buf, "%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+		(unsigned int)(guid[0] | (guid[1] << 8) | (guid[2] << 16)
+			| ((uint32_t)guid[3] << 24)),
+		(unsigned int)(guid[4] | (guid[5] << 8)),
+		(unsigned int)(guid[6] | (guid[7] << 8)),
+		guid[8], guid[9], guid[10], guid[11],
+		guid[12], guid[13], guid[14], guid[15]);
+}
+
+#endif /* _ONEDRIVE_HYDRATE_H */
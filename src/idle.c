@@ -0,0 +1,520 @@
+/*
+ * idle.c - Background maintenance of the OneDrive directories
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	When the environment variable ONEDRIVE_COMPACT_FILL is set to a
+ *	percentage, the directories which are read are remembered, and
+ *	once one has not been read for ONEDRIVE_COMPACT_IDLE seconds
+ *	(default 60), its index is compacted if its blocks are filled
+ *	below the percentage (see compact.c).
+ *
+ *	libntfs-3g cannot be used by another thread, so the maintenance
+ *	is run from an operation, which it delays. It is only run when no
+ *	operation went through the plugin for ONEDRIVE_IDLE_QUIET seconds
+ *	(default 10), a single task per quiet period, and never on the
+ *	inode of the operation nor on its parent directories, which
+ *	ntfs-3g may have open. The directories whose index allocation
+ *	exceeds ONEDRIVE_COMPACT_MAX_KB (default 1024) are left for
+ *	onedrive-maint, so that the delay stays short. A directory is
+ *	compacted at most once every COMPACT_INTERVAL. A directory which
+ *	was checked is not checked again before COMPACT_RECHECK, and only
+ *	if it was read in the meantime. The last COMPACT_RESULTS
+ *	compactions are shown in the statistics report.
+ *
+ *	When ONEDRIVE_RECOMPRESS_DAYS is set, the cold files of the sync
+ *	root whose data was not changed for that count of days are
+ *	compressed (see compress.c), provided this saves at least
+ *	ONEDRIVE_RECOMPRESS_SAVING percent (default 25) of their clusters.
+ *	This runs on the same quiet periods as the compaction, and the
+ *	files which would take more than ONEDRIVE_RECOMPRESS_BUDGET_MS
+ *	(default 250) to compress, estimated from the throughput of the
+ *	previous compressions, or which are larger than
+ *	ONEDRIVE_RECOMPRESS_MAX_MB (default 64), are left for
+ *	onedrive-maint. The files in the directories of the current
+ *	operation are skipped, as closing them updates the directory.
+ *	The name index is scanned RECOMPRESS_SCAN names at a time, at
+ *	most once every RECOMPRESS_INTERVAL, so that a single file is
+ *	compressed per run, and the scan restarts after RECOMPRESS_RESCAN
+ *	once all the names were seen.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <ntfs-3g/types.h>
+#include <ntfs-3g/layout.h>
+#include <ntfs-3g/volume.h>
+#include <ntfs-3g/inode.h>
+#include <ntfs-3g/attrib.h>
+#include <ntfs-3g/ntfstime.h>
+#include <ntfs-3g/logging.h>
+
+#include "onedrive.h"
+#include "compact.h"
+#include "names.h"
+#include "compress.h"
+
+#define DEFAULT_IDLE_QUIET 10		/* seconds */
+#define DEFAULT_COMPACT_IDLE 60		/* seconds */
+#define DEFAULT_COMPACT_MAX_KB 1024
+#define COMPACT_INTERVAL 10		/* seconds */
+#define COMPACT_RECHECK 3600		/* seconds */
+#define COMPACT_SLOTS 64
+#define COMPACT_RESULTS 16
+#define DEFAULT_RECOMPRESS_SAVING 25	/* percent */
+#define DEFAULT_RECOMPRESS_MAX_MB 64
+#define DEFAULT_RECOMPRESS_BUDGET 250	/* ms */
+#define DEFAULT_RECOMPRESS_RATE 16	/* MB/s, until measured */
+#define RECOMPRESS_INTERVAL 10		/* seconds */
+#define RECOMPRESS_SCAN 512		/* names checked per run */
+#define RECOMPRESS_RESCAN 86400		/* seconds */
+#define RECOMPRESS_RESULTS 16
+#define SKIPPED_ATTRIBUTES (FILE_ATTR_OFFLINE | FILE_ATTR_COMPRESSED \
+			| FILE_ATTR_ENCRYPTED | FILE_ATTR_SPARSE_FILE)
+
+struct COMPACT_CANDIDATE {
+	MFT_REF mref;
+	time_t last_read;
+	time_t checked;
+} ;
+
+static ntfschar I30[] = {
+	const_cpu_to_le16('$'), const_cpu_to_le16('I'),
+	const_cpu_to_le16('3'), const_cpu_to_le16('0')
+} ;
+
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static int idle_quiet = DEFAULT_IDLE_QUIET;
+static int compact_fill = 0;
+static int compact_idle = DEFAULT_COMPACT_IDLE;
+static s64 compact_max = (s64)DEFAULT_COMPACT_MAX_KB << 10;
+static struct COMPACT_CANDIDATE candidates[COMPACT_SLOTS];
+static int candidate_count = 0;
+static time_t compacted = 0;
+static struct ONEDRIVE_COMPACTION results[COMPACT_RESULTS];
+static int result_count = 0;
+static u64 checks = 0;
+static u64 failures = 0;
+static u64 too_large = 0;		/* left for onedrive-maint */
+static int recompress_days = 0;
+static int recompress_saving = DEFAULT_RECOMPRESS_SAVING;
+static s64 recompress_max = (s64)DEFAULT_RECOMPRESS_MAX_MB << 20;
+static u64 recompress_budget_ns = (u64)DEFAULT_RECOMPRESS_BUDGET*1000000;
+static u64 recompress_bytes = 0;	/* measuring the throughput */
+static u64 recompress_ns = 0;
+static u32 recompress_cursor = 0;
+static time_t recompressed = 0;
+static time_t recompress_pass = 0;	/* when the last scan ended */
+static struct ONEDRIVE_COMPRESSION compressions[RECOMPRESS_RESULTS];
+static int compression_count = 0;
+static u64 recompress_checks = 0;
+static u64 recompress_failures = 0;
+static u64 recompress_skipped = 0;	/* left for onedrive-maint */
+static s64 recompress_saved = 0;	/* bytes */
+
+void onedrive_idle_init(void)
+{
+	const char *value;
+
+	value = getenv("ONEDRIVE_IDLE_QUIET");
+	if (value && value[0] && (atoi(value) >= 0))
+		idle_quiet = atoi(value);
+	value = getenv("ONEDRIVE_COMPACT_FILL");
+	if (value && value[0]) {
+		compact_fill = atoi(value);
+		if ((compact_fill < 0) || (compact_fill > 100))
+			compact_fill = 0;
+	}
+	value = getenv("ONEDRIVE_COMPACT_IDLE");
+	if (value && value[0])
+		compact_idle = atoi(value);
+	value = getenv("ONEDRIVE_COMPACT_MAX_KB");
+	if (value && (atol(value) > 0))
+		compact_max = (s64)atol(value) << 10;
+	value = getenv("ONEDRIVE_RECOMPRESS_DAYS");
+	if (value && (atoi(value) > 0))
+		recompress_days = atoi(value);
+	value = getenv("ONEDRIVE_RECOMPRESS_SAVING");
+	if (value && value[0]) {
+		recompress_saving = atoi(value);
+		if ((recompress_saving < 0) || (recompress_saving > 100))
+			recompress_saving = DEFAULT_RECOMPRESS_SAVING;
+	}
+	value = getenv("ONEDRIVE_RECOMPRESS_MAX_MB");
+	if (value && (atoi(value) > 0))
+		recompress_max = (s64)atoi(value) << 20;
+	value = getenv("ONEDRIVE_RECOMPRESS_BUDGET_MS");
+	if (value && (atoi(value) > 0))
+		recompress_budget_ns = (u64)atoi(value)*1000000;
+}
+
+/*
+ *		Remember that a directory was read
+ *
+ *	When the table is full, the directory read least recently is
+ *	forgotten.
+ */
+
+void onedrive_idle_readdir(ntfs_inode *ni)
+{
+	struct COMPACT_CANDIDATE *pc;
+	MFT_REF mref;
+	time_t now;
+	int i;
+
+	if (compact_fill && !NVolReadOnly(ni->vol)) {
+		mref = MK_MREF(ni->mft_no, le16_to_cpu(ni->mrec->sequence_number));
+		now = time((time_t*)NULL);
+		pthread_mutex_lock(&idle_lock);
+		pc = (struct COMPACT_CANDIDATE*)NULL;
+		for (i=0; (i<candidate_count) && !pc; i++)
+			if (candidates[i].mref == mref)
+				pc = &candidates[i];
+		if (!pc) {
+			if (candidate_count < COMPACT_SLOTS)
+				pc = &candidates[candidate_count++];
+			else {
+				pc = &candidates[0];
+				for (i=1; i<COMPACT_SLOTS; i++)
+					if (candidates[i].last_read
+							< pc->last_read)
+						pc = &candidates[i];
+			}
+			pc->mref = mref;
+			pc->checked = 0;
+		}
+		pc->last_read = now;
+		pthread_mutex_unlock(&idle_lock);
+	}
+}
+
+/*
+ *		Check whether an inode is a parent directory of another one
+ */
+
+static BOOL is_parent(ntfs_inode *ni, MFT_REF mref)
+{
+	ntfs_attr_search_ctx *ctx;
+	const FILE_NAME_ATTR *fn;
+	BOOL parent;
+
+	parent = FALSE;
+	ctx = ntfs_attr_get_search_ctx(ni, (MFT_RECORD*)NULL);
+	if (!ctx)
+		return (TRUE);		/* cannot tell, assume it is */
+	while (!parent
+	    && !ntfs_attr_lookup(AT_FILE_NAME, (ntfschar*)NULL, 0,
+			CASE_SENSITIVE, 0, (u8*)NULL, 0, ctx)) {
+		fn = (const FILE_NAME_ATTR*)((const char*)ctx->attr
+				+ le16_to_cpu(ctx->attr->value_offset));
+		if (MREF_LE(fn->parent_directory) == MREF(mref))
+			parent = TRUE;
+	}
+	ntfs_attr_put_search_ctx(ctx);
+	return (parent);
+}
+
+/*
+ *		Get the size of the index allocation of a directory
+ */
+
+static s64 index_size(ntfs_inode *dir_ni)
+{
+	ntfs_attr *na;
+	s64 size;
+
+	size = 0;
+	na = ntfs_attr_open(dir_ni, AT_INDEX_ALLOCATION, I30, 4);
+	if (na) {
+		size = na->allocated_size;
+		ntfs_attr_close(na);
+	}
+	return (size);
+}
+
+/*
+ *		Record a compaction for the report
+ */
+
+static void record_compaction(const struct ONEDRIVE_COMPACTION *result)
+{
+	ntfs_log_info("OneDrive compacted the index of inode %lld from %u"
+			" to %u blocks\n", (long long)result->mft_no,
+			result->blocks_before, result->blocks_after);
+	if (result_count < COMPACT_RESULTS)
+		result_count++;
+	memmove(&results[1], &results[0],
+		(result_count - 1)*sizeof(struct ONEDRIVE_COMPACTION));
+	results[0] = *result;
+}
+
+/*
+ *		Check a directory and compact its index if needed
+ */
+
+static void compact(ntfs_volume *vol, struct COMPACT_CANDIDATE *pc)
+{
+	struct ONEDRIVE_COMPACTION result;
+	ntfs_inode *dir_ni;
+
+	checks++;
+	dir_ni = ntfs_inode_open(vol, pc->mref);
+	if (dir_ni) {
+		if (index_size(dir_ni) > compact_max)
+			too_large++;
+		else
+			if (onedrive_compact_index(dir_ni, compact_fill,
+					FALSE, &result))
+				failures++;
+			else
+				if (result.compacted)
+					record_compaction(&result);
+		ntfs_inode_close(dir_ni);
+	}
+}
+
+/*
+ *		Estimate the time needed to compress some data
+ */
+
+static u64 estimate_ns(s64 size)
+{
+	if (recompress_bytes && recompress_ns)
+		return ((double)size*recompress_ns/recompress_bytes);
+	return ((double)size*1000/DEFAULT_RECOMPRESS_RATE/1.048576);
+}
+
+/*
+ *		Check whether a file is worth compressing
+ *
+ *	A file which would take too long is counted as skipped.
+ */
+
+static BOOL compressible(ntfs_volume *vol, MFT_REF mref, time_t now)
+{
+	ntfs_inode *ni;
+	struct timespec changed;
+	s64 unit_size;
+	BOOL ok;
+
+	ok = FALSE;
+	ni = ntfs_inode_open(vol, mref);
+	if (ni) {
+		changed = ntfs2timespec(ni->last_data_change_time);
+		unit_size = (s64)vol->cluster_size
+					<< STANDARD_COMPRESSION_UNIT;
+		ok = !(ni->flags & SKIPPED_ATTRIBUTES)
+			&& ((now - changed.tv_sec)
+				>= (time_t)recompress_days*86400)
+			&& (ni->data_size >= 2*unit_size);
+		if (ok && ((ni->data_size > recompress_max)
+			    || (estimate_ns(ni->data_size)
+					> recompress_budget_ns))) {
+			recompress_skipped++;
+			ok = FALSE;
+		}
+		ntfs_inode_close(ni);
+	}
+	return (ok);
+}
+
+/*
+ *		Compress the next cold file found in the name index
+ *
+ *	"ni" is the inode being used by the current operation, neither
+ *	it nor the files in its directories are compressed.
+ */
+
+static void recompress(ntfs_inode *ni, time_t now)
+{
+	struct ONEDRIVE_NAME_INFO info;
+	struct ONEDRIVE_COMPRESSION result;
+	MFT_REF mref;
+	BOOL found;
+	int n;
+
+	found = FALSE;
+	mref = 0;
+	if (onedrive_names_lock()) {
+		for (n=0; (n<RECOMPRESS_SCAN) && !found; n++) {
+			if (!onedrive_names_next(&recompress_cursor, &info)) {
+				recompress_pass = now;
+				break;
+			}
+			if (!(info.flags & ONEDRIVE_NAME_DIR)
+			    && !(info.attributes
+				& le32_to_cpu(SKIPPED_ATTRIBUTES))
+			    && (MREF(info.mref) != ni->mft_no)
+			    && (MREF(info.parent) != ni->mft_no)
+			    && !is_parent(ni, info.parent)) {
+				mref = info.mref;
+				found = TRUE;
+			}
+		}
+		onedrive_names_unlock();
+	}
+	if (found
+	    && !onedrive_file_is_open(MREF(mref))
+	    && onedrive_heat_cold(ni->vol, mref)
+	    && compressible(ni->vol, mref, now)) {
+		recompress_checks++;
+		if (onedrive_compress_file(ni->vol, mref, recompress_saving,
+				FALSE, &result))
+			recompress_failures++;
+		else
+			if (result.compressed) {
+				recompress_bytes += result.data_size;
+				recompress_ns += result.total_ns;
+				ntfs_log_info("OneDrive compressed inode %lld"
+					" from %lld to %lld clusters\n",
+					(long long)result.mft_no,
+					(long long)result.clusters_before,
+					(long long)result.clusters_after);
+				recompress_saved += (result.clusters_before
+						- result.clusters_after)
+						*ni->vol->cluster_size;
+				if (compression_count < RECOMPRESS_RESULTS)
+					compression_count++;
+				memmove(&compressions[1], &compressions[0],
+					(compression_count - 1)
+					*sizeof(struct ONEDRIVE_COMPRESSION));
+				compressions[0] = result;
+			}
+	}
+}
+
+/*
+ *		Run the maintenance which is due
+ *
+ *	"ni" is the inode being used by the current operation, neither
+ *	it nor its parent directories are changed. A single task is run,
+ *	and only when no other operation went through the plugin for a
+ *	while.
+ */
+
+void onedrive_idle_run(ntfs_inode *ni)
+{
+	struct COMPACT_CANDIDATE *pc;
+	time_t now;
+	BOOL done;
+	int i;
+
+	if ((!compact_fill && !recompress_days)
+	    || NVolReadOnly(ni->vol)
+	    || (onedrive_quiet_ns() < (u64)idle_quiet*1000000000))
+		return;
+	done = FALSE;
+	now = time((time_t*)NULL);
+	if (compact_fill
+	    && ((now - compacted) >= COMPACT_INTERVAL)
+	    && !pthread_mutex_trylock(&idle_lock)) {
+		pc = (struct COMPACT_CANDIDATE*)NULL;
+		for (i=0; (i<candidate_count) && !pc; i++)
+			if ((candidates[i].last_read > candidates[i].checked)
+			    && ((now - candidates[i].last_read)
+					>= compact_idle)
+			    && ((now - candidates[i].checked)
+					>= COMPACT_RECHECK)
+			    && (MREF(candidates[i].mref) != ni->mft_no)
+			    && !is_parent(ni, candidates[i].mref))
+				pc = &candidates[i];
+		if (pc) {
+			compacted = now;
+			pc->checked = now;
+			compact(ni->vol, pc);
+			done = TRUE;
+		}
+		pthread_mutex_unlock(&idle_lock);
+	}
+	if (recompress_days && !done
+	    && ((now - recompressed) >= RECOMPRESS_INTERVAL)
+	    && ((now - recompress_pass) >= RECOMPRESS_RESCAN)
+	    && !pthread_mutex_trylock(&idle_lock)) {
+		recompressed = now;
+		recompress(ni, now);
+		pthread_mutex_unlock(&idle_lock);
+	}
+}
+
+void onedrive_idle_report(FILE *f)
+{
+	const struct ONEDRIVE_COMPACTION *pr;
+	const struct ONEDRIVE_COMPRESSION *pc;
+	int i;
+
+	pthread_mutex_lock(&idle_lock);
+	if (checks) {
+		fprintf(f, "compaction : %llu directories checked,"
+			" %llu failures, %llu left for onedrive-maint\n",
+			(unsigned long long)checks,
+			(unsigned long long)failures,
+			(unsigned long long)too_large);
+		if (result_count)
+			fprintf(f, "%-12s %8s %13s %11s %15s %19s\n",
+				"inode", "entries", "blocks", "fill %",
+				"allocated KB", "readdir us");
+	}
+	for (i=0; i<result_count; i++) {
+		pr = &results[i];
+		fprintf(f, "%-12llu %8u %6u>%-6u %5d>%-5d %7lld>%-7lld"
+			" %9llu>%-9llu\n",
+			(unsigned long long)pr->mft_no, pr->entries,
+			pr->blocks_before, pr->blocks_after,
+			pr->fill_before, pr->fill_after,
+			(long long)(pr->allocated_before >> 10),
+			(long long)(pr->allocated_after >> 10),
+			(unsigned long long)(pr->readdir_ns_before/1000),
+			(unsigned long long)(pr->readdir_ns_after/1000));
+	}
+	if (recompress_checks || recompress_skipped) {
+		fprintf(f, "recompression : %llu files checked,"
+			" %llu failures, %llu left for onedrive-maint,"
+			" %lld KB saved\n",
+			(unsigned long long)recompress_checks,
+			(unsigned long long)recompress_failures,
+			(unsigned long long)recompress_skipped,
+			(long long)(recompress_saved >> 10));
+		if (compression_count)
+			fprintf(f, "%-12s %10s %17s %13s %9s\n",
+				"inode", "size KB", "clusters",
+				"units c/z", "ms");
+	}
+	for (i=0; i<compression_count; i++) {
+		pc = &compressions[i];
+		fprintf(f, "%-12llu %10lld %8lld>%-8lld %6u/%-6u %9.1f\n",
+			(unsigned long long)pc->mft_no,
+			(long long)(pc->data_size >> 10),
+			(long long)pc->clusters_before,
+			(long long)pc->clusters_after,
+			pc->units_compressed, pc->units_zero,
+			pc->total_ns/1000000.0);
+	}
+	pthread_mutex_unlock(&idle_lock);
+}
@@ -0,0 +1,326 @@
+/*
+ * iostat.c - Accounting of the device I/O caused by the OneDrive plugin
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	The device operations of the volume are replaced by wrappers
+ *	which charge each read or write to the plugin operation being
+ *	run by the thread, so that the bytes requested by applications
+ *	can be compared to the bytes actually read or written on the
+ *	device (partial cluster updates, decompression, MFT updates...).
+ *
+ *	ntfs-3g updates the MFT record of the inode after the plugin
+ *	returns, so the I/O done by the same thread after an operation
+ *	ended is charged to that operation, until another one begins or
+ *	TRAILING_NS has elapsed. The rest is reported as done outside
+ *	of plugin operations.
+ *
+ *	The files causing most device I/O are kept in a small table, the
+ *	file with the least I/O being evicted when a new file comes in.
+ *
+ *	The wrappers are never removed : ntfs-3g unloads the plugins
+ *	after the volume has been unmounted.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <ntfs-3g/types.h>
+#include <ntfs-3g/layout.h>
+#include <ntfs-3g/device.h>
+#include <ntfs-3g/device_io.h>
+#include <ntfs-3g/volume.h>
+#include <ntfs-3g/inode.h>
+
+#include "onedrive.h"
+
+#define TRAILING_NS 10000000	/* 10ms */
+#define FILE_SLOTS 64		/* files kept for the report */
+#define FILE_REPORT 10		/* files shown in the report */
+
+struct FILE_IO {
+	u64 mft_no;
+	s64 app_bytes;
+	s64 dev_read_bytes;
+	s64 dev_write_bytes;
+} ;
+
+struct TRAILING {
+	enum ONEDRIVE_OPS type;
+	u64 mft_no;
+	struct timespec end;
+	BOOL active;
+} ;
+
+static pthread_mutex_t iostat_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ntfs_device_operations hooked_ops;
+static struct ntfs_device_operations *real_ops;
+static struct ntfs_device *hooked_dev = (struct ntfs_device*)NULL;
+
+static struct FILE_IO files[FILE_SLOTS];
+static int file_count = 0;
+static u64 outside_reads = 0;
+static u64 outside_writes = 0;
+static s64 outside_read_bytes = 0;
+static s64 outside_write_bytes = 0;
+
+static __thread struct TRAILING trailing;
+
+/*
+ *		Add to the I/O of a file, evicting the least active one
+ *	if there is no room.
+ */
+
+static void charge_file(u64 mft_no, s64 app, s64 rd, s64 wr)
+{
+	struct FILE_IO *fio;
+	struct FILE_IO *low;
+	int i;
+
+	if (!mft_no)
+		return;
+	fio = (struct FILE_IO*)NULL;
+	for (i=0; (i<file_count) && !fio; i++)
+		if (files[i].mft_no == mft_no)
+			fio = &files[i];
+	if (!fio) {
+		if (file_count < FILE_SLOTS)
+			fio = &files[file_count++];
+		else {
+			low = &files[0];
+			for (i=1; i<FILE_SLOTS; i++)
+				if ((files[i].dev_read_bytes
+					+ files[i].dev_write_bytes)
+				    < (low->dev_read_bytes
+					+ low->dev_write_bytes))
+					low = &files[i];
+			fio = low;
+		}
+		memset(fio, 0, sizeof(struct FILE_IO));
+		fio->mft_no = mft_no;
+	}
+	fio->app_bytes += app;
+	fio->dev_read_bytes += rd;
+	fio->dev_write_bytes += wr;
+}
+
+/*
+ *		Charge a device read or write
+ */
+
+static void charge(BOOL write, s64 bytes)
+{
+	struct ONEDRIVE_OP *op;
+
+	if (bytes <= 0)
+		return;
+	op = onedrive_current_op();
+	if (op) {
+		if (write) {
+			op->dev_writes++;
+			op->dev_write_bytes += bytes;
+		} else {
+			op->dev_reads++;
+			op->dev_read_bytes += bytes;
+		}
+	} else {
+		if (trailing.active
+		    && (onedrive_elapsed_ns(&trailing.end) < TRAILING_NS)) {
+			onedrive_stats_trailing_io(trailing.type, write, bytes);
+			pthread_mutex_lock(&iostat_lock);
+			charge_file(trailing.mft_no, 0,
+				(write ? 0 : bytes), (write ? bytes : 0));
+			pthread_mutex_unlock(&iostat_lock);
+		} else {
+			trailing.active = FALSE;
+			pthread_mutex_lock(&iostat_lock);
+			if (write) {
+				outside_writes++;
+				outside_write_bytes += bytes;
+			} else {
+				outside_reads++;
+				outside_read_bytes += bytes;
+			}
+			pthread_mutex_unlock(&iostat_lock);
+		}
+	}
+}
+
+static s64 hook_read(struct ntfs_device *dev, void *buf, s64 count)
+{
+	s64 res;
+
+	res = real_ops->read(dev, buf, count);
+	charge(FALSE, res);
+	return (res);
+}
+
+static s64 hook_write(struct ntfs_device *dev, const void *buf, s64 count)
+{
+	s64 res;
+
+	res = real_ops->write(dev, buf, count);
+	charge(TRUE, res);
+	return (res);
+}
+
+static s64 hook_pread(struct ntfs_device *dev, void *buf, s64 count,
+			s64 offset)
+{
+	s64 res;
+
+	res = real_ops->pread(dev, buf, count, offset);
+	charge(FALSE, res);
+	return (res);
+}
+
+static s64 hook_pwrite(struct ntfs_device *dev, const void *buf, s64 count,
+			s64 offset)
+{
+	s64 res;
+
+	res = real_ops->pwrite(dev, buf, count, offset);
+	charge(TRUE, res);
+	return (res);
+}
+
+/*
+ *		Insert the wrappers, on the first operation
+ */
+
+static void hook_device(struct ntfs_device *dev)
+{
+	pthread_mutex_lock(&iostat_lock);
+	if (!hooked_dev && dev && dev->d_ops) {
+		real_ops = dev->d_ops;
+		hooked_ops = *real_ops;
+		if (real_ops->read)
+			hooked_ops.read = hook_read;
+		if (real_ops->write)
+			hooked_ops.write = hook_write;
+		if (real_ops->pread)
+			hooked_ops.pread = hook_pread;
+		if (real_ops->pwrite)
+			hooked_ops.pwrite = hook_pwrite;
+		dev->d_ops = &hooked_ops;
+		hooked_dev = dev;
+	}
+	pthread_mutex_unlock(&iostat_lock);
+}
+
+void onedrive_iostat_begin(struct ONEDRIVE_OP *op __attribute__((unused)),
+			ntfs_inode *ni)
+{
+	if (!hooked_dev && ni && ni->vol)
+		hook_device(ni->vol->dev);
+	trailing.active = FALSE;
+}
+
+void onedrive_iostat_end(const struct ONEDRIVE_OP *op)
+{
+	if (!op->outer) {
+		trailing.type = op->type;
+		trailing.mft_no = op->mft_no;
+		clock_gettime(CLOCK_MONOTONIC, &trailing.end);
+		trailing.active = TRUE;
+	}
+	pthread_mutex_lock(&iostat_lock);
+	charge_file(op->mft_no, op->app_bytes,
+			op->dev_read_bytes, op->dev_write_bytes);
+	pthread_mutex_unlock(&iostat_lock);
+}
+
+/*
+ *		Get the file descriptor of the device
+ *
+ *	Returns -1 if the device is not accessed through a file descriptor
+ */
+
+int onedrive_device_fd(struct ntfs_device *dev)
+{
+	struct ntfs_device_operations *dops;
+
+	dops = (dev->d_ops == &hooked_ops ? real_ops : dev->d_ops);
+	if ((dops != &ntfs_device_default_io_ops) || !dev->d_private)
+		return (-1);
+	return (*(int*)dev->d_private);
+}
+
+static int compare_files(const void *p1, const void *p2)
+{
+	const struct FILE_IO *f1 = (const struct FILE_IO*)p1;
+	const struct FILE_IO *f2 = (const struct FILE_IO*)p2;
+	s64 d1, d2;
+
+	d1 = f1->dev_read_bytes + f1->dev_write_bytes;
+	d2 = f2->dev_read_bytes + f2->dev_write_bytes;
+	return ((d1 < d2) - (d1 > d2));
+}
+
+void onedrive_iostat_report(FILE *f)
+{
+	struct FILE_IO snap[FILE_SLOTS];
+	int count;
+	int i;
+
+	pthread_mutex_lock(&iostat_lock);
+	count = file_count;
+	memcpy(snap, files, count*sizeof(struct FILE_IO));
+	fprintf(f, "outside plugin : %llu reads %lld bytes,"
+			" %llu writes %lld bytes\n",
+		(unsigned long long)outside_reads,
+		(long long)outside_read_bytes,
+		(unsigned long long)outside_writes,
+		(long long)outside_write_bytes);
+	pthread_mutex_unlock(&iostat_lock);
+
+	qsort(snap, count, sizeof(struct FILE_IO), compare_files);
+	if (count > FILE_REPORT)
+		count = FILE_REPORT;
+	if (count)
+		fprintf(f, "%-12s %12s %12s %12s %6s\n", "inode",
+			"app_bytes", "dev_read", "dev_write", "amp");
+	for (i=0; i<count; i++) {
+		if (snap[i].app_bytes > 0)
+			fprintf(f, "%-12llu %12lld %12lld %12lld %6.2f\n",
+				(unsigned long long)snap[i].mft_no,
+				(long long)snap[i].app_bytes,
+				(long long)snap[i].dev_read_bytes,
+				(long long)snap[i].dev_write_bytes,
+				(double)(snap[i].dev_read_bytes
+					+ snap[i].dev_write_bytes)
+					/ snap[i].app_bytes);
+		else
+			fprintf(f, "%-12llu %12lld %12lld %12lld %6s\n",
+				(unsigned long long)snap[i].mft_no,
+				(long long)snap[i].app_bytes,
+				(long long)snap[i].dev_read_bytes,
+				(long long)snap[i].dev_write_bytes, "-");
+	}
+}
@@ -0,0 +1,337 @@
+/*
+ * lznt1.c - LZNT1 compression of the NTFS compression units
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	A compression unit (usually 16 clusters of 4KB) is compressed as
+ *	a sequence of 4KB chunks, each one preceded by a 16-bit header
+ *	giving its compressed size, and stored as is if compressing does
+ *	not make it shorter. Within a chunk, groups of eight tokens are
+ *	preceded by a byte flagging the back references among them, the
+ *	other tokens being literal bytes. A back reference is 16 bits
+ *	split between the distance and the length, more bits going to the
+ *	distance as the position in the chunk grows.
+ *
+ *	The matches are found through hash chains of the three-byte
+ *	sequences of the chunk, and they are extended eight bytes at a
+ *	time, by locating the first differing byte in the exclusive or
+ *	of two words, so that long matches, such as runs of zeroes or
+ *	repeated records, cost little.
+ *
+ *	This only uses the buffers given, so that compression units can
+ *	be compressed concurrently by the workers.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include <ntfs-3g/types.h>
+#include <ntfs-3g/layout.h>
+#include <ntfs-3g/volume.h>
+
+#include "onedrive.h"
+
+#define CHUNK_SIZE 4096
+#define HASH_BITS 12
+#define MAX_CHAIN 24			/* candidates examined */
+#define GOOD_LENGTH 64			/* stop searching beyond */
+
+struct MATCHER {
+	u16 head[1 << HASH_BITS];	/* position plus one */
+	u16 prev[CHUNK_SIZE];
+} ;
+
+static inline unsigned int hash3(const u8 *p)
+{
+	return ((((u32)p[0] << 16) | ((u32)p[1] << 8) | p[2])
+			* 2654435761U) >> (32 - HASH_BITS);
+}
+
+/*
+ *		Get the length of the common prefix of two sequences
+ *
+ *	The second one may overlap the first one.
+ */
+
+static inline unsigned int match_length(const u8 *p, const u8 *q,
+			unsigned int max)
+{
+	unsigned int len;
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+	u64 a, b;
+
+	len = 0;
+	while ((len + 8) <= max) {
+		memcpy(&a, p + len, 8);
+		memcpy(&b, q + len, 8);
+		if (a != b)
+			return (len + (__builtin_ctzll(a ^ b) >> 3));
+		len += 8;
+	}
+#else
+	len = 0;
+#endif
+	while ((len < max) && (p[len] == q[len]))
+		len++;
+	return (len);
+}
+
+static inline void insert(struct MATCHER *m, const u8 *in, unsigned int pos)
+{
+	unsigned int h;
+
+	h = hash3(&in[pos]);
+	m->prev[pos] = m->head[h];
+	m->head[h] = pos + 1;
+}
+
+/*
+ *		Compress a chunk
+ *
+ *	Returns the size of the compressed chunk including its header,
+ *	or zero if it would not be shorter than the stored chunk or
+ *	would not fit into "max" bytes.
+ */
+
+static unsigned int compress_chunk(struct MATCHER *m, const u8 *in,
+			unsigned int len, u8 *out, unsigned int max)
+{
+	const u8 *end;
+	u8 *flag_byte;
+	u8 *op;
+	unsigned int pos;
+	unsigned int cand;
+	unsigned int best_len;
+	unsigned int best_dist;
+	unsigned int max_len;
+	unsigned int l;
+	unsigned int size;
+	unsigned int lg;
+	int chain;
+	int bit;
+	u16 token;
+
+	if (max > (CHUNK_SIZE + 2))
+		max = CHUNK_SIZE + 2;
+	if (max < 3)
+		return (0);
+	end = out + max;
+	memset(m->head, 0, sizeof(m->head));
+	op = out + 2;
+	flag_byte = op++;
+	*flag_byte = 0;
+	bit = 0;
+	lg = 0;
+	pos = 0;
+	while (pos < len) {
+		while (pos && ((pos - 1) >= (16U << lg)))
+			lg++;
+		best_len = 0;
+		best_dist = 0;
+		if (pos && ((pos + 3) <= len)) {
+			max_len = (0xfff >> lg) + 3;
+			if (max_len > (len - pos))
+				max_len = len - pos;
+			chain = MAX_CHAIN;
+			cand = m->head[hash3(&in[pos])];
+			while (cand && (chain-- > 0)) {
+				l = match_length(&in[pos], &in[cand - 1],
+							max_len);
+				if (l > best_len) {
+					best_len = l;
+					best_dist = pos - cand + 1;
+					if ((l == max_len) || (l >= GOOD_LENGTH))
+						break;
+				}
+				cand = m->prev[cand - 1];
+			}
+		}
+		if (best_len >= 3) {
+			if ((op + 2) > end)
+				return (0);
+			token = ((best_dist - 1) << (12 - lg)) | (best_len - 3);
+			*op++ = token & 255;
+			*op++ = token >> 8;
+			*flag_byte |= 1 << bit;
+			for (l=0; l<best_len; l++, pos++)
+				if ((pos + 3) <= len)
+					insert(m, in, pos);
+		} else {
+			if (op >= end)
+				return (0);
+			*op++ = in[pos];
+			if ((pos + 3) <= len)
+				insert(m, in, pos);
+			pos++;
+		}
+		if ((++bit == 8) && (pos < len)) {
+			if (op >= end)
+				return (0);
+			flag_byte = op++;
+			*flag_byte = 0;
+			bit = 0;
+		}
+	}
+	size = op - out;
+	if (size >= (CHUNK_SIZE + 2))
+		return (0);
+		/* signature 3, compressed, size minus three */
+	token = 0xb000 | (size - 3);
+	out[0] = token & 255;
+	out[1] = token >> 8;
+	return (size);
+}
+
+/*
+ *		Compress a compression unit
+ *
+ *	The chunks which do not compress are stored, the last one being
+ *	padded with zeroes, and an end marker is appended if there is
+ *	room.
+ *
+ *	Returns the compressed size, or zero if it would exceed "max"
+ */
+
+size_t onedrive_lznt1_compress(const void *in, size_t size,
+			void *out, size_t max)
+{
+	struct MATCHER matcher;
+	const u8 *ip;
+	u8 *op;
+	u8 *end;
+	unsigned int len;
+	unsigned int done;
+	size_t pos;
+
+	ip = (const u8*)in;
+	op = (u8*)out;
+	end = op + max;
+	for (pos=0; pos<size; pos+=len) {
+		len = (size - pos > CHUNK_SIZE ? CHUNK_SIZE : size - pos);
+		done = compress_chunk(&matcher, &ip[pos], len, op,
+					end - op);
+		if (!done) {
+			if ((size_t)(end - op) < (CHUNK_SIZE + 2))
+				return (0);
+				/* signature 3, stored, 4096 minus one */
+			op[0] = 0xff;
+			op[1] = 0x3f;
+			memcpy(op + 2, &ip[pos], len);
+			memset(op + 2 + len, 0, CHUNK_SIZE - len);
+			done = CHUNK_SIZE + 2;
+		}
+		op += done;
+	}
+	if ((op + 2) <= end) {
+		*op++ = 0;
+		*op++ = 0;
+	}
+	return (op - (u8*)out);
+}
+
+/*
+ *		Decompress a compression unit
+ *
+ *	A chunk decompressing to less than 4KB is padded with zeroes
+ *	when there is room.
+ *
+ *	Returns the decompressed size, or -1 if the data is not valid
+ */
+
+ssize_t onedrive_lznt1_decompress(const void *in, size_t size,
+			void *out, size_t max)
+{
+	const u8 *ip;
+	const u8 *iend;
+	const u8 *chunk_end;
+	u8 *op;
+	u8 *oend;
+	u8 *start;
+	unsigned int header;
+	unsigned int pos;
+	unsigned int lg;
+	unsigned int dist;
+	unsigned int len;
+	unsigned int token;
+	int flags;
+	int bit;
+
+	ip = (const u8*)in;
+	iend = ip + size;
+	op = (u8*)out;
+	oend = op + max;
+	while ((ip + 2) <= iend) {
+		header = ip[0] | (ip[1] << 8);
+		if (!header)
+			break;
+		chunk_end = ip + (header & 0xfff) + 3;
+		if (chunk_end > iend)
+			return (-1);
+		ip += 2;
+		if (!(header & 0x8000)) {
+			len = chunk_end - ip;
+			if ((len > CHUNK_SIZE) || ((size_t)(oend - op) < len))
+				return (-1);
+			memcpy(op, ip, len);
+			op += len;
+			ip = chunk_end;
+			continue;
+		}
+		start = op;
+		while (ip < chunk_end) {
+			flags = *ip++;
+			for (bit=0; (bit<8) && (ip<chunk_end); bit++) {
+				pos = op - start;
+				if (!(flags & (1 << bit))) {
+					if ((op >= oend) || (pos >= CHUNK_SIZE))
+						return (-1);
+					*op++ = *ip++;
+					continue;
+				}
+				if (!pos || ((ip + 2) > chunk_end))
+					return (-1);
+				token = ip[0] | (ip[1] << 8);
+				ip += 2;
+				lg = 0;
+				while ((pos - 1) >= (16U << lg))
+					lg++;
+				dist = (token >> (12 - lg)) + 1;
+				len = (token & (0xfff >> lg)) + 3;
+				if ((dist > pos) || ((pos + len) > CHUNK_SIZE)
+				    || ((size_t)(oend - op) < len))
+					return (-1);
+				while (len--) {
+					*op = *(op - dist);
+					op++;
+				}
+			}
+		}
+		len = CHUNK_SIZE - (op - start);
+		if ((size_t)(oend - op) < len)
+			len = oend - op;
+		memset(op, 0, len);
+		op += len;
+	}
+	return (op - (u8*)out);
+}
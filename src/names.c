@@ -0,0 +1,1227 @@
+/*
+ * names.c - Index of the names of the files in the OneDrive tree
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	The names of all the files in the OneDrive tree are kept in
+ *	memory and saved in the cache directory with a trigram index,
+ *	so that tools/onedrive-find can search them without walking the
+ *	directories. This is only done when ONEDRIVE_CACHE_DIR is set.
+ *
+ *	The index is built by a thread which reads the MFT directly from
+ *	the device, so that the FUSE thread is not delayed and libntfs-3g
+ *	is not used concurrently : only the runlist of the MFT is got,
+ *	from the FUSE thread, on the first operation. The OneDrive tree
+ *	is made of the directories having a cloud reparse point and of
+ *	whatever lies below them.
+ *
+ *	The saved index is reused when the USN journal has not changed
+ *	since it was built, otherwise Windows may have changed the tree
+ *	and it is built again. Without a journal, it is built on each
+ *	mount. As ntfs-3g does not update the journal, the changes made
+ *	from Linux would not be detected : the index is always built on
+ *	a read-write mount, the previous one being deleted first so that
+ *	it is not reused after a crash, and an index built on a
+ *	read-write mount is never reused. The changes made through the
+ *	plugin (create, link and unlink) update the index, those made
+ *	while it is being built are applied when it is ready. Changes
+ *	made in directories which have no reparse point do not go
+ *	through the plugin and are not seen until the next rebuild.
+ *
+ *	The same thread saves the index periodically when it has been
+ *	updated, and when the plugin is unloaded.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include <stdio.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <ntfs-3g/types.h>
+#include <ntfs-3g/layout.h>
+#include <ntfs-3g/device.h>
+#include <ntfs-3g/volume.h>
+#include <ntfs-3g/inode.h>
+#include <ntfs-3g/attrib.h>
+#include <ntfs-3g/dir.h>
+#include <ntfs-3g/mst.h>
+#include <ntfs-3g/unistr.h>
+#include <ntfs-3g/logging.h>
+
+#include "onedrive.h"
+#include "names.h"
+
+#define NAMES_BUCKETS 65536	/* hash of inode numbers */
+#define NAMES_CHUNK 1048576	/* bytes of MFT read at once */
+#define NAMES_MAX_DEPTH 1024
+#define NAMES_SAVE_INTERVAL 60	/* seconds */
+
+enum NAMES_ACTIONS { NAMES_ADD, NAMES_REMOVE, NAMES_STATE } ;
+
+struct NAME {
+	MFT_REF mref;			/* zero when deleted */
+	MFT_REF parent;
+	u32 name_offset;
+	u16 name_length;
+	u16 flags;
+	u32 attributes;			/* from the standard information */
+	u32 next;			/* in hash chain, plus one */
+	u32 next_child;			/* in hash chain of parent, plus one */
+} ;
+
+struct PENDING {
+	struct PENDING *next;
+	enum NAMES_ACTIONS action;
+	MFT_REF mref;
+	MFT_REF parent;
+	u16 flags;
+	u32 attributes;
+	char name[1];
+} ;
+
+struct SCAN {
+	int fd;
+	runlist_element *rl;		/* of the MFT */
+	s64 mft_size;
+	u32 record_size;
+	u8 cluster_size_bits;
+	u64 *clouds;			/* directories with cloud reparse */
+	u32 cloud_count;
+	u32 cloud_alloc;
+} ;
+
+static pthread_mutex_t names_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t names_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t names_thread;
+static BOOL names_started = FALSE;
+static BOOL names_ready = FALSE;
+static BOOL names_failed = FALSE;
+static BOOL names_dirty = FALSE;
+static BOOL names_stop = FALSE;
+
+static struct NAME *names = (struct NAME*)NULL;
+static u32 name_count = 0;
+static u32 name_alloc = 0;
+static u32 live_count = 0;
+static char *blob = (char*)NULL;
+static size_t blob_size = 0;
+static size_t blob_alloc = 0;
+static u32 buckets[NAMES_BUCKETS];
+static u32 child_buckets[NAMES_BUCKETS];
+static struct PENDING *pending = (struct PENDING*)NULL;
+static struct PENDING **pending_tail = &pending;
+
+static struct SCAN scan;
+static u64 usn_journal_id = 0;
+static u64 usn_next = 0;
+static BOOL names_read_write = FALSE;
+static char names_path[4096] = "";
+
+static BOOL names_loaded = FALSE;	/* from the saved index */
+static u64 build_ns = 0;
+static u64 updates = 0;
+static u64 saves = 0;
+
+/*
+ *		Append a name, with no hashing
+ *
+ *	The growth of the arrays is charged to the memory budget, they
+ *	are kept until the plugin is unloaded.
+ *
+ *	Returns the index of the entry, or -1 if there is no memory
+ */
+
+static s64 append_name(MFT_REF mref, MFT_REF parent, const char *name,
+			int len, u16 flags, u32 attributes)
+{
+	struct NAME *newnames;
+	char *newblob;
+	struct NAME *n;
+	size_t more;
+
+	if (name_count >= name_alloc) {
+		more = name_alloc/2 + 1024;
+		if (!onedrive_mem_charge(more*sizeof(struct NAME)))
+			return (-1);
+		newnames = (struct NAME*)realloc(names,
+			(name_alloc + more)*sizeof(struct NAME));
+		if (!newnames) {
+			onedrive_mem_uncharge(more*sizeof(struct NAME));
+			return (-1);
+		}
+		names = newnames;
+		name_alloc += more;
+	}
+	if (blob_size + len > blob_alloc) {
+		more = blob_alloc/2 + len + 65536;
+		if (!onedrive_mem_charge(more))
+			return (-1);
+		newblob = (char*)realloc(blob, blob_alloc + more);
+		if (!newblob) {
+			onedrive_mem_uncharge(more);
+			return (-1);
+		}
+		blob = newblob;
+		blob_alloc += more;
+	}
+	n = &names[name_count];
+	n->mref = mref;
+	n->parent = parent;
+	n->name_offset = blob_size;
+	n->name_length = len;
+	n->flags = flags;
+	n->attributes = attributes;
+	n->next = 0;
+	n->next_child = 0;
+	memcpy(&blob[blob_size], name, len);
+	blob_size += len;
+	return (name_count++);
+}
+
+static u32 hash_mref(MFT_REF mref)
+{
+	return ((MREF(mref) * 0x9e3779b1) >> 16) % NAMES_BUCKETS;
+}
+
+static void hash_name(u32 i)
+{
+	u32 h;
+
+	h = hash_mref(names[i].mref);
+	names[i].next = buckets[h];
+	buckets[h] = i + 1;
+	h = hash_mref(names[i].parent);
+	names[i].next_child = child_buckets[h];
+	child_buckets[h] = i + 1;
+}
+
+static void unhash_child(u32 i)
+{
+	u32 *prev;
+
+	prev = &child_buckets[hash_mref(names[i].parent)];
+	while (*prev && (*prev != (i + 1)))
+		prev = &names[*prev - 1].next_child;
+	if (*prev)
+		*prev = names[i].next_child;
+}
+
+static void rehash(void)
+{
+	u32 i;
+
+	memset(buckets, 0, sizeof(buckets));
+	memset(child_buckets, 0, sizeof(child_buckets));
+	live_count = 0;
+	for (i=0; i<name_count; i++)
+		if (names[i].mref) {
+			hash_name(i);
+			live_count++;
+		}
+}
+
+/*
+ *		Apply an update to the ready index
+ *
+ *	Must be called with the lock held
+ */
+
+static void apply(enum NAMES_ACTIONS action, MFT_REF mref, MFT_REF parent,
+			const char *name, u16 flags, u32 attributes)
+{
+	struct NAME *n;
+	s64 i;
+	u32 *prev;
+	u32 j;
+	int len;
+
+	switch (action) {
+	case NAMES_ADD :
+		i = append_name(mref, parent, name, strlen(name), flags,
+				attributes);
+		if (i >= 0) {
+			hash_name(i);
+			live_count++;
+		}
+		break;
+	case NAMES_REMOVE :
+		len = strlen(name);
+		for (prev=&buckets[hash_mref(mref)]; *prev;
+				prev=&names[*prev - 1].next) {
+			n = &names[*prev - 1];
+			if ((n->mref == mref) && (n->parent == parent)
+			    && (n->name_length == len)
+			    && !memcmp(&blob[n->name_offset], name, len)) {
+				unhash_child(*prev - 1);
+				*prev = n->next;
+				n->mref = 0;
+				live_count--;
+				break;
+			}
+		}
+		break;
+	case NAMES_STATE :
+			/* only record an actual change */
+		for (j=buckets[hash_mref(mref)]; j; j=names[j - 1].next) {
+			n = &names[j - 1];
+			if ((n->mref == mref)
+			    && ((n->attributes != attributes)
+				|| ((n->flags | flags) != n->flags))) {
+				n->attributes = attributes;
+				n->flags |= flags;
+				names_dirty = TRUE;
+			}
+		}
+		return;
+	}
+	names_dirty = TRUE;
+	updates++;
+}
+
+/*
+ *		Apply the updates received while building
+ *
+ *	Must be called with the lock held
+ */
+
+static void apply_pending(void)
+{
+	struct PENDING *p;
+
+	while (pending) {
+		p = pending;
+		pending = p->next;
+		apply(p->action, p->mref, p->parent, p->name, p->flags,
+			p->attributes);
+		free(p);
+	}
+	pending_tail = &pending;
+}
+
+/*
+ *		Read from the MFT, as designated by its runlist
+ *
+ *	Returns the count of bytes read, or -1
+ */
+
+static s64 read_mft(char *buf, s64 pos, s64 size)
+{
+	const runlist_element *rl;
+	s64 start, end;
+	s64 count;
+	s64 total;
+	s64 got;
+
+	total = 0;
+	for (rl=scan.rl; rl->length && (total < size); rl++) {
+		start = rl->vcn << scan.cluster_size_bits;
+		end = (rl->vcn + rl->length) << scan.cluster_size_bits;
+		if ((pos + total < start) || (pos + total >= end))
+			continue;
+		if (rl->lcn < 0)
+			return (-1);
+		count = end - pos - total;
+		if (count > size - total)
+			count = size - total;
+		got = pread(scan.fd, &buf[total], count,
+			(rl->lcn << scan.cluster_size_bits)
+				+ pos + total - start);
+		if (got != count)
+			return (-1);
+		total += count;
+	}
+	return (total);
+}
+
+static void note_cloud(u64 mft_no)
+{
+	u64 *newclouds;
+
+	if (scan.cloud_count >= scan.cloud_alloc) {
+		newclouds = (u64*)realloc(scan.clouds,
+				(scan.cloud_alloc + 256)*sizeof(u64));
+		if (!newclouds)
+			return;
+		scan.clouds = newclouds;
+		scan.cloud_alloc += 256;
+	}
+	scan.clouds[scan.cloud_count++] = mft_no;
+}
+
+/*
+ *		Get the names and the cloud reparse tag from an MFT record
+ *
+ *	Extension records are considered too, their attributes belong
+ *	to the base record. The file attributes are taken from the
+ *	standard information, which comes first in the base record.
+ */
+
+static void parse_record(MFT_RECORD *mrec, u64 mft_no)
+{
+	const ATTR_RECORD *a;
+	const FILE_NAME_ATTR *fn;
+	const REPARSE_POINT *rp;
+	const STANDARD_INFORMATION *si;
+	ntfschar uname[256];		/* the name length is a u8 */
+	MFT_REF owner;
+	u32 attributes;
+	char *name;
+	u32 used;
+	u32 off;
+	u32 len;
+	int namelen;
+	u16 flags;
+
+	if ((mrec->magic != magic_FILE)
+	    || ntfs_mst_post_read_fixup((NTFS_RECORD*)mrec, scan.record_size)
+	    || !(mrec->flags & MFT_RECORD_IN_USE))
+		return;
+	owner = le64_to_cpu(mrec->base_mft_record);
+	if (!owner)
+		owner = MK_MREF(mft_no, le16_to_cpu(mrec->sequence_number));
+	used = le32_to_cpu(mrec->bytes_in_use);
+	if (used > scan.record_size)
+		return;
+	off = le16_to_cpu(mrec->attrs_offset);
+	attributes = 0;
+	while ((off + 16) <= used) {
+		a = (const ATTR_RECORD*)((const char*)mrec + off);
+		len = le32_to_cpu(a->length);
+		if ((a->type == AT_END) || !len || ((off + len) > used))
+			break;
+		if (!a->non_resident
+		    && ((le16_to_cpu(a->value_offset)
+				+ le32_to_cpu(a->value_length)) <= len)) {
+			if ((a->type == AT_STANDARD_INFORMATION)
+			    && (le32_to_cpu(a->value_length)
+				>= offsetof(STANDARD_INFORMATION,
+					file_attributes) + 4)) {
+				si = (const STANDARD_INFORMATION*)
+					((const char*)a
+					+ le16_to_cpu(a->value_offset));
+				attributes = le32_to_cpu(si->file_attributes);
+			}
+			if (a->type == AT_FILE_NAME) {
+				fn = (const FILE_NAME_ATTR*)((const char*)a
+					+ le16_to_cpu(a->value_offset));
+				name = (char*)NULL;
+				if ((fn->file_name_type != FILE_NAME_DOS)
+				    && ((sizeof(FILE_NAME_ATTR)
+					+ 2*fn->file_name_length)
+					<= le32_to_cpu(a->value_length))) {
+						/* the name may not be aligned */
+					memcpy(uname, fn->file_name,
+						2*fn->file_name_length);
+					namelen = ntfs_ucstombs(uname,
+						fn->file_name_length, &name, 0);
+					flags = ((fn->file_attributes
+						& FILE_ATTR_I30_INDEX_PRESENT)
+						|| (!mrec->base_mft_record
+						    && (mrec->flags
+						    & MFT_RECORD_IS_DIRECTORY))
+						? ONEDRIVE_NAME_DIR : 0);
+					if (namelen > 0)
+						append_name(owner,
+						    le64_to_cpu(
+							fn->parent_directory),
+						    name, namelen, flags,
+						    attributes);
+					free(name);
+				}
+			}
+			if (a->type == AT_REPARSE_POINT) {
+				rp = (const REPARSE_POINT*)((const char*)a
+					+ le16_to_cpu(a->value_offset));
+				if (!((rp->reparse_tag ^ IO_REPARSE_TAG_CLOUD)
+					& IO_REPARSE_PLUGIN_SELECT))
+					note_cloud(MREF(owner));
+			}
+		}
+		off += len;
+	}
+}
+
+static int compare_u64(const void *p1, const void *p2)
+{
+	u64 v1 = *(const u64*)p1;
+	u64 v2 = *(const u64*)p2;
+
+	return ((v1 > v2) - (v1 < v2));
+}
+
+static int compare_names(const void *p1, const void *p2)
+{
+	const struct NAME *n1 = (const struct NAME*)p1;
+	const struct NAME *n2 = (const struct NAME*)p2;
+
+	return ((MREF(n1->mref) > MREF(n2->mref))
+		- (MREF(n1->mref) < MREF(n2->mref)));
+}
+
+/*
+ *		Find the first name of an inode in the sorted names
+ *
+ *	Returns the index of the name, or -1
+ */
+
+static s64 find_sorted(u64 mft_no)
+{
+	s64 low, high, mid;
+
+	low = 0;
+	high = (s64)name_count - 1;
+	while (low <= high) {
+		mid = (low + high)/2;
+		if (MREF(names[mid].mref) < mft_no)
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+	if ((low < name_count) && (MREF(names[low].mref) == mft_no))
+		return (low);
+	return (-1);
+}
+
+static BOOL is_cloud(u64 mft_no)
+{
+	return (bsearch(&mft_no, scan.clouds, scan.cloud_count,
+			sizeof(u64), compare_u64) != (void*)NULL);
+}
+
+/*
+ *		Keep only the names in the OneDrive tree, and those of the
+ *	directories leading to it
+ */
+
+static void select_tree(void)
+{
+	enum { UNKNOWN, VISITING, INSIDE, OUTSIDE, ABOVE } ;
+	u8 *state;
+	u32 *stack;
+	s64 cur, p;
+	u32 depth;
+	u32 i, j;
+	u8 res;
+
+	qsort(names, name_count, sizeof(struct NAME), compare_names);
+	qsort(scan.clouds, scan.cloud_count, sizeof(u64), compare_u64);
+	state = (u8*)calloc(name_count, 1);
+	stack = (u32*)malloc(NAMES_MAX_DEPTH*sizeof(u32));
+	if (!state || !stack) {
+		name_count = 0;
+		free(state);
+		free(stack);
+		return;
+	}
+	for (i=0; i<name_count; i++) {
+		cur = i;
+		depth = 0;
+		res = OUTSIDE;
+		while (depth < NAMES_MAX_DEPTH) {
+			if (state[cur] >= INSIDE) {
+				res = state[cur];
+				break;
+			}
+			if (state[cur] == VISITING)
+				break;
+			stack[depth++] = cur;
+			state[cur] = VISITING;
+			if ((names[cur].flags & ONEDRIVE_NAME_DIR)
+			    && is_cloud(MREF(names[cur].mref))) {
+				res = INSIDE;
+				break;
+			}
+			if (MREF(names[cur].mref) == FILE_root)
+				break;
+			p = find_sorted(MREF(names[cur].parent));
+			if (p < 0)
+				break;
+			cur = p;
+		}
+		for (j=0; j<depth; j++)
+			state[stack[j]] = res;
+	}
+		/* mark the directories leading to the tree */
+	for (i=0; i<name_count; i++)
+		if ((state[i] == INSIDE)
+		    && (MREF(names[i].mref) != FILE_root)) {
+			p = find_sorted(MREF(names[i].parent));
+			depth = 0;
+			while ((p >= 0) && (state[p] == OUTSIDE)
+			    && (depth++ < NAMES_MAX_DEPTH)) {
+				state[p] = ABOVE;
+				if (MREF(names[p].mref) == FILE_root)
+					break;
+				p = find_sorted(MREF(names[p].parent));
+			}
+		}
+	for (i=j=0; i<name_count; i++)
+		if ((state[i] == INSIDE) || (state[i] == ABOVE)) {
+			names[j] = names[i];
+			if (state[i] == ABOVE)
+				names[j].flags |= ONEDRIVE_NAME_ABOVE;
+			j++;
+		}
+	name_count = j;
+	free(state);
+	free(stack);
+}
+
+/*
+ *		Build the index by scanning the MFT
+ *
+ *	Returns zero, or -1 if the scan failed or was stopped
+ */
+
+static int build_index(void)
+{
+	char *buf;
+	s64 pos;
+	s64 count;
+	u32 i;
+	int res;
+
+	buf = (char*)malloc(NAMES_CHUNK);
+	if (!buf)
+		return (-1);
+	res = 0;
+	for (pos=0; (pos<scan.mft_size) && !res; pos+=count) {
+		count = scan.mft_size - pos;
+		if (count > NAMES_CHUNK)
+			count = NAMES_CHUNK;
+		if (names_stop || (read_mft(buf, pos, count) != count))
+			res = -1;
+		else
+			for (i=0; (i + 1)*scan.record_size <= count; i++)
+				parse_record((MFT_RECORD*)&buf[i
+						*scan.record_size],
+					pos/scan.record_size + i);
+	}
+	free(buf);
+	if (!res)
+		select_tree();
+	return (res);
+}
+
+/*
+ *		Load the saved index, if still valid
+ *
+ *	Returns zero if it was loaded
+ */
+
+static int load_index(void)
+{
+	const struct ONEDRIVE_NAMES_HEADER *header;
+	const struct ONEDRIVE_NAME_ENTRY *entries;
+	const char *saved_names;
+	char *buf;
+	size_t size;
+	u32 i;
+	int res;
+
+	res = -1;
+	if (!usn_journal_id || names_read_write)
+		return (res);
+	buf = (char*)onedrive_cachefile_load(names_path,
+			ONEDRIVE_NAMES_MAGIC, ONEDRIVE_NAMES_VERSION, &size);
+	if (!buf)
+		return (res);
+	header = (const struct ONEDRIVE_NAMES_HEADER*)buf;
+	if ((size >= sizeof(*header))
+	    && (header->usn_journal_id == usn_journal_id)
+	    && (header->usn_next == usn_next)
+	    && !(header->index_flags & ONEDRIVE_NAMES_READ_WRITE)
+	    && (size == (sizeof(*header)
+		+ header->entry_count*sizeof(struct ONEDRIVE_NAME_ENTRY)
+		+ header->trigram_count*sizeof(struct ONEDRIVE_TRIGRAM)
+		+ header->posting_count*sizeof(u32)
+		+ header->names_size))) {
+		entries = (const struct ONEDRIVE_NAME_ENTRY*)&header[1];
+		saved_names = buf + size - header->names_size;
+		res = 0;
+		for (i=0; (i<header->entry_count) && !res; i++)
+			if (((entries[i].name_offset + entries[i].name_length)
+					> header->names_size)
+			    || (append_name(entries[i].mref,
+					entries[i].parent,
+					&saved_names[entries[i].name_offset],
+					entries[i].name_length,
+					entries[i].flags,
+					entries[i].attributes) < 0))
+				res = -1;
+		if (res)
+			name_count = blob_size = 0;
+	}
+	free(buf);
+	return (res);
+}
+
+struct POSTING {
+	u32 trigram;
+	u32 entry;
+} ;
+
+static int compare_postings(const void *p1, const void *p2)
+{
+	const struct POSTING *q1 = (const struct POSTING*)p1;
+	const struct POSTING *q2 = (const struct POSTING*)p2;
+
+	if (q1->trigram != q2->trigram)
+		return ((q1->trigram > q2->trigram)
+			- (q1->trigram < q2->trigram));
+	return ((q1->entry > q2->entry) - (q1->entry < q2->entry));
+}
+
+/*
+ *		Save a copy of the index, with its trigrams
+ *
+ *	The copy is taken with the lock held, the rest is done without.
+ */
+
+static void save_index(void)
+{
+	struct ONEDRIVE_NAMES_HEADER *header;
+	struct ONEDRIVE_NAME_ENTRY *entries;
+	struct ONEDRIVE_TRIGRAM *trigrams;
+	struct POSTING *postings;
+	u32 *out;
+	char *names_out;
+	char *buf;
+	size_t size;
+	u64 npost;
+	u64 total;
+	u32 count;
+	u32 ntri;
+	u32 i, j, k;
+	const char *name;
+
+	pthread_mutex_lock(&names_lock);
+	names_dirty = FALSE;
+	count = live_count;
+	total = 0;
+	for (i=0; i<name_count; i++)
+		if (names[i].mref)
+			total += names[i].name_length;
+	entries = (struct ONEDRIVE_NAME_ENTRY*)malloc(count
+			*sizeof(struct ONEDRIVE_NAME_ENTRY) + 1);
+	names_out = (char*)malloc(total + 1);
+	if (!entries || !names_out) {
+		names_dirty = TRUE;
+		pthread_mutex_unlock(&names_lock);
+		free(entries);
+		free(names_out);
+		return;
+	}
+	total = 0;
+	for (i=j=0; i<name_count; i++)
+		if (names[i].mref && (j < count)) {
+			entries[j].mref = names[i].mref;
+			entries[j].parent = names[i].parent;
+			entries[j].name_offset = total;
+			entries[j].name_length = names[i].name_length;
+			entries[j].flags = names[i].flags;
+			entries[j].attributes = names[i].attributes;
+			entries[j].reserved = 0;
+			memcpy(&names_out[total], &blob[names[i].name_offset],
+					names[i].name_length);
+			total += names[i].name_length;
+			j++;
+		}
+	pthread_mutex_unlock(&names_lock);
+
+	qsort(entries, count, sizeof(struct ONEDRIVE_NAME_ENTRY),
+			compare_names);
+	npost = 0;
+	for (i=0; i<count; i++)
+		if (entries[i].name_length >= 3)
+			npost += entries[i].name_length - 2;
+	postings = (struct POSTING*)malloc(npost*sizeof(struct POSTING) + 1);
+	if (!postings) {
+		free(entries);
+		free(names_out);
+		return;
+	}
+	npost = 0;
+	for (i=0; i<count; i++) {
+		name = &names_out[entries[i].name_offset];
+		for (k=0; (k + 3)<=entries[i].name_length; k++) {
+			postings[npost].trigram = onedrive_trigram(&name[k]);
+			postings[npost++].entry = i;
+		}
+	}
+	qsort(postings, npost, sizeof(struct POSTING), compare_postings);
+		/* drop duplicates, and count the trigrams */
+	ntri = 0;
+	for (i=j=0; i<npost; i++)
+		if (!j || (postings[i].trigram != postings[j-1].trigram)
+		    || (postings[i].entry != postings[j-1].entry)) {
+			if (!j || (postings[i].trigram
+					!= postings[j-1].trigram))
+				ntri++;
+			postings[j++] = postings[i];
+		}
+	npost = j;
+
+	size = sizeof(*header) + count*sizeof(struct ONEDRIVE_NAME_ENTRY)
+		+ ntri*sizeof(struct ONEDRIVE_TRIGRAM) + npost*sizeof(u32)
+		+ total;
+	buf = (char*)malloc(size);
+	if (buf) {
+		header = (struct ONEDRIVE_NAMES_HEADER*)buf;
+		header->usn_journal_id = usn_journal_id;
+		header->usn_next = usn_next;
+		header->index_flags = (names_read_write
+					? ONEDRIVE_NAMES_READ_WRITE : 0);
+		header->reserved = 0;
+		header->entry_count = count;
+		header->trigram_count = ntri;
+		header->posting_count = npost;
+		header->names_size = total;
+		memcpy(&header[1], entries,
+			count*sizeof(struct ONEDRIVE_NAME_ENTRY));
+		trigrams = (struct ONEDRIVE_TRIGRAM*)((char*)&header[1]
+			+ count*sizeof(struct ONEDRIVE_NAME_ENTRY));
+		out = (u32*)&trigrams[ntri];
+		for (i=0, j=0; i<npost; i++) {
+			if (!i || (postings[i].trigram
+					!= postings[i-1].trigram)) {
+				trigrams[j].trigram = postings[i].trigram;
+				trigrams[j].count = 0;
+				trigrams[j].first = i;
+				j++;
+			}
+			trigrams[j-1].count++;
+			out[i] = postings[i].entry;
+		}
+		memcpy(&out[npost], names_out, total);
+		if (!onedrive_cachefile_save(names_path, ONEDRIVE_NAMES_MAGIC,
+				ONEDRIVE_NAMES_VERSION, buf, size)) {
+			pthread_mutex_lock(&names_lock);
+			saves++;
+			pthread_mutex_unlock(&names_lock);
+		}
+		free(buf);
+	}
+	free(postings);
+	free(entries);
+	free(names_out);
+}
+
+/*
+ *		The thread building and saving the index
+ */
+
+static void *names_main(void *arg __attribute__((unused)))
+{
+	struct timespec start;
+	struct timespec deadline;
+	struct PENDING *p;
+	BOOL built;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	built = FALSE;
+	if (names_read_write)
+		unlink(names_path);
+	if (!load_index())
+		names_loaded = TRUE;
+	else
+		built = !build_index();
+	pthread_mutex_lock(&names_lock);
+	if (!names_loaded && !built) {
+		name_count = blob_size = 0;
+		names_failed = TRUE;
+		while (pending) {
+			p = pending;
+			pending = p->next;
+			free(p);
+		}
+		if (!names_stop)
+			ntfs_log_error("OneDrive could not index the names"
+					" of files\n");
+		pthread_mutex_unlock(&names_lock);
+		return ((void*)NULL);
+	}
+	build_ns = onedrive_elapsed_ns(&start);
+	rehash();
+	apply_pending();
+	names_ready = TRUE;
+	names_dirty |= built;
+	free(scan.clouds);
+	scan.clouds = (u64*)NULL;
+	while (!names_stop || names_dirty) {
+		if (names_dirty) {
+			pthread_mutex_unlock(&names_lock);
+			save_index();
+			pthread_mutex_lock(&names_lock);
+		}
+		if (!names_stop) {
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += NAMES_SAVE_INTERVAL;
+			pthread_cond_timedwait(&names_cond, &names_lock,
+					&deadline);
+		}
+	}
+	pthread_mutex_unlock(&names_lock);
+	return ((void*)NULL);
+}
+
+/*
+ *		Get the state of the USN journal
+ */
+
+static void get_usn_state(ntfs_volume *vol)
+{
+	static ntfschar J[] = { const_cpu_to_le16('$'),
+			const_cpu_to_le16('J') };
+	static ntfschar MAX[] = { const_cpu_to_le16('$'),
+			const_cpu_to_le16('M'), const_cpu_to_le16('a'),
+			const_cpu_to_le16('x') };
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	le64 id;
+
+	ni = ntfs_pathname_to_inode(vol, (ntfs_inode*)NULL,
+			"$Extend/$UsnJrnl");
+	if (!ni)
+		return;
+	na = ntfs_attr_open(ni, AT_DATA, J, 2);
+	if (na) {
+		usn_next = na->data_size;
+		ntfs_attr_close(na);
+		na = ntfs_attr_open(ni, AT_DATA, MAX, 4);
+		if (na) {
+			if (ntfs_attr_pread(na, 16, 8, &id) == 8)
+				usn_journal_id = le64_to_cpu(id);
+			ntfs_attr_close(na);
+		}
+	}
+	ntfs_inode_close(ni);
+}
+
+/*
+ *		Start indexing, on the first operation
+ */
+
+void onedrive_names_start(ntfs_volume *vol)
+{
+	const runlist_element *rl;
+	int count;
+
+	if (names_started || !onedrive_cachefile_enabled())
+		return;
+	names_started = TRUE;
+	if (onedrive_cachefile_path(vol, "names", names_path,
+				sizeof(names_path)))
+		return;
+	scan.fd = onedrive_device_fd(vol->dev);
+	if ((scan.fd < 0) || ntfs_attr_map_whole_runlist(vol->mft_na))
+		return;
+	get_usn_state(vol);
+	names_read_write = !NVolReadOnly(vol);
+	count = 0;
+	for (rl=vol->mft_na->rl; rl->length; rl++)
+		count++;
+	scan.rl = (runlist_element*)malloc((count + 1)
+				*sizeof(runlist_element));
+	if (!scan.rl)
+		return;
+	memcpy(scan.rl, vol->mft_na->rl, (count + 1)*sizeof(runlist_element));
+	scan.mft_size = vol->mft_na->initialized_size;
+	scan.record_size = vol->mft_record_size;
+	scan.cluster_size_bits = vol->cluster_size_bits;
+	if (pthread_create(&names_thread, (pthread_attr_t*)NULL,
+			names_main, (void*)NULL)) {
+		free(scan.rl);
+		scan.rl = (runlist_element*)NULL;
+	}
+}
+
+/*
+ *		Record an update, or queue it if the index is being built
+ *
+ *	A change of state has no name.
+ */
+
+static void update(enum NAMES_ACTIONS action, MFT_REF mref, MFT_REF parent,
+			const ntfschar *uname, int ulen, u16 flags,
+			u32 attributes)
+{
+	struct PENDING *p;
+	char *name;
+
+	if (!names_started || !scan.rl)
+		return;
+	name = (char*)NULL;
+	if (uname && (ntfs_ucstombs(uname, ulen, &name, 0) <= 0))
+		return;
+	pthread_mutex_lock(&names_lock);
+	if (names_ready)
+		apply(action, mref, parent, (name ? name : ""), flags,
+			attributes);
+	else if (!names_failed) {
+		p = (struct PENDING*)malloc(sizeof(struct PENDING)
+				+ (name ? strlen(name) : 0));
+		if (p) {
+			p->next = (struct PENDING*)NULL;
+			p->action = action;
+			p->mref = mref;
+			p->parent = parent;
+			p->flags = flags;
+			p->attributes = attributes;
+			strcpy(p->name, (name ? name : ""));
+			*pending_tail = p;
+			pending_tail = &p->next;
+		}
+	}
+	pthread_mutex_unlock(&names_lock);
+	free(name);
+}
+
+static MFT_REF inode_mref(ntfs_inode *ni)
+{
+	return (MK_MREF(ni->mft_no, le16_to_cpu(ni->mrec->sequence_number)));
+}
+
+void onedrive_names_add(ntfs_inode *dir_ni, ntfs_inode *ni,
+			const ntfschar *name, int len)
+{
+	update(NAMES_ADD, inode_mref(ni), inode_mref(dir_ni), name, len,
+		(ni->mrec->flags & MFT_RECORD_IS_DIRECTORY
+			? ONEDRIVE_NAME_DIR : 0), le32_to_cpu(ni->flags));
+}
+
+void onedrive_names_remove(ntfs_inode *dir_ni, MFT_REF mref,
+			const ntfschar *name, int len)
+{
+	update(NAMES_REMOVE, mref, inode_mref(dir_ni), name, len, 0, 0);
+}
+
+/*
+ *		Record the current attributes of a file, and whether it was
+ *	written to
+ */
+
+void onedrive_names_state(ntfs_inode *ni, BOOL modified)
+{
+	update(NAMES_STATE, inode_mref(ni), 0, (ntfschar*)NULL, 0,
+		(modified ? ONEDRIVE_NAME_MODIFIED : 0),
+		le32_to_cpu(ni->flags));
+}
+
+/*
+ *		Lock the index for lookups
+ *
+ *	Returns FALSE, not locked, if the index is not ready
+ */
+
+BOOL onedrive_names_lock(void)
+{
+	pthread_mutex_lock(&names_lock);
+	if (!names_ready) {
+		pthread_mutex_unlock(&names_lock);
+		return (FALSE);
+	}
+	return (TRUE);
+}
+
+void onedrive_names_unlock(void)
+{
+	pthread_mutex_unlock(&names_lock);
+}
+
+static void get_info(const struct NAME *n, struct ONEDRIVE_NAME_INFO *info)
+{
+	info->mref = n->mref;
+	info->parent = n->parent;
+	info->name = &blob[n->name_offset];
+	info->name_length = n->name_length;
+	info->flags = n->flags;
+	info->attributes = n->attributes;
+}
+
+/*
+ *		Get the first name of an inode
+ *
+ *	The sequence number is only checked when not zero.
+ *	Must be called with the index locked.
+ */
+
+BOOL onedrive_names_by_mref(MFT_REF mref, struct ONEDRIVE_NAME_INFO *info)
+{
+	const struct NAME *n;
+	u32 j;
+
+	for (j=buckets[hash_mref(mref)]; j; j=names[j - 1].next) {
+		n = &names[j - 1];
+		if ((MREF(n->mref) == MREF(mref))
+		    && (!MSEQNO(mref) || (n->mref == mref))) {
+			get_info(n, info);
+			return (TRUE);
+		}
+	}
+	return (FALSE);
+}
+
+static const struct NAME *find_child(MFT_REF dir, const char *name, int len)
+{
+	const struct NAME *n;
+	u32 j;
+
+	for (j=child_buckets[hash_mref(dir)]; j; j=names[j - 1].next_child) {
+		n = &names[j - 1];
+		if ((MREF(n->parent) == MREF(dir))
+		    && (n->name_length == len)
+		    && !memcmp(&blob[n->name_offset], name, len))
+			return (n);
+	}
+	return ((const struct NAME*)NULL);
+}
+
+/*
+ *		Get the inode designated by a path from the root of the volume
+ *
+ *	The names are compared exactly, there is no case folding.
+ *	Must be called with the index locked.
+ */
+
+BOOL onedrive_names_by_path(const char *path, struct ONEDRIVE_NAME_INFO *info)
+{
+	const struct NAME *n;
+	int depth;
+	int len;
+
+	if (!onedrive_names_by_mref(FILE_root, info))
+		return (FALSE);
+	depth = 0;
+	while (*path && (depth++ < NAMES_MAX_DEPTH)) {
+		while (*path == '/')
+			path++;
+		len = strcspn(path, "/");
+		if ((len == 2) && !strncmp(path, "..", 2)) {
+			if (!onedrive_names_by_mref(info->parent, info))
+				return (FALSE);
+		} else
+			if (len && ((len != 1) || (path[0] != '.'))) {
+				n = find_child(info->mref, path, len);
+				if (!n)
+					return (FALSE);
+				get_info(n, info);
+			}
+		path += len;
+	}
+	return (!*path);
+}
+
+/*
+ *		Enumerate the names in a directory
+ *
+ *	Returns the count of names, or the first non-zero value returned
+ *	by "fn" if it is negative.
+ *	Must be called with the index locked.
+ */
+
+int onedrive_names_children(MFT_REF dir,
+		int (*fn)(void *ctx, const struct ONEDRIVE_NAME_INFO *info),
+		void *ctx)
+{
+	struct ONEDRIVE_NAME_INFO info;
+	const struct NAME *n;
+	int count;
+	int res;
+	u32 j;
+
+	count = 0;
+	for (j=child_buckets[hash_mref(dir)]; j; j=names[j - 1].next_child) {
+		n = &names[j - 1];
+		if ((MREF(n->parent) == MREF(dir))
+		    && (MREF(n->mref) != MREF(dir))) {
+			get_info(n, &info);
+			res = fn(ctx, &info);
+			if (res < 0)
+				return (res);
+			count++;
+		}
+	}
+	return (count);
+}
+
+/*
+ *		Get the next name in the index
+ *
+ *	The cursor is to be set to zero for the first name, and FALSE is
+ *	returned after the last one, the cursor being reset.
+ *	Must be called with the index locked.
+ */
+
+BOOL onedrive_names_next(u32 *cursor, struct ONEDRIVE_NAME_INFO *info)
+{
+	while (*cursor < name_count) {
+		if (names[(*cursor)++].mref) {
+			get_info(&names[*cursor - 1], info);
+			return (TRUE);
+		}
+	}
+	*cursor = 0;
+	return (FALSE);
+}
+
+void onedrive_names_report(FILE *f)
+{
+	pthread_mutex_lock(&names_lock);
+	if (names_ready)
+		fprintf(f, "names : %lu indexed, %s in %.3f s, %llu updates,"
+				" %llu saves\n",
+			(unsigned long)live_count,
+			(names_loaded ? "loaded" : "built"),
+			(double)build_ns/1000000000,
+			(unsigned long long)updates,
+			(unsigned long long)saves);
+	pthread_mutex_unlock(&names_lock);
+}
+
+/*
+ *		Save the index when the plugin is unloaded
+ *
+ *	A scan still running is abandoned, as the device is closed.
+ */
+
+static void __attribute__((destructor)) names_exit(void)
+{
+	if (names_started && scan.rl) {
+		pthread_mutex_lock(&names_lock);
+		names_stop = TRUE;
+		pthread_cond_signal(&names_cond);
+		pthread_mutex_unlock(&names_lock);
+		pthread_join(names_thread, (void**)NULL);
+	}
+}
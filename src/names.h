@@ -0,0 +1,101 @@
+/*
+ * names.h - Layout of the name index of the OneDrive tree
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ONEDRIVE_NAMES_H
+#define _ONEDRIVE_NAMES_H
+
+/*
+ *	The name index is saved as the table "names" in the cache
+ *	directory (see cachefile.h). Following the header come :
+ *	- the entries, one per name of a file, ordered by inode number,
+ *	- the trigrams, ordered by value,
+ *	- the postings of each trigram, as indexes of entries, ascending,
+ *	- the names, in UTF-8, not terminated.
+ *
+ *	A trigram is made of three consecutive bytes of a name, ASCII
+ *	letters being folded to lower case, so that case insensitive
+ *	searches for a substring of at least three bytes only have
+ *	to check the entries listed for all its trigrams.
+ *
+ *	The directories leading from the root of the volume to the
+ *	OneDrive tree are present, so that paths can be built, but they
+ *	are flagged not to be shown in searches.
+ *
+ *	The state of the USN journal when the index was built is
+ *	recorded, so that a change made by Windows can be detected.
+ *	ntfs-3g does not write to the journal, so an index built while
+ *	the volume was mounted read-write is flagged, and not reused.
+ *
+ *	The file attributes (offline, pinned, unpinned) are those found
+ *	when the index was built, and later when the file was accessed
+ *	through the plugin. A file written through the plugin is flagged
+ *	as modified, until the index is rebuilt after Windows has synced.
+ */
+
+#include <stdint.h>
+
+#define ONEDRIVE_NAMES_MAGIC 0x4d4e444f		/* "ODNM" */
+#define ONEDRIVE_NAMES_VERSION 3
+
+#define ONEDRIVE_NAME_DIR 1		/* a directory */
+#define ONEDRIVE_NAME_ABOVE 2		/* leading to the OneDrive tree */
+#define ONEDRIVE_NAME_MODIFIED 4	/* written through the plugin */
+
+#define ONEDRIVE_NAMES_READ_WRITE 1	/* built on a read-write mount */
+
+struct ONEDRIVE_NAMES_HEADER {
+	uint64_t usn_journal_id;	/* zero if there is no journal */
+	uint64_t usn_next;		/* next USN when built */
+	uint32_t index_flags;
+	uint32_t reserved;
+	uint32_t entry_count;
+	uint32_t trigram_count;
+	uint64_t posting_count;
+	uint64_t names_size;
+} ;
+
+struct ONEDRIVE_NAME_ENTRY {
+	uint64_t mref;			/* with sequence number */
+	uint64_t parent;
+	uint32_t name_offset;		/* in the names */
+	uint16_t name_length;		/* in bytes */
+	uint16_t flags;
+	uint32_t attributes;		/* FILE_ATTR_* */
+	uint32_t reserved;
+} ;
+
+struct ONEDRIVE_TRIGRAM {
+	uint32_t trigram;
+	uint32_t count;			/* of postings */
+	uint64_t first;			/* index of first posting */
+} ;
+
+static inline unsigned char onedrive_fold(unsigned char c)
+{
+	return (((c >= 'A') && (c <= 'Z')) ? c + 'a' - 'A' : c);
+}
+
+static inline uint32_t onedrive_trigram(const char *s)
+{
+	return (((uint32_t)onedrive_fold(s[0]) << 16)
+		| ((uint32_t)onedrive_fold(s[1]) << 8)
+		| onedrive_fold(s[2]));
+}
+
+#endif /* _ONEDRIVE_NAMES_H */
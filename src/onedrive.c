@@ -34,10 +34,25 @@
  *
  *		Version 1.2.0, Dec 2020
  *	- implemented creating/linking/unlinking files
+ *
+ *		Version 1.3.0
+ *	- allowed reading files stored in the cloud through a local service
+ *	- collected statistics on operations and device I/O
+ *	- recorded the slow operations
+ *	- ranked the processes and users by activity
+ *	- prefetched the ranges usually read when opening a file
+ *	- tracked how often files are used, and optionally pinned them
+ *	- indexed the names of files, for searching
+ *	- aggregated the I/O errors, with rate-limited logging
+ *	- added an optional sampling profiler
+ *	- compacted the indexes of idle directories
+ *	- served the sync status of files through a Unix socket
+ *	- pooled the aligned I/O buffers, within a memory budget
+ *	- compressed large writes on workers, and recompressed cold files
+ *	- hashed the data written, for the OneDrive content hash
+ *	- wrote large requests directly to the clusters allocated
  */
 
-#define ONEDRIVE_VERSION "1.2.0"
-
 #include "config.h"
 
 /*
@@ -74,6 +89,9 @@
 #include <ntfs-3g/plugin.h>
 #include <ntfs-3g/misc.h>
 
+#include "onedrive.h"
+#include "compress.h"
+
 struct ONEDRIVE_REPARSE {
 	le32 reparse_tag;		/* Reparse point type (inc. flags). */
 	le16 reparse_data_length;	/* Byte size of reparse data. */
@@ -94,9 +112,17 @@ static int onedrive_getattr(ntfs_inode *ni, const REPARSE_POINT *reparse,
 	static ntfschar I30[] =
 		{ const_cpu_to_le16('$'), const_cpu_to_le16('I'),
 		  const_cpu_to_le16('3'), const_cpu_to_le16('0') };
+	struct ONEDRIVE_OP op;
 	ntfs_attr *na;
 	int res;
 
+	onedrive_op_begin(&op, ONEDRIVE_GETATTR, ni);
+	if (ni) {
+		onedrive_bufpool_start(ni->vol);
+		onedrive_names_start(ni->vol);
+		onedrive_status_start();
+		onedrive_idle_run(ni);
+	}
 	res = -EOPNOTSUPP;
 	if (ni && reparse && stbuf
 	    && !((reparse->reparse_tag ^ IO_REPARSE_TAG_CLOUD)
@@ -106,6 +132,8 @@ static int onedrive_getattr(ntfs_inode *ni, const REPARSE_POINT *reparse,
 			stbuf->st_mode = S_IFDIR | 0555;
 			/* get index size, if not known */
 			if (!test_nino_flag(ni, KnownSize)) {
+				op.cache_misses++;
+				onedrive_op_phase(&op, ONEDRIVE_PHASE_ATTR_OPEN);
 				na = ntfs_attr_open(ni, AT_INDEX_ALLOCATION,
 						I30, 4);
 				if (na) {
@@ -114,7 +142,9 @@ static int onedrive_getattr(ntfs_inode *ni, const REPARSE_POINT *reparse,
 					set_nino_flag(ni, KnownSize);
 					ntfs_attr_close(na);
 				}
-			}
+				onedrive_op_phase(&op, ONEDRIVE_PHASE_PLUGIN);
+			} else
+				op.cache_hits++;
 			stbuf->st_size = ni->data_size;
 			stbuf->st_blocks = ni->allocated_size >> 9;
 			stbuf->st_nlink = 1;	/* Make find(1) work */
@@ -126,8 +156,10 @@ static int onedrive_getattr(ntfs_inode *ni, const REPARSE_POINT *reparse,
 			stbuf->st_mode = S_IFREG | 0555;
 			res = 0;
 		}
+		onedrive_names_state(ni, FALSE);
 	}
 	/* Not a onedrive file/directory, or some other error occurred */
+	onedrive_op_end(&op, res);
 	return (res);
 }
 
@@ -141,8 +173,10 @@ static int onedrive_opendir(ntfs_inode *ni __attribute__((unused)),
 			   const REPARSE_POINT *reparse,
 			   struct fuse_file_info *fi)
 {
+	struct ONEDRIVE_OP op;
 	int res;
 
+	onedrive_op_begin(&op, ONEDRIVE_OPENDIR, ni);
 	res = -EOPNOTSUPP;
 	if (ni && reparse && fi
 	    && !((reparse->reparse_tag ^ IO_REPARSE_TAG_CLOUD)
@@ -150,43 +184,79 @@ static int onedrive_opendir(ntfs_inode *ni __attribute__((unused)),
 	    && (ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)
 	    && ((fi->flags & O_ACCMODE) == O_RDONLY))
 		res = 0;
+	onedrive_op_end(&op, res);
 	return (res);
 }
 
 /*
- *		Release a onedrive directory
+ *		Release a onedrive file
  *
- *	Should never be called, as we did not define a reading context
+ *	The ranges read are stored into the profile of the file, the hash
+ *	of the data written is recorded, and the context created when
+ *	opening is freed. No context is created for directories.
  */
 
-static int onedrive_release(ntfs_inode *ni __attribute__((unused)),
+static int onedrive_release(ntfs_inode *ni,
 			   const REPARSE_POINT *reparse __attribute__((unused)),
-			   struct fuse_file_info *fi __attribute__((unused)))
+			   struct fuse_file_info *fi)
 {
+	struct ONEDRIVE_OP op;
+	struct ONEDRIVE_FILE *file;
+
+	onedrive_op_begin(&op, ONEDRIVE_RELEASE, ni);
+	file = onedrive_file_get(fi);
+	if (file) {
+		if (ni) {
+			onedrive_profile_update(ni, file);
+			onedrive_file_commit(ni, file);
+		}
+		onedrive_file_release(fi);
+	}
+	onedrive_op_end(&op, 0);
 	return 0;
 }
 
 /*
  *		Open a onedrive file
  *
- *	Currently no reading context is created.
+ *	A context is created for recording the ranges read, and the
+ *	ranges read after the previous opening are prefetched.
+ *	A file with no local data can only be opened for reading, and
+ *	only when its contents can be fetched from the cloud service.
  */
 
 static int onedrive_open(ntfs_inode *ni, const REPARSE_POINT *reparse,
-			   struct fuse_file_info *fi __attribute__((unused)))
+			   struct fuse_file_info *fi)
 {
+	struct ONEDRIVE_OP op;
+	struct ONEDRIVE_FILE *file;
 	int res;
 
+	onedrive_op_begin(&op, ONEDRIVE_OPEN, ni);
 	res = -EOPNOTSUPP;
-	if (ni && reparse
+	if (ni && reparse && fi
 	    && !((reparse->reparse_tag ^ IO_REPARSE_TAG_CLOUD)
 		& IO_REPARSE_PLUGIN_SELECT)
 	    && !(ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)) {
-		if (ni->flags & FILE_ATTR_OFFLINE)
+		onedrive_heat_open(ni);
+		if ((ni->flags & FILE_ATTR_OFFLINE)
+		    && (!onedrive_hydrate_enabled()
+			|| ((fi->flags & O_ACCMODE) != O_RDONLY)))
 			res = -EREMOTE; /* No local data */
-		else
-			res = 0;
+		else {
+			file = onedrive_file_open(ni, fi);
+			if (file) {
+				if (!(ni->flags & FILE_ATTR_OFFLINE)) {
+					onedrive_op_phase(&op,
+						ONEDRIVE_PHASE_IO);
+					onedrive_profile_prefetch(ni, file);
+				}
+				res = 0;
+			} else
+				res = -ENOMEM;
+		}
 	}
+	onedrive_op_end(&op, res);
 	return (res);
 }
 
@@ -201,18 +271,23 @@ static ntfs_inode *onedrive_create(ntfs_inode *dir_ni,
 			const REPARSE_POINT *reparse, le32 securid,
 			ntfschar *name, int name_len, mode_t type)
 {
+	struct ONEDRIVE_OP op;
 	ntfs_inode *ni;
 
+	onedrive_op_begin(&op, ONEDRIVE_CREATE, dir_ni);
 	if (dir_ni && reparse
 	    && !((reparse->reparse_tag ^ IO_REPARSE_TAG_CLOUD)
 		& IO_REPARSE_PLUGIN_SELECT)
 	    && (dir_ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)
 	    && ((type == S_IFREG) || (type == S_IFDIR))) {
 		ni = ntfs_create(dir_ni, securid, name, name_len, type);
+		if (ni)
+			onedrive_names_add(dir_ni, ni, name, name_len);
 	} else {
 		ni = (ntfs_inode*)NULL;
 		errno = EOPNOTSUPP;
 	}
+	onedrive_op_end(&op, (ni ? 0 : -errno));
 	return (ni);
 }
 
@@ -223,16 +298,21 @@ static ntfs_inode *onedrive_create(ntfs_inode *dir_ni,
 static int onedrive_link(ntfs_inode *dir_ni, const REPARSE_POINT *reparse,
 			ntfs_inode *ni, ntfschar *name, int name_len)
 {
+	struct ONEDRIVE_OP op;
 	int res;
 
+	onedrive_op_begin(&op, ONEDRIVE_LINK, ni);
 	if (dir_ni && reparse
 	    && !((reparse->reparse_tag ^ IO_REPARSE_TAG_CLOUD)
 		& IO_REPARSE_PLUGIN_SELECT)
 	    && (dir_ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)) {
 		res = ntfs_link(ni, dir_ni, name, name_len);
+		if (!res)
+			onedrive_names_add(dir_ni, ni, name, name_len);
 	} else {
 		res = -EOPNOTSUPP;
 	}
+	onedrive_op_end(&op, res);
 	return (res);
 }
 
@@ -244,17 +324,28 @@ static int onedrive_unlink(ntfs_inode *dir_ni, const REPARSE_POINT *reparse,
 			const char *pathname,
 			ntfs_inode *ni, ntfschar *name, int name_len)
 {
+	struct ONEDRIVE_OP op;
+	MFT_REF mref;
 	int res;
 
+	onedrive_op_begin(&op, ONEDRIVE_UNLINK, ni);
 	if (dir_ni && reparse
 	    && !((reparse->reparse_tag ^ IO_REPARSE_TAG_CLOUD)
 		& IO_REPARSE_PLUGIN_SELECT)
 	    && (dir_ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)) {
+			/* ni is freed by ntfs_delete() */
+		mref = MK_MREF(ni->mft_no,
+				le16_to_cpu(ni->mrec->sequence_number));
+		op.ni = (ntfs_inode*)NULL;
+		op.path = pathname;
 		res = ntfs_delete(dir_ni->vol, pathname, ni,
 				dir_ni, name, name_len);
+		if (!res)
+			onedrive_names_remove(dir_ni, mref, name, name_len);
 	} else {
 		res = -EOPNOTSUPP;
 	}
+	onedrive_op_end(&op, res);
 	return (res);
 }
 
@@ -266,24 +357,52 @@ static int onedrive_unlink(ntfs_inode *dir_ni, const REPARSE_POINT *reparse,
 
 static int onedrive_read(ntfs_inode *ni, const REPARSE_POINT *reparse,
 			   char *buf, size_t size, off_t offset,
-			   struct fuse_file_info *fi __attribute__((unused)))
+			   struct fuse_file_info *fi)
 {
 	const struct ONEDRIVE_REPARSE *onedrive_reparse;
+	struct ONEDRIVE_OP op;
+	struct ONEDRIVE_FILE *file;
 	ntfs_attr *na = NULL;
 	s64 total = 0;
 	s64 max_read;
+	s64 used;
 	int res;
 
+	onedrive_op_begin(&op, ONEDRIVE_READ, ni);
+	op.offset = offset;
+	op.size = size;
 	res = -EOPNOTSUPP;
 	onedrive_reparse = (struct ONEDRIVE_REPARSE*)reparse;
 	if (ni && reparse && buf
+	    && (ni->flags & FILE_ATTR_OFFLINE)
 	    && !((onedrive_reparse->reparse_tag ^ IO_REPARSE_TAG_CLOUD)
 			& IO_REPARSE_PLUGIN_SELECT)) {
+			/* No local data, fetch from the cloud */
+		if (!onedrive_hydrate_enabled()) {
+			res = -EREMOTE;
+			goto exit;
+		}
+		if (offset >= ni->data_size)
+			res = 0;
+		else {
+			if (offset + (off_t)size > ni->data_size)
+				size = ni->data_size - offset;
+				/* no local copy */
+			op.cache_misses++;
+			onedrive_op_phase(&op, ONEDRIVE_PHASE_FETCH);
+			res = onedrive_hydrate_read(&onedrive_reparse->guid,
+					buf, size, offset);
+		}
+	} else if (ni && reparse && buf
+	    && !((onedrive_reparse->reparse_tag ^ IO_REPARSE_TAG_CLOUD)
+			& IO_REPARSE_PLUGIN_SELECT)) {
+		onedrive_op_phase(&op, ONEDRIVE_PHASE_ATTR_OPEN);
 		na = ntfs_attr_open(ni, AT_DATA, (ntfschar*)NULL, 0);
 		if (!na) {
 			res = -errno;
 			goto exit;
 		}
+		onedrive_op_phase(&op, ONEDRIVE_PHASE_IO);
 		max_read = na->data_size;
 		if (offset + (off_t)size > max_read) {
 			if (max_read < offset)
@@ -294,27 +413,44 @@ static int onedrive_read(ntfs_inode *ni, const REPARSE_POINT *reparse,
 			s64 ret = ntfs_attr_pread(na, offset, size,
 					buf + total);
 			if (ret != (s64)size) {
-				ntfs_log_perror("onedrive_read error reading inode "
-					"%lld at offset %lld\n",
-					(long long)ni->mft_no,
-					(long long)offset);
 				if (ret <= 0 || ret > (s64)size) {
-					ntfs_attr_close(na);
 					res = (ret < 0) ? -errno : -EIO;
+					onedrive_error_record(ONEDRIVE_READ, na,
+							offset, -res);
+					ntfs_attr_close(na);
 					goto exit;
 				}
+				onedrive_error_record(ONEDRIVE_READ, na,
+						offset, 0);
 			}
 			size -= ret;
 			offset += ret;
 			total += ret;
 		}
 ok:
+		if (onedrive_op_is_slow(&op))
+			op.fragments = onedrive_count_fragments(na);
+		onedrive_op_phase(&op, ONEDRIVE_PHASE_CLOSE);
 		ntfs_attr_close(na);
 		res = total;
+		file = onedrive_file_get(fi);
+		if (file) {
+			used = onedrive_profile_record(file, op.offset, total);
+				/* the prefetched ranges are the only cache */
+			if (file->prefetch_count && total) {
+				if (used == total)
+					op.cache_hits++;
+				else
+					op.cache_misses++;
+			}
+		}
 	} else {
 		res = -EINVAL;
 	}
 exit :
+	if (res > 0)
+		onedrive_heat_read(ni, res);
+	onedrive_op_end(&op, res);
 	return (res);
 }
 
@@ -326,46 +462,65 @@ exit :
 
 static int onedrive_write(ntfs_inode *ni, const REPARSE_POINT *reparse,
 			   const char *buf, size_t size, off_t offset,
-			   struct fuse_file_info *fi __attribute__((unused)))
+			   struct fuse_file_info *fi)
 {
 	const struct ONEDRIVE_REPARSE *onedrive_reparse;
+	struct ONEDRIVE_OP op;
 	ntfs_attr *na = NULL;
 	s64 total = 0;
 	int res;
 
+	onedrive_op_begin(&op, ONEDRIVE_WRITE, ni);
+	op.offset = offset;
+	op.size = size;
 	res = -EOPNOTSUPP;
 	onedrive_reparse = (struct ONEDRIVE_REPARSE*)reparse;
 	if (ni && reparse && buf
 	    && !(ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)
 	    && !((onedrive_reparse->reparse_tag ^ IO_REPARSE_TAG_CLOUD)
 			& IO_REPARSE_PLUGIN_SELECT)) {
+		onedrive_op_phase(&op, ONEDRIVE_PHASE_ATTR_OPEN);
 		na = ntfs_attr_open(ni, AT_DATA, (ntfschar*)NULL, 0);
 		if (!na) {
 			res = -errno;
 			goto exit;
 		}
+		onedrive_op_phase(&op, ONEDRIVE_PHASE_IO);
 		while (size > 0) {
-			s64 ret = ntfs_attr_pwrite(na, offset, size,
+			s64 ret = onedrive_compress_write(na, offset, size,
+						buf + total);
+			if (!ret)
+				ret = onedrive_direct_write(na, offset, size,
+						buf + total);
+			if (!ret)
+				ret = ntfs_attr_pwrite(na, offset, size,
 						buf + total);
 			if (ret <= 0) {
-				ntfs_log_perror("onedrive_write error writing"
-					" to inode %lld at offset %lld\n",
-					(long long)ni->mft_no,
-					(long long)offset);
-				ntfs_attr_close(na);
 				res = (ret < 0) ? -errno : -EIO;
+				onedrive_error_record(ONEDRIVE_WRITE, na,
+						offset, -res);
+				ntfs_attr_close(na);
+				onedrive_file_written(ni, onedrive_file_get(fi),
+						op.offset, buf, total);
 				goto exit;
 			}
 			size -= ret;
 			offset += ret;
 			total += ret;
 		}
+		if (onedrive_op_is_slow(&op))
+			op.fragments = onedrive_count_fragments(na);
+		onedrive_op_phase(&op, ONEDRIVE_PHASE_CLOSE);
 		ntfs_attr_close(na);
+		onedrive_file_written(ni, onedrive_file_get(fi), op.offset,
+				buf, total);
+		onedrive_names_state(ni, TRUE);
 		res = total;
 	} else {
 		res = -EINVAL;
 	}
 exit :
+	onedrive_op_end(&op, res);
 	return (res);
 }
 
@@ -379,26 +534,37 @@ static int onedrive_truncate(ntfs_inode *ni, const REPARSE_POINT *reparse,
 			   off_t size)
 {
 	const struct ONEDRIVE_REPARSE *onedrive_reparse;
+	struct ONEDRIVE_OP op;
 	ntfs_attr *na = NULL;
 	int res;
 
+	onedrive_op_begin(&op, ONEDRIVE_TRUNCATE, ni);
+	op.offset = size;
 	res = -EOPNOTSUPP;
 	onedrive_reparse = (struct ONEDRIVE_REPARSE*)reparse;
 	if (ni && reparse
 	    && !(ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)
 	    && !((onedrive_reparse->reparse_tag ^ IO_REPARSE_TAG_CLOUD)
 			& IO_REPARSE_PLUGIN_SELECT)) {
+		onedrive_op_phase(&op, ONEDRIVE_PHASE_ATTR_OPEN);
 		na = ntfs_attr_open(ni, AT_DATA, (ntfschar*)NULL, 0);
 		if (!na) {
 			res = -errno;
 			goto exit;
 		}
+		onedrive_op_phase(&op, ONEDRIVE_PHASE_IO);
 		res = ntfs_attr_truncate(na, size);
+		onedrive_op_phase(&op, ONEDRIVE_PHASE_CLOSE);
 		ntfs_attr_close(na);
+		if (!res) {
+			onedrive_file_truncated(ni, size);
+			onedrive_names_state(ni, TRUE);
+		}
 	} else {
 		res = -EINVAL;
 	}
 exit :
+	onedrive_op_end(&op, res);
 	return (res);
 }
 
@@ -413,8 +579,10 @@ static int onedrive_readdir(ntfs_inode *ni, const REPARSE_POINT *reparse,
 			struct fuse_file_info *fi __attribute__((unused)))
 {
 	const struct ONEDRIVE_REPARSE *onedrive_reparse;
+	struct ONEDRIVE_OP op;
 	int res;
 
+	onedrive_op_begin(&op, ONEDRIVE_READDIR, ni);
 	res = -EOPNOTSUPP;
 	onedrive_reparse = (struct ONEDRIVE_REPARSE*)reparse;
 	if (ni && reparse && pos && fillctx && filldir
@@ -422,9 +590,13 @@ static int onedrive_readdir(ntfs_inode *ni, const REPARSE_POINT *reparse,
 	    && !((onedrive_reparse->reparse_tag ^ IO_REPARSE_TAG_CLOUD)
 			& IO_REPARSE_PLUGIN_SELECT)) {
 		res = 0;
+		onedrive_op_phase(&op, ONEDRIVE_PHASE_IO);
 		if (ntfs_readdir(ni, pos, fillctx, filldir))
 			res = -errno;
+		else
+			onedrive_idle_readdir(ni);
 	}
+	onedrive_op_end(&op, res);
 	return (res);
 }
 
@@ -452,6 +624,19 @@ const struct plugin_operations *init(le32 tag)
 
 	pops = (const struct plugin_operations*)NULL;
 	if (!((tag ^ IO_REPARSE_TAG_CLOUD) & IO_REPARSE_PLUGIN_SELECT)) {
+		onedrive_stats_init();
+		onedrive_errstat_init();
+		onedrive_sampler_init();
+		onedrive_bufpool_init();
+		onedrive_cachefile_init();
+		onedrive_slowop_init();
+		onedrive_hydrate_init();
+		onedrive_heat_init();
+		onedrive_idle_init();
+		onedrive_status_init();
+		onedrive_workers_init();
+		onedrive_compress_init();
+		onedrive_direct_init();
 		pops = &ops;
 	} else {
 		ntfs_log_error("Error in OneDrive plugin call\n");
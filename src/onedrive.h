@@ -0,0 +1,326 @@
+/*
+ * onedrive.h - Declarations shared by the parts of the OneDrive plugin
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ONEDRIVE_H
+#define _ONEDRIVE_H
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include <ntfs-3g/types.h>
+#include <ntfs-3g/layout.h>
+#include <ntfs-3g/volume.h>
+#include <ntfs-3g/inode.h>
+#include <ntfs-3g/attrib.h>
+
+#include "cachefile.h"
+
+#define ONEDRIVE_VERSION "1.3.0"
+
+#ifndef FILE_ATTR_PINNED
+#define FILE_ATTR_PINNED const_cpu_to_le32(0x00080000)
+#endif
+#ifndef FILE_ATTR_UNPINNED
+#define FILE_ATTR_UNPINNED const_cpu_to_le32(0x00100000)
+#endif
+
+enum ONEDRIVE_OPS {
+	ONEDRIVE_GETATTR,
+	ONEDRIVE_OPEN,
+	ONEDRIVE_RELEASE,
+	ONEDRIVE_READ,
+	ONEDRIVE_WRITE,
+	ONEDRIVE_TRUNCATE,
+	ONEDRIVE_OPENDIR,
+	ONEDRIVE_READDIR,
+	ONEDRIVE_CREATE,
+	ONEDRIVE_LINK,
+	ONEDRIVE_UNLINK,
+	ONEDRIVE_OPS_COUNT
+} ;
+
+enum ONEDRIVE_PHASES {
+	ONEDRIVE_PHASE_PLUGIN,		/* in the plugin itself */
+	ONEDRIVE_PHASE_ATTR_OPEN,	/* opening the attribute */
+	ONEDRIVE_PHASE_IO,		/* reading or writing */
+	ONEDRIVE_PHASE_CLOSE,		/* closing the attribute */
+	ONEDRIVE_PHASE_FETCH,		/* fetching from the cloud */
+	ONEDRIVE_PHASES_COUNT
+} ;
+
+/*
+ *	Context of a plugin operation, for statistics
+ */
+
+struct ONEDRIVE_OP {
+	enum ONEDRIVE_OPS type;
+	u64 mft_no;
+	ntfs_inode *ni;			/* NULL when no longer valid */
+	const char *path;		/* when known */
+	struct timespec start;
+	struct ONEDRIVE_OP *outer;	/* operation being nested into */
+	s64 offset;			/* range requested */
+	s64 size;
+	s64 app_bytes;			/* bytes read or written */
+	u64 dev_reads;			/* device I/O while running */
+	u64 dev_writes;
+	s64 dev_read_bytes;
+	s64 dev_write_bytes;
+	u32 fragments;			/* of the attribute, when slow */
+	u32 cache_hits;
+	u32 cache_misses;
+	enum ONEDRIVE_PHASES phase;
+	struct timespec phase_start;
+	u64 phase_ns[ONEDRIVE_PHASES_COUNT];
+} ;
+
+#define ONEDRIVE_PROFILE_RANGES 8
+#define ONEDRIVE_QXH_SIZE 20		/* bytes of a QuickXorHash */
+#define ONEDRIVE_QXH_FOLD 160		/* bytes per turn of the register */
+
+enum ONEDRIVE_HASH_EVENTS {
+	ONEDRIVE_HASH_STARTED,		/* hashing a file being written */
+	ONEDRIVE_HASH_SEEDED,		/* from the hash of previous data */
+	ONEDRIVE_HASH_COMMITTED,
+	ONEDRIVE_HASH_REWRITTEN,	/* bytes hashed were written again */
+	ONEDRIVE_HASH_OTHER_WRITER,	/* written through another handle */
+	ONEDRIVE_HASH_TRUNCATED,	/* bytes hashed were truncated */
+	ONEDRIVE_HASH_SCATTERED,	/* too many ranges written */
+	ONEDRIVE_HASH_EVENTS_COUNT
+} ;
+
+struct ONEDRIVE_RANGE {
+	s64 offset;
+	s64 length;
+} ;
+
+/*
+ *	Context of an open file, designated by fi->fh
+ */
+
+struct ONEDRIVE_FILE {
+	u64 mft_no;
+	MFT_REF mref;			/* with sequence number */
+	s64 data_size;			/* when opened */
+	s64 next_offset;		/* after the last read, -1 if not recorded */
+	int last_range;			/* range recorded by the last read */
+	int range_count;		/* ranges read since opened */
+	int prefetch_count;		/* ranges prefetched when opened */
+	struct ONEDRIVE_RANGE ranges[ONEDRIVE_PROFILE_RANGES];
+	struct ONEDRIVE_RANGE prefetched[ONEDRIVE_PROFILE_RANGES];
+	struct ONEDRIVE_HASHING *hashing; /* when hashing the writes */
+} ;
+
+/*
+ *	A name found in the name index, see names.c
+ */
+
+struct ONEDRIVE_NAME_INFO {
+	MFT_REF mref;
+	MFT_REF parent;
+	const char *name;		/* not terminated, while locked */
+	int name_length;
+	u16 flags;			/* ONEDRIVE_NAME_* */
+	u32 attributes;			/* FILE_ATTR_* */
+} ;
+
+struct fuse_file_info;
+struct ntfs_device;
+
+/* bufpool.c */
+
+void onedrive_bufpool_init(void);
+void onedrive_bufpool_start(ntfs_volume *vol);
+void *onedrive_buffer_get(size_t size);
+void onedrive_buffer_put(void *buf, size_t size);
+BOOL onedrive_mem_charge(s64 bytes);
+void onedrive_mem_uncharge(s64 bytes);
+void onedrive_bufpool_report(FILE *f);
+
+/* cachefile.c */
+
+void onedrive_cachefile_init(void);
+BOOL onedrive_cachefile_enabled(void);
+int onedrive_cachefile_path(ntfs_volume *vol, const char *kind,
+			char *path, size_t size);
+void *onedrive_cachefile_load(const char *path, u32 magic, u32 version,
+			size_t *size);
+int onedrive_cachefile_save(const char *path, u32 magic, u32 version,
+			const void *buf, size_t size);
+
+/* compress.c */
+
+void onedrive_compress_init(void);
+void onedrive_compress_report(FILE *f);
+
+/* direct.c */
+
+void onedrive_direct_init(void);
+s64 onedrive_direct_write(ntfs_attr *na, s64 offset, s64 size,
+			const char *buf);
+void onedrive_direct_report(FILE *f);
+
+/* errstat.c */
+
+void onedrive_errstat_init(void);
+void onedrive_error_record(enum ONEDRIVE_OPS type, ntfs_attr *na,
+			s64 offset, int err);
+void onedrive_errstat_tick(void);
+void onedrive_errstat_report(FILE *f);
+
+/* files.c */
+
+struct ONEDRIVE_FILE *onedrive_file_open(ntfs_inode *ni,
+			struct fuse_file_info *fi);
+struct ONEDRIVE_FILE *onedrive_file_get(struct fuse_file_info *fi);
+void onedrive_file_release(struct fuse_file_info *fi);
+BOOL onedrive_file_is_open(u64 mft_no);
+void onedrive_file_written(ntfs_inode *ni, struct ONEDRIVE_FILE *file,
+			s64 offset, const char *buf, s64 size);
+void onedrive_file_truncated(ntfs_inode *ni, s64 size);
+void onedrive_file_commit(ntfs_inode *ni, struct ONEDRIVE_FILE *file);
+
+/* heat.c */
+
+void onedrive_heat_init(void);
+void onedrive_heat_open(ntfs_inode *ni);
+void onedrive_heat_read(ntfs_inode *ni, s64 bytes);
+BOOL onedrive_heat_cold(ntfs_volume *vol, MFT_REF mref);
+void onedrive_heat_report(FILE *f);
+
+/* hydrate.c */
+
+void onedrive_hydrate_init(void);
+BOOL onedrive_hydrate_enabled(void);
+int onedrive_hydrate_read(const GUID *guid, char *buf, size_t size,
+			off_t offset);
+
+/* stats.c */
+
+void onedrive_stats_init(void);
+void onedrive_stats_report(void);
+void onedrive_op_begin(struct ONEDRIVE_OP *op, enum ONEDRIVE_OPS type,
+			ntfs_inode *ni);
+void onedrive_op_phase(struct ONEDRIVE_OP *op, enum ONEDRIVE_PHASES phase);
+void onedrive_op_end(struct ONEDRIVE_OP *op, s64 res);
+struct ONEDRIVE_OP *onedrive_current_op(void);
+const char *onedrive_op_name(enum ONEDRIVE_OPS type);
+void onedrive_stats_trailing_io(enum ONEDRIVE_OPS type, BOOL write,
+			s64 bytes);
+u64 onedrive_elapsed_ns(const struct timespec *from);
+u64 onedrive_quiet_ns(void);
+
+/* idle.c */
+
+void onedrive_idle_init(void);
+void onedrive_idle_readdir(ntfs_inode *ni);
+void onedrive_idle_run(ntfs_inode *ni);
+void onedrive_idle_report(FILE *f);
+
+/* iostat.c */
+
+void onedrive_iostat_begin(struct ONEDRIVE_OP *op, ntfs_inode *ni);
+void onedrive_iostat_end(const struct ONEDRIVE_OP *op);
+void onedrive_iostat_report(FILE *f);
+int onedrive_device_fd(struct ntfs_device *dev);
+
+/* lznt1.c */
+
+size_t onedrive_lznt1_compress(const void *in, size_t size,
+			void *out, size_t max);
+ssize_t onedrive_lznt1_decompress(const void *in, size_t size,
+			void *out, size_t max);
+
+/* profile.c */
+
+void onedrive_profile_prefetch(ntfs_inode *ni, struct ONEDRIVE_FILE *file);
+s64 onedrive_profile_record(struct ONEDRIVE_FILE *file, s64 offset,
+			s64 size);
+void onedrive_profile_update(ntfs_inode *ni, struct ONEDRIVE_FILE *file);
+void onedrive_profile_report(FILE *f);
+
+/* names.c */
+
+void onedrive_names_start(ntfs_volume *vol);
+void onedrive_names_add(ntfs_inode *dir_ni, ntfs_inode *ni,
+			const ntfschar *name, int len);
+void onedrive_names_remove(ntfs_inode *dir_ni, MFT_REF mref,
+			const ntfschar *name, int len);
+void onedrive_names_state(ntfs_inode *ni, BOOL modified);
+BOOL onedrive_names_lock(void);
+void onedrive_names_unlock(void);
+BOOL onedrive_names_by_mref(MFT_REF mref, struct ONEDRIVE_NAME_INFO *info);
+BOOL onedrive_names_by_path(const char *path,
+			struct ONEDRIVE_NAME_INFO *info);
+int onedrive_names_children(MFT_REF dir,
+		int (*fn)(void *ctx, const struct ONEDRIVE_NAME_INFO *info),
+		void *ctx);
+BOOL onedrive_names_next(u32 *cursor, struct ONEDRIVE_NAME_INFO *info);
+void onedrive_names_report(FILE *f);
+
+/* procstat.c */
+
+void onedrive_procstat_charge(s64 bytes, u64 ns);
+void onedrive_procstat_report(FILE *f);
+
+/* quickxor.c */
+
+void onedrive_qxh_fold(u8 *fold, s64 offset, const char *buf, size_t size);
+void onedrive_qxh_register(const u8 *fold, u8 *reg);
+void onedrive_qxh_final(const u8 *reg, s64 length, u8 *hash);
+void onedrive_hash_commit(ntfs_inode *ni, const u8 *reg);
+BOOL onedrive_hash_get(ntfs_inode *ni, u8 *reg);
+void onedrive_hash_forget(ntfs_inode *ni);
+void onedrive_hash_event(enum ONEDRIVE_HASH_EVENTS event);
+void onedrive_hash_report(FILE *f);
+
+/* sampler.c */
+
+void onedrive_sampler_init(void);
+void onedrive_sampler_begin(void);
+void onedrive_sampler_end(void);
+void onedrive_sampler_report(FILE *f);
+
+/* slowop.c */
+
+void onedrive_slowop_init(void);
+BOOL onedrive_op_is_slow(const struct ONEDRIVE_OP *op);
+u32 onedrive_count_fragments(const ntfs_attr *na);
+int onedrive_inode_name(ntfs_inode *ni, char *buf, int size, MFT_REF *parent);
+void onedrive_inode_path(ntfs_inode *ni, char *path, int size);
+void onedrive_slowop_record(struct ONEDRIVE_OP *op, u64 ns, s64 res);
+void onedrive_slowop_report(FILE *f);
+
+/* status.c */
+
+void onedrive_status_init(void);
+void onedrive_status_start(void);
+void onedrive_status_report(FILE *f);
+
+/* workers.c */
+
+void onedrive_workers_init(void);
+void onedrive_workers_set(int count);
+int onedrive_workers_count(void);
+void onedrive_workers_run(void (*run)(void *arg, int job), void *arg,
+			int count);
+void onedrive_workers_report(FILE *f);
+
+#endif /* _ONEDRIVE_H */
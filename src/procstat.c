@@ -0,0 +1,230 @@
+/*
+ * procstat.c - Attribution of the OneDrive plugin activity to processes
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	Each operation is charged to the process and to the user which
+ *	requested it, as known from the FUSE context. Only the most
+ *	active ones are kept, in fixed-size tables maintained by the
+ *	"space-saving" algorithm : when a newcomer finds no free slot,
+ *	it takes the slot with the smallest count of operations and
+ *	inherits that count as its error bound, so that a process doing
+ *	many operations cannot be missed whatever the count of processes.
+ *
+ *	The process name is read from /proc when the process has done
+ *	enough operations to be of interest, or when producing the
+ *	report, as short-lived processes would otherwise cost an open()
+ *	each.
+ *
+ *	fuse_get_context() is not available when ntfs-3g is built with
+ *	its internal FUSE library, so it is referenced weakly.
+ */
+
+#include "config.h"
+
+#define FUSE_USE_VERSION 26
+#include <fuse.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include <ntfs-3g/types.h>
+
+#include "onedrive.h"
+
+#pragma weak fuse_get_context
+
+#define PROC_SLOTS 32
+#define USER_SLOTS 16
+#define NAME_THRESHOLD 64	/* ops before getting the process name */
+#define PROC_REPORT 10
+
+struct HITTER {
+	u32 id;			/* pid or uid */
+	u32 uid;		/* for processes */
+	u64 ops;		/* approximate count, an upper bound */
+	u64 error;		/* max overestimation of ops */
+	s64 bytes;
+	u64 total_ns;
+	u64 max_ns;
+	char name[16];		/* process name, when known */
+} ;
+
+struct SKETCH {
+	int size;
+	int count;
+	struct HITTER *slots;
+} ;
+
+static pthread_mutex_t proc_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct HITTER proc_slots[PROC_SLOTS];
+static struct HITTER user_slots[USER_SLOTS];
+static struct SKETCH procs = { PROC_SLOTS, 0, proc_slots } ;
+static struct SKETCH users = { USER_SLOTS, 0, user_slots } ;
+
+static void get_name(struct HITTER *h)
+{
+	char path[32];
+	FILE *f;
+	int len;
+
+	snprintf(path, sizeof(path), "/proc/%lu/comm", (unsigned long)h->id);
+	f = fopen(path, "r");
+	if (f) {
+		if (fgets(h->name, sizeof(h->name), f)) {
+			len = strlen(h->name);
+			if (len && (h->name[len - 1] == '\n'))
+				h->name[len - 1] = 0;
+		}
+		fclose(f);
+	}
+	if (!h->name[0])
+		strcpy(h->name, "?");
+}
+
+/*
+ *		Find the slot of an id, taking the least active slot
+ *	if the id is not present.
+ */
+
+static struct HITTER *sketch_slot(struct SKETCH *sk, u32 id)
+{
+	struct HITTER *h;
+	struct HITTER *low;
+	int i;
+
+	for (i=0; i<sk->count; i++)
+		if (sk->slots[i].id == id)
+			return (&sk->slots[i]);
+	if (sk->count < sk->size) {
+		h = &sk->slots[sk->count++];
+		memset(h, 0, sizeof(struct HITTER));
+	} else {
+		low = &sk->slots[0];
+		for (i=1; i<sk->size; i++)
+			if (sk->slots[i].ops < low->ops)
+				low = &sk->slots[i];
+		h = low;
+		h->error = h->ops;
+		h->bytes = 0;
+		h->total_ns = 0;
+		h->max_ns = 0;
+		h->name[0] = 0;
+	}
+	h->id = id;
+	return (h);
+}
+
+static void sketch_charge(struct HITTER *h, s64 bytes, u64 ns)
+{
+	h->ops++;
+	h->bytes += bytes;
+	h->total_ns += ns;
+	if (ns > h->max_ns)
+		h->max_ns = ns;
+}
+
+/*
+ *		Charge an operation to the requesting process and user
+ */
+
+void onedrive_procstat_charge(s64 bytes, u64 ns)
+{
+	struct fuse_context *context;
+	struct HITTER *h;
+
+	if (!fuse_get_context)
+		return;
+	context = fuse_get_context();
+	if (!context || !context->pid)
+		return;
+	pthread_mutex_lock(&proc_lock);
+	h = sketch_slot(&procs, context->pid);
+	h->uid = context->uid;
+	sketch_charge(h, bytes, ns);
+	if (!h->name[0] && ((h->ops - h->error) >= NAME_THRESHOLD))
+		get_name(h);
+	sketch_charge(sketch_slot(&users, context->uid), bytes, ns);
+	pthread_mutex_unlock(&proc_lock);
+}
+
+static int compare_hitters(const void *p1, const void *p2)
+{
+	const struct HITTER *h1 = (const struct HITTER*)p1;
+	const struct HITTER *h2 = (const struct HITTER*)p2;
+
+	return ((h1->ops < h2->ops) - (h1->ops > h2->ops));
+}
+
+static void report_sketch(FILE *f, struct SKETCH *sk, BOOL isproc)
+{
+	struct HITTER snap[PROC_SLOTS];
+	const struct HITTER *h;
+	int count;
+	int i;
+
+	pthread_mutex_lock(&proc_lock);
+	count = sk->count;
+	if (isproc)
+		for (i=0; i<count; i++)
+			if (!sk->slots[i].name[0])
+				get_name(&sk->slots[i]);
+	memcpy(snap, sk->slots, count*sizeof(struct HITTER));
+	pthread_mutex_unlock(&proc_lock);
+	if (!count)
+		return;
+	qsort(snap, count, sizeof(struct HITTER), compare_hitters);
+	if (count > PROC_REPORT)
+		count = PROC_REPORT;
+	if (isproc)
+		fprintf(f, "%-8s %-16s %6s", "pid", "process", "uid");
+	else
+		fprintf(f, "%-8s", "uid");
+	fprintf(f, " %10s %8s %12s %9s %9s\n", "ops", "error", "bytes",
+			"avg_us", "max_us");
+	for (i=0; i<count; i++) {
+		h = &snap[i];
+		if (isproc)
+			fprintf(f, "%-8lu %-16s %6lu", (unsigned long)h->id,
+				h->name, (unsigned long)h->uid);
+		else
+			fprintf(f, "%-8lu", (unsigned long)h->id);
+		fprintf(f, " %10llu %8llu %12lld %9llu %9llu\n",
+			(unsigned long long)h->ops,
+			(unsigned long long)h->error,
+			(long long)h->bytes,
+			(unsigned long long)(h->ops > h->error
+				? h->total_ns / (h->ops - h->error) / 1000
+				: 0),
+			(unsigned long long)(h->max_ns / 1000));
+	}
+}
+
+void onedrive_procstat_report(FILE *f)
+{
+	report_sketch(f, &procs, TRUE);
+	report_sketch(f, &users, FALSE);
+}
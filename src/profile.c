@@ -0,0 +1,385 @@
+/*
+ * profile.c - Learning how files are read, to prefetch them when opened
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	Many files are read the same way on each open : a database header
+ *	then some pages, the index at the end of a media file, the
+ *	central directory of a zip archive... The first ranges read after
+ *	opening a file are recorded, merging the sequential reads, and
+ *	they are stored into a profile of the file when it is released.
+ *
+ *	When the file is opened again, the ranges of its profile are
+ *	mapped to the device and the kernel is advised to read them,
+ *	which it does in the background, so that the first reads of the
+ *	application find the data in memory.
+ *
+ *	The profiles are kept in a set-associative table of fixed size,
+ *	the least recently used profile of a set being replaced. A
+ *	profile is identified by the inode number and sequence number of
+ *	the file, and it is dropped when the size of the file changed.
+ *	Small files are not profiled, a single read gets them.
+ *
+ *	The table is saved in the cache directory on unloading and
+ *	periodically when it has been updated.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <ntfs-3g/types.h>
+#include <ntfs-3g/layout.h>
+#include <ntfs-3g/device.h>
+#include <ntfs-3g/volume.h>
+#include <ntfs-3g/inode.h>
+#include <ntfs-3g/attrib.h>
+
+#include "onedrive.h"
+
+#define PROFILE_WAYS 4
+#define PROFILE_SETS 512
+#define PROFILE_MIN_SIZE 131072	/* files not profiled when smaller */
+#define PROFILE_MAX_RANGE 1048576	/* max bytes in a range */
+#define PROFILE_SAVE_INTERVAL 300	/* seconds */
+#define PROFILE_MAGIC 0x4650444f	/* "ODPF" */
+#define PROFILE_VERSION 1
+
+struct PROFILE {
+	MFT_REF mref;			/* zero when free */
+	s64 data_size;
+	u32 stamp;			/* of last use */
+	u32 count;
+	struct ONEDRIVE_RANGE ranges[ONEDRIVE_PROFILE_RANGES];
+} ;
+
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct PROFILE profiles[PROFILE_SETS][PROFILE_WAYS];
+static u32 profile_stamp = 0;
+static BOOL profiles_loaded = FALSE;
+static BOOL profiles_dirty = FALSE;
+static time_t profiles_saved = 0;
+static char profile_path[4096] = "";
+
+static u64 learned = 0;
+static u64 prefetches = 0;
+static s64 prefetch_bytes = 0;
+static s64 prefetch_used = 0;
+static u64 dropped = 0;
+
+/*
+ *		Load the profiles saved for the volume, on first use
+ *
+ *	Must be called with the lock held
+ */
+
+static void load_profiles(ntfs_volume *vol)
+{
+	struct PROFILE *saved;
+	size_t size;
+
+	profiles_loaded = TRUE;
+	profiles_saved = time((time_t*)NULL);
+	if (onedrive_cachefile_path(vol, "profiles", profile_path,
+				sizeof(profile_path))) {
+		profile_path[0] = 0;
+		return;
+	}
+	saved = (struct PROFILE*)onedrive_cachefile_load(profile_path,
+			PROFILE_MAGIC, PROFILE_VERSION, &size);
+	if (saved) {
+		if (size == sizeof(profiles))
+			memcpy(profiles, saved, size);
+		free(saved);
+	}
+}
+
+/*
+ *		Save the profiles if they were updated
+ *
+ *	Must be called with the lock held
+ */
+
+static void save_profiles(void)
+{
+	if (profiles_dirty && profile_path[0]
+	    && !onedrive_cachefile_save(profile_path, PROFILE_MAGIC,
+			PROFILE_VERSION, profiles, sizeof(profiles)))
+		profiles_dirty = FALSE;
+	profiles_saved = time((time_t*)NULL);
+}
+
+/*
+ *		Find the profile of a file
+ *
+ *	When there is none and "create" is set, the least recently used
+ *	profile of the set is reassigned to the file.
+ *	Must be called with the lock held.
+ */
+
+static struct PROFILE *find_profile(MFT_REF mref, BOOL create)
+{
+	struct PROFILE *set;
+	struct PROFILE *pf;
+	int i;
+
+	set = profiles[(mref ^ (mref >> 48)) % PROFILE_SETS];
+	pf = (struct PROFILE*)NULL;
+	for (i=0; (i<PROFILE_WAYS) && !pf; i++)
+		if (set[i].mref == mref)
+			pf = &set[i];
+	if (!pf && create) {
+		pf = &set[0];
+		for (i=1; (i<PROFILE_WAYS) && pf->mref; i++)
+			if (!set[i].mref
+			    || ((s32)(set[i].stamp - pf->stamp) < 0))
+				pf = &set[i];
+		memset(pf, 0, sizeof(struct PROFILE));
+		pf->mref = mref;
+	}
+	if (pf)
+		pf->stamp = ++profile_stamp;
+	return (pf);
+}
+
+/*
+ *		Advise the kernel to read the device extents of a range
+ *
+ *	Returns the count of bytes the kernel was advised to read
+ */
+
+static s64 prefetch_range(ntfs_attr *na, int fd, s64 offset, s64 length)
+{
+	ntfs_volume *vol;
+	runlist_element *rl;
+	VCN vcn;
+	VCN end;
+	s64 count;
+	s64 total;
+
+	vol = na->ni->vol;
+	total = 0;
+	if (NAttrCompressed(na)) {
+		length += offset & (na->compression_block_size - 1);
+		offset &= ~(s64)(na->compression_block_size - 1);
+	}
+	if (offset + length > na->allocated_size)
+		length = na->allocated_size - offset;
+	if (length <= 0)
+		return (0);
+	vcn = offset >> vol->cluster_size_bits;
+	end = (offset + length + vol->cluster_size - 1)
+			>> vol->cluster_size_bits;
+	while (vcn < end) {
+		rl = ntfs_attr_find_vcn(na, vcn);
+		if (!rl || !rl->length)
+			break;
+		count = rl->vcn + rl->length - vcn;
+		if (count > end - vcn)
+			count = end - vcn;
+		if ((rl->lcn >= 0)
+		    && !posix_fadvise(fd,
+				(rl->lcn + vcn - rl->vcn) << vol->cluster_size_bits,
+				count << vol->cluster_size_bits,
+				POSIX_FADV_WILLNEED))
+			total += count << vol->cluster_size_bits;
+		vcn += count;
+	}
+	return (total);
+}
+
+/*
+ *		Prefetch the ranges of the profile of a file being opened
+ */
+
+void onedrive_profile_prefetch(ntfs_inode *ni, struct ONEDRIVE_FILE *file)
+{
+	struct PROFILE *pf;
+	ntfs_attr *na;
+	s64 bytes;
+	int fd;
+	int i;
+
+	if (file->data_size < PROFILE_MIN_SIZE)
+		return;
+	pthread_mutex_lock(&profile_lock);
+	if (!profiles_loaded)
+		load_profiles(ni->vol);
+	pf = find_profile(file->mref, FALSE);
+	if (pf && (pf->data_size != file->data_size)) {
+		pf->mref = 0;
+		pf = (struct PROFILE*)NULL;
+		profiles_dirty = TRUE;
+		dropped++;
+	}
+	if (pf) {
+		file->prefetch_count = pf->count;
+		memcpy(file->prefetched, pf->ranges,
+				pf->count*sizeof(struct ONEDRIVE_RANGE));
+	}
+	pthread_mutex_unlock(&profile_lock);
+
+	fd = onedrive_device_fd(ni->vol->dev);
+	if (!file->prefetch_count || (fd < 0))
+		return;
+	na = ntfs_attr_open(ni, AT_DATA, (ntfschar*)NULL, 0);
+	if (na) {
+		bytes = 0;
+		if (NAttrNonResident(na))
+			for (i=0; i<file->prefetch_count; i++)
+				bytes += prefetch_range(na, fd,
+						file->prefetched[i].offset,
+						file->prefetched[i].length);
+		ntfs_attr_close(na);
+		pthread_mutex_lock(&profile_lock);
+		prefetches++;
+		prefetch_bytes += bytes;
+		pthread_mutex_unlock(&profile_lock);
+	}
+}
+
+/*
+ *		Record a range read from an open file
+ *
+ *	A read continuing the previous one extends its range, other reads
+ *	make new ranges until the profile is full.
+ *
+ *	Returns the count of bytes which were in the prefetched ranges
+ */
+
+s64 onedrive_profile_record(struct ONEDRIVE_FILE *file, s64 offset,
+			s64 size)
+{
+	struct ONEDRIVE_RANGE *range;
+	s64 used;
+	s64 start;
+	s64 end;
+	int i;
+
+	if ((size <= 0) || (file->data_size < PROFILE_MIN_SIZE))
+		return (0);
+	used = 0;
+	for (i=0; i<file->prefetch_count; i++) {
+		range = &file->prefetched[i];
+		start = (offset > range->offset ? offset : range->offset);
+		end = (offset + size < range->offset + range->length
+			? offset + size : range->offset + range->length);
+		if (end > start)
+			used += end - start;
+	}
+	if (used) {
+		pthread_mutex_lock(&profile_lock);
+		prefetch_used += used;
+		pthread_mutex_unlock(&profile_lock);
+	}
+		/* only extend the range recorded by the previous read */
+	if (file->range_count && (offset == file->next_offset)) {
+		range = &file->ranges[file->last_range];
+		range->length = offset + size - range->offset;
+		if (range->length > PROFILE_MAX_RANGE)
+			range->length = PROFILE_MAX_RANGE;
+		file->next_offset = offset + size;
+	} else {
+		for (i=0; i<file->range_count; i++) {
+			range = &file->ranges[i];
+			if ((offset >= range->offset)
+			    && (offset + size <= range->offset + range->length))
+				break;
+		}
+		if ((i >= file->range_count)
+		    && (file->range_count < ONEDRIVE_PROFILE_RANGES)) {
+			file->last_range = file->range_count++;
+			range = &file->ranges[file->last_range];
+			range->offset = offset;
+			range->length = (size < PROFILE_MAX_RANGE
+					? size : PROFILE_MAX_RANGE);
+			file->next_offset = offset + size;
+		} else
+			file->next_offset = -1;
+	}
+	return (used);
+}
+
+/*
+ *		Store the ranges read into the profile of a file released
+ */
+
+void onedrive_profile_update(ntfs_inode *ni, struct ONEDRIVE_FILE *file)
+{
+	struct PROFILE *pf;
+
+	if (!file->range_count || (ni->data_size < PROFILE_MIN_SIZE))
+		return;
+	pthread_mutex_lock(&profile_lock);
+	if (!profiles_loaded)
+		load_profiles(ni->vol);
+	pf = find_profile(file->mref, TRUE);
+	if (!pf->count)
+		learned++;
+	if ((pf->data_size != ni->data_size)
+	    || (pf->count != (u32)file->range_count)
+	    || memcmp(pf->ranges, file->ranges,
+		file->range_count*sizeof(struct ONEDRIVE_RANGE))) {
+		pf->data_size = ni->data_size;
+		pf->count = file->range_count;
+		memcpy(pf->ranges, file->ranges,
+			file->range_count*sizeof(struct ONEDRIVE_RANGE));
+		profiles_dirty = TRUE;
+	}
+	if (profiles_dirty
+	    && ((time((time_t*)NULL) - profiles_saved)
+			>= PROFILE_SAVE_INTERVAL))
+		save_profiles();
+	pthread_mutex_unlock(&profile_lock);
+}
+
+void onedrive_profile_report(FILE *f)
+{
+	pthread_mutex_lock(&profile_lock);
+	if (learned || prefetches)
+		fprintf(f, "profiles : %llu learned %llu dropped,"
+				" %llu prefetches %lld bytes, %lld bytes used\n",
+			(unsigned long long)learned,
+			(unsigned long long)dropped,
+			(unsigned long long)prefetches,
+			(long long)prefetch_bytes,
+			(long long)prefetch_used);
+	pthread_mutex_unlock(&profile_lock);
+}
+
+/*
+ *		Save the profiles when the plugin is unloaded
+ */
+
+static void __attribute__((destructor)) profile_exit(void)
+{
+	pthread_mutex_lock(&profile_lock);
+	save_profiles();
+	pthread_mutex_unlock(&profile_lock);
+}
@@ -0,0 +1,332 @@
+/*
+ * quickxor.c - QuickXorHash of OneDrive files, and cache of the hashes
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	QuickXorHash is the content hash used by OneDrive : each byte is
+ *	xored into a 160-bit register, shifted circularly by 11 bits more
+ *	than the previous byte, and the length of the data is xored into
+ *	the last 64 bits at the end.
+ *
+ *	As 160 bytes shift by a whole turn, the bytes whose positions
+ *	are equal modulo 160 can first be xored together ("folded"), and
+ *	the register is only computed from the 160 folded bytes. Folding
+ *	does not depend on the order of the bytes, so that data written
+ *	out of order can be hashed as well, provided no byte is written
+ *	twice. The bytes never written are zeroes, which leave the hash
+ *	unchanged.
+ *
+ *	The hashes computed while writing files (see files.c) are kept
+ *	in a set-associative table, with the size and the change time of
+ *	the data they apply to, and they are saved in the cache
+ *	directory. The register is kept without the length, so that data
+ *	appended later can be hashed without reading the previous data.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <ntfs-3g/types.h>
+#include <ntfs-3g/layout.h>
+#include <ntfs-3g/volume.h>
+#include <ntfs-3g/inode.h>
+
+#include "onedrive.h"
+
+#define QXH_SHIFT 11
+#define HASH_WAYS 4
+#define HASH_SETS 2048
+#define HASH_SAVE_INTERVAL 300		/* seconds */
+#define HASH_MAGIC 0x5851444f		/* "ODQX" */
+#define HASH_VERSION 1
+
+struct HASH_ENTRY {
+	MFT_REF mref;			/* zero when free */
+	s64 size;			/* of data hashed */
+	s64 changed;			/* NTFS time of last data change */
+	u32 when;			/* when committed */
+	u8 reg[ONEDRIVE_QXH_SIZE];	/* without the length */
+} ;
+
+static pthread_mutex_t hash_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct HASH_ENTRY entries[HASH_SETS][HASH_WAYS];
+static BOOL hashes_loaded = FALSE;
+static BOOL hashes_dirty = FALSE;
+static time_t hashes_saved = 0;
+static char hash_path[4096] = "";
+
+static u64 events[ONEDRIVE_HASH_EVENTS_COUNT];
+
+/*
+ *		Fold some data at some offset
+ */
+
+void onedrive_qxh_fold(u8 *fold, s64 offset, const char *buf, size_t size)
+{
+	unsigned int pos;
+	size_t i;
+	u64 a, b;
+	int j;
+
+	pos = offset % ONEDRIVE_QXH_FOLD;
+	i = 0;
+	while (pos && (i < size)) {
+		fold[pos] ^= buf[i++];
+		if (++pos == ONEDRIVE_QXH_FOLD)
+			pos = 0;
+	}
+		/* a whole turn at a time */
+	while ((i + ONEDRIVE_QXH_FOLD) <= size) {
+		for (j=0; j<ONEDRIVE_QXH_FOLD; j+=8) {
+			memcpy(&a, &fold[j], 8);
+			memcpy(&b, &buf[i + j], 8);
+			a ^= b;
+			memcpy(&fold[j], &a, 8);
+		}
+		i += ONEDRIVE_QXH_FOLD;
+	}
+	while (i < size)
+		fold[pos++] ^= buf[i++];
+}
+
+/*
+ *		Xor the folded bytes into a register
+ */
+
+void onedrive_qxh_register(const u8 *fold, u8 *reg)
+{
+	unsigned int bit;
+	unsigned int k;
+	unsigned int s;
+	int j;
+
+	bit = 0;
+	for (j=0; j<ONEDRIVE_QXH_FOLD; j++) {
+		k = bit >> 3;
+		s = bit & 7;
+		reg[k] ^= fold[j] << s;
+		if (s)
+			reg[(k + 1) % ONEDRIVE_QXH_SIZE] ^= fold[j] >> (8 - s);
+		bit = (bit + QXH_SHIFT) % (8*ONEDRIVE_QXH_SIZE);
+	}
+}
+
+/*
+ *		Get the hash from a register and the length of the data
+ */
+
+void onedrive_qxh_final(const u8 *reg, s64 length, u8 *hash)
+{
+	int i;
+
+	memcpy(hash, reg, ONEDRIVE_QXH_SIZE);
+	for (i=0; i<8; i++)
+		hash[ONEDRIVE_QXH_SIZE - 8 + i] ^= (u64)length >> (8*i);
+}
+
+static void load_hashes(ntfs_volume *vol)
+{
+	struct HASH_ENTRY *saved;
+	size_t size;
+
+	hashes_loaded = TRUE;
+	hashes_saved = time((time_t*)NULL);
+	if (onedrive_cachefile_path(vol, "qxhash", hash_path,
+				sizeof(hash_path))) {
+		hash_path[0] = 0;
+		return;
+	}
+	saved = (struct HASH_ENTRY*)onedrive_cachefile_load(hash_path,
+			HASH_MAGIC, HASH_VERSION, &size);
+	if (saved) {
+		if (size == sizeof(entries))
+			memcpy(entries, saved, size);
+		free(saved);
+	}
+}
+
+static void save_hashes(void)
+{
+	if (hashes_dirty && hash_path[0]
+	    && !onedrive_cachefile_save(hash_path, HASH_MAGIC,
+			HASH_VERSION, entries, sizeof(entries)))
+		hashes_dirty = FALSE;
+	hashes_saved = time((time_t*)NULL);
+}
+
+static MFT_REF inode_mref(ntfs_inode *ni)
+{
+	return (MK_MREF(ni->mft_no, le16_to_cpu(ni->mrec->sequence_number)));
+}
+
+/*
+ *		Find the entry of an inode
+ *
+ *	Must be called with the lock held.
+ */
+
+static struct HASH_ENTRY *find_entry(ntfs_inode *ni)
+{
+	struct HASH_ENTRY *set;
+	MFT_REF mref;
+	int i;
+
+	if (!hashes_loaded)
+		load_hashes(ni->vol);
+	mref = inode_mref(ni);
+	set = entries[(mref ^ (mref >> 48)) % HASH_SETS];
+	for (i=0; i<HASH_WAYS; i++)
+		if (set[i].mref == mref)
+			return (&set[i]);
+	return ((struct HASH_ENTRY*)NULL);
+}
+
+/*
+ *		Record the hash of the current data of an inode
+ *
+ *	The entry committed least recently in the set is replaced if
+ *	there is no room.
+ */
+
+void onedrive_hash_commit(ntfs_inode *ni, const u8 *reg)
+{
+	struct HASH_ENTRY *set;
+	struct HASH_ENTRY *h;
+	MFT_REF mref;
+	time_t now;
+	int i;
+
+	now = time((time_t*)NULL);
+	mref = inode_mref(ni);
+	pthread_mutex_lock(&hash_lock);
+	h = find_entry(ni);
+	if (!h) {
+		set = entries[(mref ^ (mref >> 48)) % HASH_SETS];
+		h = &set[0];
+		for (i=1; (i<HASH_WAYS) && h->mref; i++)
+			if (!set[i].mref || (set[i].when < h->when))
+				h = &set[i];
+	}
+	h->mref = mref;
+	h->size = ni->data_size;
+	h->changed = sle64_to_cpu(ni->last_data_change_time);
+	h->when = now;
+	memcpy(h->reg, reg, ONEDRIVE_QXH_SIZE);
+	hashes_dirty = TRUE;
+	events[ONEDRIVE_HASH_COMMITTED]++;
+	if ((now - hashes_saved) >= HASH_SAVE_INTERVAL)
+		save_hashes();
+	pthread_mutex_unlock(&hash_lock);
+}
+
+/*
+ *		Get the register of the current data of an inode
+ *
+ *	Returns FALSE if the data was changed since it was hashed.
+ */
+
+BOOL onedrive_hash_get(ntfs_inode *ni, u8 *reg)
+{
+	const struct HASH_ENTRY *h;
+	BOOL found;
+
+	found = FALSE;
+	pthread_mutex_lock(&hash_lock);
+	h = find_entry(ni);
+	if (h && (h->size == ni->data_size)
+	    && (h->changed == sle64_to_cpu(ni->last_data_change_time))) {
+		memcpy(reg, h->reg, ONEDRIVE_QXH_SIZE);
+		found = TRUE;
+	}
+	pthread_mutex_unlock(&hash_lock);
+	return (found);
+}
+
+/*
+ *		Forget the hash of an inode whose data is changing
+ */
+
+void onedrive_hash_forget(ntfs_inode *ni)
+{
+	struct HASH_ENTRY *h;
+
+	pthread_mutex_lock(&hash_lock);
+	h = find_entry(ni);
+	if (h) {
+		memset(h, 0, sizeof(struct HASH_ENTRY));
+		hashes_dirty = TRUE;
+	}
+	pthread_mutex_unlock(&hash_lock);
+}
+
+void onedrive_hash_event(enum ONEDRIVE_HASH_EVENTS event)
+{
+	pthread_mutex_lock(&hash_lock);
+	events[event]++;
+	pthread_mutex_unlock(&hash_lock);
+}
+
+void onedrive_hash_report(FILE *f)
+{
+	int count;
+	int i, j;
+
+	pthread_mutex_lock(&hash_lock);
+	if (events[ONEDRIVE_HASH_STARTED]) {
+		count = 0;
+		for (i=0; i<HASH_SETS; i++)
+			for (j=0; j<HASH_WAYS; j++)
+				if (entries[i][j].mref)
+					count++;
+		fprintf(f, "content hash : %llu files hashed while written"
+			" (%llu appended to), %llu committed, %llu dropped"
+			" (%llu rewritten, %llu other writer, %llu"
+			" truncated, %llu scattered), %d cached\n",
+			(unsigned long long)events[ONEDRIVE_HASH_STARTED],
+			(unsigned long long)events[ONEDRIVE_HASH_SEEDED],
+			(unsigned long long)events[ONEDRIVE_HASH_COMMITTED],
+			(unsigned long long)(events[ONEDRIVE_HASH_REWRITTEN]
+				+ events[ONEDRIVE_HASH_OTHER_WRITER]
+				+ events[ONEDRIVE_HASH_TRUNCATED]
+				+ events[ONEDRIVE_HASH_SCATTERED]),
+			(unsigned long long)events[ONEDRIVE_HASH_REWRITTEN],
+			(unsigned long long)events[ONEDRIVE_HASH_OTHER_WRITER],
+			(unsigned long long)events[ONEDRIVE_HASH_TRUNCATED],
+			(unsigned long long)events[ONEDRIVE_HASH_SCATTERED],
+			count);
+	}
+	pthread_mutex_unlock(&hash_lock);
+}
+
+static void __attribute__((destructor)) hash_exit(void)
+{
+	pthread_mutex_lock(&hash_lock);
+	save_hashes();
+	pthread_mutex_unlock(&hash_lock);
+}
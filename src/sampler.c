@@ -0,0 +1,463 @@
+/*
+ * sampler.c - Sampling profiler of the OneDrive plugin
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	When the environment variable ONEDRIVE_SAMPLER designates a file,
+ *	the stacks of the threads running plugin operations are sampled
+ *	ONEDRIVE_SAMPLER_HZ times per second of CPU time (default 99),
+ *	and written to the file in the folded format used to draw flame
+ *	graphs, one line per distinct stack followed by its count.
+ *
+ *	Each thread entering a plugin operation for the first time gets
+ *	a timer on its own CPU clock, which sends SIGPROF to the thread.
+ *	The handler only records a stack when the thread is within an
+ *	operation (including the libntfs-3g calls made from it), into a
+ *	ring of slots reserved without locking. The ring is drained
+ *	into a table of distinct stacks when an operation ends, so that
+ *	nothing is allocated in the handler.
+ *
+ *	The stacks are symbolized when written : the frames outer to the
+ *	plugin are dropped, and the frames which cannot be named from
+ *	the dynamic symbols are shown as module+offset. The functions
+ *	which are not exported are named after the exported symbol
+ *	preceding them.
+ *
+ *	The file is rewritten every SAMPLER_WRITE_INTERVAL, when a
+ *	statistics report is made and when the plugin is unloaded. The
+ *	CPU time spent in the handler is measured and shown in the
+ *	report, relative to the sampled time.
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include <stdio.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <sys/syscall.h>
+
+#include <ntfs-3g/types.h>
+#include <ntfs-3g/layout.h>
+#include <ntfs-3g/inode.h>
+#include <ntfs-3g/logging.h>
+
+#include "onedrive.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#define DEFAULT_SAMPLER_HZ 99
+#define MAX_SAMPLER_HZ 1000
+#define SAMPLE_DEPTH 48
+#define SAMPLE_SKIP 2			/* the handler and signal frame */
+#define RING_SLOTS 1024
+#define STACK_BUCKETS 1024
+#define MAX_STACKS 16384
+#define SAMPLER_WRITE_INTERVAL 60	/* seconds */
+
+struct SAMPLE_SLOT {
+	volatile int ready;
+	int depth;
+	void *frames[SAMPLE_DEPTH];
+} ;
+
+struct SAMPLED_STACK {
+	struct SAMPLED_STACK *next;
+	u64 count;
+	u32 hash;
+	int depth;
+	void *frames[];
+} ;
+
+static pthread_mutex_t sampler_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char *sampler_file = (const char*)NULL;
+static long sampler_hz = DEFAULT_SAMPLER_HZ;
+static pthread_key_t timer_key;
+static struct SAMPLE_SLOT *ring = (struct SAMPLE_SLOT*)NULL;
+static u64 ring_head = 0;		/* next slot to reserve */
+static u64 ring_tail = 0;		/* next slot to drain */
+static struct SAMPLED_STACK *stacks[STACK_BUCKETS];
+static int stack_count = 0;
+static u64 samples = 0;			/* drained into the stacks */
+static u64 lost = 0;			/* beyond MAX_STACKS */
+static u64 dropped = 0;			/* ring full */
+static u64 outside = 0;			/* not within an operation */
+static u64 handler_ns = 0;
+static time_t written = 0;
+static void *plugin_base = (void*)NULL;
+
+/*
+ *	The thread-local variables are first touched out of the handler,
+ *	as their allocation in a loaded module is not signal-safe.
+ */
+
+static __thread volatile sig_atomic_t in_op = 0;
+static __thread BOOL timer_made = FALSE;
+
+static void sampler_signal(int sig __attribute__((unused)),
+			siginfo_t *info __attribute__((unused)),
+			void *context __attribute__((unused)))
+{
+	struct SAMPLE_SLOT *slot;
+	struct timespec start;
+	struct timespec end;
+	int olderrno;
+	u64 pos;
+
+	if (!in_op) {
+		__atomic_add_fetch(&outside, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	olderrno = errno;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+	do {
+		if ((pos - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE))
+				>= RING_SLOTS) {
+			__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+			errno = olderrno;
+			return;
+		}
+	} while (!__atomic_compare_exchange_n(&ring_head, &pos, pos + 1,
+			FALSE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+	slot = &ring[pos % RING_SLOTS];
+	slot->depth = backtrace(slot->frames, SAMPLE_DEPTH);
+	__atomic_store_n(&slot->ready, 1, __ATOMIC_RELEASE);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	__atomic_add_fetch(&handler_ns, (u64)(end.tv_sec - start.tv_sec)
+			*1000000000 + end.tv_nsec - start.tv_nsec,
+			__ATOMIC_RELAXED);
+	errno = olderrno;
+}
+
+static void delete_timer(void *timer)
+{
+	timer_delete((timer_t)timer);
+}
+
+/*
+ *		Get the settings and catch SIGPROF
+ *
+ *	backtrace() is called once here, as its first call loads the
+ *	unwinder, which must not happen in the handler.
+ */
+
+void onedrive_sampler_init(void)
+{
+	struct sigaction sa;
+	struct sigaction old;
+	const char *value;
+	Dl_info info;
+	void *frame;
+
+	sampler_file = getenv("ONEDRIVE_SAMPLER");
+	if (!sampler_file || !sampler_file[0]) {
+		sampler_file = (const char*)NULL;
+		return;
+	}
+	value = getenv("ONEDRIVE_SAMPLER_HZ");
+	if (value && value[0]) {
+		sampler_hz = atol(value);
+		if (sampler_hz <= 0)
+			sampler_hz = DEFAULT_SAMPLER_HZ;
+		if (sampler_hz > MAX_SAMPLER_HZ)
+			sampler_hz = MAX_SAMPLER_HZ;
+	}
+	ring = (struct SAMPLE_SLOT*)calloc(RING_SLOTS,
+				sizeof(struct SAMPLE_SLOT));
+	if (!ring
+	    || pthread_key_create(&timer_key, delete_timer)
+	    || sigaction(SIGPROF, (struct sigaction*)NULL, &old)
+	    || (old.sa_handler != SIG_DFL)) {
+		ntfs_log_error("OneDrive could not start the sampler\n");
+		free(ring);
+		ring = (struct SAMPLE_SLOT*)NULL;
+		sampler_file = (const char*)NULL;
+		return;
+	}
+	if (dladdr((void*)onedrive_sampler_init, &info))
+		plugin_base = info.dli_fbase;
+	backtrace(&frame, 1);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = sampler_signal;
+	sa.sa_flags = SA_RESTART | SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGPROF, &sa, (struct sigaction*)NULL);
+	written = time((time_t*)NULL);
+}
+
+/*
+ *		Start the timer of the current thread
+ */
+
+static void start_timer(void)
+{
+	struct sigevent sev;
+	struct itimerspec its;
+	timer_t timer;
+
+	timer_made = TRUE;
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = SIGPROF;
+	sev.sigev_notify_thread_id = syscall(SYS_gettid);
+	if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &timer)) {
+		ntfs_log_perror("OneDrive could not create a sampling"
+				" timer");
+		return;
+	}
+	its.it_interval.tv_sec = 1/sampler_hz;
+	its.it_interval.tv_nsec = (1000000000/sampler_hz) % 1000000000;
+	its.it_value = its.it_interval;
+	if (timer_settime(timer, 0, &its, (struct itimerspec*)NULL)) {
+		ntfs_log_perror("OneDrive could not start a sampling"
+				" timer");
+		timer_delete(timer);
+		return;
+	}
+	pthread_setspecific(timer_key, (void*)timer);
+}
+
+/*
+ *		Hash a stack
+ */
+
+static u32 stack_hash(void * const *frames, int depth)
+{
+	u64 h;
+	int i;
+
+	h = depth;
+	for (i=0; i<depth; i++)
+		h = (h ^ (u64)(unsigned long)frames[i]) * 0x100000001b3ULL;
+	return ((u32)(h ^ (h >> 32)));
+}
+
+/*
+ *		Move the ready slots of the ring to the table of stacks
+ *
+ *	Must be called with the lock held
+ */
+
+static void drain_ring(void)
+{
+	struct SAMPLE_SLOT *slot;
+	struct SAMPLED_STACK *ps;
+	void * const *frames;
+	int depth;
+	u32 hash;
+
+	for (slot=&ring[ring_tail % RING_SLOTS];
+	    __atomic_load_n(&slot->ready, __ATOMIC_ACQUIRE);
+	    slot=&ring[ring_tail % RING_SLOTS]) {
+		depth = slot->depth - SAMPLE_SKIP;
+		if (depth > 0) {
+			frames = &slot->frames[SAMPLE_SKIP];
+			hash = stack_hash(frames, depth);
+			for (ps=stacks[hash % STACK_BUCKETS];
+			    ps && ((ps->hash != hash)
+				|| (ps->depth != depth)
+				|| memcmp(ps->frames, frames,
+					depth*sizeof(void*)));
+			    ps=ps->next) { }
+			if (!ps && (stack_count < MAX_STACKS)) {
+				ps = (struct SAMPLED_STACK*)malloc(
+					sizeof(struct SAMPLED_STACK)
+						+ depth*sizeof(void*));
+				if (ps) {
+					ps->count = 0;
+					ps->hash = hash;
+					ps->depth = depth;
+					memcpy(ps->frames, frames,
+						depth*sizeof(void*));
+					ps->next = stacks[hash % STACK_BUCKETS];
+					stacks[hash % STACK_BUCKETS] = ps;
+					stack_count++;
+				}
+			}
+			if (ps) {
+				ps->count++;
+				samples++;
+			} else
+				lost++;
+		}
+		__atomic_store_n(&slot->ready, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&ring_tail, ring_tail + 1, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ *		Write the name of a frame
+ */
+
+static void write_frame(FILE *f, void *addr)
+{
+	const char *module;
+	Dl_info info;
+
+	if (!dladdr(addr, &info))
+		fprintf(f, "%p", addr);
+	else
+		if (info.dli_sname)
+			fputs(info.dli_sname, f);
+		else {
+			module = (info.dli_fname
+					? strrchr(info.dli_fname, '/')
+					: (const char*)NULL);
+			module = (module ? module + 1 : info.dli_fname);
+			fprintf(f, "%s+0x%lx", (module ? module : "?"),
+				(long)((char*)addr - (char*)info.dli_fbase));
+		}
+}
+
+/*
+ *		Write the stacks in folded format
+ *
+ *	The outermost frames, up to the first one in the plugin, are not
+ *	written, they are the same for all the samples. The frames are
+ *	written outermost first, as expected by flame graph tools.
+ *
+ *	Must be called with the lock held
+ */
+
+static void write_stacks(void)
+{
+	char tmpname[4096];
+	struct SAMPLED_STACK *ps;
+	Dl_info info;
+	FILE *f;
+	int outer;
+	int i;
+	int j;
+
+	written = time((time_t*)NULL);
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", sampler_file);
+	f = fopen(tmpname, "w");
+	if (!f) {
+		ntfs_log_error("OneDrive could not write samples to %s\n",
+				sampler_file);
+		return;
+	}
+	for (i=0; i<STACK_BUCKETS; i++)
+		for (ps=stacks[i]; ps; ps=ps->next) {
+			outer = ps->depth - 1;
+			while ((outer > 0)
+			    && (!dladdr(ps->frames[outer], &info)
+				|| (info.dli_fbase != plugin_base)))
+				outer--;
+			for (j=outer; j>=0; j--) {
+				write_frame(f, ps->frames[j]);
+				putc((j ? ';' : ' '), f);
+			}
+			fprintf(f, "%llu\n", (unsigned long long)ps->count);
+		}
+	if (fclose(f) || rename(tmpname, sampler_file)) {
+		ntfs_log_error("OneDrive could not write samples to %s\n",
+				sampler_file);
+		unlink(tmpname);
+	}
+}
+
+/*
+ *		Enter an outer plugin operation
+ */
+
+void onedrive_sampler_begin(void)
+{
+	if (sampler_file) {
+		in_op = 1;
+		if (!timer_made)
+			start_timer();
+	}
+}
+
+/*
+ *		Leave an outer plugin operation
+ */
+
+void onedrive_sampler_end(void)
+{
+	if (sampler_file) {
+		in_op = 0;
+		if (__atomic_load_n(&ring[ring_tail % RING_SLOTS].ready,
+				__ATOMIC_ACQUIRE)
+		    && !pthread_mutex_trylock(&sampler_lock)) {
+			drain_ring();
+			if ((time((time_t*)NULL) - written)
+					>= SAMPLER_WRITE_INTERVAL)
+				write_stacks();
+			pthread_mutex_unlock(&sampler_lock);
+		}
+	}
+}
+
+void onedrive_sampler_report(FILE *f)
+{
+	u64 sampled_ns;
+
+	if (sampler_file) {
+		pthread_mutex_lock(&sampler_lock);
+		drain_ring();
+		write_stacks();
+		sampled_ns = (samples + lost + dropped + outside)
+				* (1000000000/sampler_hz);
+		fprintf(f, "sampler : %llu samples in %d stacks at %ld Hz,"
+			" %llu lost, %llu dropped, %llu out of operations,"
+			" overhead %.3f%%\n",
+			(unsigned long long)samples, stack_count, sampler_hz,
+			(unsigned long long)lost,
+			(unsigned long long)dropped,
+			(unsigned long long)outside,
+			(sampled_ns ? 100.0*handler_ns/sampled_ns : 0.0));
+		pthread_mutex_unlock(&sampler_lock);
+	}
+}
+
+/*
+ *		Write the samples when the plugin is unloaded
+ */
+
+static void __attribute__((destructor)) sampler_exit(void)
+{
+	if (sampler_file) {
+		signal(SIGPROF, SIG_IGN);
+		pthread_mutex_lock(&sampler_lock);
+		drain_ring();
+		write_stacks();
+		pthread_mutex_unlock(&sampler_lock);
+	}
+}
@@ -0,0 +1,298 @@
+/*
+ * slowop.c - Recording the slow operations of the OneDrive plugin
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	An operation lasting longer than the threshold set by the
+ *	environment variable ONEDRIVE_SLOW_MS (default 200, zero to
+ *	disable) is recorded with its context : inode, path, range,
+ *	fragment count of the attribute, cache outcomes, device I/O and
+ *	time spent in each phase. The last SLOW_SLOTS ones are kept and
+ *	shown in the statistics report.
+ *
+ *	The path is only determined for the operations found slow, by
+ *	following the parent directories up to the root.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <ntfs-3g/types.h>
+#include <ntfs-3g/layout.h>
+#include <ntfs-3g/inode.h>
+#include <ntfs-3g/attrib.h>
+#include <ntfs-3g/unistr.h>
+
+#include "onedrive.h"
+
+#define DEFAULT_SLOW_MS 200
+#define SLOW_SLOTS 64
+#define PATH_MAX_DEPTH 64
+
+struct SLOW_OP {
+	enum ONEDRIVE_OPS type;
+	time_t when;
+	u64 mft_no;
+	s64 offset;
+	s64 size;
+	u64 ns;
+	u64 phase_ns[ONEDRIVE_PHASES_COUNT];
+	u32 fragments;
+	u32 cache_hits;
+	u32 cache_misses;
+	u64 dev_ios;
+	s64 dev_bytes;
+	int res;
+	char path[256];
+} ;
+
+static const char *phase_names[ONEDRIVE_PHASES_COUNT] = {
+	"plugin", "attr_open", "io", "close", "fetch"
+} ;
+
+static pthread_mutex_t slow_lock = PTHREAD_MUTEX_INITIALIZER;
+static u64 slow_ns = (u64)DEFAULT_SLOW_MS*1000000;
+static struct SLOW_OP slow_ops[SLOW_SLOTS];
+static u64 slow_count[ONEDRIVE_OPS_COUNT];
+static unsigned int slow_next = 0;
+static u64 slow_total = 0;
+
+void onedrive_slowop_init(void)
+{
+	const char *value;
+
+	value = getenv("ONEDRIVE_SLOW_MS");
+	if (value && value[0])
+		slow_ns = strtoull(value, (char**)NULL, 10)*1000000;
+}
+
+/*
+ *		Check whether the current operation is already slow
+ *
+ *	This is meant for collecting details which are too costly to
+ *	get for every operation.
+ */
+
+BOOL onedrive_op_is_slow(const struct ONEDRIVE_OP *op)
+{
+	return (slow_ns && (onedrive_elapsed_ns(&op->start) >= slow_ns));
+}
+
+/*
+ *		Count the fragments of the mapped part of an attribute
+ */
+
+u32 onedrive_count_fragments(const ntfs_attr *na)
+{
+	const runlist_element *rl;
+	u32 count;
+
+	count = 0;
+	if (NAttrNonResident(na) && na->rl)
+		for (rl=na->rl; rl->length; rl++)
+			if (rl->lcn >= 0)
+				count++;
+	return (count);
+}
+
+/*
+ *		Get the name of an inode and its parent directory
+ *
+ *	Returns the count of chars of the name, or -1
+ */
+
+int onedrive_inode_name(ntfs_inode *ni, char *buf, int size, MFT_REF *parent)
+{
+	ntfs_attr_search_ctx *ctx;
+	const FILE_NAME_ATTR *fn;
+	ntfschar uname[256];		/* the name length is a u8 */
+	char *name;
+	int len;
+
+	len = -1;
+	ctx = ntfs_attr_get_search_ctx(ni, (MFT_RECORD*)NULL);
+	if (!ctx)
+		return (-1);
+	while ((len < 0)
+	    && !ntfs_attr_lookup(AT_FILE_NAME, (ntfschar*)NULL, 0,
+			CASE_SENSITIVE, 0, (u8*)NULL, 0, ctx)) {
+		fn = (const FILE_NAME_ATTR*)((const char*)ctx->attr
+				+ le16_to_cpu(ctx->attr->value_offset));
+		if (fn->file_name_type == FILE_NAME_DOS)
+			continue;
+		name = (char*)NULL;
+			/* the name may not be aligned */
+		memcpy(uname, fn->file_name, 2*fn->file_name_length);
+		if (ntfs_ucstombs(uname, fn->file_name_length,
+				&name, 0) >= 0) {
+			strncpy(buf, name, size - 1);
+			buf[size - 1] = 0;
+			len = strlen(buf);
+			free(name);
+			*parent = le64_to_cpu(fn->parent_directory);
+		}
+	}
+	ntfs_attr_put_search_ctx(ctx);
+	return (len);
+}
+
+/*
+ *		Build the path of an inode from the root of the volume
+ *
+ *	The path is truncated on the left if too long, and it is left
+ *	incomplete if some directory cannot be opened.
+ */
+
+void onedrive_inode_path(ntfs_inode *ni, char *path, int size)
+{
+	char name[256];
+	ntfs_inode *dir_ni;
+	MFT_REF parent;
+	int depth;
+	int pos;
+	int len;
+
+	pos = size - 1;
+	path[pos] = 0;
+	dir_ni = ni;
+	depth = 0;
+	while (dir_ni && (dir_ni->mft_no != FILE_root)
+	    && (depth++ < PATH_MAX_DEPTH) && (pos >= 4)) {
+		len = onedrive_inode_name(dir_ni, name, sizeof(name), &parent);
+		if (dir_ni != ni)
+			ntfs_inode_close(dir_ni);
+		dir_ni = (ntfs_inode*)NULL;
+		if (len >= 0) {
+			if (len >= pos) {
+				len = pos - 1;
+				memcpy(name, "...", 3);
+			}
+			pos -= len;
+			memcpy(&path[pos], name, len);
+			path[--pos] = '/';
+			dir_ni = ntfs_inode_open(ni->vol, parent);
+		}
+	}
+	if (dir_ni && (dir_ni != ni))
+		ntfs_inode_close(dir_ni);
+	memmove(path, &path[pos], size - pos);
+}
+
+/*
+ *		Record an operation found slow when ending
+ */
+
+void onedrive_slowop_record(struct ONEDRIVE_OP *op, u64 ns, s64 res)
+{
+	struct SLOW_OP *so;
+	char path[sizeof(so->path)];
+
+	if (!slow_ns || (ns < slow_ns))
+		return;
+	path[0] = 0;
+	if (op->path) {
+		strncpy(path, op->path, sizeof(path) - 1);
+		path[sizeof(path) - 1] = 0;
+	} else
+		if (op->ni)
+			onedrive_inode_path(op->ni, path, sizeof(path));
+
+	pthread_mutex_lock(&slow_lock);
+	so = &slow_ops[slow_next];
+	slow_next = (slow_next + 1) % SLOW_SLOTS;
+	slow_total++;
+	slow_count[op->type]++;
+	so->type = op->type;
+	so->when = time((time_t*)NULL);
+	so->mft_no = op->mft_no;
+	so->offset = op->offset;
+	so->size = op->size;
+	so->ns = ns;
+	memcpy(so->phase_ns, op->phase_ns, sizeof(so->phase_ns));
+	so->fragments = op->fragments;
+	so->cache_hits = op->cache_hits;
+	so->cache_misses = op->cache_misses;
+	so->dev_ios = op->dev_reads + op->dev_writes;
+	so->dev_bytes = op->dev_read_bytes + op->dev_write_bytes;
+	so->res = (res < 0 ? res : 0);
+	strcpy(so->path, path);
+	pthread_mutex_unlock(&slow_lock);
+}
+
+void onedrive_slowop_report(FILE *f)
+{
+	const struct SLOW_OP *so;
+	struct tm tm;
+	char when[32];
+	unsigned int count;
+	unsigned int i;
+	int j;
+
+	pthread_mutex_lock(&slow_lock);
+	if (!slow_total) {
+		pthread_mutex_unlock(&slow_lock);
+		return;
+	}
+	fprintf(f, "slow operations (over %llu ms) : %llu\n",
+		(unsigned long long)(slow_ns/1000000),
+		(unsigned long long)slow_total);
+	for (j=0; j<ONEDRIVE_OPS_COUNT; j++)
+		if (slow_count[j])
+			fprintf(f, "  %-9s %llu\n", onedrive_op_name(j),
+				(unsigned long long)slow_count[j]);
+	count = (slow_total < SLOW_SLOTS ? slow_total : SLOW_SLOTS);
+	for (i=0; i<count; i++) {
+		so = &slow_ops[(slow_next + SLOW_SLOTS - count + i)
+				% SLOW_SLOTS];
+		localtime_r(&so->when, &tm);
+		strftime(when, sizeof(when), "%F %T", &tm);
+		fprintf(f, "%s %s %.3f ms inode %llu \"%s\" offset %lld"
+				" size %lld res %d\n",
+			when, onedrive_op_name(so->type),
+			(double)so->ns/1000000,
+			(unsigned long long)so->mft_no, so->path,
+			(long long)so->offset, (long long)so->size,
+			so->res);
+		fprintf(f, "    fragments %lu", (unsigned long)so->fragments);
+			/* only for operations which have a cache */
+		if (so->cache_hits || so->cache_misses)
+			fprintf(f, " cache %lu hit %lu miss",
+				(unsigned long)so->cache_hits,
+				(unsigned long)so->cache_misses);
+		fprintf(f, ", device %llu I/O %lld bytes,",
+			(unsigned long long)so->dev_ios,
+			(long long)so->dev_bytes);
+		for (j=0; j<ONEDRIVE_PHASES_COUNT; j++)
+			if (so->phase_ns[j])
+				fprintf(f, " %s %.3f", phase_names[j],
+					(double)so->phase_ns[j]/1000000);
+		fprintf(f, " ms\n");
+	}
+	pthread_mutex_unlock(&slow_lock);
+}
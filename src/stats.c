@@ -0,0 +1,397 @@
+/*
+ * stats.c - Statistics on the operations of the OneDrive plugin
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	Each plugin operation is bracketed by onedrive_op_begin() and
+ *	onedrive_op_end(), which count the calls, errors, elapsed time,
+ *	bytes requested by the application and the device I/O caused
+ *	(see iostat.c). The slow ones are recorded with more details
+ *	(see slowop.c), the requesting processes and users are ranked
+ *	(see procstat.c), and the stacks may be sampled (see sampler.c).
+ *
+ *	A report is produced when the process gets SIGUSR2, and when the
+ *	plugin is unloaded. It is written to the file designated by the
+ *	environment variable ONEDRIVE_STATS_FILE, or logged when the
+ *	variable is not set. As the signal may come at any time, the
+ *	handler only records the request, and the report is produced
+ *	when the next operation begins.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include <stdio.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <ntfs-3g/types.h>
+#include <ntfs-3g/layout.h>
+#include <ntfs-3g/inode.h>
+#include <ntfs-3g/logging.h>
+
+#include "onedrive.h"
+
+struct OP_STATS {
+	u64 calls;
+	u64 errors;
+	u64 total_ns;
+	u64 max_ns;
+	s64 app_bytes;
+	u64 dev_reads;
+	u64 dev_writes;
+	s64 dev_read_bytes;
+	s64 dev_write_bytes;
+} ;
+
+static const char *op_names[ONEDRIVE_OPS_COUNT] = {
+	"getattr", "open", "release", "read", "write", "truncate",
+	"opendir", "readdir", "create", "link", "unlink"
+} ;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct OP_STATS op_stats[ONEDRIVE_OPS_COUNT];
+static struct timespec start_time;
+static struct timespec last_end;	/* of an outermost operation */
+static const char *stats_file = (const char*)NULL;
+static volatile sig_atomic_t report_requested = 0;
+
+static __thread struct ONEDRIVE_OP *current_op = (struct ONEDRIVE_OP*)NULL;
+
+static void stats_signal(int sig __attribute__((unused)))
+{
+	report_requested = 1;
+}
+
+/*
+ *		Get the settings and catch SIGUSR2
+ *
+ *	The signal is not caught if ntfs-3g uses it for its own needs.
+ */
+
+void onedrive_stats_init(void)
+{
+	struct sigaction sa;
+	struct sigaction old;
+
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	stats_file = getenv("ONEDRIVE_STATS_FILE");
+	if (stats_file && !stats_file[0])
+		stats_file = (const char*)NULL;
+	if (!sigaction(SIGUSR2, (struct sigaction*)NULL, &old)
+	    && (old.sa_handler == SIG_DFL)) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = stats_signal;
+		sa.sa_flags = SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGUSR2, &sa, (struct sigaction*)NULL);
+	}
+}
+
+u64 onedrive_elapsed_ns(const struct timespec *from)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((u64)(now.tv_sec - from->tv_sec)*1000000000
+			+ now.tv_nsec - from->tv_nsec);
+}
+
+/*
+ *		Get the operation being run by the current thread
+ */
+
+struct ONEDRIVE_OP *onedrive_current_op(void)
+{
+	return (current_op);
+}
+
+const char *onedrive_op_name(enum ONEDRIVE_OPS type)
+{
+	return (op_names[type]);
+}
+
+/*
+ *		Begin a plugin operation
+ */
+
+void onedrive_op_begin(struct ONEDRIVE_OP *op, enum ONEDRIVE_OPS type,
+			ntfs_inode *ni)
+{
+	if (report_requested)
+		onedrive_stats_report();
+	memset(op, 0, sizeof(struct ONEDRIVE_OP));
+	op->type = type;
+	op->ni = ni;
+	op->mft_no = (ni ? ni->mft_no : 0);
+	op->outer = current_op;
+	current_op = op;
+	if (!op->outer)
+		onedrive_sampler_begin();
+	onedrive_iostat_begin(op, ni);
+	clock_gettime(CLOCK_MONOTONIC, &op->start);
+	op->phase = ONEDRIVE_PHASE_PLUGIN;
+	op->phase_start = op->start;
+}
+
+/*
+ *		Switch an operation to another phase
+ */
+
+void onedrive_op_phase(struct ONEDRIVE_OP *op, enum ONEDRIVE_PHASES phase)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	op->phase_ns[op->phase] += (u64)(now.tv_sec
+				- op->phase_start.tv_sec)*1000000000
+			+ now.tv_nsec - op->phase_start.tv_nsec;
+	op->phase = phase;
+	op->phase_start = now;
+}
+
+/*
+ *		End a plugin operation
+ *
+ *	"res" is the value to be returned by the operation : a negative
+ *	error code, or the count of bytes transferred for read and write.
+ *	errno is preserved for the operations which return it.
+ */
+
+void onedrive_op_end(struct ONEDRIVE_OP *op, s64 res)
+{
+	struct OP_STATS *ps;
+	int olderrno;
+	u64 ns;
+
+	olderrno = errno;
+	onedrive_op_phase(op, ONEDRIVE_PHASE_PLUGIN);
+	ns = onedrive_elapsed_ns(&op->start);
+	if (res > 0)
+		op->app_bytes = res;
+	current_op = op->outer;
+	onedrive_iostat_end(op);
+	onedrive_slowop_record(op, ns, res);
+	if (!op->outer) {
+		pthread_mutex_lock(&stats_lock);
+		clock_gettime(CLOCK_MONOTONIC, &last_end);
+		pthread_mutex_unlock(&stats_lock);
+		onedrive_procstat_charge(op->app_bytes, ns);
+		onedrive_errstat_tick();
+		onedrive_sampler_end();
+	}
+
+	pthread_mutex_lock(&stats_lock);
+	ps = &op_stats[op->type];
+	ps->calls++;
+	if (res < 0)
+		ps->errors++;
+	ps->total_ns += ns;
+	if (ns > ps->max_ns)
+		ps->max_ns = ns;
+	ps->app_bytes += op->app_bytes;
+	ps->dev_reads += op->dev_reads;
+	ps->dev_writes += op->dev_writes;
+	ps->dev_read_bytes += op->dev_read_bytes;
+	ps->dev_write_bytes += op->dev_write_bytes;
+	pthread_mutex_unlock(&stats_lock);
+	errno = olderrno;
+}
+
+/*
+ *		Get the time elapsed since the last operation ended
+ *
+ *	This is the time since the plugin was started if no operation
+ *	ended yet.
+ */
+
+u64 onedrive_quiet_ns(void)
+{
+	u64 ns;
+
+	pthread_mutex_lock(&stats_lock);
+	ns = onedrive_elapsed_ns(last_end.tv_sec ? &last_end : &start_time);
+	pthread_mutex_unlock(&stats_lock);
+	return (ns);
+}
+
+/*
+ *		Charge device I/O which happened after an operation ended
+ *
+ *	This is the I/O done by ntfs-3g when closing the inode, mostly
+ *	updating the MFT record.
+ */
+
+void onedrive_stats_trailing_io(enum ONEDRIVE_OPS type, BOOL write,
+			s64 bytes)
+{
+	struct OP_STATS *ps;
+
+	pthread_mutex_lock(&stats_lock);
+	ps = &op_stats[type];
+	if (write) {
+		ps->dev_writes++;
+		ps->dev_write_bytes += bytes;
+	} else {
+		ps->dev_reads++;
+		ps->dev_read_bytes += bytes;
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ *		Format an amplification ratio
+ */
+
+static const char *ratio(char *buf, s64 dev, s64 app)
+{
+	if (app > 0)
+		sprintf(buf, "%.2f", (double)dev/app);
+	else
+		strcpy(buf, "-");
+	return (buf);
+}
+
+static void report_ops(FILE *f)
+{
+	struct OP_STATS snap[ONEDRIVE_OPS_COUNT];
+	char rbuf[24];
+	char wbuf[24];
+	int i;
+
+	pthread_mutex_lock(&stats_lock);
+	memcpy(snap, op_stats, sizeof(snap));
+	pthread_mutex_unlock(&stats_lock);
+	fprintf(f, "%-9s %10s %7s %9s %9s %12s %12s %12s %6s %6s\n",
+		"op", "calls", "errors", "avg_us", "max_us", "app_bytes",
+		"dev_read", "dev_write", "r_amp", "w_amp");
+	for (i=0; i<ONEDRIVE_OPS_COUNT; i++) {
+		if (!snap[i].calls)
+			continue;
+		fprintf(f, "%-9s %10llu %7llu %9llu %9llu %12lld %12lld"
+				" %12lld %6s %6s\n",
+			op_names[i],
+			(unsigned long long)snap[i].calls,
+			(unsigned long long)snap[i].errors,
+			(unsigned long long)(snap[i].total_ns
+					/ snap[i].calls / 1000),
+			(unsigned long long)(snap[i].max_ns / 1000),
+			(long long)snap[i].app_bytes,
+			(long long)snap[i].dev_read_bytes,
+			(long long)snap[i].dev_write_bytes,
+			ratio(rbuf, snap[i].dev_read_bytes,
+				(i == ONEDRIVE_READ ? snap[i].app_bytes : 0)),
+			ratio(wbuf, snap[i].dev_write_bytes,
+				(i == ONEDRIVE_WRITE ? snap[i].app_bytes : 0)));
+	}
+}
+
+static void report(FILE *f)
+{
+	fprintf(f, "OneDrive plugin %s statistics, pid %ld, up %llu s\n",
+		ONEDRIVE_VERSION, (long)getpid(),
+		(unsigned long long)(onedrive_elapsed_ns(&start_time)
+				/ 1000000000));
+	report_ops(f);
+	onedrive_iostat_report(f);
+	onedrive_procstat_report(f);
+	onedrive_profile_report(f);
+	onedrive_heat_report(f);
+	onedrive_names_report(f);
+	onedrive_status_report(f);
+	onedrive_idle_report(f);
+	onedrive_bufpool_report(f);
+	onedrive_workers_report(f);
+	onedrive_compress_report(f);
+	onedrive_direct_report(f);
+	onedrive_hash_report(f);
+	onedrive_errstat_report(f);
+	onedrive_sampler_report(f);
+	onedrive_slowop_report(f);
+}
+
+/*
+ *		Produce the report
+ *
+ *	The report file is replaced atomically, so that it can be
+ *	polled. With no report file, the report is logged line by line.
+ */
+
+void onedrive_stats_report(void)
+{
+	char tmpname[4096];
+	char *buf;
+	size_t size;
+	char *line;
+	char *next;
+	FILE *f;
+
+	report_requested = 0;
+	if (stats_file) {
+		snprintf(tmpname, sizeof(tmpname), "%s.tmp", stats_file);
+		f = fopen(tmpname, "w");
+		if (f) {
+			report(f);
+			if (!fclose(f) && !rename(tmpname, stats_file))
+				return;
+			unlink(tmpname);
+		}
+		ntfs_log_error("OneDrive could not write statistics to"
+				" %s\n", stats_file);
+	} else {
+		buf = (char*)NULL;
+		size = 0;
+		f = open_memstream(&buf, &size);
+		if (f) {
+			report(f);
+			fclose(f);
+			for (line=buf; line && *line; line=next) {
+				next = strchr(line, '\n');
+				if (next)
+					*next++ = 0;
+				ntfs_log_info("%s\n", line);
+			}
+			free(buf);
+		}
+	}
+}
+
+/*
+ *		Write the final report when the plugin is unloaded
+ *
+ *	This is only done into a file, logging may no longer be possible.
+ */
+
+static void __attribute__((destructor)) stats_exit(void)
+{
+	if (stats_file)
+		onedrive_stats_report();
+}
@@ -0,0 +1,535 @@
+/*
+ * status.c - Service answering queries on the sync status of files
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	When the environment variable ONEDRIVE_STATUS_SOCKET designates
+ *	a path, a Unix socket is created there, on which file managers
+ *	can query the status of files (local, offline, pinned, modified)
+ *	to show overlay icons, without having to get the attributes of
+ *	each file through FUSE. The protocol is defined in
+ *	lib/onedrive-status.h, along with a client library.
+ *
+ *	The answers are taken from the name index (see names.c), which
+ *	records the file attributes and is kept up to date by the plugin
+ *	operations, so the service needs ONEDRIVE_CACHE_DIR to be set.
+ *	A thread serves the clients, it never calls libntfs-3g, so the
+ *	FUSE thread is only delayed while the index is locked to build
+ *	a reply. The clients are served one request at a time, and a
+ *	client which does not send its request or read its reply
+ *	within STATUS_IO_TIMEOUT, or stays idle longer, is disconnected.
+ *
+ *	As a directory can be listed through the socket, it is only
+ *	accessible to the owner of the ntfs-3g process, unless another
+ *	mode is set by ONEDRIVE_STATUS_MODE (in octal), for instance
+ *	0660 to let a group of users query the status.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <ntfs-3g/types.h>
+#include <ntfs-3g/layout.h>
+#include <ntfs-3g/volume.h>
+#include <ntfs-3g/inode.h>
+#include <ntfs-3g/logging.h>
+
+#include "onedrive.h"
+#include "names.h"
+#include "../lib/onedrive-status.h"
+
+#define STATUS_CLIENTS 16
+#define STATUS_POLL_MS 1000
+#define STATUS_IO_TIMEOUT 2		/* seconds */
+#define DEFAULT_STATUS_MODE 0600
+
+struct STATUS_REPLY {
+	char *buf;			/* header, then entries */
+	size_t size;
+	size_t alloc;
+	char *names;
+	u32 names_size;
+	u32 names_alloc;
+	u32 count;
+} ;
+
+static pthread_mutex_t status_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t status_thread;
+static char status_path[sizeof(((struct sockaddr_un*)NULL)->sun_path)] = "";
+static BOOL status_started = FALSE;
+static BOOL status_running = FALSE;
+static BOOL status_stop = FALSE;
+static int listen_fd = -1;
+static mode_t status_mode = DEFAULT_STATUS_MODE;
+
+static u64 requests = 0;
+static u64 files = 0;
+static u64 failures = 0;
+static u64 connections = 0;
+static u64 idle_closed = 0;
+static u64 total_ns = 0;
+static u64 max_ns = 0;
+
+void onedrive_status_init(void)
+{
+	const char *value;
+
+	value = getenv("ONEDRIVE_STATUS_SOCKET");
+	if (value && value[0]) {
+		if (strlen(value) < sizeof(status_path))
+			strcpy(status_path, value);
+		else
+			ntfs_log_error("OneDrive status socket path %s is"
+					" too long\n", value);
+	}
+	value = getenv("ONEDRIVE_STATUS_MODE");
+	if (value && value[0])
+		status_mode = strtoul(value, (char**)NULL, 8) & 0777;
+}
+
+/*
+ *		Translate the attributes of a file into its status
+ */
+
+static u32 file_status(const struct ONEDRIVE_NAME_INFO *info)
+{
+	u32 status;
+
+	status = ONEDRIVE_STATUS_FOUND;
+	if (info->flags & ONEDRIVE_NAME_DIR)
+		status |= ONEDRIVE_STATUS_DIR;
+	else
+		if (info->attributes & le32_to_cpu(FILE_ATTR_OFFLINE))
+			status |= ONEDRIVE_STATUS_OFFLINE;
+		else
+			status |= ONEDRIVE_STATUS_LOCAL;
+	if (info->attributes & le32_to_cpu(FILE_ATTR_PINNED))
+		status |= ONEDRIVE_STATUS_PINNED;
+	if (info->attributes & le32_to_cpu(FILE_ATTR_UNPINNED))
+		status |= ONEDRIVE_STATUS_UNPINNED;
+	if (info->flags & ONEDRIVE_NAME_MODIFIED)
+		status |= ONEDRIVE_STATUS_MODIFIED;
+	if (info->flags & ONEDRIVE_NAME_ABOVE)
+		status |= ONEDRIVE_STATUS_OUTSIDE;
+	return (status);
+}
+
+/*
+ *		Append an entry to a reply, with its name when listing
+ *
+ *	Returns zero, or -1 if there is no memory
+ */
+
+static int add_entry(struct STATUS_REPLY *reply,
+			const struct ONEDRIVE_NAME_INFO *info, BOOL named)
+{
+	struct ONEDRIVE_STATUS_ENTRY *entry;
+	char *newbuf;
+	char *newnames;
+
+	if ((reply->size + sizeof(struct ONEDRIVE_STATUS_ENTRY))
+			> reply->alloc) {
+		newbuf = (char*)realloc(reply->buf,
+			reply->alloc + reply->alloc/2
+			+ 256*sizeof(struct ONEDRIVE_STATUS_ENTRY));
+		if (!newbuf)
+			return (-1);
+		reply->buf = newbuf;
+		reply->alloc += reply->alloc/2
+			+ 256*sizeof(struct ONEDRIVE_STATUS_ENTRY);
+	}
+	entry = (struct ONEDRIVE_STATUS_ENTRY*)&reply->buf[reply->size];
+	memset(entry, 0, sizeof(struct ONEDRIVE_STATUS_ENTRY));
+	if (info) {
+		entry->mref = info->mref;
+		entry->status = file_status(info);
+		if (named) {
+			if ((reply->names_size + info->name_length)
+					> reply->names_alloc) {
+				newnames = (char*)realloc(reply->names,
+					reply->names_alloc
+					+ reply->names_alloc/2
+					+ info->name_length + 4096);
+				if (!newnames)
+					return (-1);
+				reply->names = newnames;
+				reply->names_alloc += reply->names_alloc/2
+					+ info->name_length + 4096;
+			}
+			memcpy(&reply->names[reply->names_size], info->name,
+					info->name_length);
+			entry->name_offset = reply->names_size;
+			entry->name_length = info->name_length;
+			reply->names_size += info->name_length;
+		}
+	}
+	reply->size += sizeof(struct ONEDRIVE_STATUS_ENTRY);
+	reply->count++;
+	return (0);
+}
+
+static int list_child(void *ctx, const struct ONEDRIVE_NAME_INFO *info)
+{
+	return (add_entry((struct STATUS_REPLY*)ctx, info, TRUE));
+}
+
+/*
+ *		Look up the files requested
+ *
+ *	Returns zero or an errno value
+ */
+
+static int answer(const struct ONEDRIVE_STATUS_REQUEST *request,
+			const char *data, struct STATUS_REPLY *reply)
+{
+	struct ONEDRIVE_NAME_INFO info;
+	const char *p;
+	u64 mref;
+	u32 i;
+	int err;
+
+	err = 0;
+		/* check the request before locking */
+	switch (request->kind) {
+	case ONEDRIVE_STATUS_BY_PATH :
+	case ONEDRIVE_STATUS_DIRECTORY :
+		p = data;
+		for (i=0; (i<request->count) && !err; i++) {
+			p = (const char*)memchr(p, '\0',
+					data + request->size - p);
+			if (p)
+				p++;
+			else
+				err = EINVAL;
+		}
+		if ((request->kind == ONEDRIVE_STATUS_DIRECTORY)
+		    && (request->count != 1))
+			err = EINVAL;
+		break;
+	case ONEDRIVE_STATUS_BY_REF :
+		if (request->size != request->count*sizeof(u64))
+			err = EINVAL;
+		break;
+	default :
+		err = EINVAL;
+		break;
+	}
+	if (err)
+		return (err);
+	if (!onedrive_names_lock())
+		return (EAGAIN);
+	p = data;
+	for (i=0; (i<request->count) && !err; i++) {
+		switch (request->kind) {
+		case ONEDRIVE_STATUS_BY_PATH :
+			if (add_entry(reply, (onedrive_names_by_path(p, &info)
+				? &info : (struct ONEDRIVE_NAME_INFO*)NULL),
+					FALSE))
+				err = ENOMEM;
+			p += strlen(p) + 1;
+			break;
+		case ONEDRIVE_STATUS_BY_REF :
+			memcpy(&mref, &data[i*sizeof(u64)], sizeof(u64));
+			if (add_entry(reply, (onedrive_names_by_mref(mref,
+					&info) ? &info
+					: (struct ONEDRIVE_NAME_INFO*)NULL),
+					FALSE))
+				err = ENOMEM;
+			break;
+		default :
+			if (!onedrive_names_by_path(p, &info))
+				err = ENOENT;
+			else
+				if (!(info.flags & ONEDRIVE_NAME_DIR))
+					err = ENOTDIR;
+				else
+					if (onedrive_names_children(info.mref,
+						list_child, reply) < 0)
+						err = ENOMEM;
+			break;
+		}
+	}
+	onedrive_names_unlock();
+	return (err);
+}
+
+static int read_all(int fd, void *buf, size_t size)
+{
+	ssize_t got;
+	size_t total;
+
+	for (total=0; total<size; total+=got) {
+		got = recv(fd, (char*)buf + total, size - total, 0);
+		if (got <= 0)
+			return (-1);
+	}
+	return (0);
+}
+
+static int send_all(int fd, const void *buf, size_t size)
+{
+	ssize_t sent;
+	size_t total;
+
+	for (total=0; total<size; total+=sent) {
+		sent = send(fd, (const char*)buf + total, size - total,
+				MSG_NOSIGNAL);
+		if (sent <= 0)
+			return (-1);
+	}
+	return (0);
+}
+
+/*
+ *		Serve a request from a client
+ *
+ *	Returns zero, or -1 if the client is to be disconnected
+ */
+
+static int serve(int fd)
+{
+	struct ONEDRIVE_STATUS_REQUEST request;
+	struct ONEDRIVE_STATUS_REPLY *header;
+	struct STATUS_REPLY reply;
+	struct timespec start;
+	char *data;
+	u64 ns;
+	int err;
+	int res;
+
+	if (read_all(fd, &request, sizeof(request)))
+		return (-1);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	memset(&reply, 0, sizeof(reply));
+	reply.size = reply.alloc = sizeof(struct ONEDRIVE_STATUS_REPLY);
+	reply.buf = (char*)malloc(reply.alloc);
+	data = (char*)NULL;
+	res = -1;
+	if (!reply.buf)
+		goto out;
+	if ((request.magic != ONEDRIVE_STATUS_MAGIC)
+	    || (request.version != ONEDRIVE_STATUS_VERSION)
+	    || (request.size > ONEDRIVE_STATUS_MAX_REQUEST))
+		err = EINVAL;
+	else {
+		data = (char*)malloc(request.size + 1);
+		if (!data)
+			goto out;
+		if (read_all(fd, data, request.size))
+			goto out;
+		err = answer(&request, data, &reply);
+		res = 0;
+	}
+	if (err) {
+		reply.size = sizeof(struct ONEDRIVE_STATUS_REPLY);
+		reply.count = reply.names_size = 0;
+	}
+	header = (struct ONEDRIVE_STATUS_REPLY*)reply.buf;
+	header->magic = ONEDRIVE_STATUS_MAGIC;
+	header->error = err;
+	header->count = reply.count;
+	header->size = reply.size - sizeof(struct ONEDRIVE_STATUS_REPLY)
+			+ reply.names_size;
+	if (send_all(fd, reply.buf, reply.size)
+	    || (reply.names_size
+		&& send_all(fd, reply.names, reply.names_size)))
+		res = -1;
+	ns = onedrive_elapsed_ns(&start);
+	pthread_mutex_lock(&status_lock);
+	requests++;
+	if (err)
+		failures++;
+	else
+		files += reply.count;
+	total_ns += ns;
+	if (ns > max_ns)
+		max_ns = ns;
+	pthread_mutex_unlock(&status_lock);
+out :
+	free(data);
+	free(reply.buf);
+	free(reply.names);
+	return (res);
+}
+
+static void accept_client(struct pollfd *fds, time_t *seen, int *count,
+			time_t now)
+{
+	struct timeval timeout;
+	int fd;
+
+	fd = accept(listen_fd, (struct sockaddr*)NULL, (socklen_t*)NULL);
+	if (fd < 0)
+		return;
+	if (*count > STATUS_CLIENTS) {
+		close(fd);
+		return;
+	}
+	timeout.tv_sec = STATUS_IO_TIMEOUT;
+	timeout.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	fds[*count].fd = fd;
+	fds[*count].events = POLLIN;
+	fds[*count].revents = 0;
+	seen[*count] = now;
+	(*count)++;
+	pthread_mutex_lock(&status_lock);
+	connections++;
+	pthread_mutex_unlock(&status_lock);
+}
+
+/*
+ *		The thread serving the clients
+ */
+
+static void *status_main(void *arg __attribute__((unused)))
+{
+	struct pollfd fds[STATUS_CLIENTS + 1];
+	time_t seen[STATUS_CLIENTS + 1];	/* last activity */
+	time_t now;
+	BOOL drop;
+	int ready;
+	int count;
+	int i;
+
+	fds[0].fd = listen_fd;
+	fds[0].events = POLLIN;
+	count = 1;
+	while (!status_stop) {
+		ready = poll(fds, count, STATUS_POLL_MS);
+		now = time((time_t*)NULL);
+			/* a client removed is replaced by one already seen */
+		for (i=count-1; i>0; i--) {
+			if ((ready > 0) && fds[i].revents) {
+				drop = (!(fds[i].revents & POLLIN)
+					|| serve(fds[i].fd));
+				seen[i] = now;
+			} else {
+				drop = ((now - seen[i]) > STATUS_IO_TIMEOUT);
+				if (drop) {
+					pthread_mutex_lock(&status_lock);
+					idle_closed++;
+					pthread_mutex_unlock(&status_lock);
+				}
+			}
+			if (drop) {
+				close(fds[i].fd);
+				count--;
+				fds[i] = fds[count];
+				seen[i] = seen[count];
+			}
+		}
+		if ((ready > 0) && (fds[0].revents & POLLIN))
+			accept_client(fds, seen, &count, now);
+	}
+	for (i=1; i<count; i++)
+		close(fds[i].fd);
+	return ((void*)NULL);
+}
+
+/*
+ *		Start the service, on the first operation
+ */
+
+void onedrive_status_start(void)
+{
+	struct sockaddr_un addr;
+
+	if (status_started || !status_path[0])
+		return;
+	status_started = TRUE;
+	if (!onedrive_cachefile_enabled()) {
+		ntfs_log_error("OneDrive status service needs"
+				" ONEDRIVE_CACHE_DIR\n");
+		return;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, status_path);
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0) {
+		ntfs_log_perror("Could not create the OneDrive status socket");
+		return;
+	}
+		/* a socket left by a previous mount is replaced */
+	unlink(status_path);
+	if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr))
+	    || chmod(status_path, status_mode)
+	    || listen(listen_fd, STATUS_CLIENTS)
+	    || pthread_create(&status_thread, (pthread_attr_t*)NULL,
+			status_main, (void*)NULL)) {
+		ntfs_log_perror("Could not listen on %s", status_path);
+		close(listen_fd);
+		listen_fd = -1;
+		unlink(status_path);
+	} else
+		status_running = TRUE;
+}
+
+void onedrive_status_report(FILE *f)
+{
+	pthread_mutex_lock(&status_lock);
+	if (requests)
+		fprintf(f, "status : %llu requests from %llu connections"
+				" (%llu closed when idle), %llu files,"
+				" %llu failures, mean %.1f us, max %.1f us\n",
+			(unsigned long long)requests,
+			(unsigned long long)connections,
+			(unsigned long long)idle_closed,
+			(unsigned long long)files,
+			(unsigned long long)failures,
+			(double)total_ns/requests/1000,
+			(double)max_ns/1000);
+	pthread_mutex_unlock(&status_lock);
+}
+
+/*
+ *		Stop the service when the plugin is unloaded
+ */
+
+static void __attribute__((destructor)) status_exit(void)
+{
+	if (status_running) {
+		status_stop = TRUE;
+		pthread_join(status_thread, (void**)NULL);
+		close(listen_fd);
+		unlink(status_path);
+	}
+}
@@ -0,0 +1,239 @@
+/*
+ * workers.c - Pool of threads running CPU-bound jobs for the plugin
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	A batch of independent jobs, such as compressing the units of a
+ *	large write, is shared by the thread submitting it and by the
+ *	workers, each one taking the next job until none is left, and the
+ *	submitter returns when all of them are done. The jobs must not
+ *	call libntfs-3g, which is not reentrant, they only work on the
+ *	buffers given by the submitter.
+ *
+ *	The count of workers is set by ONEDRIVE_WORKERS, by default one
+ *	less than the count of processors, at most MAX_WORKERS. With no
+ *	workers, the jobs are run by the submitter. The threads are
+ *	started on the first batch, and batches are run one at a time.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <ntfs-3g/types.h>
+#include <ntfs-3g/layout.h>
+#include <ntfs-3g/volume.h>
+
+#include "onedrive.h"
+
+#define MAX_WORKERS 16
+
+struct BATCH {
+	void (*run)(void *arg, int job);
+	void *arg;
+	int count;
+	int next;			/* job to take */
+	int done;
+} ;
+
+static pthread_mutex_t submit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t workers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t threads[MAX_WORKERS];
+static int worker_count = -1;		/* not set yet */
+static int started_count = 0;
+static BOOL workers_stop = FALSE;
+static struct BATCH *batch = (struct BATCH*)NULL;
+
+static u64 batches = 0;
+static u64 jobs = 0;
+static u64 worker_jobs = 0;		/* run by the workers */
+static u64 batch_ns = 0;
+
+void onedrive_workers_init(void)
+{
+	const char *value;
+
+	value = getenv("ONEDRIVE_WORKERS");
+	if (value && value[0])
+		onedrive_workers_set(atoi(value));
+}
+
+/*
+ *		Set the count of workers, before the first batch
+ *
+ *	A negative count means the default.
+ */
+
+void onedrive_workers_set(int count)
+{
+	long cpus;
+
+	if (count < 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		count = (cpus > 1 ? cpus - 1 : 0);
+	}
+	if (count > MAX_WORKERS)
+		count = MAX_WORKERS;
+	if (!started_count)
+		worker_count = count;
+}
+
+int onedrive_workers_count(void)
+{
+	if (worker_count < 0)
+		onedrive_workers_set(-1);
+	return (worker_count);
+}
+
+/*
+ *		Take jobs from the current batch until none is left
+ *
+ *	Must be called with the lock held, which is released while
+ *	running a job.
+ */
+
+static int take_jobs(struct BATCH *b)
+{
+	int count;
+	int job;
+
+	count = 0;
+	while (b->next < b->count) {
+		job = b->next++;
+		pthread_mutex_unlock(&workers_lock);
+		b->run(b->arg, job);
+		pthread_mutex_lock(&workers_lock);
+		count++;
+		if (++b->done == b->count)
+			pthread_cond_broadcast(&done_cond);
+	}
+	return (count);
+}
+
+static void *worker_main(void *arg __attribute__((unused)))
+{
+	pthread_mutex_lock(&workers_lock);
+	while (!workers_stop) {
+		if (batch && (batch->next < batch->count))
+			worker_jobs += take_jobs(batch);
+		else
+			pthread_cond_wait(&work_cond, &workers_lock);
+	}
+	pthread_mutex_unlock(&workers_lock);
+	return ((void*)NULL);
+}
+
+/*
+ *		Start the workers, on the first batch
+ *
+ *	Must be called with the lock held. The workers which could not
+ *	be started are done without.
+ */
+
+static void start_workers(void)
+{
+	while ((started_count < worker_count)
+	    && !pthread_create(&threads[started_count],
+				(pthread_attr_t*)NULL, worker_main, NULL))
+		started_count++;
+	worker_count = started_count;
+}
+
+/*
+ *		Run a batch of jobs, numbered from 0 to count - 1
+ *
+ *	Returns when all of them are done.
+ */
+
+void onedrive_workers_run(void (*run)(void *arg, int job), void *arg,
+			int count)
+{
+	struct BATCH b;
+	struct timespec start;
+	struct timespec end;
+	int job;
+
+	if (count <= 0)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if ((count == 1) || !onedrive_workers_count()) {
+		for (job=0; job<count; job++)
+			run(arg, job);
+		pthread_mutex_lock(&workers_lock);
+	} else {
+		b.run = run;
+		b.arg = arg;
+		b.count = count;
+		b.next = 0;
+		b.done = 0;
+		pthread_mutex_lock(&submit_lock);
+		pthread_mutex_lock(&workers_lock);
+		if (!started_count)
+			start_workers();
+		batch = &b;
+		pthread_cond_broadcast(&work_cond);
+		take_jobs(&b);
+		while (b.done < b.count)
+			pthread_cond_wait(&done_cond, &workers_lock);
+		batch = (struct BATCH*)NULL;
+		pthread_mutex_unlock(&submit_lock);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	batches++;
+	jobs += count;
+	batch_ns += (u64)(end.tv_sec - start.tv_sec)*1000000000
+			+ end.tv_nsec - start.tv_nsec;
+	pthread_mutex_unlock(&workers_lock);
+}
+
+void onedrive_workers_report(FILE *f)
+{
+	pthread_mutex_lock(&workers_lock);
+	if (batches)
+		fprintf(f, "workers : %d threads, %llu batches of %.1f jobs,"
+				" %.1f%% by the workers, %.3f ms per batch\n",
+			started_count, (unsigned long long)batches,
+			(double)jobs/batches, 100.0*worker_jobs/jobs,
+			(double)batch_ns/batches/1000000);
+	pthread_mutex_unlock(&workers_lock);
+}
+
+static void __attribute__((destructor)) workers_exit(void)
+{
+	int i;
+
+	pthread_mutex_lock(&workers_lock);
+	workers_stop = TRUE;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&workers_lock);
+	for (i=0; i<started_count; i++)
+		pthread_join(threads[i], (void**)NULL);
+}
@@ -0,0 +1,452 @@
+/*
+ * onedrive-find.c - Search the names of files in the OneDrive tree
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	Searches the name index saved by the plugin (see src/names.h)
+ *	and prints the paths of the matching files, relative to the
+ *	root of the volume, or prefixed by the mount point if given.
+ *
+ *	usage : onedrive-find [options] pattern
+ *		-d dir	cache directory (default $ONEDRIVE_CACHE_DIR)
+ *		-g	the pattern is a glob, as in find -iname
+ *		-p	the pattern is a prefix of the names
+ *		-m dir	mount point to prefix the paths with
+ *		-i	also print the inode numbers
+ *		-t	print the search time on stderr
+ *
+ *	The search ignores the case of ASCII letters. By default the
+ *	pattern is a substring of the names. The candidates are the
+ *	names having all the trigrams of the pattern (or of the
+ *	fixed parts of a glob), which are then checked.
+ */
+
+#define _GNU_SOURCE	/* for memmem() and FNM_CASEFOLD */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../src/cachefile.h"
+#include "../src/names.h"
+
+#define MREF_MASK 0x0000ffffffffffffULL
+#define ROOT_INODE 5
+#define MAX_DEPTH 1024
+
+enum MODE { SUBSTRING, PREFIX, GLOB } ;
+
+struct INDEX {
+	const struct ONEDRIVE_NAMES_HEADER *header;
+	const struct ONEDRIVE_NAME_ENTRY *entries;
+	const struct ONEDRIVE_TRIGRAM *trigrams;
+	const uint32_t *postings;
+	const char *names;
+} ;
+
+static const char *mountpoint = "";
+static int show_inodes = 0;
+static enum MODE mode = SUBSTRING;
+
+static void usage(void)
+{
+	fprintf(stderr, "usage : onedrive-find [-d cachedir] [-g|-p]"
+			" [-m mountpoint] [-i] [-t] pattern\n");
+	exit(2);
+}
+
+/*
+ *		Map an index file
+ *
+ *	Returns zero, or -1 if it is not a valid index
+ */
+
+static int map_index(const char *path, struct INDEX *index)
+{
+	const struct ONEDRIVE_CACHEFILE_HEADER *fh;
+	const struct ONEDRIVE_NAMES_HEADER *h;
+	struct stat st;
+	const char *base;
+	uint64_t size;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return (-1);
+	if (fstat(fd, &st)
+	    || (st.st_size < (off_t)(sizeof(*fh) + sizeof(*h)))) {
+		close(fd);
+		return (-1);
+	}
+	base = (const char*)mmap((void*)NULL, st.st_size, PROT_READ,
+				MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == (const char*)MAP_FAILED)
+		return (-1);
+	fh = (const struct ONEDRIVE_CACHEFILE_HEADER*)base;
+	h = (const struct ONEDRIVE_NAMES_HEADER*)&fh[1];
+	size = sizeof(*h)
+		+ h->entry_count*sizeof(struct ONEDRIVE_NAME_ENTRY)
+		+ h->trigram_count*sizeof(struct ONEDRIVE_TRIGRAM)
+		+ h->posting_count*sizeof(uint32_t)
+		+ h->names_size;
+	if ((fh->magic != ONEDRIVE_NAMES_MAGIC)
+	    || (fh->version != ONEDRIVE_NAMES_VERSION)
+	    || (fh->size != size)
+	    || ((uint64_t)st.st_size != sizeof(*fh) + size)) {
+		munmap((void*)base, st.st_size);
+		return (-1);
+	}
+	index->header = h;
+	index->entries = (const struct ONEDRIVE_NAME_ENTRY*)&h[1];
+	index->trigrams = (const struct ONEDRIVE_TRIGRAM*)
+				&index->entries[h->entry_count];
+	index->postings = (const uint32_t*)
+				&index->trigrams[h->trigram_count];
+	index->names = (const char*)&index->postings[h->posting_count];
+	return (0);
+}
+
+/*
+ *		Find the postings of a trigram
+ *
+ *	Returns the trigram, or NULL if no name has it
+ */
+
+static const struct ONEDRIVE_TRIGRAM *find_trigram(const struct INDEX *index,
+			uint32_t trigram)
+{
+	const struct ONEDRIVE_TRIGRAM *t;
+	uint32_t low, high, mid;
+
+	low = 0;
+	high = index->header->trigram_count;
+	while (low < high) {
+		mid = (low + high)/2;
+		t = &index->trigrams[mid];
+		if (t->trigram == trigram)
+			return (t);
+		if (t->trigram < trigram)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return ((const struct ONEDRIVE_TRIGRAM*)NULL);
+}
+
+/*
+ *		Find the first entry of an inode
+ *
+ *	Returns the index of the entry, or -1
+ */
+
+static int64_t find_inode(const struct INDEX *index, uint64_t inode)
+{
+	int64_t low, high, mid;
+
+	low = 0;
+	high = (int64_t)index->header->entry_count - 1;
+	while (low <= high) {
+		mid = (low + high)/2;
+		if ((index->entries[mid].mref & MREF_MASK) < inode)
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+	if ((low < index->header->entry_count)
+	    && ((index->entries[low].mref & MREF_MASK) == inode))
+		return (low);
+	return (-1);
+}
+
+static void print_path(const struct INDEX *index, uint32_t i)
+{
+	const struct ONEDRIVE_NAME_ENTRY *e;
+	uint32_t chain[MAX_DEPTH];
+	int64_t cur;
+	int depth;
+
+	depth = 0;
+	cur = i;
+	while ((cur >= 0) && (depth < MAX_DEPTH)
+	    && ((index->entries[cur].mref & MREF_MASK) != ROOT_INODE)) {
+		chain[depth++] = cur;
+		cur = find_inode(index, index->entries[cur].parent & MREF_MASK);
+	}
+	if (show_inodes)
+		printf("%llu\t", (unsigned long long)
+				(index->entries[i].mref & MREF_MASK));
+	printf("%s", mountpoint);
+	if (cur < 0)
+		printf("/...");
+	while (depth-- > 0) {
+		e = &index->entries[chain[depth]];
+		printf("/%.*s", (int)e->name_length,
+			&index->names[e->name_offset]);
+	}
+	if (index->entries[i].flags & ONEDRIVE_NAME_DIR)
+		putchar('/');
+	putchar('\n');
+}
+
+/*
+ *		Check whether a name matches the pattern
+ */
+
+static int matches(const struct INDEX *index, uint32_t i,
+			const char *pattern, size_t plen)
+{
+	const struct ONEDRIVE_NAME_ENTRY *e;
+	char name[1024];
+	size_t len;
+	size_t k;
+
+	e = &index->entries[i];
+	if (e->flags & ONEDRIVE_NAME_ABOVE)
+		return (0);
+	len = e->name_length;
+	if (len >= sizeof(name))
+		len = sizeof(name) - 1;
+	for (k=0; k<len; k++)
+		name[k] = onedrive_fold(index->names[e->name_offset + k]);
+	name[len] = 0;
+	switch (mode) {
+	case PREFIX :
+		return ((len >= plen) && !memcmp(name, pattern, plen));
+	case GLOB :
+		return (!fnmatch(pattern, name, FNM_CASEFOLD));
+	default :
+		return (memmem(name, len, pattern, plen) != (void*)NULL);
+	}
+}
+
+/*
+ *		Get the trigrams which all the matching names have
+ *
+ *	For a glob, these are the trigrams of the fixed parts.
+ *	Returns the count of trigrams.
+ */
+
+static int pattern_trigrams(const char *pattern, uint32_t *trigrams, int max)
+{
+	char fixed[1024];
+	const char *p;
+	int count;
+	int len;
+	int k;
+
+	count = 0;
+	p = pattern;
+	while (*p && (count < max)) {
+		len = 0;
+		while (*p && (len < (int)sizeof(fixed))
+		    && ((mode != GLOB) || !strchr("*?[]\\", *p)))
+			fixed[len++] = *p++;
+		for (k=0; ((k + 3) <= len) && (count < max); k++)
+			trigrams[count++] = onedrive_trigram(&fixed[k]);
+		if (*p && (mode == GLOB)) {
+			if ((*p == '[') && strchr(p, ']'))
+				p = strchr(p, ']');
+			else if ((*p == '\\') && p[1])
+				p++;
+			p++;
+		}
+	}
+	return (count);
+}
+
+static int compare_counts(const void *p1, const void *p2)
+{
+	const struct ONEDRIVE_TRIGRAM *t1 =
+			*(const struct ONEDRIVE_TRIGRAM* const*)p1;
+	const struct ONEDRIVE_TRIGRAM *t2 =
+			*(const struct ONEDRIVE_TRIGRAM* const*)p2;
+
+	return ((t1->count > t2->count) - (t1->count < t2->count));
+}
+
+/*
+ *		Check whether an entry is in a posting list
+ */
+
+static int has_posting(const struct INDEX *index,
+			const struct ONEDRIVE_TRIGRAM *t, uint32_t entry)
+{
+	const uint32_t *list;
+	uint32_t low, high, mid;
+
+	list = &index->postings[t->first];
+	low = 0;
+	high = t->count;
+	while (low < high) {
+		mid = (low + high)/2;
+		if (list[mid] == entry)
+			return (1);
+		if (list[mid] < entry)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return (0);
+}
+
+/*
+ *		Search an index
+ *
+ *	Returns the count of matches
+ */
+
+static uint64_t search(const struct INDEX *index, const char *pattern)
+{
+	const struct ONEDRIVE_TRIGRAM *lists[256];
+	uint32_t trigrams[256];
+	const uint32_t *candidates;
+	uint64_t found;
+	uint32_t count;
+	uint32_t i;
+	size_t plen;
+	int ntri;
+	int n;
+	int k;
+
+	found = 0;
+	plen = strlen(pattern);
+	ntri = pattern_trigrams(pattern, trigrams, 256);
+	n = 0;
+	for (k=0; k<ntri; k++) {
+		lists[n] = find_trigram(index, trigrams[k]);
+		if (!lists[n])
+			return (0);	/* no name has this trigram */
+		n++;
+	}
+	if (!n) {
+			/* nothing to filter with, check all the names */
+		for (i=0; i<index->header->entry_count; i++)
+			if (matches(index, i, pattern, plen)) {
+				print_path(index, i);
+				found++;
+			}
+		return (found);
+	}
+	qsort(lists, n, sizeof(lists[0]), compare_counts);
+	candidates = &index->postings[lists[0]->first];
+	count = lists[0]->count;
+	for (i=0; i<count; i++) {
+		for (k=1; (k<n) && has_posting(index, lists[k], candidates[i]);
+				k++) { }
+		if ((k >= n) && matches(index, candidates[i], pattern, plen)) {
+			print_path(index, candidates[i]);
+			found++;
+		}
+	}
+	return (found);
+}
+
+int main(int argc, char *argv[])
+{
+	struct INDEX index;
+	struct timespec start, end;
+	const char *dir;
+	char *pattern;
+	char path[4096];
+	struct dirent *de;
+	DIR *d;
+	size_t len;
+	uint64_t found;
+	int timing;
+	int indexes;
+	int opt;
+	size_t k;
+
+	dir = getenv("ONEDRIVE_CACHE_DIR");
+	timing = 0;
+	while ((opt = getopt(argc, argv, "d:gm:ipt")) != -1) {
+		switch (opt) {
+		case 'd' :
+			dir = optarg;
+			break;
+		case 'g' :
+			mode = GLOB;
+			break;
+		case 'm' :
+			mountpoint = optarg;
+			break;
+		case 'i' :
+			show_inodes = 1;
+			break;
+		case 'p' :
+			mode = PREFIX;
+			break;
+		case 't' :
+			timing = 1;
+			break;
+		default :
+			usage();
+		}
+	}
+	if ((optind != (argc - 1)) || !dir || !dir[0])
+		usage();
+	pattern = strdup(argv[optind]);
+	if (!pattern)
+		return (1);
+	for (k=0; pattern[k]; k++)
+		pattern[k] = onedrive_fold(pattern[k]);
+
+	d = opendir(dir);
+	if (!d) {
+		fprintf(stderr, "Could not open %s : %s\n", dir,
+				strerror(errno));
+		return (1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	found = 0;
+	indexes = 0;
+	while ((de = readdir(d))) {
+		len = strlen(de->d_name);
+		if ((len < 6) || strcmp(&de->d_name[len - 6], ".names"))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		if (!map_index(path, &index)) {
+			found += search(&index, pattern);
+			indexes++;
+		} else
+			fprintf(stderr, "Ignoring %s, not a valid index\n",
+					path);
+	}
+	closedir(d);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (!indexes)
+		fprintf(stderr, "No name index in %s\n", dir);
+	if (timing)
+		fprintf(stderr, "%llu found in %.3f ms\n",
+			(unsigned long long)found,
+			(end.tv_sec - start.tv_sec)*1000.0
+				+ (end.tv_nsec - start.tv_nsec)/1000000.0);
+	free(pattern);
+	return (found ? 0 : 1);
+}
@@ -0,0 +1,662 @@
+/*
+ * onedrive-maint.c - Maintenance of the OneDrive tree on an unmounted volume
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	usage : onedrive-maint command [options] device path...
+ *
+ *	compact [-n] [-f fill] device dir...
+ *		Rebuild densely the indexes of the directories whose
+ *		blocks are filled less than "fill" percent (default 90),
+ *		and show the readdir time before and after.
+ *		-n	only show what would be achieved
+ *
+ *	flatten [-n] device path...
+ *		Relocate the data of the files which overflows into
+ *		extension MFT records, so that it gets back to the base
+ *		record, and show the time to open the data before and
+ *		after. The directories are searched recursively.
+ *		-n	only list the files concerned
+ *
+ *	compress [-n] [-s saving] device path...
+ *		Compress the data of the files which would then use at
+ *		least "saving" percent (default 25) less clusters, and
+ *		show the sizes and the compression throughput. The
+ *		directories are searched recursively.
+ *		-n	only show what would be achieved
+ *
+ *	hash [-d cachedir] [-v] device path...
+ *		Show the QuickXorHash of files, as shown by OneDrive,
+ *		taken from the hashes recorded by the plugin when they
+ *		were written, or computed by reading them. The
+ *		directories are searched recursively. The volume is
+ *		opened read-only.
+ *		-d dir	cache directory (default $ONEDRIVE_CACHE_DIR)
+ *		-v	read the files whose hash is recorded, to check it
+ *
+ *	The paths are relative to the root of the volume. The volume
+ *	must not be mounted, except for -n which opens it read-only.
+ *	The plugin does the compaction on a mounted volume for the idle
+ *	directories, and the compression for the cold files, when
+ *	configured to.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <ntfs-3g/types.h>
+#include <ntfs-3g/layout.h>
+#include <ntfs-3g/volume.h>
+#include <ntfs-3g/inode.h>
+#include <ntfs-3g/attrib.h>
+#include <ntfs-3g/dir.h>
+#include <ntfs-3g/unistr.h>
+#include <ntfs-3g/logging.h>
+
+#include "../src/onedrive.h"
+#include "../src/compact.h"
+#include "../src/flatten.h"
+#include "../src/compress.h"
+
+#define DEFAULT_COMPACT_FILL 90
+#define DEFAULT_COMPRESS_SAVING 25
+#define SAMPLE_UNITS 16		/* as in compress.c */
+#define HASH_BUFFER_SIZE 1048576
+#define FIRST_USER_INODE 16
+#define MAX_DEPTH 256
+
+struct COMMAND {
+	const char *name;
+	int (*run)(int argc, char *argv[]);
+	const char *usage;
+} ;
+
+struct DIR_ENTRY {
+	MFT_REF mref;
+	unsigned int dt_type;
+	char *name;
+} ;
+
+struct DIR_LIST {
+	struct DIR_ENTRY *entries;
+	int count;
+	int alloc;
+} ;
+
+struct TREE_OPTIONS {
+	int (*file)(ntfs_volume *vol, ntfs_inode *ni, const char *path,
+			const struct TREE_OPTIONS *options);
+	BOOL dry_run;
+	BOOL verify;
+	int saving;
+} ;
+
+static int compact_command(int argc, char *argv[]);
+static int flatten_command(int argc, char *argv[]);
+static int compress_command(int argc, char *argv[]);
+static int hash_command(int argc, char *argv[]);
+
+static const struct COMMAND commands[] = {
+	{ "compact", compact_command, "compact [-n] [-f fill] device dir..." },
+	{ "flatten", flatten_command, "flatten [-n] device path..." },
+	{ "compress", compress_command,
+			"compress [-n] [-s saving] device path..." },
+	{ "hash", hash_command, "hash [-d cachedir] [-v] device path..." },
+} ;
+
+static void usage(void)
+{
+	unsigned int i;
+
+	fprintf(stderr, "usage :\n");
+	for (i=0; i<sizeof(commands)/sizeof(commands[0]); i++)
+		fprintf(stderr, "\tonedrive-maint %s\n", commands[i].usage);
+	exit(2);
+}
+
+static ntfs_volume *mount_volume(const char *device, BOOL rdonly)
+{
+	ntfs_volume *vol;
+
+	vol = ntfs_mount(device, (rdonly ? NTFS_MNT_RDONLY : NTFS_MNT_NONE));
+	if (!vol)
+		fprintf(stderr, "Could not open %s : %s\n", device,
+				strerror(errno));
+	return (vol);
+}
+
+/*
+ *		Compact the indexes of directories
+ */
+
+static int compact_command(int argc, char *argv[])
+{
+	struct ONEDRIVE_COMPACTION result;
+	ntfs_volume *vol;
+	ntfs_inode *ni;
+	BOOL dry_run;
+	int fill;
+	int opt;
+	int rc;
+	int i;
+
+	dry_run = FALSE;
+	fill = DEFAULT_COMPACT_FILL;
+	while ((opt = getopt(argc, argv, "f:n")) != -1) {
+		switch (opt) {
+		case 'f' :
+			fill = atoi(optarg);
+			break;
+		case 'n' :
+			dry_run = TRUE;
+			break;
+		default :
+			usage();
+		}
+	}
+	if ((optind + 2) > argc)
+		usage();
+	vol = mount_volume(argv[optind], dry_run);
+	if (!vol)
+		return (1);
+	rc = 0;
+	for (i=optind+1; i<argc; i++) {
+		ni = ntfs_pathname_to_inode(vol, (ntfs_inode*)NULL, argv[i]);
+		if (!ni) {
+			fprintf(stderr, "Could not open %s : %s\n", argv[i],
+					strerror(errno));
+			rc = 1;
+			continue;
+		}
+		if (onedrive_compact_index(ni, fill, dry_run, &result)) {
+			fprintf(stderr, "Could not compact %s : %s\n",
+					argv[i], strerror(errno));
+			rc = 1;
+		} else
+			if (!result.blocks_before)
+				printf("%s : no index blocks\n", argv[i]);
+			else
+				if (result.compacted)
+					printf("%s : %u entries, %u blocks"
+						" (%d%% full) -> %u blocks"
+						" (%d%% full), %lld KB"
+						" -> %lld KB, readdir"
+						" %llu us -> %llu us\n",
+						argv[i], result.entries,
+						result.blocks_before,
+						result.fill_before,
+						result.blocks_after,
+						result.fill_after,
+						(long long)(result
+						    .allocated_before >> 10),
+						(long long)(result
+						    .allocated_after >> 10),
+						(unsigned long long)(result
+						    .readdir_ns_before/1000),
+						(unsigned long long)(result
+						    .readdir_ns_after/1000));
+				else
+					printf("%s : %u entries, %u blocks"
+						" (%d%% full), %s %u blocks"
+						" (%d%% full), readdir"
+						" %llu us\n",
+						argv[i], result.entries,
+						result.blocks_before,
+						result.fill_before,
+						(dry_run ? "would be"
+							: "left, could be"),
+						result.blocks_after,
+						result.fill_after,
+						(unsigned long long)(result
+						    .readdir_ns_before/1000));
+		ntfs_inode_close(ni);
+	}
+	if (ntfs_umount(vol, FALSE)) {
+		fprintf(stderr, "Could not close the volume : %s\n",
+				strerror(errno));
+		rc = 1;
+	}
+	return (rc);
+}
+
+/*
+ *		Collect the entries of a directory, except the DOS names
+ */
+
+static int list_filldir(void *context, const ntfschar *name,
+			const int name_len, const int name_type,
+			const s64 pos __attribute__((unused)),
+			const MFT_REF mref, const unsigned dt_type)
+{
+	struct DIR_LIST *list;
+	struct DIR_ENTRY *p;
+	char *mbsname;
+
+	list = (struct DIR_LIST*)context;
+	if ((name_type == FILE_NAME_DOS)
+	    || (MREF(mref) < FIRST_USER_INODE))
+		return (0);
+	mbsname = (char*)NULL;
+	if (ntfs_ucstombs(name, name_len, &mbsname, 0) < 0)
+		return (0);
+	if (!strcmp(mbsname, ".") || !strcmp(mbsname, "..")) {
+		free(mbsname);
+		return (0);
+	}
+	if (list->count >= list->alloc) {
+		p = (struct DIR_ENTRY*)realloc(list->entries,
+			(list->alloc + 256)*sizeof(struct DIR_ENTRY));
+		if (!p) {
+			free(mbsname);
+			return (-1);
+		}
+		list->entries = p;
+		list->alloc += 256;
+	}
+	p = &list->entries[list->count++];
+	p->mref = mref;
+	p->dt_type = dt_type;
+	p->name = mbsname;
+	return (0);
+}
+
+/*
+ *		Relocate the data of a file if needed
+ */
+
+static int flatten_file(ntfs_volume *vol, ntfs_inode *ni, const char *path,
+			const struct TREE_OPTIONS *options)
+{
+	struct ONEDRIVE_FLATTENING result;
+	MFT_REF mref;
+	BOOL dry_run;
+
+	if (!onedrive_flatten_needed(ni)) {
+		ntfs_inode_close(ni);
+		return (0);
+	}
+	mref = MK_MREF(ni->mft_no, le16_to_cpu(ni->mrec->sequence_number));
+	ntfs_inode_close(ni);
+	dry_run = options->dry_run;
+	if (onedrive_flatten_file(vol, mref, dry_run, &result)) {
+		fprintf(stderr, "Could not relocate %s : %s\n", path,
+				strerror(errno));
+		return (1);
+	}
+	if (result.flattened)
+		printf("%s : %u runs in %u extents -> %u runs in %u"
+			" extents%s, open %llu us -> %llu us\n",
+			path, result.runs_before, result.extents_before,
+			result.runs_after, result.extents_after,
+			(result.attrlist_after
+				? ", attribute list kept" : ""),
+			(unsigned long long)(result.open_ns_before/1000),
+			(unsigned long long)(result.open_ns_after/1000));
+	else
+		printf("%s : %u runs in %u extents%s, open %llu us\n",
+			path, result.runs_before, result.extents_before,
+			(dry_run ? "" : ", free space too fragmented"),
+			(unsigned long long)(result.open_ns_before/1000));
+	return (0);
+}
+
+/*
+ *		Compress the data of a file if worth it
+ */
+
+static int compress_file(ntfs_volume *vol, ntfs_inode *ni, const char *path,
+			const struct TREE_OPTIONS *options)
+{
+	struct ONEDRIVE_COMPRESSION result;
+	MFT_REF mref;
+	double rate;
+
+	mref = MK_MREF(ni->mft_no, le16_to_cpu(ni->mrec->sequence_number));
+	ntfs_inode_close(ni);
+	if (onedrive_compress_file(vol, mref, options->saving,
+			options->dry_run, &result)) {
+		fprintf(stderr, "Could not compress %s : %s\n", path,
+				strerror(errno));
+		return (1);
+	}
+	if (!result.units)
+		return (0);
+	rate = 0.0;
+	if (result.compress_ns)
+		rate = (result.sampled ? SAMPLE_UNITS : result.units)
+				*(double)(vol->cluster_size
+					<< STANDARD_COMPRESSION_UNIT)
+				*1000.0/result.compress_ns;
+	printf("%s : %lld KB, %lld clusters %s %lld%s, %u units"
+		" compressed, %u zero, %.1f MB/s\n",
+		path, (long long)(result.data_size >> 10),
+		(long long)result.clusters_before,
+		(result.compressed ? "->"
+			: (options->dry_run ? "would be" : "not worth")),
+		(long long)result.clusters_after,
+		(result.sampled ? " (estimated)" : ""),
+		result.units_compressed, result.units_zero, rate);
+	return (0);
+}
+
+static void base64(const u8 *data, int size, char *out)
+{
+	static const char digits[] =
+	    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	u32 v;
+	int i;
+
+	for (i=0; i<size; i+=3) {
+		v = data[i] << 16;
+		if ((i + 1) < size)
+			v |= data[i + 1] << 8;
+		if ((i + 2) < size)
+			v |= data[i + 2];
+		*out++ = digits[(v >> 18) & 63];
+		*out++ = digits[(v >> 12) & 63];
+		*out++ = ((i + 1) < size ? digits[(v >> 6) & 63] : '=');
+		*out++ = ((i + 2) < size ? digits[v & 63] : '=');
+	}
+	*out = 0;
+}
+
+/*
+ *		Compute the QuickXorHash of a file by reading it
+ */
+
+static int read_hash(ntfs_inode *ni, u8 *reg)
+{
+	u8 fold[ONEDRIVE_QXH_FOLD];
+	ntfs_attr *na;
+	char *buf;
+	s64 pos;
+	s64 got;
+	int res;
+
+	memset(fold, 0, sizeof(fold));
+	memset(reg, 0, ONEDRIVE_QXH_SIZE);
+	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	if (!na)
+		return (-1);
+	buf = (char*)malloc(HASH_BUFFER_SIZE);
+	res = -1;
+	if (buf) {
+		got = 0;
+		for (pos=0; pos<na->data_size; pos+=got) {
+			got = ntfs_attr_pread(na, pos, HASH_BUFFER_SIZE, buf);
+			if (got <= 0)
+				break;
+			onedrive_qxh_fold(fold, pos, buf, got);
+		}
+		if (pos >= na->data_size) {
+			onedrive_qxh_register(fold, reg);
+			res = 0;
+		} else
+			if (!got)
+				errno = EIO;
+		free(buf);
+	}
+	ntfs_attr_close(na);
+	return (res);
+}
+
+/*
+ *		Show the QuickXorHash of a file
+ */
+
+static int hash_file(ntfs_volume *vol __attribute__((unused)),
+			ntfs_inode *ni, const char *path,
+			const struct TREE_OPTIONS *options)
+{
+	u8 recorded[ONEDRIVE_QXH_SIZE];
+	u8 reg[ONEDRIVE_QXH_SIZE];
+	u8 hash[ONEDRIVE_QXH_SIZE];
+	char text[2*ONEDRIVE_QXH_SIZE];
+	const char *origin;
+	BOOL known;
+	int rc;
+
+	rc = 0;
+	known = onedrive_hash_get(ni, recorded);
+	if (ni->flags & FILE_ATTR_OFFLINE) {
+		if (known)
+			memcpy(reg, recorded, ONEDRIVE_QXH_SIZE);
+		origin = (known ? "recorded, offline" : (const char*)NULL);
+	} else
+		if (known && !options->verify) {
+			memcpy(reg, recorded, ONEDRIVE_QXH_SIZE);
+			origin = "recorded";
+		} else
+			if (read_hash(ni, reg)) {
+				fprintf(stderr, "Could not read %s : %s\n",
+					path, strerror(errno));
+				origin = (const char*)NULL;
+				rc = 1;
+			} else
+				if (!known)
+					origin = "read";
+				else
+					if (memcmp(reg, recorded,
+						ONEDRIVE_QXH_SIZE)) {
+						origin = "MISMATCH with the"
+							" recorded hash";
+						rc = 1;
+					} else
+						origin = "recorded, verified";
+	if (origin) {
+		onedrive_qxh_final(reg, ni->data_size, hash);
+		base64(hash, ONEDRIVE_QXH_SIZE, text);
+		printf("%s  %s (%s)\n", text, path, origin);
+	} else
+		if (!rc)
+			printf("%s : offline, no recorded hash\n", path);
+	ntfs_inode_close(ni);
+	return (rc);
+}
+
+/*
+ *		Process the files in a tree
+ *
+ *	The inode is closed.
+ */
+
+static int walk_tree(ntfs_volume *vol, ntfs_inode *ni, const char *path,
+			const struct TREE_OPTIONS *options, int depth)
+{
+	struct DIR_LIST list;
+	ntfs_inode *sub_ni;
+	char *sub_path;
+	s64 pos;
+	int rc;
+	int i;
+
+	if (!(ni->mrec->flags & MFT_RECORD_IS_DIRECTORY))
+		return (options->file(vol, ni, path, options));
+	memset(&list, 0, sizeof(list));
+	pos = 0;
+	rc = 0;
+	if (ntfs_readdir(ni, &pos, &list, list_filldir)) {
+		fprintf(stderr, "Could not read %s : %s\n", path,
+				strerror(errno));
+		rc = 1;
+	}
+	ntfs_inode_close(ni);
+	for (i=0; i<list.count; i++) {
+		sub_path = (char*)malloc(strlen(path)
+				+ strlen(list.entries[i].name) + 2);
+		if (sub_path) {
+			sprintf(sub_path, "%s/%s", path,
+					list.entries[i].name);
+			sub_ni = ntfs_inode_open(vol, list.entries[i].mref);
+			if (!sub_ni) {
+				fprintf(stderr, "Could not open %s : %s\n",
+					sub_path, strerror(errno));
+				rc = 1;
+			} else
+				if ((list.entries[i].dt_type == NTFS_DT_DIR)
+				    && (depth >= MAX_DEPTH))
+					ntfs_inode_close(sub_ni);
+				else
+					rc |= walk_tree(vol, sub_ni,
+						sub_path, options, depth + 1);
+			free(sub_path);
+		}
+		free(list.entries[i].name);
+	}
+	free(list.entries);
+	return (rc);
+}
+
+/*
+ *		Process the files in the trees designated after the options
+ */
+
+static int walk_trees(int argc, char *argv[],
+			const struct TREE_OPTIONS *options)
+{
+	ntfs_volume *vol;
+	ntfs_inode *ni;
+	int rc;
+	int i;
+
+	if ((optind + 2) > argc)
+		usage();
+	vol = mount_volume(argv[optind], options->dry_run);
+	if (!vol)
+		return (1);
+	onedrive_bufpool_start(vol);
+	rc = 0;
+	for (i=optind+1; i<argc; i++) {
+		ni = ntfs_pathname_to_inode(vol, (ntfs_inode*)NULL, argv[i]);
+		if (!ni) {
+			fprintf(stderr, "Could not open %s : %s\n", argv[i],
+					strerror(errno));
+			rc = 1;
+		} else
+			rc |= walk_tree(vol, ni, argv[i], options, 0);
+	}
+	if (ntfs_umount(vol, FALSE)) {
+		fprintf(stderr, "Could not close the volume : %s\n",
+				strerror(errno));
+		rc = 1;
+	}
+	return (rc);
+}
+
+/*
+ *		Relocate the data of fragmented files
+ */
+
+static int flatten_command(int argc, char *argv[])
+{
+	struct TREE_OPTIONS options;
+	int opt;
+
+	options.file = flatten_file;
+	options.dry_run = FALSE;
+	options.verify = FALSE;
+	options.saving = 0;
+	while ((opt = getopt(argc, argv, "n")) != -1) {
+		switch (opt) {
+		case 'n' :
+			options.dry_run = TRUE;
+			break;
+		default :
+			usage();
+		}
+	}
+	return (walk_trees(argc, argv, &options));
+}
+
+/*
+ *		Compress the data of files
+ */
+
+static int compress_command(int argc, char *argv[])
+{
+	struct TREE_OPTIONS options;
+	int opt;
+
+	options.file = compress_file;
+	options.dry_run = FALSE;
+	options.verify = FALSE;
+	options.saving = DEFAULT_COMPRESS_SAVING;
+	while ((opt = getopt(argc, argv, "ns:")) != -1) {
+		switch (opt) {
+		case 'n' :
+			options.dry_run = TRUE;
+			break;
+		case 's' :
+			options.saving = atoi(optarg);
+			if ((options.saving < 0) || (options.saving > 100))
+				usage();
+			break;
+		default :
+			usage();
+		}
+	}
+	return (walk_trees(argc, argv, &options));
+}
+
+/*
+ *		Show the content hash of files
+ */
+
+static int hash_command(int argc, char *argv[])
+{
+	struct TREE_OPTIONS options;
+	int opt;
+
+	options.file = hash_file;
+	options.dry_run = TRUE;		/* read-only */
+	options.verify = FALSE;
+	options.saving = 0;
+	while ((opt = getopt(argc, argv, "d:v")) != -1) {
+		switch (opt) {
+		case 'd' :
+			setenv("ONEDRIVE_CACHE_DIR", optarg, 1);
+			break;
+		case 'v' :
+			options.verify = TRUE;
+			break;
+		default :
+			usage();
+		}
+	}
+	onedrive_cachefile_init();
+	return (walk_trees(argc, argv, &options));
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i;
+
+	if (argc < 2)
+		usage();
+	ntfs_log_set_handler(ntfs_log_handler_stderr);
+	for (i=0; i<sizeof(commands)/sizeof(commands[0]); i++)
+		if (!strcmp(argv[1], commands[i].name))
+			return (commands[i].run(argc - 1, &argv[1]));
+	usage();
+	return (2);
+}
@@ -0,0 +1,167 @@
+/*
+ * onedrive-status.c - Show the sync status of OneDrive files
+ *
+ * Copyright (C) 2026 agent
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	usage : onedrive-status -s socket -m mountpoint [-l | -i] file...
+ *
+ *	Asks the plugin for the status of the files, through the socket
+ *	designated by ONEDRIVE_STATUS_SOCKET when mounting, with a single
+ *	request, and prints a line per file :
+ *		D directory, L local, O offline, P pinned, U unpinned,
+ *		M modified, ? unknown
+ *	-l	list the status of the files in the directories
+ *	-i	the files are designated by their inode numbers
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "../lib/onedrive-status.h"
+
+static void usage(void)
+{
+	fprintf(stderr, "usage : onedrive-status -s socket -m mountpoint"
+			" [-l | -i] file...\n");
+	exit(2);
+}
+
+static void print_status(const struct ONEDRIVE_STATUS_FILE *file,
+			const char *name)
+{
+	static const struct {
+		uint32_t bit;
+		char mark;
+	} marks[] = {
+		{ ONEDRIVE_STATUS_DIR, 'D' },
+		{ ONEDRIVE_STATUS_LOCAL, 'L' },
+		{ ONEDRIVE_STATUS_OFFLINE, 'O' },
+		{ ONEDRIVE_STATUS_PINNED, 'P' },
+		{ ONEDRIVE_STATUS_UNPINNED, 'U' },
+		{ ONEDRIVE_STATUS_MODIFIED, 'M' },
+	} ;
+	char buf[8];
+	unsigned int i;
+
+	if (file->status & ONEDRIVE_STATUS_FOUND) {
+		for (i=0; i<sizeof(marks)/sizeof(marks[0]); i++)
+			buf[i] = (file->status & marks[i].bit
+					? marks[i].mark : '-');
+		buf[i] = '\0';
+		printf("%s %12llu %s\n", buf,
+			(unsigned long long)(file->mref & 0xffffffffffffULL),
+			name);
+	} else
+		printf("?????? %12s %s\n", "", name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct ONEDRIVE_STATUS_CLIENT *client;
+	struct ONEDRIVE_STATUS_FILE *files;
+	const char *socket_path;
+	const char *mountpoint;
+	uint64_t *mrefs;
+	int listing;
+	int byref;
+	int count;
+	int opt;
+	int rc;
+	int i, j;
+
+	socket_path = (const char*)NULL;
+	mountpoint = (const char*)NULL;
+	listing = 0;
+	byref = 0;
+	while ((opt = getopt(argc, argv, "ilm:s:")) != -1) {
+		switch (opt) {
+		case 'i' :
+			byref = 1;
+			break;
+		case 'l' :
+			listing = 1;
+			break;
+		case 'm' :
+			mountpoint = optarg;
+			break;
+		case 's' :
+			socket_path = optarg;
+			break;
+		default :
+			usage();
+		}
+	}
+	if (!socket_path || !mountpoint || (listing && byref)
+	    || (optind >= argc))
+		usage();
+	client = onedrive_status_connect(socket_path, mountpoint);
+	if (!client) {
+		fprintf(stderr, "Could not connect to %s : %s\n", socket_path,
+				strerror(errno));
+		return (1);
+	}
+	rc = 0;
+	count = argc - optind;
+	if (listing) {
+		for (i=optind; i<argc; i++) {
+			count = onedrive_status_list(client, argv[i], &files);
+			if (count < 0) {
+				fprintf(stderr, "Could not list %s : %s\n",
+					argv[i], strerror(errno));
+				rc = 1;
+				continue;
+			}
+			for (j=0; j<count; j++)
+				print_status(&files[j], files[j].name);
+			free(files);
+		}
+	} else {
+		files = (struct ONEDRIVE_STATUS_FILE*)malloc(count
+				*sizeof(struct ONEDRIVE_STATUS_FILE));
+		mrefs = (uint64_t*)malloc(count*sizeof(uint64_t));
+		if (!files || !mrefs)
+			count = -1;
+		else
+			if (byref) {
+				for (i=0; i<count; i++)
+					mrefs[i] = strtoull(argv[optind + i],
+						(char**)NULL, 0);
+				count = onedrive_status_refs(client, mrefs,
+						count, files);
+			} else
+				count = onedrive_status_paths(client,
+					(const char *const*)&argv[optind],
+					count, files);
+		if (count < 0) {
+			fprintf(stderr, "Could not get the status : %s\n",
+					strerror(errno));
+			rc = 1;
+		}
+		for (i=0; i<count; i++)
+			print_status(&files[i], argv[optind + i]);
+		free(files);
+		free(mrefs);
+	}
+	onedrive_status_close(client);
+	return (rc);
+}